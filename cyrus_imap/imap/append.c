@@ -69,6 +69,7 @@
 #include "quota.h"
 
 #include "message_uuid.h"
+#include "headerindex.h"
 
 struct stagemsg {
     char fname[1024];
@@ -89,6 +90,9 @@ struct stagemsg {
 static int append_addseen(struct mailbox *mailbox, const char *userid,
 			  const char *msgrange);
 static void addme(char **msgrange, int *alloced, long uid);
+static void append_indexheaders(struct appendstate *as,
+				struct mailbox *mailbox,
+				struct index_record *record);
 
 #define zero_index(i) { memset(&i, 0, sizeof(struct index_record)); }
 
@@ -240,6 +244,7 @@ int append_setup(struct appendstate *as, const char *name,
     as->writeheader = 0;
     as->seen_msgrange = NULL;
     as->seen_alloced = 0;
+    as->hindex = NULL;
 
     as->s = APPEND_READY;
     
@@ -314,6 +319,9 @@ int append_commit(struct appendstate *as,
 	return r;
     }
 
+    /* Record the new messages' header fields while still locked */
+    if (as->hindex) headerindex_commit(&as->m, &as->hindex);
+
     /* Write out updated quota usage */
     as->m.quota.used += as->quota_used;
     r = quota_write(&as->m.quota, &as->tid);
@@ -369,6 +377,8 @@ int append_abort(struct appendstate *as)
     /* truncate the cache */
     ftruncate(as->m.cache_fd, as->orig_cache_len);
 
+    headerindex_abort(&as->hindex);
+
     /* unlock mailbox */
     mailbox_unlock_index(&as->m);
     mailbox_unlock_header(&as->m);
@@ -577,6 +587,7 @@ int append_fromstage(struct appendstate *as, struct body **body,
 	if (!*body || (as->nummsg - 1))
 	    r = message_parse_file(destfile, NULL, NULL, body);
 	if (!r) r = message_create_record(mailbox, &message_index, *body);
+	if (!r) append_indexheaders(as, mailbox, &message_index);
     }
     if (destfile) {
 	/* this will hopefully ensure that the link() actually happened
@@ -657,6 +668,29 @@ int append_fromstage(struct appendstate *as, struct body **body,
     return 0;
 }
 
+/*
+ * Queue the header index entries for the message just written as
+ * 'record' in 'mailbox'.
+ */
+static void append_indexheaders(struct appendstate *as,
+				struct mailbox *mailbox,
+				struct index_record *record)
+{
+    if (!headerindex_enabled()) return;
+
+    if (!as->hindex) {
+	/* these come after the last message already in the mailbox */
+	struct index_record last;
+
+	if (!mailbox->exists) headerindex_setprev(&as->hindex, 0);
+	else if (!mailbox_read_index_record(mailbox, mailbox->exists, &last)) {
+	    headerindex_setprev(&as->hindex, last.uid);
+	}
+    }
+    headerindex_addmsgfile(&as->hindex, mailbox, record->uid,
+			   record->header_size);
+}
+
 int append_removestage(struct stagemsg *stage)
 {
     char *p;
@@ -742,6 +776,7 @@ int append_fromstream(struct appendstate *as, struct body **body,
 	if (!*body || (as->nummsg - 1))
 	    r = message_parse_file(destfile, NULL, NULL, body);
 	if (!r) r = message_create_record(mailbox, &message_index, *body);
+	if (!r) append_indexheaders(as, mailbox, &message_index);
     }
     fclose(destfile);
     if (r) {
@@ -906,6 +941,8 @@ int append_copy(struct mailbox *mailbox,
 		r = IMAP_IOERROR;
 		goto fail;
 	    }
+
+	    append_indexheaders(as, append_mailbox, &message_index[msg]);
 	} else {
 	    /*
 	     * Have to copy the message, possibly converting LF to CR LF
@@ -952,6 +989,8 @@ int append_copy(struct mailbox *mailbox,
 	    if (!r) r = message_parse_file(destfile, NULL, NULL, &body);
 	    if (!r) r = message_create_record(append_mailbox,
 					      &message_index[msg], body);
+	    if (!r) append_indexheaders(as, append_mailbox,
+					&message_index[msg]);
 	    if (body) message_free_body(body);
 	    fclose(destfile);
 	    if (r) goto fail;
@@ -49,6 +49,8 @@
 #include "message.h"
 #include "prot.h"
 
+struct headerindex_txn;
+
 struct copymsg {
     unsigned long uid;
     time_t internaldate;
@@ -95,6 +97,9 @@ struct appendstate {
 
     /* txn for updating quota */
     struct txn *tid;
+
+    /* header index entries to write on commit */
+    struct headerindex_txn *hindex;
 };
 
 /* add helper function to determine uid range appended? */
@@ -62,6 +62,7 @@
 #include "exitcodes.h"
 #include "global.h"
 #include "hash.h"
+#include "imap_err.h"
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "util.h"
@@ -75,7 +76,8 @@ const int config_need_data = 0;
 void usage(void)
 {
     fprintf(stderr,
-	    "cyr_expire [-C <altconfig>] -E <days> [-X <expunge-days>] [-v]\n");
+	    "cyr_expire [-C <altconfig>] -E <days> [-X <expunge-days>]"
+	    " [-c [-b <kbytes/sec>]] [-v]\n");
     exit(-1);
 }
 
@@ -87,6 +89,9 @@ struct expire_rock {
     unsigned long mailboxes;
     unsigned long messages;
     unsigned long deleted;
+    int compact;
+    unsigned long iolimit;
+    unsigned long compacted;
     int verbose;
 };
 
@@ -121,6 +126,38 @@ static int expire_cb(struct mailbox *mailbox __attribute__((unused)),
 }
 
 
+/*
+ * Compact the cache of mailbox 'name' if it has leaked records or
+ * records without a field directory, without holding the mailbox lock
+ * for the bulk of the work.
+ */
+static int compact(char *name, struct expire_rock *erock)
+{
+    struct mailbox mailbox;
+    unsigned long old = 0;
+    int r, tries = 0;
+
+    do {
+	r = mailbox_open_header(name, 0, &mailbox);
+	if (r) return r;
+
+	r = mailbox_open_index(&mailbox);
+	if (!r) old = mailbox_cache_count_old(&mailbox);
+	if (!r && (mailbox.leaked_cache_records || old)) {
+	    if (erock->verbose) {
+		fprintf(stderr, "compacting %s (%lu leaked cache records, "
+			"%lu to upgrade)\n",
+			name, mailbox.leaked_cache_records, old);
+	    }
+	    r = mailbox_compact(&mailbox, erock->iolimit);
+	    if (!r) erock->compacted++;
+	}
+	mailbox_close(&mailbox);
+    } while (r == IMAP_AGAIN && ++tries < 3);
+
+    return r;
+}
+
 /*
  * mboxlist_findall() callback function to:
  * - expire messages from mailboxes,
@@ -184,7 +221,7 @@ int expire(char *name, int matchlen, int maycreate __attribute__((unused)),
 	       erock->expunge_mode != IMAP_ENUM_EXPUNGE_MODE_IMMEDIATE)) {
 	struct mailbox mailbox;
 	int doclose = 0;
-	int expunge_flags = 0;
+	int expunge_flags = erock->compact ? EXPUNGE_KEEPCACHE : 0;
 
 	if (!attrib.value &&
 	    erock->expunge_mode != IMAP_ENUM_EXPUNGE_MODE_IMMEDIATE) {
@@ -204,7 +241,7 @@ int expire(char *name, int matchlen, int maycreate __attribute__((unused)),
 		strlcpy(fnamebuf, path, sizeof(fnamebuf));
 	    }
 	    strlcat(fnamebuf, FNAME_EXPUNGE_INDEX, sizeof(fnamebuf));
-	    if (stat(fnamebuf, &sbuf)) return 0;
+	    if (stat(fnamebuf, &sbuf)) goto docompact;
 
 	    expunge_flags |= EXPUNGE_CLEANUP;
 	}
@@ -262,6 +299,12 @@ int expire(char *name, int matchlen, int maycreate __attribute__((unused)),
 	syslog(LOG_WARNING, "failure expiring %s: %s", name, error_message(r));
     }
 
+  docompact:
+    if (erock->compact && (r = compact(name, erock))) {
+	syslog(LOG_WARNING, "failure compacting %s: %s",
+	       name, error_message(r));
+    }
+
     /* Even if we had a problem with one mailbox, continue with the others */
     return 0;
 }
@@ -280,7 +323,7 @@ int main(int argc, char *argv[])
     /* zero the expire_rock */
     memset(&erock, 0, sizeof(erock));
 
-    while ((opt = getopt(argc, argv, "C:E:X:v")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:E:X:b:cv")) != EOF) {
 	switch (opt) {
 	case 'C': /* alt config file */
 	    alt_config = optarg;
@@ -296,6 +339,14 @@ int main(int argc, char *argv[])
 	    expunge_days = atoi(optarg);
 	    break;
 
+	case 'b':
+	    erock.iolimit = strtoul(optarg, NULL, 10) * 1024;
+	    break;
+
+	case 'c':
+	    erock.compact = 1;
+	    break;
+
 	case 'v':
 	    erock.verbose++;
 	    break;
@@ -353,6 +404,12 @@ int main(int argc, char *argv[])
 	fprintf(stderr, "\nexpunged %lu out of %lu messages from %lu mailboxes\n",
 		erock.deleted, erock.messages, erock.mailboxes);
     }
+    if (erock.compact) {
+	syslog(LOG_NOTICE, "compacted %lu mailboxes", erock.compacted);
+	if (erock.verbose) {
+	    fprintf(stderr, "compacted %lu mailboxes\n", erock.compacted);
+	}
+    }
 
     /* purge deliver.db entries of expired messages */
     r = duplicate_prune(expire_days, &expire_table);
@@ -70,6 +70,8 @@
 # endif
 #endif
 #include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
 
 #include "xmalloc.h"
 #include "imap_err.h"
@@ -77,6 +79,10 @@
 #include "exitcodes.h"
 #include "util.h"
 #include "cyrusdb.h"
+#include "lock.h"
+#include "map.h"
+#include "retry.h"
+#include "mailbox.h"
 
 #include "duplicate.h"
 
@@ -85,6 +91,379 @@
 static struct db *dupdb = NULL;
 static int duplicate_dbopen = 0;
 
+/* Bloom filter.
+ *
+ * Almost every duplicate_check() is for a message we haven't seen, so
+ * next to deliver.db we keep a Bloom filter of its keys, and only look
+ * in the database when the filter says the key might be there.
+ * duplicate_mark() adds keys to the filter, and duplicate_prune()
+ * replaces it with one sized for what's left in the database.
+ *
+ * All processes share the filter through a MAP_SHARED map, so we don't
+ * use it with "nommap".  Bits are only ever set, and only while holding
+ * the exclusive lock on the file.  A rebuild puts the new file in place
+ * (still BUILDING, so checks go to the database) before it scans the
+ * database, so a mark either went into the old file before the scan
+ * started or goes into the new one; the old file is then marked
+ * RETIRED so that processes still looking at it move on.  If a mark
+ * can't be added, the file is removed and marked RETIRED the same way,
+ * and checks go to the database until the next rebuild.
+ */
+
+#define BLOOM_MAGIC ("\241\002\213\015dupbloom")
+#define BLOOM_MAGIC_SIZE (12)
+
+enum {
+    BLOOM_VERSION = 1,
+    BLOOM_HASHES = 8,
+    BLOOM_BITS_PER_KEY = 16,	/* leaves room for a day or so of growth */
+    BLOOM_MINLOGBITS = 20,	/* 128KB */
+    BLOOM_MAXLOGBITS = 30,
+
+    OFFSET_VERSION = 12,
+    OFFSET_STATE = 16,
+    OFFSET_LOGBITS = 20,
+    OFFSET_NHASHES = 24,
+    OFFSET_NKEYS = 28,
+    BLOOM_HEADER_SIZE = 32
+};
+
+enum {
+    BLOOM_READY = 0,
+    BLOOM_BUILDING = 1,
+    BLOOM_RETIRED = 2
+};
+
+#define BLOOM_RETRY (60)	/* seconds between tries to open it */
+
+static char *bloom_fname = NULL;
+static int bloom_fd = -1;
+static ino_t bloom_ino = 0;
+static const char *bloom_base = NULL;
+static unsigned long bloom_len = 0;
+static time_t bloom_next_open = 0;
+
+#define BLOOM_FIELD(base, offset) (ntohl(*((bit32 *)((base) + (offset)))))
+
+static void bloom_unmap(void)
+{
+    if (bloom_base) map_free(&bloom_base, &bloom_len);
+    bloom_base = NULL;
+    bloom_len = 0;
+    bloom_ino = 0;
+}
+
+static void bloom_close(void)
+{
+    bloom_unmap();
+    if (bloom_fd != -1) close(bloom_fd);
+    bloom_fd = -1;
+}
+
+/* map the file open on bloom_fd, if it looks like one of ours */
+static int bloom_map(void)
+{
+    struct stat sbuf;
+    bit32 logbits;
+
+    bloom_unmap();
+
+    if (fstat(bloom_fd, &sbuf) == -1 || sbuf.st_size < BLOOM_HEADER_SIZE) {
+	return -1;
+    }
+    map_refresh(bloom_fd, 1, &bloom_base, &bloom_len, sbuf.st_size,
+		bloom_fname, 0);
+    bloom_ino = sbuf.st_ino;
+
+    logbits = BLOOM_FIELD(bloom_base, OFFSET_LOGBITS);
+    if (memcmp(bloom_base, BLOOM_MAGIC, BLOOM_MAGIC_SIZE) ||
+	BLOOM_FIELD(bloom_base, OFFSET_VERSION) != BLOOM_VERSION ||
+	logbits < 3 || logbits > BLOOM_MAXLOGBITS ||
+	BLOOM_FIELD(bloom_base, OFFSET_NHASHES) == 0 ||
+	sbuf.st_size != BLOOM_HEADER_SIZE + (1UL << logbits) / 8) {
+	syslog(LOG_ERR, "duplicate: %s is not a valid filter; ignoring it",
+	       bloom_fname);
+	bloom_unmap();
+	return -1;
+    }
+
+    return 0;
+}
+
+static int bloom_open(void)
+{
+    bloom_close();
+
+    if (!bloom_fname) return -1;
+    if (time(NULL) < bloom_next_open) return -1;
+
+    bloom_fd = open(bloom_fname, O_RDWR, 0644);
+    if (bloom_fd == -1 || bloom_map()) {
+	/* no filter (yet); don't keep trying on every check */
+	bloom_close();
+	bloom_next_open = time(NULL) + BLOOM_RETRY;
+	return -1;
+    }
+
+    return 0;
+}
+
+/* the two hashes we derive all BLOOM_HASHES bit positions from */
+static void bloom_hash(const char *key, int keylen, bit32 *h1, bit32 *h2)
+{
+    const unsigned char *p = (const unsigned char *) key;
+    bit32 a = 2166136261U, b = 0x9e3779b9U;
+    int i;
+
+    for (i = 0; i < keylen; i++) {
+	a = (a ^ p[i]) * 16777619U;
+	b = (b ^ p[i]) * 0x01000193U + (b >> 27);
+    }
+    /* the step must be odd so it reaches every bit */
+    *h1 = a;
+    *h2 = (b ^ (b >> 15)) | 1;
+}
+
+#define BLOOM_BIT(h1, h2, i, logbits) \
+    (((h1) + (i) * (h2)) & (((bit32) 1 << (logbits)) - 1))
+
+/* returns 0 if 'key' is certainly not in the database, 1 if it might
+   be (or we can't tell) */
+static int bloom_test(const char *key, int keylen)
+{
+    bit32 h1, h2, bit, logbits, nhashes, i;
+    const char *bits;
+
+    if (bloom_fd == -1 && bloom_open()) return 1;
+
+    if (BLOOM_FIELD(bloom_base, OFFSET_STATE) == BLOOM_RETIRED) {
+	/* rebuilt since we opened it */
+	bloom_next_open = 0;
+	if (bloom_open()) return 1;
+    }
+    if (BLOOM_FIELD(bloom_base, OFFSET_STATE) != BLOOM_READY) return 1;
+
+    logbits = BLOOM_FIELD(bloom_base, OFFSET_LOGBITS);
+    nhashes = BLOOM_FIELD(bloom_base, OFFSET_NHASHES);
+    bits = bloom_base + BLOOM_HEADER_SIZE;
+
+    bloom_hash(key, keylen, &h1, &h2);
+    for (i = 0; i < nhashes; i++) {
+	bit = BLOOM_BIT(h1, h2, i, logbits);
+	if (!(bits[bit >> 3] & (1 << (bit & 7)))) return 0;
+    }
+
+    return 1;
+}
+
+/* a key we stored couldn't be added: make sure nobody trusts the
+   filter until duplicate_prune() builds a new one */
+static void bloom_disable(void)
+{
+    bit32 state = htonl(BLOOM_RETIRED);
+
+    syslog(LOG_ERR, "duplicate: disabling %s until it is rebuilt",
+	   bloom_fname);
+
+    if (unlink(bloom_fname) == -1 && errno != ENOENT) {
+	syslog(LOG_ERR, "IOERROR: unlinking %s: %m", bloom_fname);
+    }
+    /* and move anyone who has it mapped on */
+    if (bloom_fd != -1 &&
+	pwrite(bloom_fd, &state, 4, OFFSET_STATE) != 4) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", bloom_fname);
+    }
+    bloom_close();
+}
+
+static void bloom_add(const char *key, int keylen)
+{
+    struct stat sbuf;
+    const char *lockfailaction;
+    bit32 h1, h2, bit, logbits, nhashes, i;
+    unsigned long offset;
+    unsigned char c;
+
+    if (!bloom_fname) return;
+
+    if (bloom_fd == -1) {
+	/* not throttled like bloom_open(): a filter that appeared since
+	   we last looked must get this key */
+	bloom_fd = open(bloom_fname, O_RDWR, 0644);
+	if (bloom_fd == -1) {
+	    /* without a file, a rebuild starting now scans the database
+	       after our store and so finds the key there */
+	    if (errno == ENOENT) return;
+	    syslog(LOG_ERR, "IOERROR: opening %s: %m", bloom_fname);
+	    bloom_disable();
+	    return;
+	}
+	if (bloom_map()) {
+	    bloom_disable();
+	    return;
+	}
+    }
+
+    /* make sure we set the bits in the current file */
+    if (lock_reopen(bloom_fd, bloom_fname, &sbuf, &lockfailaction) < 0) {
+	syslog(LOG_ERR, "IOERROR: %s %s: %m", lockfailaction, bloom_fname);
+	bloom_disable();
+	return;
+    }
+    if (sbuf.st_ino != bloom_ino && bloom_map()) {
+	lock_unlock(bloom_fd);
+	bloom_disable();
+	return;
+    }
+
+    logbits = BLOOM_FIELD(bloom_base, OFFSET_LOGBITS);
+    nhashes = BLOOM_FIELD(bloom_base, OFFSET_NHASHES);
+
+    bloom_hash(key, keylen, &h1, &h2);
+    for (i = 0; i < nhashes; i++) {
+	bit = BLOOM_BIT(h1, h2, i, logbits);
+	offset = BLOOM_HEADER_SIZE + (bit >> 3);
+	c = bloom_base[offset];
+	if (c & (1 << (bit & 7))) continue;
+
+	c |= (1 << (bit & 7));
+	if (pwrite(bloom_fd, &c, 1, offset) != 1) {
+	    syslog(LOG_ERR, "IOERROR: writing %s: %m", bloom_fname);
+	    lock_unlock(bloom_fd);
+	    bloom_disable();
+	    return;
+	}
+    }
+
+    lock_unlock(bloom_fd);
+}
+
+struct bloomrock {
+    unsigned char *bits;
+    bit32 logbits;
+};
+
+static int bloom_build_cb(void *rock,
+			  const char *key, int keylen,
+			  const char *data __attribute__((unused)),
+			  int datalen __attribute__((unused)))
+{
+    struct bloomrock *brock = (struct bloomrock *) rock;
+    bit32 h1, h2, bit, i;
+
+    bloom_hash(key, keylen, &h1, &h2);
+    for (i = 0; i < BLOOM_HASHES; i++) {
+	bit = BLOOM_BIT(h1, h2, i, brock->logbits);
+	brock->bits[bit >> 3] |= (1 << (bit & 7));
+    }
+
+    return 0;
+}
+
+/* replace the filter with one for the 'nkeys' keys now in the database */
+static void bloom_rebuild(int nkeys)
+{
+    char newfname[1024];
+    char header[BLOOM_HEADER_SIZE];
+    struct bloomrock brock;
+    unsigned char *cur = NULL;
+    size_t size, i;
+    bit32 state;
+    int fd, oldfd, r;
+
+    if (!bloom_fname) return;
+    if (strlen(bloom_fname) + 5 > sizeof(newfname)) return;
+    strcpy(newfname, bloom_fname);
+    strcat(newfname, ".NEW");
+
+    brock.logbits = BLOOM_MINLOGBITS;
+    while (brock.logbits < BLOOM_MAXLOGBITS &&
+	   (1UL << brock.logbits) < (unsigned long) nkeys * BLOOM_BITS_PER_KEY) {
+	brock.logbits++;
+    }
+    size = (1UL << brock.logbits) / 8;
+    brock.bits = (unsigned char *) xzmalloc(size);
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, BLOOM_MAGIC, BLOOM_MAGIC_SIZE);
+    *((bit32 *)(header + OFFSET_VERSION)) = htonl(BLOOM_VERSION);
+    *((bit32 *)(header + OFFSET_STATE)) = htonl(BLOOM_BUILDING);
+    *((bit32 *)(header + OFFSET_LOGBITS)) = htonl(brock.logbits);
+    *((bit32 *)(header + OFFSET_NHASHES)) = htonl(BLOOM_HASHES);
+    *((bit32 *)(header + OFFSET_NKEYS)) = htonl(nkeys);
+
+    fd = open(newfname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 ||
+	retry_write(fd, header, sizeof(header)) == -1 ||
+	retry_write(fd, (char *) brock.bits, size) == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	goto fail;
+    }
+
+    /* put the empty filter in place; marks from now on go into it */
+    oldfd = open(bloom_fname, O_RDWR, 0644);
+    if (oldfd != -1 && lock_blocking(oldfd) < 0) {
+	close(oldfd);
+	oldfd = -1;
+    }
+    r = rename(newfname, bloom_fname);
+    if (oldfd != -1) {
+	if (!r) {
+	    state = htonl(BLOOM_RETIRED);
+	    if (pwrite(oldfd, &state, 4, OFFSET_STATE) != 4) {
+		syslog(LOG_ERR, "IOERROR: writing %s: %m", bloom_fname);
+	    }
+	}
+	lock_unlock(oldfd);
+	close(oldfd);
+    }
+    if (r) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+	goto fail;
+    }
+
+    /* add what's in the database */
+    DB->foreach(dupdb, "", 0, NULL, &bloom_build_cb, &brock, NULL);
+
+    /* merge in what got marked meanwhile, and make it live.  the bits
+       must be on disk before the state, or a crash could leave us with
+       a READY filter that's missing keys */
+    cur = (unsigned char *) xmalloc(size);
+    if (lock_blocking(fd) < 0 ||
+	pread(fd, cur, size, BLOOM_HEADER_SIZE) != (ssize_t) size ||
+	pread(fd, &state, 4, OFFSET_STATE) != 4) {
+	syslog(LOG_ERR, "IOERROR: reading %s: %m", bloom_fname);
+	goto fail;
+    }
+    if (ntohl(state) == BLOOM_RETIRED) {
+	/* a mark failed to make it in (bloom_disable()); leave it dead */
+	syslog(LOG_ERR, "duplicate_prune: %s was disabled while rebuilding",
+	       bloom_fname);
+	goto fail;
+    }
+    for (i = 0; i < size; i++) brock.bits[i] |= cur[i];
+    state = htonl(BLOOM_READY);
+    if (pwrite(fd, brock.bits, size, BLOOM_HEADER_SIZE) != (ssize_t) size ||
+	fsync(fd) == -1 ||
+	pwrite(fd, &state, 4, OFFSET_STATE) != 4) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", bloom_fname);
+	goto fail;
+    }
+    lock_unlock(fd);
+
+    syslog(LOG_NOTICE, "duplicate_prune: rebuilt filter for %d entries (%lu KB)",
+	   nkeys, (unsigned long) size / 1024);
+
+ fail:
+    if (fd != -1) close(fd);
+    if (cur) free(cur);
+    free(brock.bits);
+
+    /* pick up the new one next time */
+    bloom_close();
+    bloom_next_open = 0;
+}
+
 /* must be called after cyrus_init */
 int duplicate_init(char *fname, int myflags __attribute__((unused)))
 {
@@ -112,6 +491,25 @@ int duplicate_init(char *fname, int myflags __attribute__((unused)))
 	else
 	    duplicate_dbopen = 1;
 
+	/* the filter lives next to the database */
+	if (!r) {
+	    char *p;
+
+	    bloom_fname = xmalloc(strlen(fname) + sizeof(FNAME_DELIVERBLOOM));
+	    strcpy(bloom_fname, fname);
+	    p = strrchr(bloom_fname, '/');
+	    if (p) strcpy(p, FNAME_DELIVERBLOOM);
+	    else strcpy(bloom_fname, FNAME_DELIVERBLOOM + 1);
+
+	    if (!config_getswitch(IMAPOPT_DUPLICATE_BLOOM) ||
+		!strcmp(map_method_desc, "nommap")) {
+		/* we won't keep it up to date, so nobody may use it */
+		unlink(bloom_fname);
+		free(bloom_fname);
+		bloom_fname = NULL;
+	    }
+	}
+
 	if (tofree) free(tofree);
     }
 
@@ -134,6 +532,13 @@ time_t duplicate_check(char *id, int idlen, const char *to, int tolen)
     memcpy(buf + idlen + 1, to, tolen);
     buf[idlen + tolen + 1] = '\0';
 
+    if (!bloom_test(buf, idlen + tolen + 2)) {
+	/* never seen it */
+	syslog(LOG_DEBUG, "duplicate_check: %-40s %-20s %ld (filter)",
+	       buf, buf+idlen+1, mark);
+	return 0;
+    }
+
     do {
 	r = DB->fetch(dupdb, buf,
 		      idlen + tolen + 2, /* +2 b/c 1 for the center null;
@@ -201,6 +606,10 @@ void duplicate_mark(char *id, int idlen, const char *to, int tolen, time_t mark,
 		      data, sizeof(mark)+sizeof(uid), NULL);
     } while (r == CYRUSDB_AGAIN);
 
+    /* after the store, so a rebuild that doesn't see it in the
+       database sees it in the filter */
+    if (!r) bloom_add(buf, idlen + tolen + 2);
+
     syslog(LOG_DEBUG, "duplicate_mark: %-40s %-20s %ld %lu",
 	   buf, buf+idlen+1, mark, uid);
 
@@ -329,6 +738,9 @@ int duplicate_prune(int days, struct hash_table *expire_table)
     syslog(LOG_NOTICE, "duplicate_prune: purged %d out of %d entries",
 	   prock.deletions, prock.count);
 
+    /* start over with a filter for what's left */
+    bloom_rebuild(prock.count - prock.deletions);
+
     return 0;
 }
 
@@ -412,5 +824,9 @@ int duplicate_done(void)
 	duplicate_dbopen = 0;
     }
 
+    bloom_close();
+    if (bloom_fname) free(bloom_fname);
+    bloom_fname = NULL;
+
     return r;
 }
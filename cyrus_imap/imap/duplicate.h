@@ -48,6 +48,9 @@
 /* name of the duplicate delivery database */
 #define FNAME_DELIVERDB "/deliver.db"
 
+/* name of the Bloom filter in front of it */
+#define FNAME_DELIVERBLOOM "/deliver.bloom"
+
 int duplicate_init(char*, int);
 
 time_t duplicate_check(char *id, int idlen, const char *to, int tolen);
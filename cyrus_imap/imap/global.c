@@ -102,6 +102,7 @@ struct cyrusdb_backend *config_mboxkey_db;
 struct cyrusdb_backend *config_duplicate_db;
 struct cyrusdb_backend *config_tlscache_db;
 struct cyrusdb_backend *config_ptscache_db;
+struct cyrusdb_backend *config_headerindex_db;
 
 /* Called before a cyrus application starts (but after command line parameters
  * are read) */
@@ -200,6 +201,8 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 	    cyrusdb_fromname(config_getstring(IMAPOPT_TLSCACHE_DB));
 	config_ptscache_db =
 	    cyrusdb_fromname(config_getstring(IMAPOPT_PTSCACHE_DB));
+	config_headerindex_db =
+	    cyrusdb_fromname(config_getstring(IMAPOPT_HEADERINDEX_DB));
 
 	/* configure libcyrus as needed */
 	libcyrus_config_setstring(CYRUSOPT_CONFIG_DIR, config_dir);
@@ -209,6 +212,8 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 				  config_getswitch(IMAPOPT_USERNAME_TOLOWER));
 	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_UNSAFE,
 				  config_getswitch(IMAPOPT_SKIPLIST_UNSAFE));
+	libcyrus_config_setint(CYRUSOPT_SKIPLIST_GROUPCOMMIT,
+			       config_getint(IMAPOPT_SKIPLIST_GROUPCOMMIT));
 	libcyrus_config_setstring(CYRUSOPT_TEMP_PATH,
 				  config_getstring(IMAPOPT_TEMP_PATH));
 	libcyrus_config_setint(CYRUSOPT_PTS_CACHE_TIMEOUT,
@@ -153,5 +153,6 @@ extern struct cyrusdb_backend *config_mboxkey_db;
 extern struct cyrusdb_backend *config_duplicate_db;
 extern struct cyrusdb_backend *config_tlscache_db;
 extern struct cyrusdb_backend *config_ptscache_db;
+extern struct cyrusdb_backend *config_headerindex_db;
 
 #endif /* INCLUDED_GLOBAL_H */
@@ -0,0 +1,778 @@
+/* headerindex.c -- per-mailbox index of selected header fields
+ * $Id$
+ *
+ * Copyright (c) 1998-2005 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * Each mailbox may have a cyrus.hindex database mapping the values of
+ * the header fields named in "headerindex_fields" to the UIDs of the
+ * messages carrying them, so that SEARCH HEADER on those fields is an
+ * index probe instead of a pass over every message's header.
+ *
+ * Keys are "<field> <value> <uid>", with the field lowercased and the
+ * value in canonical search form (which has no whitespace), and empty
+ * data.  Appends write their entries when they commit, while the
+ * mailbox is still locked.
+ *
+ * The ":state" record holds "<uidvalidity> <start> <last> <fields>":
+ * every message with a UID from <start> to <last> has its entries for
+ * <fields>.  Appends and replicated uploads carry the range on,
+ * across any UIDs that were never used or whose messages are gone.  A
+ * commit that can't (because some earlier addition wasn't indexed, or
+ * the field list changed) starts the range over, so messages outside
+ * it are just searched the usual way until reconstruct rebuilds the
+ * whole index.  Entries for expunged messages are dropped when their
+ * files are purged; until then lookups ignore UIDs no longer in the
+ * mailbox.
+ *
+ * If threadcache is set, the last THREAD response for each algorithm
+ * is kept as ":thread <algorithm>", holding "<uidvalidity> <digest>
+ * <response>": the response lists UIDs, and <digest> is the MD5 of
+ * the UIDs that were threaded.  Messages never change once appended,
+ * so the response stands for as long as the same messages are
+ * threaded, whatever happens to their flags.
+ *
+ * Likewise, if sortcache is set, the last SORT result for each set of
+ * criteria is kept as ":sort <criteria>", holding the UIDVALIDITY and
+ * then the UIDs in sorted order, as 32-bit network-order integers.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <limits.h>
+#include <netinet/in.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "charset.h"
+#include "cyrusdb.h"
+#include "global.h"
+#include "imap_err.h"
+#include "mailbox.h"
+#include "util.h"
+#include "xmalloc.h"
+#include "xstrlcpy.h"
+#include "xstrlcat.h"
+
+#include "headerindex.h"
+
+#define DB (config_headerindex_db)
+
+#define STATE_KEY ":state"
+#define THREAD_KEY ":thread "
+#define SORT_KEY ":sort "
+
+struct headerindex_txn {
+    unsigned long firstuid, lastuid;	/* messages queued */
+    unsigned long prevuid;		/* message before them, if prevset */
+    int prevset;
+    int restart;			/* start the covered range over */
+    int rebuild;			/* replace every entry */
+    char **keys;
+    int nkeys, alloc;
+};
+
+struct headerindex_state {
+    unsigned long uidvalidity;
+    unsigned long start, last;
+    const char *fields;
+};
+
+/* the configured fields, lowercased */
+static char **fields = NULL;
+static int nfields = -1;
+static char *fieldlist = NULL;
+
+static void headerindex_readconfig(void)
+{
+    const char *val;
+    char *copy, *p;
+    int len = 0, i;
+
+    if (nfields >= 0) return;
+    nfields = 0;
+
+    val = config_getstring(IMAPOPT_HEADERINDEX_FIELDS);
+    if (!val) return;
+
+    copy = lcase(xstrdup(val));
+    for (p = strtok(copy, " \t,"); p; p = strtok(NULL, " \t,")) {
+	fields = (char **) xrealloc(fields, (nfields + 1) * sizeof(char *));
+	fields[nfields++] = p;
+	len += strlen(p) + 1;
+    }
+
+    fieldlist = xzmalloc(len + 1);
+    for (i = 0; i < nfields; i++) {
+	if (i) strcat(fieldlist, " ");
+	strcat(fieldlist, fields[i]);
+    }
+}
+
+int headerindex_enabled(void)
+{
+    headerindex_readconfig();
+    return nfields > 0;
+}
+
+int headerindex_field(const char *name)
+{
+    int i;
+
+    headerindex_readconfig();
+    for (i = 0; i < nfields; i++) {
+	if (!strcasecmp(fields[i], name)) return 1;
+    }
+    return 0;
+}
+
+static void headerindex_getfname(struct mailbox *mailbox, char *buf,
+				 size_t size)
+{
+    const char *path;
+
+    path = mailbox->mpath &&
+	(config_metapartition_files & IMAP_ENUM_METAPARTITION_FILES_HINDEX) ?
+	mailbox->mpath : mailbox->path;
+    strlcpy(buf, path, size);
+    strlcat(buf, FNAME_HEADER_INDEX, size);
+}
+
+/* parse the ":state" record; 'fields' points into 'data' */
+static int headerindex_parsestate(const char *data, int datalen,
+				  struct headerindex_state *st,
+				  char *buf, size_t size)
+{
+    char *p;
+
+    if (datalen <= 0 || (size_t) datalen >= size) return -1;
+    memcpy(buf, data, datalen);
+    buf[datalen] = '\0';
+
+    st->uidvalidity = strtoul(buf, &p, 10);
+    if (*p != ' ') return -1;
+    st->start = strtoul(p + 1, &p, 10);
+    if (*p != ' ') return -1;
+    st->last = strtoul(p + 1, &p, 10);
+    if (*p != ' ') return -1;
+    st->fields = p + 1;
+
+    return 0;
+}
+
+void headerindex_addmsg(struct headerindex_txn **txnp, unsigned long uid,
+			const char *hdr, unsigned long len)
+{
+    struct headerindex_txn *txn;
+    const char *p, *eol, *colon, *end = hdr + len;
+    char *val, *canon;
+    int i, namelen;
+
+    headerindex_readconfig();
+    if (!nfields) return;
+
+    if (!*txnp) {
+	*txnp = (struct headerindex_txn *)
+	    xzmalloc(sizeof(struct headerindex_txn));
+    }
+    txn = *txnp;
+    if (!txn->lastuid) txn->firstuid = uid;
+    txn->lastuid = uid;
+
+    if (!hdr) {
+	/* couldn't read this one, so only cover what comes after it */
+	txn->firstuid = uid + 1;
+	txn->restart = 1;
+	return;
+    }
+
+    for (p = hdr; p < end; p = eol) {
+	/* find the end of this header, including continuation lines */
+	eol = p;
+	do {
+	    eol = memchr(eol, '\n', end - eol);
+	    eol = eol ? eol + 1 : end;
+	} while (eol < end && (*eol == ' ' || *eol == '\t'));
+
+	colon = memchr(p, ':', eol - p);
+	if (!colon) continue;
+	namelen = colon - p;
+
+	for (i = 0; i < nfields; i++) {
+	    if (strlen(fields[i]) == namelen &&
+		!strncasecmp(fields[i], p, namelen)) break;
+	}
+	if (i == nfields) continue;
+
+	val = xstrndup(colon + 1, eol - colon - 1);
+	canon = charset_decode_mimeheader(val, NULL, 0);
+	free(val);
+
+	if (txn->nkeys == txn->alloc) {
+	    txn->alloc += 16;
+	    txn->keys = (char **) xrealloc(txn->keys,
+					   txn->alloc * sizeof(char *));
+	}
+	txn->keys[txn->nkeys] = xmalloc(namelen + strlen(canon) + 30);
+	sprintf(txn->keys[txn->nkeys++], "%s %s %lu", fields[i], canon, uid);
+	free(canon);
+    }
+}
+
+void headerindex_addmsgfile(struct headerindex_txn **txnp,
+			    struct mailbox *mailbox, unsigned long uid,
+			    unsigned long header_size)
+{
+    const char *base = NULL;
+    unsigned long len = 0;
+
+    if (!headerindex_enabled()) return;
+
+    if (mailbox_map_message(mailbox, uid, &base, &len)) {
+	headerindex_addmsg(txnp, uid, NULL, 0);
+	return;
+    }
+    headerindex_addmsg(txnp, uid, base, header_size < len ? header_size : len);
+    mailbox_unmap_message(mailbox, uid, &base, &len);
+}
+
+void headerindex_setprev(struct headerindex_txn **txnp, unsigned long prevuid)
+{
+    if (!headerindex_enabled()) return;
+
+    if (!*txnp) {
+	*txnp = (struct headerindex_txn *)
+	    xzmalloc(sizeof(struct headerindex_txn));
+    }
+    (*txnp)->prevuid = prevuid;
+    (*txnp)->prevset = 1;
+}
+
+void headerindex_abort(struct headerindex_txn **txnp)
+{
+    struct headerindex_txn *txn = *txnp;
+    int i;
+
+    if (!txn) return;
+    for (i = 0; i < txn->nkeys; i++) free(txn->keys[i]);
+    if (txn->keys) free(txn->keys);
+    free(txn);
+    *txnp = NULL;
+}
+
+static int ulong_cmp(const void *a, const void *b)
+{
+    unsigned long ua = *(const unsigned long *) a;
+    unsigned long ub = *(const unsigned long *) b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+struct expunge_rock {
+    struct db *db;
+    struct txn *tid;
+    unsigned long below;	/* drop every UID under this... */
+    unsigned long *uids;	/* ...and these */
+    unsigned num;
+    int r;
+};
+
+static int expunge_cb(void *rock, const char *key, int keylen,
+		      const char *data __attribute__((unused)),
+		      int datalen __attribute__((unused)))
+{
+    struct expunge_rock *erock = (struct expunge_rock *) rock;
+    unsigned long uid;
+    unsigned lo, hi, mid;
+    int i;
+
+    for (i = keylen; i > 0 && key[i-1] != ' '; i--);
+    if (!i || key[0] == ':') return 0;
+    uid = strtoul(key + i, NULL, 10);
+
+    if (uid < erock->below) {
+	erock->r = DB->delete(erock->db, key, keylen, &erock->tid, 1);
+	return erock->r ? CYRUSDB_DONE : 0;
+    }
+
+    lo = 0;
+    hi = erock->num;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (erock->uids[mid] < uid) lo = mid + 1;
+	else hi = mid;
+    }
+    if (lo < erock->num && erock->uids[lo] == uid) {
+	erock->r = DB->delete(erock->db, key, keylen, &erock->tid, 1);
+	if (erock->r) return CYRUSDB_DONE;
+    }
+    return 0;
+}
+
+int headerindex_commit(struct mailbox *mailbox,
+		       struct headerindex_txn **txnp)
+{
+    struct headerindex_txn *txn = *txnp;
+    char fname[MAX_MAILBOX_PATH+1];
+    char statebuf[1024];
+    struct headerindex_state st;
+    struct db *db = NULL;
+    struct txn *tid = NULL;
+    const char *data;
+    int datalen, i, r;
+    char *newstate;
+
+    if (!txn || !txn->lastuid) {
+	/* nothing queued */
+	headerindex_abort(txnp);
+	return 0;
+    }
+
+    headerindex_getfname(mailbox, fname, sizeof(fname));
+    r = DB->open(fname, CYRUSDB_CREATE, &db);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+	       cyrusdb_strerror(r));
+	goto done;
+    }
+
+    r = DB->fetchlock(db, STATE_KEY, strlen(STATE_KEY),
+		      &data, &datalen, &tid);
+    if ((r && r != CYRUSDB_NOTFOUND) ||
+	(!r && headerindex_parsestate(data, datalen, &st,
+				      statebuf, sizeof(statebuf)))) {
+	r = CYRUSDB_NOTFOUND;
+	memset(&st, 0, sizeof(st));
+    }
+    if (txn->rebuild || r || txn->restart ||
+	st.uidvalidity != mailbox->uidvalidity ||
+	strcmp(st.fields, fieldlist) ||
+	(st.last + 1 != txn->firstuid &&
+	 /* every message before these is covered, and none between */
+	 !(txn->prevset && txn->prevuid <= st.last &&
+	   txn->firstuid > st.last))) {
+	/* can't carry on from what's there; cover just these messages
+	   and throw away the entries left from the old range */
+	struct expunge_rock erock;
+
+	memset(&erock, 0, sizeof(erock));
+	erock.db = db;
+	erock.tid = tid;
+	erock.below = txn->rebuild ? ULONG_MAX : txn->firstuid;
+	r = DB->foreach(db, "", 0, NULL, expunge_cb, &erock, &erock.tid);
+	if (erock.r) r = erock.r;
+	tid = erock.tid;
+	st.start = txn->firstuid;
+	if (txn->prevset && !txn->restart) {
+	    /* nothing between the previous message and these */
+	    st.start = txn->prevuid + 1;
+	}
+    }
+    st.last = txn->lastuid;
+
+    for (i = 0; !r && i < txn->nkeys; i++) {
+	r = DB->store(db, txn->keys[i], strlen(txn->keys[i]), "", 0, &tid);
+    }
+    if (!r) {
+	newstate = xmalloc(strlen(fieldlist) + 50);
+	sprintf(newstate, "%lu %lu %lu %s", mailbox->uidvalidity,
+		st.start, st.last, fieldlist);
+	r = DB->store(db, STATE_KEY, strlen(STATE_KEY),
+		      newstate, strlen(newstate), &tid);
+	free(newstate);
+    }
+
+    if (!r) r = DB->commit(db, tid);
+    else if (tid) DB->abort(db, tid);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: updating %s: %s", fname,
+	       cyrusdb_strerror(r));
+    }
+
+ done:
+    if (db) DB->close(db);
+    headerindex_abort(txnp);
+    return r ? IMAP_IOERROR : 0;
+}
+
+int headerindex_rebuild(struct mailbox *mailbox,
+			struct headerindex_txn **txnp)
+{
+    if (!headerindex_enabled()) return 0;
+
+    if (!*txnp) {
+	*txnp = (struct headerindex_txn *)
+	    xzmalloc(sizeof(struct headerindex_txn));
+    }
+    if (!(*txnp)->restart) (*txnp)->firstuid = 1;
+    if ((*txnp)->lastuid < mailbox->last_uid) {
+	(*txnp)->lastuid = mailbox->last_uid;
+    }
+    (*txnp)->rebuild = 1;
+
+    return headerindex_commit(mailbox, txnp);
+}
+
+int headerindex_expunge(struct mailbox *mailbox,
+			unsigned long *uids, unsigned num)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    struct expunge_rock erock;
+    int r;
+
+    if (!num) return 0;
+
+    headerindex_getfname(mailbox, fname, sizeof(fname));
+    if (access(fname, F_OK)) return 0;
+
+    memset(&erock, 0, sizeof(erock));
+    r = DB->open(fname, 0, &erock.db);
+    if (r) return 0;
+
+    qsort(uids, num, sizeof(unsigned long), ulong_cmp);
+    erock.uids = uids;
+    erock.num = num;
+    r = DB->foreach(erock.db, "", 0, NULL, expunge_cb, &erock, &erock.tid);
+    if (erock.r) r = erock.r;
+
+    if (erock.tid) {
+	if (!r) r = DB->commit(erock.db, erock.tid);
+	else DB->abort(erock.db, erock.tid);
+    }
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: expunging from %s: %s", fname,
+	       cyrusdb_strerror(r));
+    }
+    DB->close(erock.db);
+
+    return r ? IMAP_IOERROR : 0;
+}
+
+struct search_rock {
+    const char *substr;
+    comp_pat *pat;
+    int prefixlen;
+    struct headerindex_result *res;
+    int alloc;
+    /* the last value looked at, and whether it matched */
+    char *lastval;
+    int lastlen, lastmatch;
+};
+
+static int search_cb(void *rock, const char *key, int keylen,
+		     const char *data __attribute__((unused)),
+		     int datalen __attribute__((unused)))
+{
+    struct search_rock *srock = (struct search_rock *) rock;
+    struct headerindex_result *res = srock->res;
+    const char *val = key + srock->prefixlen;
+    unsigned long uid;
+    int i, vallen;
+
+    for (i = keylen; i > srock->prefixlen && key[i-1] != ' '; i--);
+    if (i <= srock->prefixlen) return 0;	/* not an entry */
+    vallen = key + i - 1 - val;
+    uid = strtoul(key + i, NULL, 10);
+    if (uid < res->start || uid > res->last) return 0;
+
+    /* entries for a value are adjacent, so match each value once */
+    if (!srock->lastval || vallen != srock->lastlen ||
+	memcmp(val, srock->lastval, vallen)) {
+	srock->lastval = xrealloc(srock->lastval, vallen + 1);
+	memcpy(srock->lastval, val, vallen);
+	srock->lastval[vallen] = '\0';
+	srock->lastlen = vallen;
+	srock->lastmatch = !*srock->substr ||
+	    charset_searchstring(srock->substr, srock->pat,
+				 srock->lastval, vallen);
+    }
+    if (!srock->lastmatch) return 0;
+
+    if (res->nuids == srock->alloc) {
+	srock->alloc += 256;
+	res->uids = (unsigned long *)
+	    xrealloc(res->uids, srock->alloc * sizeof(unsigned long));
+    }
+    res->uids[res->nuids++] = uid;
+
+    return 0;
+}
+
+int headerindex_search(struct mailbox *mailbox, const char *field,
+		       const char *substr, comp_pat *pat,
+		       struct headerindex_result *res)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    char statebuf[1024];
+    struct headerindex_state st;
+    struct search_rock srock;
+    struct db *db = NULL;
+    const char *data;
+    char *prefix;
+    int datalen, r, i, n;
+
+    if (!headerindex_field(field)) return -1;
+
+    headerindex_getfname(mailbox, fname, sizeof(fname));
+    if (access(fname, F_OK)) return -1;
+    if (DB->open(fname, 0, &db)) return -1;
+
+    r = DB->fetch(db, STATE_KEY, strlen(STATE_KEY), &data, &datalen, NULL);
+    if (r || headerindex_parsestate(data, datalen, &st,
+				    statebuf, sizeof(statebuf)) ||
+	st.uidvalidity != mailbox->uidvalidity ||
+	strcmp(st.fields, fieldlist)) {
+	DB->close(db);
+	return -1;
+    }
+
+    memset(res, 0, sizeof(*res));
+    res->start = st.start;
+    res->last = st.last;
+
+    prefix = xmalloc(strlen(field) + 2);
+    sprintf(prefix, "%s ", field);
+    lcase(prefix);
+
+    memset(&srock, 0, sizeof(srock));
+    srock.substr = substr;
+    srock.pat = pat;
+    srock.prefixlen = strlen(prefix);
+    srock.res = res;
+    r = DB->foreach(db, prefix, strlen(prefix), NULL, search_cb, &srock, NULL);
+
+    free(prefix);
+    if (srock.lastval) free(srock.lastval);
+    DB->close(db);
+
+    if (r) {
+	if (res->uids) free(res->uids);
+	res->uids = NULL;
+	return -1;
+    }
+
+    /* sort by UID, dropping repeats (a header given twice) */
+    qsort(res->uids, res->nuids, sizeof(unsigned long), ulong_cmp);
+    for (i = n = 0; i < res->nuids; i++) {
+	if (!n || res->uids[i] != res->uids[n-1]) res->uids[n++] = res->uids[i];
+    }
+    res->nuids = n;
+
+    return 0;
+}
+
+/* fetch the record 'prefix''name' into a new buffer (NUL-terminated,
+   caller frees); returns its length, or -1 if there is none */
+static int headerindex_fetchcache(struct mailbox *mailbox, const char *prefix,
+				  const char *name, char **datap)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    struct db *db = NULL;
+    const char *data;
+    char *key;
+    int datalen, r;
+
+    headerindex_getfname(mailbox, fname, sizeof(fname));
+    if (access(fname, F_OK)) return -1;
+    if (DB->open(fname, 0, &db)) return -1;
+
+    key = xmalloc(strlen(prefix) + strlen(name) + 1);
+    strcpy(key, prefix);
+    strcat(key, name);
+
+    r = DB->fetch(db, key, strlen(key), &data, &datalen, NULL);
+    if (!r) {
+	*datap = xmalloc(datalen + 1);
+	memcpy(*datap, data, datalen);
+	(*datap)[datalen] = '\0';
+    }
+
+    free(key);
+    DB->close(db);
+    return r ? -1 : datalen;
+}
+
+/* store 'data' as the record 'prefix''name' */
+static void headerindex_storecache(struct mailbox *mailbox, const char *prefix,
+				   const char *name,
+				   const char *data, int datalen)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    struct db *db = NULL;
+    struct txn *tid = NULL;
+    char *key;
+    int r;
+
+    headerindex_getfname(mailbox, fname, sizeof(fname));
+    r = DB->open(fname, CYRUSDB_CREATE, &db);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+	       cyrusdb_strerror(r));
+	return;
+    }
+
+    key = xmalloc(strlen(prefix) + strlen(name) + 1);
+    strcpy(key, prefix);
+    strcat(key, name);
+
+    r = DB->store(db, key, strlen(key), data, datalen, &tid);
+    if (!r) r = DB->commit(db, tid);
+    else if (tid) DB->abort(db, tid);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: storing %s in %s: %s", key, fname,
+	       cyrusdb_strerror(r));
+    }
+
+    free(key);
+    DB->close(db);
+}
+
+static void digest_hex(const unsigned char digest[16], char *hex)
+{
+    static const char xdigit[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	hex[2*i] = xdigit[digest[i] >> 4];
+	hex[2*i+1] = xdigit[digest[i] & 0xf];
+    }
+    hex[32] = '\0';
+}
+
+char *headerindex_getthread(struct mailbox *mailbox, const char *alg,
+			    const unsigned char digest[16])
+{
+    char hex[33], head[50];
+    char *data = NULL;
+    int datalen, headlen;
+
+    if (!config_getswitch(IMAPOPT_THREADCACHE)) return NULL;
+
+    datalen = headerindex_fetchcache(mailbox, THREAD_KEY, alg, &data);
+    if (datalen < 0) return NULL;
+
+    digest_hex(digest, hex);
+    headlen = snprintf(head, sizeof(head), "%lu %s",
+		       mailbox->uidvalidity, hex);
+
+    if (datalen < headlen || memcmp(data, head, headlen) ||
+	(datalen > headlen && data[headlen] != ' ')) {
+	free(data);
+	return NULL;
+    }
+
+    /* what follows the digest is the response, space and all */
+    memmove(data, data + headlen, datalen - headlen + 1);
+    return data;
+}
+
+void headerindex_putthread(struct mailbox *mailbox, const char *alg,
+			   const unsigned char digest[16], const char *tree)
+{
+    char hex[33];
+    char *data;
+
+    if (!config_getswitch(IMAPOPT_THREADCACHE)) return;
+
+    digest_hex(digest, hex);
+    data = xmalloc(strlen(tree) + 50);
+    sprintf(data, "%lu %s%s", mailbox->uidvalidity, hex, tree);
+
+    headerindex_storecache(mailbox, THREAD_KEY, alg, data, strlen(data));
+    free(data);
+}
+
+int headerindex_getsort(struct mailbox *mailbox, const char *crit,
+			unsigned long **uids, int *nuids)
+{
+    char *data = NULL;
+    int datalen, i, n;
+    bit32 val;
+
+    if (!config_getswitch(IMAPOPT_SORTCACHE)) return -1;
+
+    datalen = headerindex_fetchcache(mailbox, SORT_KEY, crit, &data);
+    if (datalen < 0) return -1;
+
+    /* UIDVALIDITY, then the UIDs in order, all 32-bit network order */
+    if (datalen < (int) sizeof(bit32) || datalen % sizeof(bit32)) {
+	free(data);
+	return -1;
+    }
+    memcpy(&val, data, sizeof(bit32));
+    if (ntohl(val) != mailbox->uidvalidity) {
+	free(data);
+	return -1;
+    }
+
+    n = datalen / sizeof(bit32) - 1;
+    *uids = (unsigned long *) xmalloc((n + 1) * sizeof(unsigned long));
+    for (i = 0; i < n; i++) {
+	memcpy(&val, data + (i + 1) * sizeof(bit32), sizeof(bit32));
+	(*uids)[i] = ntohl(val);
+    }
+    *nuids = n;
+
+    free(data);
+    return 0;
+}
+
+void headerindex_putsort(struct mailbox *mailbox, const char *crit,
+			 const unsigned long *uids, int nuids)
+{
+    bit32 *data;
+    int i;
+
+    if (!config_getswitch(IMAPOPT_SORTCACHE)) return;
+
+    data = (bit32 *) xmalloc((nuids + 1) * sizeof(bit32));
+    data[0] = htonl(mailbox->uidvalidity);
+    for (i = 0; i < nuids; i++) data[i + 1] = htonl(uids[i]);
+
+    headerindex_storecache(mailbox, SORT_KEY, crit, (const char *) data,
+			   (nuids + 1) * sizeof(bit32));
+    free(data);
+}
@@ -0,0 +1,129 @@
+/* headerindex.h -- per-mailbox index of selected header fields
+ * $Id$
+ * Copyright (c) 1998-2005 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef INCLUDED_HEADERINDEX_H
+#define INCLUDED_HEADERINDEX_H
+
+#include "charset.h"
+#include "mailbox.h"
+
+/* Entries queued by an append, written out when it commits */
+struct headerindex_txn;
+
+/* What a lookup found */
+struct headerindex_result {
+    unsigned long start, last;	/* UIDs the index covers */
+    unsigned long *uids;	/* matching UIDs, ascending */
+    int nuids;
+};
+
+/* are any header fields indexed? */
+extern int headerindex_enabled(void);
+
+/* is header 'name' one of the indexed fields? */
+extern int headerindex_field(const char *name);
+
+/* queue the index entries for message 'uid', whose header is the
+   'len' bytes at 'hdr' (NULL if it couldn't be read) */
+extern void headerindex_addmsg(struct headerindex_txn **txnp,
+			       unsigned long uid,
+			       const char *hdr, unsigned long len);
+
+/* queue the index entries for message 'uid' of 'mailbox', reading
+   the 'header_size' bytes of header from its message file */
+extern void headerindex_addmsgfile(struct headerindex_txn **txnp,
+				   struct mailbox *mailbox, unsigned long uid,
+				   unsigned long header_size);
+
+/* the messages queued come right after the message with UID 'prevuid'
+   (0 if there is none), so the covered range can carry on over the
+   UIDs in between */
+extern void headerindex_setprev(struct headerindex_txn **txnp,
+				unsigned long prevuid);
+
+/* write the queued entries to 'mailbox's index; the mailbox must
+   still be locked and the messages committed to its index */
+extern int headerindex_commit(struct mailbox *mailbox,
+			      struct headerindex_txn **txnp);
+
+/* replace 'mailbox's index with the queued entries, which must be for
+   every message in it (as reconstruct does); locked as for commit */
+extern int headerindex_rebuild(struct mailbox *mailbox,
+			       struct headerindex_txn **txnp);
+
+/* throw away the queued entries */
+extern void headerindex_abort(struct headerindex_txn **txnp);
+
+/* drop the entries for the 'num' expunged UIDs in 'uids' (which get
+   sorted in place) */
+extern int headerindex_expunge(struct mailbox *mailbox,
+			       unsigned long *uids, unsigned num);
+
+/* find the messages whose 'field' header contains 'substr' (already
+   in canonical search form, compiled as 'pat').  An empty 'substr'
+   matches every message with the header.  Returns 0 and fills in
+   'res' (caller frees res->uids), or -1 if the index can't answer. */
+extern int headerindex_search(struct mailbox *mailbox, const char *field,
+			      const char *substr, comp_pat *pat,
+			      struct headerindex_result *res);
+
+/* return the cached 'alg' THREAD response (caller frees) for the
+   messages whose UIDs have MD5 'digest', or NULL if there isn't one */
+extern char *headerindex_getthread(struct mailbox *mailbox, const char *alg,
+				   const unsigned char digest[16]);
+
+/* cache the 'alg' THREAD response 'tree' for the messages whose UIDs
+   have MD5 'digest' */
+extern void headerindex_putthread(struct mailbox *mailbox, const char *alg,
+				  const unsigned char digest[16],
+				  const char *tree);
+
+/* return the cached SORT result for criteria 'crit' as the '*nuids'
+   UIDs in '*uids' (caller frees), or -1 if there isn't one */
+extern int headerindex_getsort(struct mailbox *mailbox, const char *crit,
+			       unsigned long **uids, int *nuids);
+
+/* cache the SORT result for criteria 'crit' */
+extern void headerindex_putsort(struct mailbox *mailbox, const char *crit,
+				const unsigned long *uids, int nuids);
+
+#endif /* INCLUDED_HEADERINDEX_H */
@@ -68,6 +68,10 @@
 #include <openssl/rand.h>
 #endif /* HAVE_SSL */
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
 #include "acl.h"
 #include "annotate.h"
 #include "append.h"
@@ -165,6 +169,7 @@ static int imapd_userisproxyadmin = 0;
 int imapd_condstore_client = 0;
 static sasl_conn_t *imapd_saslconn; /* the sasl connection context */
 static int imapd_starttls_done = 0; /* have we done a successful starttls? */
+static int imapd_compress_done = 0; /* have we done a successful compress? */
 const char *plaintextloginalert = NULL;
 #ifdef HAVE_SSL
 /* our tls connection, if any */
@@ -279,6 +284,9 @@ void cmd_idle(char* tag);
 void idle_update(idle_flags_t flags);
 
 void cmd_starttls(char *tag, int imaps);
+#ifdef HAVE_ZLIB
+void cmd_compress(char *tag, char *alg);
+#endif
 
 #ifdef HAVE_SSL
 void cmd_urlfetch(char *tag);
@@ -621,6 +629,7 @@ static void imapd_reset(void)
 	imapd_saslconn = NULL;
     }
     imapd_starttls_done = 0;
+    imapd_compress_done = 0;
     plaintextloginalert = NULL;
 
     if(saslprops.iplocalport) {
@@ -919,6 +928,8 @@ void shut_down(int code)
 {
     int i;
 
+    if (index_search_helper) _exit(code);
+
     proc_cleanup();
 
     i = 0;
@@ -987,6 +998,12 @@ void fatal(const char *s, int code)
 {
     static int recurse_code = 0;
 
+    if (index_search_helper) {
+	/* the client and our proc entry belong to the parent, which
+	   will search this slice itself */
+	syslog(LOG_ERR, "search helper: fatal error: %s", s);
+	_exit(code ? code : EC_TEMPFAIL);
+    }
     if (recurse_code) {
 	/* We were called recursively. Just give up */
 	proc_cleanup();
@@ -1258,6 +1275,19 @@ void cmdloop()
 
 		snmp_increment(CLOSE_COUNT, 1);
 	    }
+#ifdef HAVE_ZLIB
+	    else if (!strcmp(cmd.s, "Compress")) {
+		if (c != ' ') goto missingargs;
+		c = getword(imapd_in, &arg1);
+		if (c == EOF) goto missingargs;
+		if (c == '\r') c = prot_getc(imapd_in);
+		if (c != '\n') goto extraargs;
+
+		cmd_compress(tag.s, arg1.s);
+
+		snmp_increment(COMPRESS_COUNT, 1);
+	    }
+#endif /* HAVE_ZLIB */
 	    else goto badcmd;
 	    break;
 
@@ -3276,6 +3306,12 @@ void capa_response(int flags)
 	prot_printf(imapd_out, " IDLE");
     }
 
+#ifdef HAVE_ZLIB
+    if (!imapd_compress_done) {
+	prot_printf(imapd_out, " COMPRESS=DEFLATE");
+    }
+#endif /* HAVE_ZLIB */
+
 #ifdef ENABLE_LISTEXT
     prot_printf(imapd_out, " LISTEXT LIST-SUBSCRIBED");
 #endif /* ENABLE_LISTEXT */
@@ -7346,6 +7382,40 @@ void cmd_starttls(char *tag, int imaps)
 }
 #endif /* HAVE_SSL */
 
+#ifdef HAVE_ZLIB
+/*
+ * Perform a COMPRESS command, as described in RFC 4978
+ */
+void cmd_compress(char *tag, char *alg)
+{
+    if (imapd_compress_done) {
+	prot_printf(imapd_out, "%s BAD [COMPRESSIONACTIVE] %s\r\n",
+		    tag, "DEFLATE active via COMPRESS");
+    }
+    else if (strcasecmp(alg, "DEFLATE")) {
+	prot_printf(imapd_out, "%s NO Unknown COMPRESS algorithm: %s\r\n",
+		    tag, alg);
+    }
+    else if (ZLIB_VERSION[0] != zlibVersion()[0]) {
+	prot_printf(imapd_out,
+		    "%s NO Error initializing %s (incompatible zlib version)\r\n",
+		    tag, alg);
+    }
+    else {
+	prot_printf(imapd_out, "%s OK %s active\r\n", tag, alg);
+
+	/* the response goes out uncompressed, everything after it
+	   (in both directions) is compressed */
+	if (prot_setcompress(imapd_in) == EOF ||
+	    prot_setcompress(imapd_out) == EOF) {
+	    fatal("prot_setcompress() failed: cmd_compress()", EC_TEMPFAIL);
+	}
+
+	imapd_compress_done = 1;
+    }
+}
+#endif /* HAVE_ZLIB */
+
 /*
  * Parse and perform a STATUS command
  * The command has been parsed up to the attribute list
@@ -67,6 +67,8 @@ enum {
 struct notify_message {
     int message;
     pid_t service_pid;
+    int backlog;
+    unsigned int wait;
 	time_t	i_start_time;
 	char i_user_buf[64+1];
 	char i_host_buf[64+1];
@@ -300,5 +302,10 @@ extern mailbox_decideproc_t index_expungeuidlist;
 extern void index_getsearchtext(struct mailbox* mailbox,
                                 index_search_text_receiver_t receiver,
                                 void* rock);
+/* Same, but only for messages with a UID above lowuid. */
+extern void index_getsearchtext_since(struct mailbox* mailbox,
+                                      unsigned lowuid,
+                                      index_search_text_receiver_t receiver,
+                                      void* rock);
 
 #endif /* INCLUDED_IMAPD_H */
@@ -47,8 +47,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <syslog.h>
@@ -62,14 +66,19 @@
 #include "charset.h"
 #include "exitcodes.h"
 #include "hash.h"
+#include "headerindex.h"
 #include "imap_err.h"
 #include "global.h"
 #include "imapd.h"
-#include "lsort.h"
+#include "keysort.h"
 #include "mailbox.h"
 #include "map.h"
+#include "md5global.h"
+#include "md5.h"
 #include "message.h"
+#include "mpool.h"
 #include "parseaddr.h"
+#include "retry.h"
 #include "search_engines.h"
 #include "seen.h"
 #include "strhash.h"
@@ -106,9 +115,54 @@ static time_t *flagreport;	/* Array for each msgno of last_updated when
 static char *seenflag;		/* Array for each msgno, nonzero if \Seen */
 static time_t seen_last_change;	/* Last mod time of \Seen state change */
 static int flagalloced = -1;	/* Allocated size of above two arrays */
+
+/*
+ * Columnar copy of the index fields that FETCH FLAGS, SEARCH, STORE
+ * and CHANGEDSINCE scan, in host byte order, so those loops walk
+ * small arrays instead of byte-swapping fields out of index records.
+ * Rebuilt by index_check() and kept current by index_storeflag().
+ * Entry 0 is unused, as for flagreport[].
+ */
+static struct {
+    unsigned exists;		/* msgnos loaded, 0 if not loaded */
+    unsigned alloced;
+    int condstore;		/* OPT_IMAP_CONDSTORE was set when loaded */
+    modseq_t highestmodseq;	/* index header HIGHESTMODSEQ when loaded */
+    bit32 *uid;
+    bit32 *system_flags;
+    bit32 *user_flags;		/* MAX_USER_FLAGS/32 words per msgno */
+    time_t *last_updated;
+    modseq_t *modseq;
+    unsigned *changed;		/* msgnos reloaded by index_snapshot_refresh */
+} snap;
+
+/* Snapshot accessors; fall back to the mapped index if not loaded */
+#define SNAP_LOADED(msgno) ((unsigned) (msgno) - 1 < snap.exists)
+#define SNAP_UID(msgno) \
+    (SNAP_LOADED(msgno) ? snap.uid[msgno] : UID(msgno))
+#define SNAP_SYSTEM_FLAGS(msgno) \
+    (SNAP_LOADED(msgno) ? snap.system_flags[msgno] : SYSTEM_FLAGS(msgno))
+#define SNAP_USER_FLAGS(msgno,i) \
+    (SNAP_LOADED(msgno) ? \
+     snap.user_flags[(msgno)*(MAX_USER_FLAGS/32)+(i)] : USER_FLAGS(msgno,i))
+#define SNAP_LAST_UPDATED(msgno) \
+    (SNAP_LOADED(msgno) ? snap.last_updated[msgno] : LAST_UPDATED(msgno))
+#define SNAP_MODSEQ(msgno) \
+    (SNAP_LOADED(msgno) ? snap.modseq[msgno] : MODSEQ(msgno))
+
+/* HIGHESTMODSEQ as currently stored in the mapped index header */
+#ifdef HAVE_LONG_LONG_INT
+#define INDEX_HIGHESTMODSEQ() \
+    ntohll(*((bit64 *)(index_base+OFFSET_HIGHESTMODSEQ_64)))
+#else
+#define INDEX_HIGHESTMODSEQ() \
+    ntohl(*((bit32 *)(index_base+OFFSET_HIGHESTMODSEQ)))
+#endif
 struct seen *seendb;		/* Seen state database object */
 static char *seenuids;		/* Sequence of UID's from last seen checkpoint */
 
+int index_search_helper = 0;	/* Nonzero in a forked SEARCH helper */
+
 /* Forward declarations */
 typedef int index_sequenceproc_t(struct mailbox *mailbox, unsigned msgno,
 				 void *rock);
@@ -118,14 +172,18 @@ static int index_forsequence(struct mailbox *mailbox, const char *sequence,
 			     index_sequenceproc_t *proc, void *rock,
 			     int* fetchedsomething);
 static int index_insequence(int num, char *sequence, int usinguid);
+static void index_snapshot_load(struct mailbox *mailbox, unsigned exists);
+static int index_snapshot_refresh(struct mailbox *mailbox, unsigned exists);
+static void index_snapshot_update(unsigned msgno,
+				  struct index_record *record);
 
-void index_fetchmsg(const char *msg_base, unsigned long msg_size,
+void index_fetchmsg(const char *msg_base, unsigned long msg_size, int msg_fd,
 		    int format, unsigned offset, unsigned size,
 		    unsigned start_octet, unsigned octet_count,
 		    struct protstream *pout);
 static int index_fetchsection(const char *resp,
 			      const char *msg_base, unsigned long msg_size,
-			      int format, char *section,
+			      int msg_fd, int format, char *section,
 			      const char *cacheitem, unsigned size,
 			      unsigned start_octet, unsigned octet_count);
 static void index_fetchfsection(const char *msg_base,
@@ -153,9 +211,9 @@ static index_sequenceproc_t index_storeflag;
 static int index_search_evaluate(struct mailbox *mailbox,
 				 struct searchargs *searchargs,
 				 unsigned msgno, struct mapfile *msgfile);
-static int index_searchmsg(char *substr, comp_pat *pat,
+static int index_searchmsg(struct searchargs *searchargs,
 			   struct mapfile *msgfile, int format,
-			   int skipheader, const char *cacheitem);
+			   const char *cacheitem);
 static int index_searchheader(char *name, char *substr, comp_pat *pat,
 			      struct mapfile *msgfile, int format,
 			      int size);
@@ -165,31 +223,44 @@ static index_sequenceproc_t index_copysetup;
 static int _index_search(unsigned **msgno_list, struct mailbox *mailbox,
 			 struct searchargs *searchargs,
 			 modseq_t *highestmodseq);
+static int index_search_needtext(struct searchargs *searchargs);
+static void index_search_hindex(struct mailbox *mailbox,
+				struct searchargs *searchargs);
+static int index_search_hindex_check(struct strlist *l, unsigned msgno);
+static int index_search_range(struct mailbox *mailbox,
+			      struct searchargs *searchargs,
+			      unsigned *list, int start, int end,
+			      unsigned *out);
+static int index_search_parallel(struct mailbox *mailbox,
+				 struct searchargs *searchargs,
+				 unsigned *list, int listcount, int nworkers);
 
 static void parse_cached_envelope(char *env, char *tokens[], int tokens_size);
-static char *find_msgid(char *str, char **rem);
-static char *get_localpart_addr(const char *header);
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
+static char *find_msgid(struct mpool *pool, char *str, char **rem);
+static char *get_localpart_addr(struct mpool *pool, const char *header);
+static char *index_extract_subject(struct mpool *pool,
+				   const char *subj, size_t len, int *is_refwd);
 static char *_index_extract_subject(char *s, int *is_refwd);
-static void index_get_ids(MsgData *msgdata,
+static void index_get_ids(struct mpool *pool, MsgData *msgdata,
 			  char *envtokens[], const char *headers);
-static MsgData *index_msgdata_load(unsigned *msgno_list, int n,
+static struct mpool *index_msgdata_pool(int nmsg);
+static MsgData *index_msgdata_load(struct mpool *pool,
+				   unsigned *msgno_list, int n,
 				   struct sortcrit *sortcrit);
 
-static void *index_sort_getnext(MsgData *node);
-static void index_sort_setnext(MsgData *node, MsgData *next);
+static MsgData *index_sort_list(MsgData *list, struct sortcrit *sortcrit);
 static int index_sort_compare(MsgData *md1, MsgData *md2,
 			      struct sortcrit *call_data);
-static void index_msgdata_free(MsgData *md);
 
-static void *index_thread_getnext(Thread *thread);
-static void index_thread_setnext(Thread *thread, Thread *next);
+static Thread *index_thread_sortlist(Thread *list,
+				     struct sortcrit *sortcrit);
 static int index_thread_compare(Thread *t1, Thread *t2,
 				struct sortcrit *call_data);
 static void index_thread_orderedsubj(unsigned *msgno_list, int nmsg,
 				     int usinguid);
 static void index_thread_sort(Thread *root, struct sortcrit *sortcrit);
 static void index_thread_print(Thread *threads, int usinguid);
+static void index_thread_output(const char *resp, int usinguid);
 static void index_thread_ref(unsigned *msgno_list, int nmsg, int usinguid);
 
 /* NOTE: Make sure these are listed in CAPABILITY_STRING */
@@ -199,6 +270,12 @@ static const struct thread_algorithm thread_algs[] = {
     { NULL, NULL }
 };
 
+/*
+ * The untagged THREAD response built by index_thread_print(), with
+ * messages given by UID, so that it can go in the thread cache.
+ */
+static struct buf thread_resp;
+
 /*
  * A mailbox is about to be closed.
  */
@@ -217,6 +294,7 @@ void index_closemailbox(struct mailbox *mailbox)
 	    map_free(&cache_base, &cache_len); 
 	index_dirty = cache_dirty = index_len = cache_end = 0;
     }
+    snap.exists = 0;
 }
 
 /*
@@ -245,6 +323,7 @@ void index_operatemailbox(struct mailbox *mailbox)
     start_offset = mailbox->start_offset;
     record_size = mailbox->record_size;
     imapd_exists = mailbox->exists;
+    snap.exists = 0;
 }
 
 /*
@@ -257,7 +336,8 @@ void index_operatemailbox(struct mailbox *mailbox)
 void index_check(struct mailbox *mailbox, int usinguid, int checkseen)
 {
     struct stat sbuf;
-    int newexists, oldexists, oldmsgno, msgno, nexpunge, i, r;
+    int newexists, oldexists, oldmsgno, msgno, nchanged, i, r;
+    unsigned *changed;
     struct index_record record;
     time_t last_read;
     bit32 user_flags[MAX_USER_FLAGS/32];
@@ -302,30 +382,34 @@ void index_check(struct mailbox *mailbox, int usinguid, int checkseen)
 		oldexists = -1;
 	    }
 
-	    for (oldmsgno = msgno = 1; oldmsgno <= imapd_exists;
-		 oldmsgno++, msgno++) {
-		if (msgno <= mailbox->exists) {
-		    mailbox_read_index_record(mailbox, msgno, &record);
-		}
-		else {
-		    record.uid = mailbox->last_uid+1;
+	    /*
+	     * Walk the old and new message lists once, reporting the
+	     * expunged messages and compacting flagreport[] and seenflag[]
+	     * over them as we go.
+	     */
+	    record.uid = 0;
+	    for (oldmsgno = msgno = 1; oldmsgno <= imapd_exists; oldmsgno++) {
+		if (record.uid == 0) {
+		    if (msgno <= mailbox->exists) {
+			mailbox_read_index_record(mailbox, msgno, &record);
+		    }
+		    else {
+			record.uid = mailbox->last_uid+1;
+		    }
 		}
-		
-		nexpunge = 0;
-		while (oldmsgno<=imapd_exists && UID(oldmsgno) < record.uid) {
-		    nexpunge++;
-		    oldmsgno++;
+
+		if (SNAP_UID(oldmsgno) < record.uid) {
+		    prot_printf(imapd_out, "* %u EXPUNGE\r\n", msgno);
+		    oldexists--;
+		    continue;
 		}
-		if (nexpunge) {
-		    memmove(flagreport+msgno, flagreport+msgno+nexpunge,
-			    (oldexists-msgno-nexpunge+1)*sizeof(*flagreport));
-		    memmove(seenflag+msgno, seenflag+msgno+nexpunge,
-			    (oldexists-msgno-nexpunge+1)*sizeof(*seenflag));
-		    oldexists -= nexpunge;
-		    while (nexpunge--) {
-			prot_printf(imapd_out, "* %u EXPUNGE\r\n", msgno);
-		    }
+
+		if (msgno != oldmsgno) {
+		    flagreport[msgno] = flagreport[oldmsgno];
+		    seenflag[msgno] = seenflag[oldmsgno];
 		}
+		msgno++;
+		record.uid = 0;
 	    }
 
 	    /* Force re-map of index/cache files */
@@ -353,6 +437,9 @@ void index_check(struct mailbox *mailbox, int usinguid, int checkseen)
 		start_offset + newexists * record_size,
 		"index", mailbox->name);
     index_dirty = 1;
+    nchanged = (imapd_exists == oldexists && snap.exists == (unsigned) oldexists) ?
+	index_snapshot_refresh(mailbox, newexists) : -1;
+    if (nchanged == -1) index_snapshot_load(mailbox, newexists);
     if (fstat(mailbox->cache_fd, &sbuf) == -1) {
 	syslog(LOG_ERR, "IOERROR: stating cache file for %s: %m",
 	       mailbox->name);
@@ -411,7 +498,7 @@ void index_check(struct mailbox *mailbox, int usinguid, int checkseen)
 
 	/* Zero out array entry for newly arrived messages */
 	for (i = oldexists+1; i <= newexists; i++) {
-	    flagreport[i] = LAST_UPDATED(i);
+	    flagreport[i] = SNAP_LAST_UPDATED(i);
 	    seenflag[i] = 0;
 	}
 
@@ -443,23 +530,159 @@ void index_check(struct mailbox *mailbox, int usinguid, int checkseen)
 	}
     }
 
-    for (msgno = 1; msgno <= oldexists; msgno++) {
-	if (flagreport[msgno] < LAST_UPDATED(msgno)) {
-	    for (i = 0; i < VECTOR_SIZE(user_flags); i++) {
-		user_flags[i] = USER_FLAGS(msgno, i);
+    /* Report flag changes; if the snapshot was refreshed incrementally
+       only the reloaded messages can have changed */
+    changed = snap.changed;
+    for (i = 0; nchanged == -1 ? i < oldexists : i < nchanged; i++) {
+	msgno = (nchanged == -1) ? i + 1 : changed[i];
+	if (msgno > oldexists) break;
+	if (flagreport[msgno] < SNAP_LAST_UPDATED(msgno)) {
+	    for (r = 0; r < VECTOR_SIZE(user_flags); r++) {
+		user_flags[r] = SNAP_USER_FLAGS(msgno, r);
 	    }
-	    index_fetchflags(mailbox, msgno, SYSTEM_FLAGS(msgno), user_flags,
-			     LAST_UPDATED(msgno));
+	    index_fetchflags(mailbox, msgno, SNAP_SYSTEM_FLAGS(msgno),
+			     user_flags, SNAP_LAST_UPDATED(msgno));
 	    if ((mailbox->options & OPT_IMAP_CONDSTORE) &&
 		imapd_condstore_client) {
-		prot_printf(imapd_out, " MODSEQ (" MODSEQ_FMT ")", MODSEQ(msgno));
+		prot_printf(imapd_out, " MODSEQ (" MODSEQ_FMT ")",
+			    SNAP_MODSEQ(msgno));
 	    }
-	    if (usinguid) prot_printf(imapd_out, " UID %u", UID(msgno));
+	    if (usinguid) prot_printf(imapd_out, " UID %u", SNAP_UID(msgno));
 	    prot_printf(imapd_out, ")\r\n");
 	}
     }
 }
 
+/*
+ * Load the columnar snapshot of the first 'exists' index records
+ * from the freshly mapped index file.
+ */
+static void index_snapshot_load(struct mailbox *mailbox, unsigned exists)
+{
+    modseq_t highestmodseq;
+    unsigned msgno;
+    int i;
+    bit32 *uf;
+
+    if (exists > snap.alloced) {
+	/* Double what we need in hopes we won't have to realloc again */
+	snap.alloced = exists * 2;
+	snap.uid = (bit32 *)
+	    xrealloc(snap.uid, (snap.alloced+1) * sizeof(bit32));
+	snap.system_flags = (bit32 *)
+	    xrealloc(snap.system_flags, (snap.alloced+1) * sizeof(bit32));
+	snap.user_flags = (bit32 *)
+	    xrealloc(snap.user_flags,
+		     (snap.alloced+1) * (MAX_USER_FLAGS/32) * sizeof(bit32));
+	snap.last_updated = (time_t *)
+	    xrealloc(snap.last_updated, (snap.alloced+1) * sizeof(time_t));
+	snap.modseq = (modseq_t *)
+	    xrealloc(snap.modseq, (snap.alloced+1) * sizeof(modseq_t));
+	snap.changed = (unsigned *)
+	    xrealloc(snap.changed, (snap.alloced+1) * sizeof(unsigned));
+    }
+
+    /* Read HIGHESTMODSEQ before the records, so that a record changed
+     * while we copy it is reloaded by the next index_snapshot_refresh() */
+    highestmodseq = INDEX_HIGHESTMODSEQ();
+
+    /* One sequential pass over the records */
+    uf = snap.user_flags + (MAX_USER_FLAGS/32);
+    for (msgno = 1; msgno <= exists; msgno++) {
+	snap.uid[msgno] = UID(msgno);
+	snap.system_flags[msgno] = SYSTEM_FLAGS(msgno);
+	for (i = 0; i < MAX_USER_FLAGS/32; i++) {
+	    *uf++ = USER_FLAGS(msgno, i);
+	}
+	snap.last_updated[msgno] = LAST_UPDATED(msgno);
+	snap.modseq[msgno] = MODSEQ(msgno);
+    }
+    snap.exists = exists;
+    snap.condstore = (mailbox->options & OPT_IMAP_CONDSTORE) != 0;
+    snap.highestmodseq = highestmodseq;
+}
+
+/*
+ * Bring a loaded snapshot up to date with the mapped index file,
+ * which now has 'exists' records and no expunges since the snapshot
+ * was taken.  Only possible for CONDSTORE mailboxes, where every
+ * change bumps the record MODSEQ above the header HIGHESTMODSEQ we
+ * recorded.  If nothing changed this costs a single header read.
+ *
+ * Returns the number of existing messages that were reloaded (their
+ * msgnos are in snap.changed), or -1 if the caller must do a full
+ * index_snapshot_load().
+ */
+static int index_snapshot_refresh(struct mailbox *mailbox, unsigned exists)
+{
+    modseq_t highestmodseq, modseq;
+    unsigned msgno, oldexists = snap.exists;
+    int i, nchanged = 0;
+    bit32 *uf;
+
+    if (!snap.exists || exists < snap.exists || exists > snap.alloced ||
+	!snap.condstore || !(mailbox->options & OPT_IMAP_CONDSTORE)) {
+	return -1;
+    }
+
+    highestmodseq = INDEX_HIGHESTMODSEQ();
+    if (highestmodseq == snap.highestmodseq && exists == oldexists) {
+	return 0;
+    }
+
+    /* Reload the records changed since the snapshot... */
+    if (highestmodseq != snap.highestmodseq) {
+	for (msgno = 1; msgno <= oldexists; msgno++) {
+	    modseq = MODSEQ(msgno);
+	    if (modseq <= snap.highestmodseq) continue;
+
+	    snap.system_flags[msgno] = SYSTEM_FLAGS(msgno);
+	    uf = snap.user_flags + msgno * (MAX_USER_FLAGS/32);
+	    for (i = 0; i < MAX_USER_FLAGS/32; i++) {
+		uf[i] = USER_FLAGS(msgno, i);
+	    }
+	    snap.last_updated[msgno] = LAST_UPDATED(msgno);
+	    snap.modseq[msgno] = modseq;
+	    snap.changed[nchanged++] = msgno;
+	}
+    }
+
+    /* ...and append the new ones */
+    uf = snap.user_flags + (oldexists + 1) * (MAX_USER_FLAGS/32);
+    for (msgno = oldexists + 1; msgno <= exists; msgno++) {
+	snap.uid[msgno] = UID(msgno);
+	snap.system_flags[msgno] = SYSTEM_FLAGS(msgno);
+	for (i = 0; i < MAX_USER_FLAGS/32; i++) {
+	    *uf++ = USER_FLAGS(msgno, i);
+	}
+	snap.last_updated[msgno] = LAST_UPDATED(msgno);
+	snap.modseq[msgno] = MODSEQ(msgno);
+    }
+
+    snap.exists = exists;
+    snap.highestmodseq = highestmodseq;
+
+    return nchanged;
+}
+
+/*
+ * Refresh the snapshot entry for 'msgno' after we rewrote its record.
+ */
+static void index_snapshot_update(unsigned msgno,
+				  struct index_record *record)
+{
+    int i;
+
+    if (!SNAP_LOADED(msgno)) return;
+
+    snap.system_flags[msgno] = record->system_flags;
+    for (i = 0; i < MAX_USER_FLAGS/32; i++) {
+	snap.user_flags[msgno*(MAX_USER_FLAGS/32)+i] = record->user_flags[i];
+    }
+    snap.last_updated[msgno] = record->last_updated;
+    snap.modseq[msgno] = record->modseq;
+}
+
 /*
  * Checkpoint the user's \Seen state
  *
@@ -522,7 +745,7 @@ int oldexists;
     while (cyrus_isdigit((int) *new)) newnext = newnext * 10 + *new++ - '0';
 
     for (msgno = 1; msgno <= imapd_exists; msgno++) {
-	uid = UID(msgno);
+	uid = SNAP_UID(msgno);
 	while (oldnext <= uid) {
 	    if (*old != ':' && !oldseen && oldnext == uid) {
 		oldseen = 1;
@@ -565,17 +788,17 @@ int oldexists;
 		seenflag[msgno] = newseen;
 		if (!quiet && msgno <= oldexists && oldexists != -1) {
 		    for (i = 0; i < VECTOR_SIZE(user_flags); i++) {
-			user_flags[i] = USER_FLAGS(msgno, i);
+			user_flags[i] = SNAP_USER_FLAGS(msgno, i);
 		    }
-		    index_fetchflags(mailbox, msgno, SYSTEM_FLAGS(msgno), 
-				     user_flags, LAST_UPDATED(msgno));
+		    index_fetchflags(mailbox, msgno, SNAP_SYSTEM_FLAGS(msgno), 
+				     user_flags, SNAP_LAST_UPDATED(msgno));
 		    if ((mailbox->options & OPT_IMAP_CONDSTORE) &&
 			imapd_condstore_client) {
 			prot_printf(imapd_out, " MODSEQ (" MODSEQ_FMT ")",
-				    MODSEQ(msgno));
+				    SNAP_MODSEQ(msgno));
 		    }
 		    if (usinguid) {
-			prot_printf(imapd_out, " UID %u", UID(msgno));
+			prot_printf(imapd_out, " UID %u", SNAP_UID(msgno));
 		    }
 		    prot_printf(imapd_out, ")\r\n");
 		}
@@ -637,7 +860,7 @@ int oldexists;
     save = saveseenuids = xmalloc(savealloced);
     *save = '\0';
     for (msgno = 1; msgno <= imapd_exists; msgno++) {
-	uid = UID(msgno);
+	uid = SNAP_UID(msgno);
 	if (seenflag[msgno] != inrange) {
 	    newallseen = 0;
 	    if (inrange) {
@@ -979,6 +1202,279 @@ int nflags;
     return r;
 }
 
+/*
+ * What the header index says about a HEADER (or Message-ID) pattern
+ * for each message.  index_search_hindex() leaves an array of these,
+ * indexed by msgno, in the pattern's 'rock'.
+ */
+#define HINDEX_UNKNOWN 0	/* not covered; check the message itself */
+#define HINDEX_NOMATCH 1
+#define HINDEX_MATCH 2
+#define HINDEX_STATE(l, msgno) \
+    ((l)->rock ? ((unsigned char *) (l)->rock)[msgno] : HINDEX_UNKNOWN)
+
+static void index_search_hindex_pat(struct mailbox *mailbox,
+				    const char *field, struct strlist *l)
+{
+    struct headerindex_result res;
+    unsigned char *state;
+    unsigned msgno;
+    unsigned long uid;
+    int i = 0;
+
+    if (l->rock) {
+	free(l->rock);
+	l->rock = NULL;
+    }
+    if (headerindex_search(mailbox, field, l->s, l->p, &res)) return;
+
+    state = (unsigned char *) xmalloc(imapd_exists + 1);
+    state[0] = HINDEX_UNKNOWN;
+    for (msgno = 1; msgno <= imapd_exists; msgno++) {
+	uid = UID(msgno);
+	if (uid < res.start || uid > res.last) {
+	    state[msgno] = HINDEX_UNKNOWN;
+	    continue;
+	}
+	while (i < res.nuids && res.uids[i] < uid) i++;
+	state[msgno] = (i < res.nuids && res.uids[i] == uid) ?
+	    HINDEX_MATCH : HINDEX_NOMATCH;
+    }
+
+    if (res.uids) free(res.uids);
+    l->rock = state;
+}
+
+/*
+ * Look up the HEADER and Message-ID criteria in 'searchargs' that
+ * the mailbox's header index covers.
+ */
+static void index_search_hindex(struct mailbox *mailbox,
+				struct searchargs *searchargs)
+{
+    struct strlist *l, *h;
+    struct searchsub *s;
+
+    h = searchargs->header_name;
+    for (l = searchargs->header; l; (l = l->next), (h = h->next)) {
+	if (headerindex_field(h->s)) index_search_hindex_pat(mailbox, h->s, l);
+    }
+    if (headerindex_field("message-id")) {
+	for (l = searchargs->messageid; l; l = l->next) {
+	    index_search_hindex_pat(mailbox, "message-id", l);
+	}
+    }
+
+    for (s = searchargs->sublist; s; s = s->next) {
+	index_search_hindex(mailbox, s->sub1);
+	if (s->sub2) index_search_hindex(mailbox, s->sub2);
+    }
+}
+
+/*
+ * Check the patterns in 'l' against the header index for 'msgno'.
+ * Returns 0 if one is known not to match, 1 if all are known to
+ * match, or -1 if the message has to be looked at.
+ */
+static int index_search_hindex_check(struct strlist *l, unsigned msgno)
+{
+    int r = 1;
+
+    for (; l; l = l->next) {
+	switch (HINDEX_STATE(l, msgno)) {
+	case HINDEX_NOMATCH:
+	    return 0;
+	case HINDEX_MATCH:
+	    break;
+	default:
+	    r = -1;
+	    break;
+	}
+    }
+
+    return r;
+}
+
+/*
+ * Returns nonzero if evaluating 'searchargs' requires reading
+ * message bodies (BODY or TEXT), anywhere in the search tree.
+ */
+static int index_search_needtext(struct searchargs *searchargs)
+{
+    struct searchsub *s;
+
+    if (searchargs->body || searchargs->text) return 1;
+
+    for (s = searchargs->sublist; s; s = s->next) {
+	if (index_search_needtext(s->sub1)) return 1;
+	if (s->sub2 && index_search_needtext(s->sub2)) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Evaluate 'searchargs' against list[start..end) and store the
+ * matching message numbers in 'out'.  'out' may alias 'list' at
+ * 'start', since we never write past the entry being examined.
+ * Returns the number of matches.
+ */
+static int index_search_range(struct mailbox *mailbox,
+			      struct searchargs *searchargs,
+			      unsigned *list, int start, int end,
+			      unsigned *out)
+{
+    unsigned msgno;
+    struct mapfile msgfile;
+    int listindex;
+    int n = 0;
+
+    for (listindex = start; listindex < end; listindex++) {
+	msgno = list[listindex];
+	msgfile.base = 0;
+	msgfile.size = 0;
+
+	if (index_search_evaluate(mailbox, searchargs, msgno, &msgfile)) {
+	    out[n++] = msgno;
+	}
+	if (msgfile.base) {
+	    mailbox_unmap_message(mailbox, UID(msgno),
+				  &msgfile.base, &msgfile.size);
+	}
+    }
+
+    return n;
+}
+
+/*
+ * Evaluate 'searchargs' against list[0..listcount) using 'nworkers'
+ * forked helper processes, each taking a contiguous slice of the list.
+ * The index is not thread-safe, but everything a helper needs (the
+ * mmap'd index and cache, the search arguments) is inherited across
+ * fork(), so each helper simply runs the serial loop on its slice and
+ * writes the matching message numbers back up a pipe.
+ *
+ * Results are compacted in place at the front of 'list', in the
+ * original order.  A slice whose helper could not be started, or whose
+ * results were lost, is evaluated by the caller instead.
+ * Returns the number of matches.
+ */
+static int index_search_parallel(struct mailbox *mailbox,
+				 struct searchargs *searchargs,
+				 unsigned *list, int listcount, int nworkers)
+{
+    pid_t *pid;
+    int *fd;
+    unsigned *buf;
+    int i, n = 0;
+    int chunk = (listcount + nworkers - 1) / nworkers;
+
+    pid = (pid_t *) xmalloc(nworkers * sizeof(pid_t));
+    fd = (int *) xmalloc(nworkers * sizeof(int));
+    buf = (unsigned *) xmalloc(chunk * sizeof(unsigned));
+
+    for (i = 0; i < nworkers; i++) {
+	int start = i * chunk;
+	int end = start + chunk;
+	int p[2];
+
+	pid[i] = -1;
+	fd[i] = -1;
+	if (end > listcount) end = listcount;
+	if (start >= end) continue;
+
+	if (pipe(p) < 0) {
+	    syslog(LOG_WARNING, "search: pipe: %m");
+	    continue;
+	}
+
+	pid[i] = fork();
+	if (pid[i] < 0) {
+	    syslog(LOG_WARNING, "search: fork: %m");
+	    close(p[0]);
+	    close(p[1]);
+	    continue;
+	}
+
+	if (pid[i] == 0) {
+	    /* helper: evaluate our slice and report back */
+	    unsigned *out;
+	    int count, j;
+
+	    /* we share the client connection and the proc entry with
+	       our parent; fatal() and shut_down() must leave them be */
+	    index_search_helper = 1;
+
+	    close(p[0]);
+	    for (j = 0; j < i; j++) {
+		if (fd[j] >= 0) close(fd[j]);
+	    }
+
+	    out = (unsigned *) xmalloc((end - start + 1) * sizeof(unsigned));
+	    count = index_search_range(mailbox, searchargs, list, start, end,
+				       out + 1);
+	    out[0] = count;
+	    if (retry_write(p[1], (char *) out,
+			    (count + 1) * sizeof(unsigned)) < 0) {
+		_exit(1);
+	    }
+	    _exit(0);
+	}
+
+	close(p[1]);
+	fd[i] = p[0];
+    }
+
+    /* collect results in slice order */
+    for (i = 0; i < nworkers; i++) {
+	int start = i * chunk;
+	int end = start + chunk;
+	unsigned count = 0;
+	int ok = 0, status = 0;
+
+	if (end > listcount) end = listcount;
+	if (start >= end) break;
+
+	if (fd[i] >= 0) {
+	    if (retry_read(fd[i], (char *) &count, sizeof(count)) ==
+		    sizeof(count) &&
+		count <= (unsigned) (end - start) &&
+		(count == 0 ||
+		 retry_read(fd[i], (char *) buf, count * sizeof(unsigned)) ==
+		     (int) (count * sizeof(unsigned)))) {
+		ok = 1;
+	    }
+	    close(fd[i]);
+	}
+	if (pid[i] > 0) {
+	    /* a helper that died only wrote nothing, but make sure */
+	    while (waitpid(pid[i], &status, 0) < 0 && errno == EINTR);
+	    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = 0;
+	}
+
+	if (ok) {
+	    /* n <= start, so this never overwrites an unread slice */
+	    memmove(list + n, buf, count * sizeof(unsigned));
+	    n += count;
+	}
+	else {
+	    if (fd[i] >= 0) {
+		syslog(LOG_WARNING,
+		       "search: helper %d failed, evaluating slice locally",
+		       (int) pid[i]);
+	    }
+	    n += index_search_range(mailbox, searchargs, list, start, end,
+				    list + n);
+	}
+    }
+
+    free(buf);
+    free(fd);
+    free(pid);
+
+    return n;
+}
+
 /*
  * Guts of the SEARCH command.
  * 
@@ -989,11 +1485,10 @@ static int _index_search(unsigned **msgno_list, struct mailbox *mailbox,
 			 struct searchargs *searchargs,
 			 modseq_t *highestmodseq)
 {
-    unsigned msgno;
-    struct mapfile msgfile;
     int n = 0;
     int listindex;
     int listcount;
+    int nworkers;
 
     if (imapd_exists <= 0) return 0;
 
@@ -1006,21 +1501,32 @@ static int _index_search(unsigned **msgno_list, struct mailbox *mailbox,
        already looked at. */
     listcount = search_prefilter_messages(*msgno_list, mailbox, searchargs);
 
-    for (listindex = 0; listindex < listcount; listindex++) {
-        msgno = (*msgno_list)[listindex];
-	msgfile.base = 0;
-	msgfile.size = 0;
+    /* Answer what we can of the header criteria from the header index */
+    if (headerindex_enabled()) index_search_hindex(mailbox, searchargs);
 
-	if (index_search_evaluate(mailbox, searchargs, msgno, &msgfile)) {
-	    (*msgno_list)[n++] = msgno;
-	    if (highestmodseq && (MODSEQ(msgno) > *highestmodseq)) {
-		*highestmodseq = MODSEQ(msgno);
+    /* Text searches over large mailboxes are dominated by scanning
+       message files; spread them over helper processes if configured. */
+    nworkers = config_getint(IMAPOPT_SEARCH_WORKERS);
+    if (nworkers > 1 &&
+	listcount >= config_getint(IMAPOPT_SEARCH_WORKERS_MINMSGS) &&
+	index_search_needtext(searchargs)) {
+	if (nworkers > listcount) nworkers = listcount;
+	n = index_search_parallel(mailbox, searchargs,
+				  *msgno_list, listcount, nworkers);
+    }
+    else {
+	n = index_search_range(mailbox, searchargs,
+			       *msgno_list, 0, listcount, *msgno_list);
+    }
+
+    if (highestmodseq) {
+	for (listindex = 0; listindex < n; listindex++) {
+	    unsigned msgno = (*msgno_list)[listindex];
+
+	    if (SNAP_MODSEQ(msgno) > *highestmodseq) {
+		*highestmodseq = SNAP_MODSEQ(msgno);
 	    }
 	}
-	if (msgfile.base) {
-	    mailbox_unmap_message(mailbox, UID(msgno),
-				  &msgfile.base, &msgfile.size);
-	}
     }
 
     /* if we didn't find any matches, free msgno_list */
@@ -1033,7 +1539,7 @@ static int _index_search(unsigned **msgno_list, struct mailbox *mailbox,
 }
 
 int index_getuid(unsigned msgno) {
-  return UID(msgno);
+  return SNAP_UID(msgno);
 }
 
 /* 'uid_list' is malloc'd string representing the hits from searchargs;
@@ -1052,7 +1558,7 @@ int index_getuidsequence(struct mailbox *mailbox,
     }
 
     for (i = 0; i < n; i++) {
-	msgno_list[i] = UID(msgno_list[i]);
+	msgno_list[i] = SNAP_UID(msgno_list[i]);
     }
 
     *uid_list = msgno_list;
@@ -1090,6 +1596,156 @@ int index_search(struct mailbox *mailbox, struct searchargs *searchargs,
     return n;
 }
 
+/*
+ * Describe 'sortcrit' in 'buf' as SORT criteria, e.g. "REVERSE DATE".
+ */
+static void index_sort_critname(struct sortcrit *sortcrit,
+				char *buf, size_t size)
+{
+    char *key_names[] = { "SEQUENCE", "ARRIVAL", "CC", "DATE", "FROM",
+			  "SIZE", "SUBJECT", "TO", "ANNOTATION", "MODSEQ" };
+    int len;
+
+    buf[0] = '\0';
+    while (sortcrit->key && sortcrit->key < VECTOR_SIZE(key_names)) {
+	if (sortcrit->flags & SORT_REVERSE)
+	    strlcat(buf, "REVERSE ", size);
+
+	strlcat(buf, key_names[sortcrit->key], size);
+
+	switch (sortcrit->key) {
+	case SORT_ANNOTATION:
+	    len = strlen(buf);
+	    snprintf(buf + len, size - len,
+		     " \"%s\" \"%s\"",
+		     sortcrit->args.annot.entry, sortcrit->args.annot.attrib);
+	    break;
+	}
+	if ((++sortcrit)->key) strlcat(buf, " ", size);
+    }
+}
+
+/*
+ * Returns nonzero if 'sortcrit' only uses keys that can't change once
+ * a message is appended, so a sorted list of UIDs stays sorted.
+ */
+static int index_sort_cacheable(struct sortcrit *sortcrit)
+{
+    int i;
+
+    for (i = 0; sortcrit[i].key != SORT_SEQUENCE; i++) {
+	if (sortcrit[i].key == SORT_ANNOTATION ||
+	    sortcrit[i].key == SORT_MODSEQ) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Sort the 'nmsg' messages in 'msgno_list' starting from the cached
+ * result for 'critname'.  Messages the cached list has that aren't in
+ * 'msgno_list' are dropped and the rest keep their order; messages it
+ * doesn't have are sorted among themselves and then merged in, with a
+ * binary search each, loading only the msgdata the searches touch.
+ *
+ * Returns the msgnos in order, or NULL if there is no cached result or
+ * so much is new that sorting from scratch is cheaper.  '*changed' is
+ * set if the result differs from what was cached.
+ */
+static unsigned *index_sort_fromcache(struct mailbox *mailbox,
+				      const char *critname,
+				      unsigned *msgno_list, int nmsg,
+				      struct sortcrit *sortcrit,
+				      int *changed)
+{
+    unsigned long *cached, uid;
+    unsigned *kept, *added, *sorted;
+    char *present;
+    MsgData *md, **probe;
+    struct mpool *pool;
+    int ncached, nkept = 0, nadded = 0, i, k, lo, hi, mid, n, bits;
+
+    if (headerindex_getsort(mailbox, critname, &cached, &ncached)) {
+	return NULL;
+    }
+
+    /* the cached messages that are still here, in their sorted order;
+       msgno_list is in UID order, so find each one by binary search */
+    kept = (unsigned *) xmalloc((ncached + 1) * sizeof(unsigned));
+    present = xzmalloc(nmsg);
+    for (i = 0; i < ncached; i++) {
+	uid = cached[i];
+	lo = 0;
+	hi = nmsg;
+	while (lo < hi) {
+	    mid = (lo + hi) / 2;
+	    if (UID(msgno_list[mid]) < uid) lo = mid + 1;
+	    else hi = mid;
+	}
+	if (lo < nmsg && UID(msgno_list[lo]) == uid && !present[lo]) {
+	    present[lo] = 1;
+	    kept[nkept++] = msgno_list[lo];
+	}
+    }
+    free(cached);
+
+    /* the ones that are new */
+    added = (unsigned *) xmalloc((nmsg + 1) * sizeof(unsigned));
+    for (i = 0; i < nmsg; i++) {
+	if (!present[i]) added[nadded++] = msgno_list[i];
+    }
+    free(present);
+
+    *changed = (nadded || nkept != ncached);
+
+    if (!nadded) {
+	free(added);
+	return kept;
+    }
+
+    /* each new message costs about log2(nkept) msgdata loads; give up
+       if that comes to more than loading everything */
+    for (bits = 1, n = nkept; n > 1; n >>= 1) bits++;
+    if (nkept < 2 || (double) nadded * bits >= nkept) {
+	free(kept);
+	free(added);
+	return NULL;
+    }
+
+    /* sort the new messages among themselves */
+    pool = index_msgdata_pool(nadded * (bits + 1));
+    md = index_msgdata_load(pool, added, nadded, sortcrit);
+    md = index_sort_list(md, sortcrit);
+
+    /* merge them into the cached order: each goes before the first
+       kept message that sorts after it, which is never earlier than
+       where the previous one went */
+    probe = (MsgData **) xzmalloc(nkept * sizeof(MsgData *));
+    sorted = (unsigned *) xmalloc(nmsg * sizeof(unsigned));
+    n = k = lo = 0;
+    for (; md; md = md->next) {
+	hi = nkept;
+	while (lo < hi) {
+	    mid = (lo + hi) / 2;
+	    if (!probe[mid]) {
+		probe[mid] = index_msgdata_load(pool, &kept[mid], 1,
+						sortcrit);
+	    }
+	    if (index_sort_compare(md, probe[mid], sortcrit) < 0) hi = mid;
+	    else lo = mid + 1;
+	}
+	while (k < lo) sorted[n++] = kept[k++];
+	sorted[n++] = md->msgno;
+    }
+    while (k < nkept) sorted[n++] = kept[k++];
+
+    free(probe);
+    free_mpool(pool);
+    free(kept);
+    free(added);
+
+    return sorted;
+}
+
 /*
  * Performs a SORT command
  */
@@ -1097,11 +1753,13 @@ int index_sort(struct mailbox *mailbox, struct sortcrit *sortcrit,
 	       struct searchargs *searchargs, int usinguid)
 {
     unsigned *msgno_list;
-    MsgData *msgdata = NULL, *freeme = NULL;
+    MsgData *msgdata = NULL;
+    struct mpool *pool;
     int nmsg;
     clock_t start;
     modseq_t highestmodseq = 0;
     int i, modseq = 0;
+    char critname[1024];
 
     if(CONFIG_TIMING_VERBOSE)
 	start = clock();
@@ -1123,30 +1781,51 @@ int index_sort(struct mailbox *mailbox, struct sortcrit *sortcrit,
     prot_printf(imapd_out, "* SORT");
 
     if (nmsg) {
-	/* Create/load the msgdata array */
-	freeme = msgdata = index_msgdata_load(msgno_list, nmsg, sortcrit);
-	free(msgno_list);
+	unsigned *sorted = NULL;
+	int cache = 0, changed = 1;
 
-	/* Sort the messages based on the given criteria */
-	msgdata = lsort(msgdata,
-			(void * (*)(void*)) index_sort_getnext,
-			(void (*)(void*,void*)) index_sort_setnext,
-			(int (*)(void*,void*,void*)) index_sort_compare,
-			sortcrit);
+	/* Start from the last result for these criteria if we can */
+	if (config_getswitch(IMAPOPT_SORTCACHE) &&
+	    index_sort_cacheable(sortcrit)) {
+	    cache = 1;
+	    index_sort_critname(sortcrit, critname, sizeof(critname));
+	    sorted = index_sort_fromcache(mailbox, critname, msgno_list, nmsg,
+					  sortcrit, &changed);
+	}
 
-	/* Output the sorted messages */ 
-	while (msgdata) {
-	    prot_printf(imapd_out, " %u",
-			usinguid ? UID(msgdata->msgno) : msgdata->msgno);
+	if (!sorted) {
+	    /* Create/load the msgdata array */
+	    pool = index_msgdata_pool(nmsg);
+	    msgdata = index_msgdata_load(pool, msgno_list, nmsg, sortcrit);
+
+	    /* Sort the messages based on the given criteria */
+	    msgdata = index_sort_list(msgdata, sortcrit);
+
+	    sorted = (unsigned *) xmalloc(nmsg * sizeof(unsigned));
+	    for (i = 0; msgdata; msgdata = msgdata->next) {
+		sorted[i++] = msgdata->msgno;
+	    }
+
+	    /* release the msgdata in one go */
+	    free_mpool(pool);
+	}
+	free(msgno_list);
 
-	    /* free contents of the current node */
-	    index_msgdata_free(msgdata);
+	if (cache && changed) {
+	    unsigned long *uids =
+		(unsigned long *) xmalloc(nmsg * sizeof(unsigned long));
 
-	    msgdata = msgdata->next;
+	    for (i = 0; i < nmsg; i++) uids[i] = UID(sorted[i]);
+	    headerindex_putsort(mailbox, critname, uids, nmsg);
+	    free(uids);
 	}
 
-	/* free the msgdata array */
-	free(freeme);
+	/* Output the sorted messages */ 
+	for (i = 0; i < nmsg; i++) {
+	    prot_printf(imapd_out, " %u",
+			usinguid ? UID(sorted[i]) : sorted[i]);
+	}
+	free(sorted);
     }
 
     if (highestmodseq) {
@@ -1157,35 +1836,33 @@ int index_sort(struct mailbox *mailbox, struct sortcrit *sortcrit,
 
     /* debug */
     if (CONFIG_TIMING_VERBOSE) {
-	int len;
-	char *key_names[] = { "SEQUENCE", "ARRIVAL", "CC", "DATE", "FROM",
-			      "SIZE", "SUBJECT", "TO", "ANNOTATION", "MODSEQ" };
-	char buf[1024] = "";
-
-	while (sortcrit->key && sortcrit->key < VECTOR_SIZE(key_names)) {
-	    if (sortcrit->flags & SORT_REVERSE)
-		strlcat(buf, "REVERSE ", sizeof(buf));
-
-	    strlcat(buf, key_names[sortcrit->key], sizeof(buf));
-
-	    switch (sortcrit->key) {
-	    case SORT_ANNOTATION:
-		len = strlen(buf);
-		snprintf(buf + len, sizeof(buf) - len,
-			 " \"%s\" \"%s\"",
-			 sortcrit->args.annot.entry, sortcrit->args.annot.attrib);
-		break;
-	    }
-	    if ((++sortcrit)->key) strlcat(buf, " ", sizeof(buf));
-	}
-
+	index_sort_critname(sortcrit, critname, sizeof(critname));
 	syslog(LOG_DEBUG, "SORT (%s) processing time: %d msg in %f sec",
-	       buf, nmsg, (clock() - start) / (double) CLOCKS_PER_SEC);
+	       critname, nmsg, (clock() - start) / (double) CLOCKS_PER_SEC);
     }
 
     return nmsg;
 }
 
+/*
+ * MD5 of the UIDs of the 'nmsg' messages in 'msgno_list', which
+ * identifies them to the thread cache.
+ */
+static void index_thread_digest(unsigned *msgno_list, int nmsg,
+				unsigned char digest[16])
+{
+    MD5_CTX ctx;
+    bit32 uid;
+    int i;
+
+    MD5Init(&ctx);
+    for (i = 0; i < nmsg; i++) {
+	uid = htonl(UID(msgno_list[i]));
+	MD5Update(&ctx, (unsigned char *) &uid, sizeof(uid));
+    }
+    MD5Final(digest, &ctx);
+}
+
 /*
  * Performs a THREAD command
  */
@@ -1205,8 +1882,30 @@ int index_thread(struct mailbox *mailbox, int algorithm,
 			 searchargs->modseq ? &highestmodseq : NULL);
 
     if (nmsg) {
-	/* Thread messages using given algorithm */
-	(*thread_algs[algorithm].threader)(msgno_list, nmsg, usinguid);
+	const char *alg_name = thread_algs[algorithm].alg_name;
+	unsigned char digest[16];
+	char *resp = NULL;
+
+	/* The same messages always thread the same way, so see if
+	   we've already answered for exactly this set of UIDs */
+	if (config_getswitch(IMAPOPT_THREADCACHE)) {
+	    index_thread_digest(msgno_list, nmsg, digest);
+	    resp = headerindex_getthread(mailbox, alg_name, digest);
+	}
+
+	if (resp) {
+	    index_thread_output(resp, usinguid);
+	    free(resp);
+	}
+	else {
+	    /* Thread messages using given algorithm */
+	    (*thread_algs[algorithm].threader)(msgno_list, nmsg, usinguid);
+
+	    if (config_getswitch(IMAPOPT_THREADCACHE)) {
+		headerindex_putthread(mailbox, alg_name, digest,
+				      thread_resp.s);
+	    }
+	}
 
 	free(msgno_list);
 
@@ -1334,6 +2033,7 @@ static int index_appendremote(struct mailbox *mailbox,
     struct protstream *pout = (struct protstream *) rock;
     const char *msg_base = 0;
     unsigned long msg_size = 0;
+    int msg_fd = -1;
     bit32 system_flags;
     bit32 user_flags[MAX_USER_FLAGS/32];
     unsigned flag;
@@ -1345,6 +2045,9 @@ static int index_appendremote(struct mailbox *mailbox,
     if (mailbox_map_message(mailbox, UID(msgno), &msg_base, &msg_size)) {
 	return IMAP_NO_MSGGONE;
     }
+    if (prot_cansendfile(pout)) {
+	msg_fd = mailbox_open_message(mailbox, UID(msgno));
+    }
 
     /* start the individual append */
     prot_printf(pout, " ");
@@ -1391,13 +2094,14 @@ static int index_appendremote(struct mailbox *mailbox,
     prot_printf(pout, ") \"%s\" ", datebuf);
 
     /* message literal */
-    index_fetchmsg(msg_base, msg_size, mailbox->format, 0, SIZE(msgno),
-		   0, 0, pout);
+    index_fetchmsg(msg_base, msg_size, msg_fd, mailbox->format, 0,
+		   SIZE(msgno), 0, 0, pout);
 
     /* close the message file */
     if (msg_base) {
 	mailbox_unmap_message(mailbox, UID(msgno), &msg_base, &msg_size);
     }
+    if (msg_fd != -1) close(msg_fd);
 
     return 0;
 }
@@ -1635,7 +2339,7 @@ unsigned uid;
 
     while (low <= high) {
 	mid = (high - low)/2 + low;
-	miduid = UID(mid);
+	miduid = SNAP_UID(mid);
 	if (miduid == uid) {
 	    return mid;
 	}
@@ -1695,7 +2399,7 @@ index_forsequence(struct mailbox* mailbox,
 	    start = start*10 + *sequence - '0';
 	}
 	else if (*sequence == '*') {
-	    start = usinguid ? UID(imapd_exists) : imapd_exists;
+	    start = usinguid ? SNAP_UID(imapd_exists) : imapd_exists;
 	}
 	else if (*sequence == ':') {
 	    end = 0;
@@ -1705,7 +2409,7 @@ index_forsequence(struct mailbox* mailbox,
 	    }
 	    if (*sequence == '*') {
 		sequence++;
-		end = usinguid ? UID(imapd_exists) : imapd_exists;
+		end = usinguid ? SNAP_UID(imapd_exists) : imapd_exists;
 	    }
 	    if (start > end) {
 		i = end;
@@ -1714,7 +2418,7 @@ index_forsequence(struct mailbox* mailbox,
 	    }
 	    if (usinguid) {
 		i = index_finduid(start);
-		if (!i || start != UID(i)) i++;
+		if (!i || start != SNAP_UID(i)) i++;
 		start = i;
 		end = index_finduid(end);
 	    }
@@ -1731,7 +2435,7 @@ index_forsequence(struct mailbox* mailbox,
 	else {
 	    if (start && usinguid) {
 		i = index_finduid(start);
-		if (!i || start != UID(i)) i = 0;
+		if (!i || start != SNAP_UID(i)) i = 0;
 		start = i;
 	    }
 	    if (start > 0 && start <= imapd_exists) {
@@ -1799,13 +2503,15 @@ int usinguid;
  * of size 'msg_size' and format 'format', starting at 'offset' and
  * containing 'size' octets.  If 'octet_count' is nonzero, the data is
  * further constrained by 'start_octet' and 'octet_count' as per the
- * IMAP command PARTIAL.
+ * IMAP command PARTIAL.  If 'msg_fd' is an open descriptor on the same
+ * file, large literals are sent from it with prot_sendfile().
  */
 void
-index_fetchmsg(msg_base, msg_size, format, offset, size,
+index_fetchmsg(msg_base, msg_size, msg_fd, format, offset, size,
 	       start_octet, octet_count, pout)
 const char *msg_base;
 unsigned long msg_size;
+int msg_fd;
 int format __attribute__((unused));
 unsigned offset;
 unsigned size;     /* this is the correct size for a news message after
@@ -1855,7 +2561,12 @@ struct protstream *pout;
 	prot_printf(pout, "{%u}\r\n", size);
     }
 
-    prot_write(pout, msg_base + offset, n);
+    if (msg_fd != -1 && n >= PROT_SENDFILE_MIN && prot_cansendfile(pout)) {
+	prot_sendfile(pout, msg_fd, offset, n);
+    }
+    else {
+	prot_write(pout, msg_base + offset, n);
+    }
     while (n++ < size) {
 	/* File too short, resynch client.
 	 *
@@ -1871,7 +2582,7 @@ struct protstream *pout;
  */
 static int index_fetchsection(const char *resp,
 			      const char *msg_base, unsigned long msg_size,
-			      int format, char *section,
+			      int msg_fd, int format, char *section,
 			      const char *cacheitem, unsigned size,
 			      unsigned start_octet, unsigned octet_count)
 {
@@ -1890,7 +2601,7 @@ static int index_fetchsection(const char *resp,
 	    prot_printf(imapd_out, "%s%u", resp, size);
 	} else {
 	    prot_printf(imapd_out, "%s", resp);
-	    index_fetchmsg(msg_base, msg_size, format, 0, size,
+	    index_fetchmsg(msg_base, msg_size, msg_fd, format, 0, size,
 			   start_octet, octet_count, imapd_out);
 	}
 	return 0;
@@ -1979,13 +2690,14 @@ static int index_fetchsection(const char *resp,
 	else {
 	    /* BINARY */
 	    msg_size = size;
+	    msg_fd = -1;
 	    offset = 0;
 	}
     }
 
     /* Output body part */
     prot_printf(imapd_out, "%s", resp);
-    index_fetchmsg(msg_base, msg_size, format, offset, size,
+    index_fetchmsg(msg_base, msg_size, msg_fd, format, offset, size,
 		   start_octet, octet_count, imapd_out);
 
     if (decbuf) free(decbuf);
@@ -2252,11 +2964,7 @@ index_fetchcacheheader(unsigned msgno, struct strlist *headers,
     unsigned crlf_start = 0;
     unsigned crlf_size = 2;
 
-    cacheitem = cache_base + CACHE_OFFSET(msgno);
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip section */
+    cacheitem = CACHE_FIELD(msgno, CACHE_HEADERS);
     
     size = CACHE_ITEM_LEN(cacheitem);
     if (bufsize < size+2) {
@@ -2429,6 +3137,7 @@ static int index_fetchreply(struct mailbox *mailbox,
     int fetchitems = fetchargs->fetchitems;
     const char *msg_base = 0;
     unsigned long msg_size = 0;
+    int msg_fd = -1;
     struct octetinfo *oi = NULL;
     int sepchar = '(';
     int started = 0;
@@ -2442,7 +3151,7 @@ static int index_fetchreply(struct mailbox *mailbox,
 
     /* Check the modseq against changedsince */
     if (fetchargs->changedsince &&
-	MODSEQ(msgno) <= fetchargs->changedsince) {
+	SNAP_MODSEQ(msgno) <= fetchargs->changedsince) {
 	return 0;
     }
 
@@ -2456,6 +3165,11 @@ static int index_fetchreply(struct mailbox *mailbox,
 	    prot_printf(imapd_out, error_message(IMAP_NO_MSGGONE), msgno);
 	    prot_printf(imapd_out, "\r\n");
 	}
+	else if ((fetchitems & (FETCH_TEXT|FETCH_RFC822) ||
+		  fetchargs->bodysections) && prot_cansendfile(imapd_out)) {
+	    /* let big literals bypass the output buffer */
+	    msg_fd = mailbox_open_message(mailbox, UID(msgno));
+	}
     }
 
     /* set the \Seen flag if necessary */
@@ -2468,10 +3182,10 @@ static int index_fetchreply(struct mailbox *mailbox,
 
     if (fetchitems & FETCH_FLAGS) {
 	for (i = 0; i < VECTOR_SIZE(user_flags); i++) {
-	    user_flags[i] = USER_FLAGS(msgno, i);
+	    user_flags[i] = SNAP_USER_FLAGS(msgno, i);
 	}
-	index_fetchflags(mailbox, msgno, SYSTEM_FLAGS(msgno), user_flags,
-			 LAST_UPDATED(msgno));
+	index_fetchflags(mailbox, msgno, SNAP_SYSTEM_FLAGS(msgno), user_flags,
+			 SNAP_LAST_UPDATED(msgno));
 	sepchar = ' ';
     }
     else if ((fetchitems & ~FETCH_SETSEEN) ||  fetchargs->fsections ||
@@ -2481,7 +3195,7 @@ static int index_fetchreply(struct mailbox *mailbox,
 	started = 1;
     }
     if (fetchitems & FETCH_UID) {
-	prot_printf(imapd_out, "%cUID %u", sepchar, UID(msgno));
+	prot_printf(imapd_out, "%cUID %u", sepchar, SNAP_UID(msgno));
 	sepchar = ' ';
     }
     if (fetchitems & FETCH_INTERNALDATE) {
@@ -2496,7 +3210,7 @@ static int index_fetchreply(struct mailbox *mailbox,
     }
     if (fetchitems & FETCH_MODSEQ) {
 	prot_printf(imapd_out, "%cMODSEQ (" MODSEQ_FMT ")",
-		    sepchar, MODSEQ(msgno));
+		    sepchar, SNAP_MODSEQ(msgno));
 	sepchar = ' ';
     }
     if (fetchitems & FETCH_SIZE) {
@@ -2506,24 +3220,21 @@ static int index_fetchreply(struct mailbox *mailbox,
     if (fetchitems & FETCH_ENVELOPE) {
 	prot_printf(imapd_out, "%cENVELOPE ", sepchar);
 	sepchar = ' ';
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
+	cacheitem = CACHE_FIELD(msgno, CACHE_ENVELOPE);
 	prot_write(imapd_out, cacheitem + CACHE_ITEM_SIZE_SKIP,
 		   CACHE_ITEM_LEN(cacheitem));
     }
     if (fetchitems & FETCH_BODYSTRUCTURE) {
 	prot_printf(imapd_out, "%cBODYSTRUCTURE ", sepchar);
 	sepchar = ' ';
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
+	cacheitem = CACHE_FIELD(msgno, CACHE_BODYSTRUCTURE);
 	prot_write(imapd_out, cacheitem + CACHE_ITEM_SIZE_SKIP,
 		   CACHE_ITEM_LEN(cacheitem));
     }
     if (fetchitems & FETCH_BODY) {
 	prot_printf(imapd_out, "%cBODY ", sepchar);
 	sepchar = ' ';
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
+	cacheitem = CACHE_FIELD(msgno, CACHE_BODY);
 	prot_write(imapd_out, cacheitem + CACHE_ITEM_SIZE_SKIP,
 		   CACHE_ITEM_LEN(cacheitem));
     }
@@ -2531,7 +3242,7 @@ static int index_fetchreply(struct mailbox *mailbox,
     if (fetchitems & FETCH_HEADER) {
 	prot_printf(imapd_out, "%cRFC822.HEADER ", sepchar);
 	sepchar = ' ';
-	index_fetchmsg(msg_base, msg_size, mailbox->format, 0,
+	index_fetchmsg(msg_base, msg_size, msg_fd, mailbox->format, 0,
 		       HEADER_SIZE(msgno),
 		       (fetchitems & FETCH_IS_PARTIAL) ?
 		         fetchargs->start_octet : 0,
@@ -2554,7 +3265,7 @@ static int index_fetchreply(struct mailbox *mailbox,
     if (fetchitems & FETCH_TEXT) {
 	prot_printf(imapd_out, "%cRFC822.TEXT ", sepchar);
 	sepchar = ' ';
-	index_fetchmsg(msg_base, msg_size, mailbox->format,
+	index_fetchmsg(msg_base, msg_size, msg_fd, mailbox->format,
 		       CONTENT_OFFSET(msgno), SIZE(msgno) - HEADER_SIZE(msgno),
 		       (fetchitems & FETCH_IS_PARTIAL) ?
 		         fetchargs->start_octet : 0,
@@ -2565,7 +3276,8 @@ static int index_fetchreply(struct mailbox *mailbox,
     if (fetchitems & FETCH_RFC822) {
 	prot_printf(imapd_out, "%cRFC822 ", sepchar);
 	sepchar = ' ';
-	index_fetchmsg(msg_base, msg_size, mailbox->format, 0, SIZE(msgno),
+	index_fetchmsg(msg_base, msg_size, msg_fd, mailbox->format,
+		       0, SIZE(msgno),
 		       (fetchitems & FETCH_IS_PARTIAL) ?
 		         fetchargs->start_octet : 0,
 		       (fetchitems & FETCH_IS_PARTIAL) ?
@@ -2588,10 +3300,7 @@ static int index_fetchreply(struct mailbox *mailbox,
 	prot_printf(imapd_out, "%s ", fsection->trail);
 
 	if(fetchargs->cache_atleast > CACHE_VERSION(msgno)) {
-	    cacheitem = cache_base + CACHE_OFFSET(msgno);
-	    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-	    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
+	    cacheitem = CACHE_FIELD(msgno, CACHE_SECTION);
 	    
 	    index_fetchfsection(msg_base, msg_size, mailbox->format, fsection,
 				cacheitem,
@@ -2617,15 +3326,12 @@ static int index_fetchreply(struct mailbox *mailbox,
 	snprintf(respbuf+strlen(respbuf), sizeof(respbuf)-strlen(respbuf),
 		 "%cBODY[%s ", sepchar, section->s);
 
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
+	cacheitem = CACHE_FIELD(msgno, CACHE_SECTION);
 
 	oi = section->rock;
 
-	r = index_fetchsection(respbuf, msg_base, msg_size, mailbox->format,
-			       section->s, cacheitem, SIZE(msgno),
+	r = index_fetchsection(respbuf, msg_base, msg_size, msg_fd,
+			       mailbox->format, section->s, cacheitem, SIZE(msgno),
 			       (fetchitems & FETCH_IS_PARTIAL) ?
 				 fetchargs->start_octet : oi->start_octet,
 			       (fetchitems & FETCH_IS_PARTIAL) ?
@@ -2641,15 +3347,12 @@ static int index_fetchreply(struct mailbox *mailbox,
 	snprintf(respbuf+strlen(respbuf), sizeof(respbuf)-strlen(respbuf),
 		 "%cBINARY[%s ", sepchar, section->s);
 
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
+	cacheitem = CACHE_FIELD(msgno, CACHE_SECTION);
 
 	oi = section->rock;
 
-	r = index_fetchsection(respbuf, msg_base, msg_size, mailbox->format,
-			       section->s, cacheitem, SIZE(msgno),
+	r = index_fetchsection(respbuf, msg_base, msg_size, msg_fd,
+			       mailbox->format, section->s, cacheitem, SIZE(msgno),
 			       (fetchitems & FETCH_IS_PARTIAL) ?
 				 fetchargs->start_octet : oi->start_octet,
 			       (fetchitems & FETCH_IS_PARTIAL) ?
@@ -2665,13 +3368,10 @@ static int index_fetchreply(struct mailbox *mailbox,
 	snprintf(respbuf+strlen(respbuf), sizeof(respbuf)-strlen(respbuf),
 		 "%cBINARY.SIZE[%s ", sepchar, section->s);
 
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
+	cacheitem = CACHE_FIELD(msgno, CACHE_SECTION);
 
-	r = index_fetchsection(respbuf, msg_base, msg_size, mailbox->format,
-			       section->s, cacheitem, SIZE(msgno),
+	r = index_fetchsection(respbuf, msg_base, msg_size, msg_fd,
+			       mailbox->format, section->s, cacheitem, SIZE(msgno),
 			       fetchargs->start_octet, fetchargs->octet_count);
 	if (!r)	sepchar = ' ';
     }
@@ -2682,6 +3382,7 @@ static int index_fetchreply(struct mailbox *mailbox,
     if (msg_base) {
 	mailbox_unmap_message(mailbox, UID(msgno), &msg_base, &msg_size);
     }
+    if (msg_fd != -1) close(msg_fd);
     return r;
 }
 
@@ -2715,10 +3416,7 @@ int index_urlfetch(struct mailbox *mailbox, unsigned msgno,
 	return IMAP_NO_MSGGONE;
     }
 
-    cacheitem = cache_base + CACHE_OFFSET(msgno);
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
+    cacheitem = CACHE_FIELD(msgno, CACHE_SECTION);
 
     size = SIZE(msgno);
 
@@ -2841,12 +3539,12 @@ static int index_storeseen(struct mailbox *mailbox, unsigned msgno, void *rock)
     if (storeargs->silent) return 0;
 
     for (i=0; i < VECTOR_SIZE(user_flags); i++) {
-	user_flags[i] = USER_FLAGS(msgno, i);
+	user_flags[i] = SNAP_USER_FLAGS(msgno, i);
     }
-    index_fetchflags(mailbox, msgno, SYSTEM_FLAGS(msgno), user_flags,
-		     LAST_UPDATED(msgno));
+    index_fetchflags(mailbox, msgno, SNAP_SYSTEM_FLAGS(msgno), user_flags,
+		     SNAP_LAST_UPDATED(msgno));
     if (storeargs->usinguid) {
-	prot_printf(imapd_out, " UID %u", UID(msgno));
+	prot_printf(imapd_out, " UID %u", SNAP_UID(msgno));
     }
     prot_printf(imapd_out, ")\r\n");
 
@@ -3044,6 +3742,7 @@ static int index_storeflag(struct mailbox *mailbox,
     if (dirty && mid) {
 	r = mailbox_write_index_record(mailbox, mid, &record, 0);
 	if (r) return r;
+	index_snapshot_update(msgno, &record);
     }
     
     return 0;
@@ -3064,6 +3763,7 @@ static int index_search_evaluate(struct mailbox *mailbox,
     const char *cacheitem;
     int cachelen;
     struct searchsub *s;
+    int msgid_known = -1, header_known = -1;
 
     if ((searchargs->flags & SEARCH_RECENT_SET) && msgno <= lastnotrecent) 
 	return 0;
@@ -3084,15 +3784,16 @@ static int index_search_evaluate(struct mailbox *mailbox,
     if (searchargs->sentbefore && SENTDATE(msgno) > searchargs->sentbefore)
       return 0;
 
-    if (searchargs->modseq && MODSEQ(msgno) < searchargs->modseq) return 0;
+    if (searchargs->modseq && SNAP_MODSEQ(msgno) < searchargs->modseq)
+	return 0;
 
-    if (~SYSTEM_FLAGS(msgno) & searchargs->system_flags_set) return 0;
-    if (SYSTEM_FLAGS(msgno) & searchargs->system_flags_unset) return 0;
+    if (~SNAP_SYSTEM_FLAGS(msgno) & searchargs->system_flags_set) return 0;
+    if (SNAP_SYSTEM_FLAGS(msgno) & searchargs->system_flags_unset) return 0;
 	
     for (i = 0; i < VECTOR_SIZE(searchargs->user_flags_set); i++) {
-	if (~USER_FLAGS(msgno,i) & searchargs->user_flags_set[i])
+	if (~SNAP_USER_FLAGS(msgno,i) & searchargs->user_flags_set[i])
 	  return 0;
-	if (USER_FLAGS(msgno,i) & searchargs->user_flags_unset[i])
+	if (SNAP_USER_FLAGS(msgno,i) & searchargs->user_flags_unset[i])
 	  return 0;
     }
 
@@ -3100,16 +3801,26 @@ static int index_search_evaluate(struct mailbox *mailbox,
 	if (!index_insequence(msgno, l->s, 0)) return 0;
     }
     for (l = searchargs->uidsequence; l; l = l->next) {
-	if (!index_insequence(UID(msgno), l->s, 1)) return 0;
+	if (!index_insequence(SNAP_UID(msgno), l->s, 1)) return 0;
+    }
+
+    /* Header criteria the header index has answered for this message */
+    if (searchargs->messageid) {
+	msgid_known = index_search_hindex_check(searchargs->messageid, msgno);
+	if (!msgid_known) return 0;
+    }
+    if (searchargs->header) {
+	header_known = index_search_hindex_check(searchargs->header, msgno);
+	if (!header_known) return 0;
     }
 
     if (searchargs->from || searchargs->to || searchargs->cc ||
 	searchargs->bcc || searchargs->subject || searchargs->messageid) {
 
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
+	cacheitem = CACHE_FIELD(msgno, CACHE_ENVELOPE);
 	cachelen = CACHE_ITEM_LEN(cacheitem);
 
-	if (searchargs->messageid) {
+	if (searchargs->messageid && msgid_known < 0) {
 	    char *tmpenv;
 	    char *envtokens[NUMENVTOKENS];
 	    char *msgid;
@@ -3145,11 +3856,7 @@ static int index_search_evaluate(struct mailbox *mailbox,
 	    if (l) return 0;
 	}
 
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip section */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip cacheheaders */
+	cacheitem = CACHE_FIELD(msgno, CACHE_FROM);
 	cachelen = CACHE_ITEM_LEN(cacheitem);
 	    
 	for (l = searchargs->from; l; l = l->next) {
@@ -3218,7 +3925,8 @@ static int index_search_evaluate(struct mailbox *mailbox,
     }
 
     if (searchargs->body || searchargs->text ||
-	searchargs->cache_atleast > CACHE_VERSION(msgno)) {
+	(header_known < 0 &&
+	 searchargs->cache_atleast > CACHE_VERSION(msgno))) {
 	if (! msgfile->size) { /* Map the message in if we haven't before */
 	    if (mailbox_map_message(mailbox, UID(msgno),
 				    &msgfile->base, &msgfile->size)) {
@@ -3228,27 +3936,21 @@ static int index_search_evaluate(struct mailbox *mailbox,
 
 	h = searchargs->header_name;
 	for (l = searchargs->header; l; (l = l->next), (h = h->next)) {
+	    if (HINDEX_STATE(l, msgno) == HINDEX_MATCH) continue;
 	    if (!index_searchheader(h->s, l->s, l->p, msgfile, mailbox->format,
 				    HEADER_SIZE(msgno))) return 0;
 	}
 
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
+	cacheitem = CACHE_FIELD(msgno, CACHE_SECTION);
 
-	for (l = searchargs->body; l; l = l->next) {
-	    if (!index_searchmsg(l->s, l->p, msgfile, mailbox->format, 1,
-				 cacheitem)) return 0;
-	}
-	for (l = searchargs->text; l; l = l->next) {
-	    if (!index_searchmsg(l->s, l->p, msgfile, mailbox->format, 0,
-				  cacheitem)) return 0;
-	}
+	if ((searchargs->body || searchargs->text) &&
+	    !index_searchmsg(searchargs, msgfile, mailbox->format,
+			     cacheitem)) return 0;
     }
-    else if (searchargs->header_name) {
+    else if (searchargs->header_name && header_known < 0) {
 	h = searchargs->header_name;
 	for (l = searchargs->header; l; (l = l->next), (h = h->next)) {
+	    if (HINDEX_STATE(l, msgno) == HINDEX_MATCH) continue;
 	    if (!index_searchcacheheader(msgno, h->s, l->s, l->p)) return 0;
 	}
     }
@@ -3257,25 +3959,57 @@ static int index_search_evaluate(struct mailbox *mailbox,
 }
 
 /*
- * Search part of a message for a substring.
+ * Search the parts of a message for all of the BODY and TEXT strings
+ * of 'searchargs' at once, so that each part is only decoded once.
+ * BODY strings are not looked for in the top-level message header.
+ * Returns nonzero iff every string was found.
  * Keep this in sync with index_getsearchtextmsg!
  */
 static int
-index_searchmsg(char *substr,
-		comp_pat *pat,
+index_searchmsg(struct searchargs *searchargs,
 		struct mapfile *msgfile,
 		int format,
-		int skipheader,
 		const char *cacheitem)
 {
+    static const char **substr = NULL;
+    static comp_pat **pat = NULL;
+    static int *found = NULL;
+    static int patalloc = 0;
+    struct strlist *l;
+    int npat = 0, nbody, left, first;
+    int skipheader = 1;
     int partsleft = 1;
     int subparts;
     int start, len, charset, encoding;
+    int i;
     char *p, *q;
     
     /* Won't find anything in a truncated file */
     if (msgfile->size == 0) return 0;
 
+    /* Gather the strings: BODY first, then TEXT */
+    for (l = searchargs->body; l; l = l->next) npat++;
+    nbody = npat;
+    for (l = searchargs->text; l; l = l->next) npat++;
+    if (npat > patalloc) {
+	patalloc = npat + 10;
+	substr = (const char **) xrealloc(substr, patalloc * sizeof(char *));
+	pat = (comp_pat **) xrealloc(pat, patalloc * sizeof(comp_pat *));
+	found = (int *) xrealloc(found, patalloc * sizeof(int));
+    }
+    npat = 0;
+    for (l = searchargs->body; l; l = l->next, npat++) {
+	substr[npat] = l->s;
+	pat[npat] = l->p;
+	found[npat] = 0;
+    }
+    for (l = searchargs->text; l; l = l->next, npat++) {
+	substr[npat] = l->s;
+	pat[npat] = l->p;
+	found[npat] = 0;
+    }
+    left = npat;
+
     cacheitem += CACHE_ITEM_SIZE_SKIP;
     while (partsleft--) {
 	subparts = CACHE_ITEM_BIT32(cacheitem);
@@ -3283,22 +4017,25 @@ index_searchmsg(char *substr,
 	if (subparts) {
 	    partsleft += subparts-1;
 
-	    if (skipheader) {
-		skipheader = 0;	/* Only skip top-level message header */
-	    }
-	    else {
-		len = CACHE_ITEM_BIT32(cacheitem + CACHE_ITEM_SIZE_SKIP);
-		if (len > 0) {
-		    p = index_readheader(msgfile->base, msgfile->size,
-					 format, CACHE_ITEM_BIT32(cacheitem),
-					 len);
-		    q = charset_decode_mimeheader(p, NULL, 0);
-		    if (charset_searchstring(substr, pat, q, strlen(q))) {
-			free(q);
-			return 1;
+	    /* Only skip top-level message header */
+	    first = skipheader ? nbody : 0;
+	    skipheader = 0;
+
+	    len = CACHE_ITEM_BIT32(cacheitem + CACHE_ITEM_SIZE_SKIP);
+	    if (len > 0 && first < npat) {
+		p = index_readheader(msgfile->base, msgfile->size,
+				     format, CACHE_ITEM_BIT32(cacheitem),
+				     len);
+		q = charset_decode_mimeheader(p, NULL, 0);
+		for (i = first; i < npat; i++) {
+		    if (!found[i] &&
+			charset_searchstring(substr[i], pat[i], q, strlen(q))) {
+			found[i] = 1;
+			left--;
 		    }
-		    free(q);
 		}
+		free(q);
+		if (!left) return 1;
 	    }
 	    cacheitem += 5*4;
 
@@ -3310,10 +4047,11 @@ index_searchmsg(char *substr,
 
 		if (start < msgfile->size && len > 0 &&
 		    charset >= 0 && charset < 0xffff) {
-		    if (charset_searchfile(substr, pat,
-					   msgfile->base + start,
-					   format == MAILBOX_FORMAT_NETNEWS,
-					   len, charset, encoding)) return 1;
+		    left -= charset_searchfile_multi(npat, substr, pat, found,
+					msgfile->base + start,
+					format == MAILBOX_FORMAT_NETNEWS,
+					len, charset, encoding);
+		    if (!left) return 1;
 		}
 		cacheitem += 5*4;
 	    }
@@ -3364,11 +4102,7 @@ static int index_searchcacheheader(unsigned msgno,
     unsigned size;
     int r;
 
-    cacheitem = cache_base + CACHE_OFFSET(msgno);
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip section */
+    cacheitem = CACHE_FIELD(msgno, CACHE_HEADERS);
     
     size = CACHE_ITEM_LEN(cacheitem);
     if (!size) return 0;	/* No cached headers, fail */
@@ -3473,17 +4207,21 @@ static void index_getsearchtextmsg(struct mailbox* mailbox,
 void index_getsearchtext(struct mailbox* mailbox,
                          index_search_text_receiver_t receiver,
                          void* rock) {
+  index_getsearchtext_since(mailbox, 0, receiver, rock);
+}
+
+void index_getsearchtext_since(struct mailbox* mailbox, unsigned lowuid,
+                               index_search_text_receiver_t receiver,
+                               void* rock) {
   int i;
 
-  /* Send the converted text of every message out to the receiver. */
-  for (i = 1; i <= imapd_exists; i++) {
+  /* Send the converted text of every message with a UID above lowuid
+     out to the receiver. */
+  for (i = index_finduid(lowuid) + 1; i <= imapd_exists; i++) {
     const char *cacheitem;
     int uid = UID(i);
 
-    cacheitem = cache_base + CACHE_OFFSET(i);
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-    cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
+    cacheitem = CACHE_FIELD(i, CACHE_SECTION);
 
     index_getsearchtextmsg(mailbox, uid, receiver, rock, cacheitem);
     
@@ -3550,13 +4288,10 @@ void *rock;
 	/* Force copy and re-parse of message */
 	copyargs->copymsg[copyargs->nummsg].cache_len = 0;
     }
-    else if (msgno < imapd_exists) {
-	copyargs->copymsg[copyargs->nummsg].cache_len =
-	  CACHE_OFFSET(msgno+1) - CACHE_OFFSET(msgno);
-    }
     else {
 	copyargs->copymsg[copyargs->nummsg].cache_len =
-	  cache_end - CACHE_OFFSET(msgno);
+	  CACHE_FIELD(msgno, NUM_CACHE_FIELDS) -
+	  copyargs->copymsg[copyargs->nummsg].cache_begin;
     }
     copyargs->copymsg[copyargs->nummsg].seen = seenflag[msgno];
     copyargs->copymsg[copyargs->nummsg].system_flags = SYSTEM_FLAGS(msgno);
@@ -3589,31 +4324,52 @@ void *rock;
 }
 
 /*
- * Creates a list of msgdata.
+ * Create the memory pool for a SORT or THREAD of nmsg messages.
+ *
+ * Everything index_msgdata_load() builds (the MsgData nodes and the
+ * strings hanging off them), along with the Thread nodes, comes out of
+ * this pool and is released all at once with free_mpool().  The first
+ * blob is sized to hold the usual case; the pool doubles if not.
+ */
+#define MSGDATA_POOL_PERMSG	(sizeof(MsgData) + 2 * sizeof(Thread) + 128)
+
+static struct mpool *index_msgdata_pool(int nmsg)
+{
+    size_t size = nmsg * MSGDATA_POOL_PERMSG;
+
+    return new_mpool(size < DEFAULT_MPOOL_SIZE ? DEFAULT_MPOOL_SIZE : size);
+}
+
+/*
+ * Creates a list of msgdata, allocated from pool.
  *
  * We fill these structs with the processed info that will be needed
  * by the specified sort criteria.
  */
-#define ANNOTGROWSIZE	10
-
-static MsgData *index_msgdata_load(unsigned *msgno_list, int n,
+static MsgData *index_msgdata_load(struct mpool *pool,
+				   unsigned *msgno_list, int n,
 				   struct sortcrit *sortcrit)
 {
     MsgData *md, *cur;
     const char *cacheitem = NULL, *env = NULL, 
 	*headers = NULL, *from = NULL, *to = NULL, *cc = NULL, *subj = NULL;
     int i, j;
-    char *tmpenv;
+    char *tmpenv = NULL;
+    size_t tmpenvsize = 0, envlen;
     char *envtokens[NUMENVTOKENS];
     int did_cache, did_env;
     int label;
-    int annotsize;
+    int nannotcrit = 0;
 
     if (!n)
 	return NULL;
 
+    for (j = 0; sortcrit[j].key; j++) {
+	if (sortcrit[j].key == SORT_ANNOTATION) nannotcrit++;
+    }
+
     /* create an array of MsgData to use as nodes of linked list */
-    md = (MsgData *) xmalloc(n * sizeof(MsgData));
+    md = (MsgData *) mpool_malloc(pool, n * sizeof(MsgData));
     memset(md, 0, n * sizeof(MsgData));
 
     for (i = 0, cur = md; i < n; i++, cur = cur->next) {
@@ -3624,8 +4380,6 @@ static MsgData *index_msgdata_load(unsigned *msgno_list, int n,
 	cur->next = (i+1 < n ? cur+1 : NULL);
 
 	did_cache = did_env = 0;
-	tmpenv = NULL;
-	annotsize = 0;
 
 	for (j = 0; sortcrit[j].key; j++) {
 	    label = sortcrit[j].key;
@@ -3636,7 +4390,7 @@ static MsgData *index_msgdata_load(unsigned *msgno_list, int n,
 		!did_cache) {
 
 		/* fetch cached info */
-		env = cache_base + CACHE_OFFSET(cur->msgno);
+		env = CACHE_FIELD(cur->msgno, CACHE_ENVELOPE);
 		cacheitem = CACHE_ITEM_NEXT(env); /* bodystructure */
 		cacheitem = CACHE_ITEM_NEXT(cacheitem); /* body */
 		cacheitem = CACHE_ITEM_NEXT(cacheitem); /* section */
@@ -3656,8 +4410,13 @@ static MsgData *index_msgdata_load(unsigned *msgno_list, int n,
 		/* make a working copy of envelope -- strip outer ()'s */
 		/* +1 -> skip the leading paren */
 		/* -2 -> don't include the size of the outer parens */
-		tmpenv = xstrndup(env + CACHE_ITEM_SIZE_SKIP + 1,
-				  CACHE_ITEM_LEN(env) - 2);
+		envlen = CACHE_ITEM_LEN(env) - 2;
+		if (envlen + 1 > tmpenvsize) {
+		    tmpenvsize = envlen + 1024;
+		    tmpenv = xrealloc(tmpenv, tmpenvsize);
+		}
+		memcpy(tmpenv, env + CACHE_ITEM_SIZE_SKIP + 1, envlen);
+		tmpenv[envlen] = '\0';
 
 		/* parse envelope into tokens */
 		parse_cached_envelope(tmpenv, envtokens,
@@ -3668,7 +4427,7 @@ static MsgData *index_msgdata_load(unsigned *msgno_list, int n,
 
 	    switch (label) {
 	    case SORT_CC:
-		cur->cc = get_localpart_addr(cc + CACHE_ITEM_SIZE_SKIP);
+		cur->cc = get_localpart_addr(pool, cc + CACHE_ITEM_SIZE_SKIP);
 		break;
 	    case SORT_DATE:
 		cur->date = message_parse_date(envtokens[ENV_DATE],
@@ -3676,38 +4435,41 @@ static MsgData *index_msgdata_load(unsigned *msgno_list, int n,
 					       | PARSE_NOCREATE);
 		break;
 	    case SORT_FROM:
-		cur->from = get_localpart_addr(from + CACHE_ITEM_SIZE_SKIP);
+		cur->from = get_localpart_addr(pool,
+					       from + CACHE_ITEM_SIZE_SKIP);
 		break;
 	    case SORT_SUBJECT:
-		cur->xsubj = index_extract_subject(subj + CACHE_ITEM_SIZE_SKIP,
+		cur->xsubj = index_extract_subject(pool,
+						   subj + CACHE_ITEM_SIZE_SKIP,
 						   CACHE_ITEM_LEN(subj),
 						   &cur->is_refwd);
 		cur->xsubj_hash = strhash(cur->xsubj);
 		break;
 	    case SORT_TO:
-		cur->to = get_localpart_addr(to + CACHE_ITEM_SIZE_SKIP);
+		cur->to = get_localpart_addr(pool, to + CACHE_ITEM_SIZE_SKIP);
 		break;
  	    case SORT_ANNOTATION:
- 		/* reallocate space for the annotation values if necessary */
- 		if (cur->nannot == annotsize) {
- 		    annotsize += ANNOTGROWSIZE;
+ 		/* allocate space for all of the annotation values */
+ 		if (!cur->annot) {
  		    cur->annot = (char **)
- 			xrealloc(cur->annot, annotsize * sizeof(char *));
+ 			mpool_malloc(pool, nannotcrit * sizeof(char *));
  		}
 
  		/* fetch attribute value - we fake it for now */
- 		cur->annot[cur->nannot] = xstrdup(sortcrit[j].args.annot.attrib);
+ 		cur->annot[cur->nannot] =
+		    mpool_strdup(pool, sortcrit[j].args.annot.attrib);
  		cur->nannot++;
  		break;
 	    case LOAD_IDS:
-		index_get_ids(cur, envtokens, headers + CACHE_ITEM_SIZE_SKIP);
+		index_get_ids(pool, cur, envtokens,
+			      headers + CACHE_ITEM_SIZE_SKIP);
 		break;
 	    }
 	}
-
-	if (tmpenv) free(tmpenv);
     }
 
+    if (tmpenv) free(tmpenv);
+
     return md;
 }
 
@@ -3796,13 +4558,13 @@ static void parse_cached_envelope(char *env, char *tokens[], int tokens_size)
 /*
  * Get the 'local-part' of an address from a header
  */
-static char *get_localpart_addr(const char *header)
+static char *get_localpart_addr(struct mpool *pool, const char *header)
 {
     struct address *addr = NULL;
     char *ret;
 
     parseaddr_list(header, &addr);
-    ret = xstrdup(addr && addr->mailbox ? addr->mailbox : "");
+    ret = mpool_strdup(pool, addr && addr->mailbox ? addr->mailbox : "");
     parseaddr_free(addr);
     return ret;
 }
@@ -3813,18 +4575,20 @@ static char *get_localpart_addr(const char *header)
  * This is a wrapper around _index_extract_subject() which preps the
  * subj NSTRING and checks for Netscape "[Fwd: ]".
  */
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd)
+static char *index_extract_subject(struct mpool *pool,
+				   const char *subj, size_t len, int *is_refwd)
 {
     char *buf, *s, *base;
 
-    /* parse the subj NSTRING and make a working copy */
+    /* parse the subj NSTRING and make a working copy in the pool;
+       the base subject is trimmed out of it in place */
     if (!strcmp(subj, "NIL")) {		       	/* NIL? */
-	return xstrdup("");			/* yes, return empty */
+	return mpool_strdup(pool, "");		/* yes, return empty */
     } else if (*subj == '"') {			/* quoted? */
-	buf = xstrndup(subj + 1, len - 2);	/* yes, strip quotes */
+	buf = mpool_strndup(pool, subj + 1, len - 2); /* yes, strip quotes */
     } else {
 	s = strchr(subj, '}') + 3;		/* literal, skip { }\r\n */
-	buf = xstrndup(s, len - (s - subj));
+	buf = mpool_strndup(pool, s, len - (s - subj));
     }
 
     for (s = buf;;) {
@@ -3847,10 +4611,6 @@ static char *index_extract_subject(const char *subj, size_t len, int *is_refwd)
 	    break;
     }
 
-    base = xstrdup(base);
-
-    free(buf);
-
     return base;
 }
 
@@ -3980,7 +4740,8 @@ static char *_index_extract_subject(char *s, int *is_refwd)
 }
 
 /* Find a message-id looking thingy in a string.  Returns a pointer to the
- * alloc'd id and the remaining string is returned in the **loc parameter.
+ * id (allocated from pool) and the remaining string is returned in the
+ * **loc parameter.
  *
  * This is a poor-man's way of finding the message-id.  We simply look for
  * any string having the format "< ... @ ... >" and assume that the mail
@@ -3988,9 +4749,10 @@ static char *_index_extract_subject(char *s, int *is_refwd)
  */
 #define MSGID_SPECIALS "<> @\\"
 
-static char *find_msgid(char *str, char **rem)
+static char *find_msgid(struct mpool *pool, char *str, char **rem)
 {
     char *msgid, *src, *dst, *cp;
+    size_t msgidsize = 0;
 
     if (!str) return NULL;
 
@@ -4035,8 +4797,12 @@ static char *find_msgid(char *str, char **rem)
 	if ((cp = strchr(cp, '>')) == NULL)
 	    return NULL;
 
-	/* alloc space for the msgid */
-	dst = msgid = (char*) xrealloc(msgid, cp - src + 2);
+	/* alloc space for the msgid, reusing what a failed attempt got */
+	if ((size_t) (cp - src + 2) > msgidsize) {
+	    msgidsize = cp - src + 2;
+	    msgid = (char *) mpool_malloc(pool, msgidsize);
+	}
+	dst = msgid;
 
 	*dst++ = *src++;
 
@@ -4072,38 +4838,41 @@ static char *find_msgid(char *str, char **rem)
 	return msgid;
     }
 
-    if (msgid) free(msgid);
     return NULL;
 }
 
 /* Get message-id, and references/in-reply-to */
 #define REFGROWSIZE 10
 
-void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers)
+static void index_get_ids(struct mpool *pool, MsgData *msgdata,
+			  char *envtokens[], const char *headers)
 {
     char *refstr, *ref, *in_reply_to;
+    char **newref;
     int refsize = REFGROWSIZE;
     char buf[100];
 
     /* get msgid */
-    msgdata->msgid = find_msgid(envtokens[ENV_MSGID], NULL);
+    msgdata->msgid = find_msgid(pool, envtokens[ENV_MSGID], NULL);
      /* if we don't have one, create one */
     if (!msgdata->msgid) {
 	snprintf(buf, sizeof(buf), "<Empty-ID: %u>", msgdata->msgno);
-	msgdata->msgid = xstrdup(buf);
+	msgdata->msgid = mpool_strdup(pool, buf);
     }
 
     /* grab the References header */
     if ((refstr = stristr(headers, "references:"))) {
 	/* allocate some space for refs */
-	msgdata->ref = (char **) xmalloc(refsize * sizeof(char *));
+	msgdata->ref = (char **) mpool_malloc(pool, refsize * sizeof(char *));
 	/* find references */
-	while ((ref = find_msgid(refstr, &refstr)) != NULL) {
-	    /* reallocate space for this msgid if necessary */
+	while ((ref = find_msgid(pool, refstr, &refstr)) != NULL) {
+	    /* move to a bigger array if necessary; the pool keeps the old
+	       one until the whole command is done */
 	    if (msgdata->nref == refsize) {
-		refsize += REFGROWSIZE;
-		msgdata->ref = (char **)
-		    xrealloc(msgdata->ref, refsize * sizeof(char *));
+		refsize *= 2;
+		newref = (char **) mpool_malloc(pool, refsize * sizeof(char *));
+		memcpy(newref, msgdata->ref, msgdata->nref * sizeof(char *));
+		msgdata->ref = newref;
 	    }
 	    /* store this msgid in the array */
 	    msgdata->ref[msgdata->nref++] = ref;
@@ -4113,30 +4882,15 @@ void index_get_ids(MsgData *msgdata, char *envtokens[], const char *headers)
     /* if we have no references, try in-reply-to */
     if (!msgdata->nref) {
 	/* get in-reply-to id */
-	in_reply_to = find_msgid(envtokens[ENV_INREPLYTO], NULL);
+	in_reply_to = find_msgid(pool, envtokens[ENV_INREPLYTO], NULL);
 	/* if we have an in-reply-to id, make it the ref */
 	if (in_reply_to) {
-	    msgdata->ref = (char **) xmalloc(sizeof(char *));
+	    msgdata->ref = (char **) mpool_malloc(pool, sizeof(char *));
 	    msgdata->ref[msgdata->nref++] = in_reply_to;
 	}
     }
 }
 
-/*
- * Getnext function for sorting message lists.
- */
-static void *index_sort_getnext(MsgData *node)
-{
-    return node->next;
-}
-
-/*
- * Setnext function for sorting message lists.
- */
-static void index_sort_setnext(MsgData *node, MsgData *next)
-{
-    node->next = next;
-}
 
 /*
  * Function for comparing two integers.
@@ -4200,42 +4954,91 @@ static int index_sort_compare(MsgData *md1, MsgData *md2,
 }
 
 /*
- * Free a msgdata node.
+ * The sort key for 'md' under the first of 'sortcrit': the value
+ * itself for numeric criteria, or the first 8 bytes for strings,
+ * inverted if reversed.  Keys order messages the same way
+ * index_sort_compare() does, up to ties.
  */
-static void index_msgdata_free(MsgData *md)
+static unsigned long long index_sort_key(MsgData *md,
+					 struct sortcrit *sortcrit)
 {
-#define FREE(x)	if (x) free(x)
+    unsigned long long key = 0;
+    const char *s = NULL;
     int i;
 
-    if (!md)
-	return;
-    FREE(md->cc);
-    FREE(md->from);
-    FREE(md->to);
-    FREE(md->xsubj);
-    FREE(md->msgid);
-    for (i = 0; i < md->nref; i++)
-	free(md->ref[i]);
-    FREE(md->ref);
-    for (i = 0; i < md->nannot; i++)
-	free(md->annot[i]);
-    FREE(md->annot);
+    switch (sortcrit->key) {
+    case SORT_SEQUENCE:
+	key = md->msgno;
+	break;
+    case SORT_ARRIVAL:
+	key = (modseq_t) INTERNALDATE(md->msgno);
+	break;
+    case SORT_DATE:
+	key = (modseq_t) (md->date ? md->date : INTERNALDATE(md->msgno));
+	break;
+    case SORT_SIZE:
+	key = (modseq_t) SIZE(md->msgno);
+	break;
+    case SORT_MODSEQ:
+	key = MODSEQ(md->msgno);
+	break;
+    case SORT_CC:
+	s = md->cc;
+	break;
+    case SORT_FROM:
+	s = md->from;
+	break;
+    case SORT_SUBJECT:
+	s = md->xsubj;
+	break;
+    case SORT_TO:
+	s = md->to;
+	break;
+    case SORT_ANNOTATION:
+	s = md->annot[0];
+	break;
+    }
+
+    if (s) {
+	/* big-endian, so comparing keys compares the bytes in order */
+	for (i = 0; i < 8; i++) {
+	    key <<= 8;
+	    if (*s) key |= (unsigned char) *s++;
+	}
+    }
+
+    return (sortcrit->flags & SORT_REVERSE) ? ~key : key;
 }
 
 /*
- * Getnext function for sorting thread lists.
+ * Sort a list of messages, returning the new head.
  */
-static void *index_thread_getnext(Thread *thread)
+static MsgData *index_sort_list(MsgData *list, struct sortcrit *sortcrit)
 {
-    return thread->next;
-}
+    struct keysort_item *items;
+    MsgData *md;
+    unsigned n, i;
 
-/*
- * Setnext function for sorting thread lists.
- */
-static void index_thread_setnext(Thread *thread, Thread *next)
-{
-    thread->next = next;
+    for (n = 0, md = list; md; md = md->next) n++;
+    if (n < 2) return list;
+
+    items = (struct keysort_item *) xmalloc(n * sizeof(struct keysort_item));
+    for (i = 0, md = list; md; md = md->next, i++) {
+	items[i].key = index_sort_key(md, sortcrit);
+	items[i].data = md;
+    }
+
+    keysort(items, n, (int (*)(void*,void*,void*)) index_sort_compare,
+	    sortcrit);
+
+    list = items[0].data;
+    for (i = 0; i < n; i++) {
+	((MsgData *) items[i].data)->next =
+	    (i+1 < n ? (MsgData *) items[i+1].data : NULL);
+    }
+    free(items);
+
+    return list;
 }
 
 /*
@@ -4252,6 +5055,39 @@ static int index_thread_compare(Thread *t1, Thread *t2,
     return index_sort_compare(md1, md2, call_data);
 }
 
+/*
+ * Sort a list of sibling threads, returning the new head.
+ */
+static Thread *index_thread_sortlist(Thread *list, struct sortcrit *sortcrit)
+{
+    struct keysort_item *items;
+    Thread *thread;
+    unsigned n, i;
+
+    for (n = 0, thread = list; thread; thread = thread->next) n++;
+    if (n < 2) return list;
+
+    items = (struct keysort_item *) xmalloc(n * sizeof(struct keysort_item));
+    for (i = 0, thread = list; thread; thread = thread->next, i++) {
+	/* if the container is empty, use the first child's container */
+	items[i].key = index_sort_key(thread->msgdata ? thread->msgdata :
+				      thread->child->msgdata, sortcrit);
+	items[i].data = thread;
+    }
+
+    keysort(items, n, (int (*)(void*,void*,void*)) index_thread_compare,
+	    sortcrit);
+
+    list = items[0].data;
+    for (i = 0; i < n; i++) {
+	((Thread *) items[i].data)->next =
+	    (i+1 < n ? (Thread *) items[i+1].data : NULL);
+    }
+    free(items);
+
+    return list;
+}
+
 /*
  * Sort a list of threads.
  */
@@ -4269,11 +5105,7 @@ static void index_thread_sort(Thread *root, struct sortcrit *sortcrit)
     }
 
     /* sort the children */
-    root->child = lsort(root->child,
-			(void * (*)(void*)) index_thread_getnext,
-			(void (*)(void*,void*)) index_thread_setnext,
-			(int (*)(void*,void*,void*)) index_thread_compare,
-			sortcrit);
+    root->child = index_thread_sortlist(root->child, sortcrit);
 }
 
 /*
@@ -4282,7 +5114,8 @@ static void index_thread_sort(Thread *root, struct sortcrit *sortcrit)
 static void index_thread_orderedsubj(unsigned *msgno_list, int nmsg,
 				     int usinguid)
 {
-    MsgData *msgdata, *freeme;
+    MsgData *msgdata;
+    struct mpool *pool;
     struct sortcrit sortcrit[] = {{ SORT_SUBJECT,  0, {{NULL, NULL}} },
 				  { SORT_DATE,     0, {{NULL, NULL}} },
 				  { SORT_SEQUENCE, 0, {{NULL, NULL}} }};
@@ -4291,21 +5124,18 @@ static void index_thread_orderedsubj(unsigned *msgno_list, int nmsg,
     Thread *head, *newnode, *cur, *parent, *last;
 
     /* Create/load the msgdata array */
-    freeme = msgdata = index_msgdata_load(msgno_list, nmsg, sortcrit);
+    pool = index_msgdata_pool(nmsg);
+    msgdata = index_msgdata_load(pool, msgno_list, nmsg, sortcrit);
 
     /* Sort messages by subject and date */
-    msgdata = lsort(msgdata,
-		    (void * (*)(void*)) index_sort_getnext,
-		    (void (*)(void*,void*)) index_sort_setnext,
-		    (int (*)(void*,void*,void*)) index_sort_compare,
-		    sortcrit);
+    msgdata = index_sort_list(msgdata, sortcrit);
 
     /* create an array of Thread to use as nodes of thread tree
      *
      * we will be building threads under a dummy head,
      * so we need (nmsg + 1) nodes
      */
-    head = (Thread *) xmalloc((nmsg + 1) * sizeof(Thread));
+    head = (Thread *) mpool_malloc(pool, (nmsg + 1) * sizeof(Thread));
     memset(head, 0, (nmsg + 1) * sizeof(Thread));
 
     newnode = head + 1;	/* set next newnode to the second
@@ -4354,40 +5184,48 @@ static void index_thread_orderedsubj(unsigned *msgno_list, int nmsg,
     /* Output the threaded messages */ 
     index_thread_print(head, usinguid);
 
-    /* free the thread array */
-    free(head);
+    /* free the thread and msgdata arrays */
+    free_mpool(pool);
+}
 
-    /* free the msgdata array */
-    free(freeme);
+static void thread_resp_add(const char *s, int len)
+{
+    if (thread_resp.len + len + 1 > thread_resp.alloc) {
+	thread_resp.alloc = thread_resp.len + len + 1 + 4096;
+	thread_resp.s = xrealloc(thread_resp.s, thread_resp.alloc);
+    }
+    memcpy(thread_resp.s + thread_resp.len, s, len);
+    thread_resp.len += len;
+    thread_resp.s[thread_resp.len] = '\0';
+}
+
+static void thread_resp_adduid(unsigned msgno)
+{
+    char buf[20];
+
+    thread_resp_add(buf, snprintf(buf, sizeof(buf), "%u", UID(msgno)));
 }
 
 /*
  * Guts of thread printing.  Recurses over children when necessary.
- *
- * Frees contents of msgdata as a side effect.
  */
-static void _index_thread_print(Thread *thread, int usinguid)
+static void _index_thread_print(Thread *thread)
 {
     Thread *child;
 
     /* for each thread... */
     while (thread) {
 	/* start the thread */
-	prot_printf(imapd_out, "(");
+	thread_resp_add("(", 1);
 
 	/* if we have a message, print its identifier
 	 * (do nothing for empty containers)
 	 */
 	if (thread->msgdata) {
-	    prot_printf(imapd_out, "%u",
-			usinguid ? UID(thread->msgdata->msgno) :
-			thread->msgdata->msgno);
+	    thread_resp_adduid(thread->msgdata->msgno);
 
 	    /* if we have a child, print the parent-child separator */
-	    if (thread->child) prot_printf(imapd_out, " ");
-
-	    /* free contents of the current node */
-	    index_msgdata_free(thread->msgdata);
+	    if (thread->child) thread_resp_add(" ", 1);
 	}
 
 	/* for each child, grandchild, etc... */
@@ -4395,27 +5233,22 @@ static void _index_thread_print(Thread *thread, int usinguid)
 	while (child) {
 	    /* if the child has siblings, print new branch and break */
 	    if (child->next) {
-		_index_thread_print(child, usinguid);
+		_index_thread_print(child);
 		break;
 	    }
 	    /* otherwise print the only child */
 	    else {
-		prot_printf(imapd_out, "%u",
-			    usinguid ? UID(child->msgdata->msgno) :
-			    child->msgdata->msgno);
+		thread_resp_adduid(child->msgdata->msgno);
 
 		/* if we have a child, print the parent-child separator */
-		if (child->child) prot_printf(imapd_out, " ");
-
-		/* free contents of the child node */
-		index_msgdata_free(child->msgdata);
+		if (child->child) thread_resp_add(" ", 1);
 
 		child = child->child;
 	    }
 	}
 
 	/* end the thread */
-	prot_printf(imapd_out, ")");
+	thread_resp_add(")", 1);
 
 	thread = thread->next;
     }
@@ -4424,16 +5257,50 @@ static void _index_thread_print(Thread *thread, int usinguid)
 /*
  * Print a list of threads.
  *
- * This is a wrapper around _index_thread_print() which simply prints the
- * start and end of the untagged thread response.
+ * This is a wrapper around _index_thread_print() which builds the
+ * response in thread_resp and then sends it.
  */
 static void index_thread_print(Thread *thread, int usinguid)
 {
-    prot_printf(imapd_out, "* THREAD");
+    thread_resp.len = 0;
+    thread_resp_add("", 0);
 
     if (thread) {
-	prot_printf(imapd_out, " ");
-	_index_thread_print(thread->child, usinguid);
+	thread_resp_add(" ", 1);
+	_index_thread_print(thread->child);
+    }
+
+    index_thread_output(thread_resp.s, usinguid);
+}
+
+/*
+ * Send the untagged THREAD response 'resp' (which gives UIDs),
+ * converting to message sequence numbers unless 'usinguid'.
+ */
+static void index_thread_output(const char *resp, int usinguid)
+{
+    unsigned long uid;
+    char *p;
+    int n;
+
+    prot_printf(imapd_out, "* THREAD");
+
+    if (usinguid) {
+	prot_write(imapd_out, resp, strlen(resp));
+	return;
+    }
+
+    while (*resp) {
+	if (cyrus_isdigit((int) *resp)) {
+	    uid = strtoul(resp, &p, 10);
+	    prot_printf(imapd_out, "%u", index_finduid(uid));
+	    resp = p;
+	}
+	else {
+	    n = strcspn(resp, "0123456789");
+	    prot_write(imapd_out, resp, n);
+	    resp += n;
+	}
     }
 }
 
@@ -4520,12 +5387,12 @@ static void thread_orphan_child(Thread *child)
 /*
  * Link messages together using message-id and references.
  */
-static void ref_link_messages(MsgData *msgdata, Thread **newnode,
-		       struct hash_table *id_table)
+static void ref_link_messages(struct mpool *pool, MsgData *msgdata,
+			      Thread **newnode, struct hash_table *id_table)
 {
     Thread *cur, *parent, *ref;
     int dup_count = 0;
-    char buf[100];
+    char buf[100], *msgid;
     int i;
 
     /* for each message... */
@@ -4541,10 +5408,11 @@ static void ref_link_messages(MsgData *msgdata, Thread **newnode,
 	     */
 	    if (cur->msgdata) {
 		snprintf(buf, sizeof(buf), "-dup%d", dup_count++);
-		msgdata->msgid =
-		    (char *) xrealloc(msgdata->msgid,
-				      strlen(msgdata->msgid) + strlen(buf) + 1);
-		strcat(msgdata->msgid, buf);
+		msgid = (char *) mpool_malloc(pool, strlen(msgdata->msgid) +
+					      strlen(buf) + 1);
+		strcpy(msgid, msgdata->msgid);
+		strcat(msgid, buf);
+		msgdata->msgid = msgid;
 		/* clear cur so that we create a new container */
 		cur = NULL;
 	    }
@@ -4707,21 +5575,13 @@ static void ref_sort_root(Thread *root)
     while (cur) {
 	/* if the message is a dummy, sort its children */
 	if (!cur->msgdata) {
-	    cur->child = lsort(cur->child,
-			       (void * (*)(void*)) index_thread_getnext,
-			       (void (*)(void*,void*)) index_thread_setnext,
-			       (int (*)(void*,void*,void*)) index_thread_compare,
-			       sortcrit);
+	    cur->child = index_thread_sortlist(cur->child, sortcrit);
 	}
 	cur = cur->next;
     }
 
     /* sort the root set */
-    root->child = lsort(root->child,
-			(void * (*)(void*)) index_thread_getnext,
-			(void (*)(void*,void*)) index_thread_setnext,
-			(int (*)(void*,void*,void*)) index_thread_compare,
-			sortcrit);
+    root->child = index_thread_sortlist(root->child, sortcrit);
 }
 
 /*
@@ -4878,24 +5738,6 @@ static void ref_group_subjects(Thread *root, unsigned nroot, Thread **newnode)
     free_hash_table(&subj_table, NULL);
 }
 
-/*
- * Free an entire thread.
- */
-static void index_thread_free(Thread *thread)
-{
-    Thread *child;
-
-    /* free the head node */
-    if (thread->msgdata) index_msgdata_free(thread->msgdata);
-
-    /* free the children recursively */
-    child = thread->child;
-    while (child) {
-	index_thread_free(child);
-	child = child->next;
-    }
-}
-
 /*
  * Guts of thread searching.  Recurses over children when necessary.
  */
@@ -4937,9 +5779,6 @@ static void index_thread_search(Thread *root, int (*searchproc) (MsgData *))
 	    else
 		prev->next = cur->next;
 
-	    /* free all nodes in the thread */
-	    index_thread_free(cur);
-
 	    /* we just removed cur from our list,
 	     * so we need to keep the same prev for the next pass
 	     */
@@ -4957,14 +5796,16 @@ static void _index_thread_ref(unsigned *msgno_list, int nmsg,
 			      int (*searchproc) (MsgData *),
 			      struct sortcrit sortcrit[], int usinguid)
 {
-    MsgData *msgdata, *freeme, *md;
+    MsgData *msgdata, *md;
+    struct mpool *pool;
     int tref, nnode;
     Thread *newnode;
     struct hash_table id_table;
     struct rootset rootset;
 
     /* Create/load the msgdata array */
-    freeme = msgdata = index_msgdata_load(msgno_list, nmsg, loadcrit);
+    pool = index_msgdata_pool(nmsg);
+    msgdata = index_msgdata_load(pool, msgno_list, nmsg, loadcrit);
 
     /* calculate the sum of the number of references for all messages */
     for (md = msgdata, tref = 0; md; md = md->next)
@@ -4988,7 +5829,7 @@ static void _index_thread_ref(unsigned *msgno_list, int nmsg,
      * (been there, done that).
      */
     nnode = (int) (1.5 * nmsg + 1 + tref);
-    rootset.root = (Thread *) xmalloc(nnode * sizeof(Thread));
+    rootset.root = (Thread *) mpool_malloc(pool, nnode * sizeof(Thread));
     memset(rootset.root, 0, nnode * sizeof(Thread));
 
     newnode = rootset.root + 1;	/* set next newnode to the second
@@ -5000,7 +5841,7 @@ static void _index_thread_ref(unsigned *msgno_list, int nmsg,
     construct_hash_table(&id_table, nmsg + tref, 1);
 
     /* Step 1: link messages together */
-    ref_link_messages(msgdata, &newnode, &id_table);
+    ref_link_messages(pool, msgdata, &newnode, &id_table);
 
     /* Step 2: find the root set (gather all of the orphan messages) */
     rootset.nroot = 0;
@@ -5028,11 +5869,8 @@ static void _index_thread_ref(unsigned *msgno_list, int nmsg,
     /* Output the threaded messages */ 
     index_thread_print(rootset.root, usinguid);
 
-    /* free the thread array */
-    free(rootset.root);
-
-    /* free the msgdata array */
-    free(freeme);
+    /* free the thread and msgdata arrays */
+    free_mpool(pool);
 }
 
 /*
@@ -5062,7 +5900,7 @@ char *index_get_msgid(struct mailbox *mailbox __attribute__((unused)),
     char *envtokens[NUMENVTOKENS];
     char *msgid;
 
-    cacheitem = cache_base + CACHE_OFFSET(msgno);
+    cacheitem = CACHE_FIELD(msgno, CACHE_ENVELOPE);
     cachelen = CACHE_ITEM_LEN(cacheitem);
 
     /* get msgid out of the envelope
@@ -5155,7 +5993,7 @@ extern struct nntp_overview *index_overview(struct mailbox *mailbox,
     char *envtokens[NUMENVTOKENS];
     struct address addr = { NULL, NULL, NULL, NULL, NULL, NULL };
 
-    cacheitem = cache_base + CACHE_OFFSET(msgno); /* envelope */
+    cacheitem = CACHE_FIELD(msgno, CACHE_ENVELOPE);
 
     /* make a working copy of envelope; strip outer ()'s */
     /* -2 -> don't include the size of the outer parens */
@@ -5249,11 +6087,7 @@ extern char *index_getheader(struct mailbox *mailbox, unsigned msgno,
     /* see if the header is cached */
     if (mailbox_cached_header(hdr) != BIT32_MAX) {
 	/* cached header */
-	cacheitem = cache_base + CACHE_OFFSET(msgno);
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip bodystructure */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip section */
+	cacheitem = CACHE_FIELD(msgno, CACHE_HEADERS);
     
 	size = CACHE_ITEM_LEN(cacheitem);
 	if (allocsize < size+2) {
@@ -97,6 +97,19 @@
 /* Size of a bit32 to skip when jumping over cache item sizes */
 #define CACHE_ITEM_SIZE_SKIP sizeof(bit32)
 
+/* CACHE_DIR_OFFSET: Get offset 'n' out of a cache record's field directory */
+/* CACHE_ITEM: Return a pointer to 'field' of the cache record at 'rec'.
+ * Records older than MAILBOX_CACHE_DIR_VERSION have to be walked */
+/* CACHE_FIELD: CACHE_ITEM for 'msgno' in the memory-mapped cache file */
+#define CACHE_DIR_OFFSET(rec, n) \
+    CACHE_ITEM_BIT32((rec)+CACHE_ITEM_SIZE_SKIP+(n)*sizeof(bit32))
+#define CACHE_ITEM(rec, version, field) \
+    ((version) >= MAILBOX_CACHE_DIR_VERSION ? \
+     (rec) + CACHE_DIR_OFFSET((rec), (field)) : \
+     mailbox_cache_walk((rec), (field)))
+#define CACHE_FIELD(msgno, field) \
+    CACHE_ITEM(cache_base + CACHE_OFFSET(msgno), CACHE_VERSION(msgno), (field))
+
 /* Calculate the number of entries in a vector */
 #define VECTOR_SIZE(vector) (sizeof(vector)/sizeof(vector[0]))
 
@@ -178,6 +191,10 @@ struct nntp_overview {
     unsigned long lines;
 };
 
+/* Set in the helper processes that a SEARCH forks: they must _exit()
+ * rather than say goodbye to the client or clean up the session */
+extern int index_search_helper;
+
 extern void index_operatemailbox(struct mailbox *mailbox);
 extern int index_finduid(unsigned uid);
 extern int index_getuid(unsigned msgno);
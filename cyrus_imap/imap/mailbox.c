@@ -74,6 +74,8 @@
 #include "assert.h"
 #include "exitcodes.h"
 #include "global.h"
+#include "hdrhash.h"
+#include "headerindex.h"
 #include "imap_err.h"
 #include "index.h"
 #include "lock.h"
@@ -173,106 +175,42 @@ static struct fnamebuf *mailbox_meta_get_fname(struct fnamepath *fpath,
     return fname;
 }
 
-/*
- * Names of the headers we cache in the cyrus.cache file.
- *
- * Changes to this list probably require bumping the cache version
- * number (obviously)
- *
- * note that header names longer than MAX_CACHED_HEADER_SIZE
- * won't be cached regardless
- *
- * xxx can we get benefits by requireing this list to be sorted?
- * (see is_cached_header())
- *
- */
-const struct mailbox_header_cache mailbox_cache_headers[] = {
-    /* things we have always cached */
-    { "priority", 0 },
-    { "references", 0 },
-    { "resent-from", 0 },
-    { "newsgroups", 0 },
-    { "followup-to", 0 },
-
-    /* x headers that we may want to cache anyway */
-    { "x-mailer", 1 },
-    { "x-trace", 1 },
-
-    /* outlook express seems to want these */
-    { "x-ref", 2  },
-    { "x-priority", 2 },
-    { "x-msmail-priority", 2 },
-    { "x-msoesrec", 2 },
-
-    /* things to never cache */
-    { "bcc", BIT32_MAX },
-    { "cc", BIT32_MAX },
-    { "date", BIT32_MAX },
-    { "delivery-date", BIT32_MAX },
-    { "envelope-to", BIT32_MAX },
-    { "from", BIT32_MAX },
-    { "in-reply-to", BIT32_MAX },
-    { "mime-version", BIT32_MAX },
-    { "reply-to", BIT32_MAX },
-    { "received", BIT32_MAX },
-    { "return-path", BIT32_MAX },
-    { "sender", BIT32_MAX },
-    { "subject", BIT32_MAX },
-    { "to", BIT32_MAX },
-
-    /* older versions of PINE (before 4.56) need message-id in the cache too
-     * though technically it is a waste of space because it is in
-     * ENVELOPE.  We should probably uncomment the following at some
-     * future point [ken3 notes this may also be useful to have here for
-     * threading so we can avoid parsing the envelope] */
-    /* { "message-id", BIT32_MAX }, */
-};
-const int MAILBOX_NUM_CACHE_HEADERS =
-  sizeof(mailbox_cache_headers)/sizeof(struct mailbox_header_cache);
-
 /*
  *  Function to test if a header is in the cache
  *
- *  Assume cache entry version 1, unless other data is found
- *  in the table.
+ *  'h' is the hdrhash_lookup() of the 'len' bytes at 'hdr'.  The
+ *  headers we know about, and the cache version each appeared in,
+ *  are listed in hdrhash.list.
+ *
+ *   Returns minimum version required for lookup to succeed
+ *   or BIT32_MAX if header not cached
  */
-static inline int is_cached_header(const char *hdr) 
+int mailbox_cached_hdrhash(const struct hdrhash_entry *h,
+			   const char *hdr, int len)
 {
-    int i;
-    
-    /* xxx if we can sort the header list we can do better here */
-    for (i=0; i<MAILBOX_NUM_CACHE_HEADERS; i++) {
-	if (!strcmp(mailbox_cache_headers[i].name, hdr))
-	    return mailbox_cache_headers[i].min_cache_version;
-    }
+    /* header names this long won't be cached regardless */
+    if (len >= MAX_CACHED_HEADER_SIZE - 1) return BIT32_MAX;
+
+    if (h) return h->min_cache_version;
 
     /* Don't Cache X- headers unless explicitly configured to*/
-    if ((hdr[0] == 'x') && (hdr[1] == '-')) return BIT32_MAX;
+    if (len >= 2 && (hdr[0] == 'x' || hdr[0] == 'X') && hdr[1] == '-')
+	return BIT32_MAX;
 
     /* Everything else we cache in version 1 */
     return 1;
 }
 
-/*  External API to is_cached_header that prepares the string
+/*  External API to mailbox_cached_hdrhash for a NUL-terminated name
  *
  *   Returns minimum version required for lookup to succeed
  *   or BIT32_MAX if header not cached
  */
 int mailbox_cached_header(const char *s) 
 {
-    char hdr[MAX_CACHED_HEADER_SIZE];
-    int i;
- 
-    /* Generate lower case copy of string */
-    /* xxx sometimes the caller has already generated this .. 
-     * maybe we can just require callers to do it? */
-    for (i=0 ; *s && (i < (MAX_CACHED_HEADER_SIZE - 1)) ; i++)
-	hdr[i] = tolower(*s++);
-    
-    if (*s) return BIT32_MAX;   /* Input too long for match */
-    hdr[i] = '\0';
-    
-    return is_cached_header(hdr);
+    int len = strlen(s);
+
+    return mailbox_cached_hdrhash(hdrhash_lookup(s, len), s, len);
 }
 
 /* Same as mailbox_cached_header, but for use on a header
@@ -280,7 +218,6 @@ int mailbox_cached_header(const char *s)
  */
 int mailbox_cached_header_inline(const char *text)
 {
-    char buf[MAX_CACHED_HEADER_SIZE];
     int i;
     
     /* Scan for header */
@@ -288,22 +225,42 @@ int mailbox_cached_header_inline(const char *text)
 	if (!text[i] || text[i] == '\r' || text[i] == '\n') break;
 	
 	if (text[i] == ':') {
-	    buf[i] = '\0';
-	    return is_cached_header(buf);
-	} else {
-	    buf[i] = tolower(text[i]);
+	    return mailbox_cached_hdrhash(hdrhash_lookup(text, i), text, i);
 	}
     }
     return BIT32_MAX;
 }
 
+/*
+ * Return a pointer to field 'field' of a cache record which has no
+ * field directory, by walking the preceding items.  Passing
+ * NUM_CACHE_FIELDS returns the end of the record.
+ */
+const char *mailbox_cache_walk(const char *cacherec, int field)
+{
+    while (field-- > 0) {
+	cacherec = CACHE_ITEM_NEXT(cacherec);
+    }
+    return cacherec;
+}
+
+/*
+ * Return the cache version of the index record at 'p'
+ */
+static bit32 mailbox_record_cache_version(struct mailbox *mailbox,
+					  const char *p)
+{
+    if (mailbox->record_size < OFFSET_CACHE_VERSION+sizeof(bit32)) return 0;
+
+    return ntohl(*((bit32 *)(p+OFFSET_CACHE_VERSION)));
+}
+
 unsigned long
 mailbox_cache_size(struct mailbox *mailbox, unsigned msgno)
 {
     const char *p;
     unsigned long cache_offset;
-    unsigned int cache_ent;
-    const char *cacheitem, *cacheitembegin;
+    const char *cacheitembegin;
 
     assert((msgno > 0) && (msgno <= mailbox->exists));
 
@@ -313,11 +270,87 @@ mailbox_cache_size(struct mailbox *mailbox, unsigned msgno)
     cache_offset = ntohl(*((bit32 *)(p+OFFSET_CACHE_OFFSET)));
 
     /* Compute size of this record */
-    cacheitembegin = cacheitem = mailbox->cache_base + cache_offset;
-    for (cache_ent = 0; cache_ent < NUM_CACHE_FIELDS; cache_ent++) {
-        cacheitem = CACHE_ITEM_NEXT(cacheitem);
+    cacheitembegin = mailbox->cache_base + cache_offset;
+    return(CACHE_ITEM(cacheitembegin, mailbox_record_cache_version(mailbox, p),
+		      NUM_CACHE_FIELDS) - cacheitembegin);
+}
+
+/*
+ * Cache records of the version just before MAILBOX_CACHE_DIR_VERSION
+ * are given a field directory whenever the cache file is rewritten;
+ * there is no upgrade on open, so both formats coexist until then.
+ * Older records store their headers differently and are left alone.
+ */
+static int mailbox_cache_needs_dir(struct mailbox *mailbox, const char *rec)
+{
+    return (mailbox_record_cache_version(mailbox, rec) + 1 ==
+	    MAILBOX_CACHE_DIR_VERSION);
+}
+
+/*
+ * Return the number of messages in 'mailbox' whose cache records
+ * would be given a field directory by mailbox_compact()
+ */
+unsigned long mailbox_cache_count_old(struct mailbox *mailbox)
+{
+    unsigned long msgno, count = 0;
+
+    for (msgno = 1; msgno <= mailbox->exists; msgno++) {
+	if (mailbox_cache_needs_dir(mailbox,
+				    mailbox->index_base + mailbox->start_offset +
+				    (msgno - 1) * mailbox->record_size)) {
+	    count++;
+	}
     }
-    return(cacheitem - cacheitembegin);
+
+    return count;
+}
+
+/*
+ * Append the cache record of the index record at 'rec' to 'newcache',
+ * adding a field directory if mailbox_cache_needs_dir() says so (the
+ * caller updates the cache version of the index record to match).
+ * Returns the number of bytes written, or 0 if the cache record is
+ * unusable.
+ */
+static size_t mailbox_copy_cache_record(struct mailbox *mailbox,
+					const char *rec, FILE *newcache)
+{
+    bit32 dir[1 + NUM_CACHE_FIELDS + 1];
+    unsigned long cache_offset;
+    const char *cacherec, *cacheitem, *cache_end;
+    size_t len;
+    int i;
+
+    cache_offset = ntohl(*((bit32 *)(rec+OFFSET_CACHE_OFFSET)));
+    if (!cache_offset || cache_offset >= mailbox->cache_size) return 0;
+
+    cacherec = mailbox->cache_base + cache_offset;
+    cache_end = mailbox->cache_base + mailbox->cache_size;
+
+    if (!mailbox_cache_needs_dir(mailbox, rec)) {
+	len = CACHE_ITEM(cacherec, mailbox_record_cache_version(mailbox, rec),
+			 NUM_CACHE_FIELDS) - cacherec;
+	if (cache_offset + len > mailbox->cache_size) return 0;
+
+	fwrite(cacherec, 1, len, newcache);
+	return len;
+    }
+
+    cacheitem = cacherec;
+    dir[0] = htonl(CACHE_DIR_LEN);
+    for (i = 0; i < NUM_CACHE_FIELDS; i++) {
+	if (cacheitem + CACHE_ITEM_SIZE_SKIP > cache_end) return 0;
+	dir[1+i] = htonl(CACHE_DIR_SIZE + (cacheitem - cacherec));
+	cacheitem = CACHE_ITEM_NEXT(cacheitem);
+    }
+    if (cacheitem > cache_end) return 0;
+    len = cacheitem - cacherec;
+    dir[1+NUM_CACHE_FIELDS] = htonl(CACHE_DIR_SIZE + len);
+
+    fwrite(dir, 1, CACHE_DIR_SIZE, newcache);
+    fwrite(cacherec, 1, len, newcache);
+    return CACHE_DIR_SIZE + len;
 }
 
 /* function to be used for notification of mailbox changes/updates */
@@ -423,6 +456,20 @@ void mailbox_unmap_message(struct mailbox *mailbox __attribute__((unused)),
     map_free(basep, lenp);
 }
 
+/*
+ * Opens the message file for UID 'uid' in 'mailbox' read-only.
+ * Returns the file descriptor, which the caller must close,
+ * or -1 with errno set.
+ */
+int mailbox_open_message(struct mailbox *mailbox, unsigned long uid)
+{
+    char buf[4096];
+
+    snprintf(buf, sizeof(buf), "%s/%lu.", mailbox->path, uid);
+
+    return open(buf, O_RDONLY, 0666);
+}
+
 /*
  * Set the "reconstruct" mode.  Causes most errors to be ignored.
  */
@@ -1910,8 +1957,6 @@ static int process_records(struct mailbox *mailbox, FILE *newindex,
 	    /* Keep this message and update the index/cache record */
 	    size_t cache_record_size;
 	    unsigned long cache_offset;
-	    unsigned int cache_ent;
-	    const char *cacheitem, *cacheitembegin;
 	    
 	    cache_offset = ntohl(*((bit32 *)(buf+OFFSET_CACHE_OFFSET)));
 
@@ -1921,22 +1966,24 @@ static int process_records(struct mailbox *mailbox, FILE *newindex,
 		continue;
 	    }
 
+	    /* Copy the cache record, adding a field directory if needed */
+	    cache_record_size = mailbox_copy_cache_record(mailbox, buf, newcache);
+	    if (!cache_record_size) {
+		syslog(LOG_ERR, "IOERROR: bad cache record %u/%lu in %s",
+		       msgno, exists, mailbox->name);
+		return IMAP_IOERROR;
+	    }
+	    if (mailbox_cache_needs_dir(mailbox, buf)) {
+		*((bit32 *)(buf+OFFSET_CACHE_VERSION)) =
+		    htonl(MAILBOX_CACHE_DIR_VERSION);
+	    }
+
 	    /* Fix up cache file offset */
 	    *((bit32 *)(buf+OFFSET_CACHE_OFFSET)) =
 		htonl(*new_cache_total_size);
 	    if (newindex) fwrite(buf, 1, mailbox->record_size, newindex);
-
-	    /* Compute size of this record */
-	    cacheitembegin = cacheitem = mailbox->cache_base + cache_offset;
-	    for (cache_ent = 0; cache_ent < NUM_CACHE_FIELDS; cache_ent++) {
-		cacheitem = CACHE_ITEM_NEXT(cacheitem);
-	    }
-	    cache_record_size = (cacheitem - cacheitembegin);
 	    *new_cache_total_size += cache_record_size;
 
-	    /* fwrite will automatically call write() in a sane way */
-	    fwrite(cacheitembegin, 1, cache_record_size, newcache);
-
 	} else if (newindex) {
 	    /* Keep this message, but just update the index record */
 	    fwrite(buf, 1, mailbox->record_size, newindex);
@@ -2050,11 +2097,16 @@ int mailbox_expunge(struct mailbox *mailbox,
     unsigned long expunge_index_len = 0;	/* mapped size */
     time_t now = time(NULL);
     unsigned long expunge_exists = 0;
+    int purge;
 
     /* EXPUNGE_FORCE means immediate mode */
-    if (flags == EXPUNGE_FORCE)
+    if ((flags & ~EXPUNGE_KEEPCACHE) == EXPUNGE_FORCE)
 	config_expunge_mode = IMAP_ENUM_EXPUNGE_MODE_IMMEDIATE;
 
+    /* Are we going to remove message files? */
+    purge = (config_expunge_mode == IMAP_ENUM_EXPUNGE_MODE_IMMEDIATE) ||
+	(flags & EXPUNGE_CLEANUP);
+
     /* initialize the paths */
     mailbox_meta_get_fname(&fpath, mailbox, 0);
 
@@ -2073,7 +2125,7 @@ int mailbox_expunge(struct mailbox *mailbox,
 	if (expunge_fd == -1) {
 	    if (errno == ENOENT && (flags & EXPUNGE_CLEANUP)) {
 		/* we're doing cleanup and no cyrus.expunge */
-		if (flags == EXPUNGE_CLEANUP) {
+		if ((flags & ~EXPUNGE_KEEPCACHE) == EXPUNGE_CLEANUP) {
 		    /* we're ONLY doing cleanup, so we're done */
 		    return 0;
 		}
@@ -2113,9 +2165,9 @@ int mailbox_expunge(struct mailbox *mailbox,
 	return IMAP_IOERROR;
     }
 
-    /* If we're in immediate or cleanup mode, open cache files */
-    if ((config_expunge_mode == IMAP_ENUM_EXPUNGE_MODE_IMMEDIATE) ||
-	(flags & EXPUNGE_CLEANUP)) {
+    /* If we're in immediate or cleanup mode, open cache files, unless
+       the caller will compact the cache with mailbox_compact() */
+    if (purge && !(flags & EXPUNGE_KEEPCACHE)) {
         fname = mailbox_meta_get_fname(&fpath, mailbox,
 				       IMAP_ENUM_METAPARTITION_FILES_CACHE);
 
@@ -2449,9 +2501,9 @@ int mailbox_expunge(struct mailbox *mailbox,
     if (expunge_index_base) map_free(&expunge_index_base, &expunge_index_len);
     fclose(newindex);
 
-    if (newcache) {
-	fclose(newcache);
+    if (newcache) fclose(newcache);
 
+    if (purge) {
 	/* Delete message files */
 	fname = &fpath.data;
 	*(fname->tail)++ = '/';
@@ -2462,6 +2514,8 @@ int mailbox_expunge(struct mailbox *mailbox,
 				      sizeof(fname->buf) - fname->len);
 	    unlink(fname->buf);
 	}
+
+	headerindex_expunge(mailbox, deleted, numdeleted);
     }
 
     if (numdeleted > 0) {
@@ -2491,6 +2545,325 @@ int mailbox_expunge(struct mailbox *mailbox,
     return IMAP_IOERROR;
 }
 
+/*
+ * Copy the cache record of the index record at 'rec' from the mapped
+ * cache file to 'newcache', returning its offset in the new file via
+ * 'new_offset'.  Returns the number of bytes copied, or 0 if the
+ * cache record is unusable.
+ */
+static size_t compact_copy_cache(struct mailbox *mailbox, const char *rec,
+				 FILE *newcache, unsigned long *new_offset)
+{
+    *new_offset = ftell(newcache);
+    return mailbox_copy_cache_record(mailbox, rec, newcache);
+}
+
+/*
+ * Write a copy of the index (or expunge index) file at 'base' to
+ * 'newindex', pointing each record at the cache offset in 'offsets'
+ * (and the cache version written by compact_copy_cache()) and bumping
+ * the generation number to 'generation'.
+ */
+static void compact_write_index(struct mailbox *mailbox, FILE *newindex,
+				const char *base, unsigned long exists,
+				unsigned long *offsets, bit32 generation)
+{
+    char buf[INDEX_HEADER_SIZE > INDEX_RECORD_SIZE ?
+	     INDEX_HEADER_SIZE : INDEX_RECORD_SIZE];
+    unsigned long msgno;
+
+    memcpy(buf, base, mailbox->start_offset);
+    *((bit32 *)(buf+OFFSET_GENERATION_NO)) = htonl(generation);
+    *((bit32 *)(buf+OFFSET_LEAKED_CACHE)) = htonl(0);
+    fwrite(buf, 1, mailbox->start_offset, newindex);
+
+    for (msgno = 1; msgno <= exists; msgno++) {
+	memcpy(buf, base + mailbox->start_offset +
+	       (msgno - 1) * mailbox->record_size, mailbox->record_size);
+	*((bit32 *)(buf+OFFSET_CACHE_OFFSET)) = htonl(offsets[msgno-1]);
+	if (mailbox_cache_needs_dir(mailbox, buf)) {
+	    *((bit32 *)(buf+OFFSET_CACHE_VERSION)) =
+		htonl(MAILBOX_CACHE_DIR_VERSION);
+	}
+	fwrite(buf, 1, mailbox->record_size, newindex);
+    }
+}
+
+/*
+ * Rewrite cyrus.cache without its leaked records (and cyrus.index and
+ * cyrus.expunge to match) while holding the index lock only briefly.
+ * Cache records without a field directory are given one on the way.
+ *
+ * The cache records of the existing messages are copied to the new
+ * cache file without any lock held; cache records are never modified
+ * once written.  The index is then locked, the records of messages
+ * appended in the meantime are copied, and the new index and expunge
+ * index are written from the current ones and renamed into place.  If
+ * the index was rewritten by someone else while we were copying,
+ * gives up with IMAP_AGAIN.
+ *
+ * 'iolimit', if non-zero, limits the unlocked copy to that many bytes
+ * per second.  The caller must not hold any locks on 'mailbox'.
+ */
+int mailbox_compact(struct mailbox *mailbox, unsigned long iolimit)
+{
+    int r;
+    struct fnamepath fpath;
+    struct fnamebuf *fname;
+    char indexfname[MAX_MAILBOX_PATH+1], cachefname[MAX_MAILBOX_PATH+1];
+    char expungefname[MAX_MAILBOX_PATH+1], fnamebufnew[MAX_MAILBOX_PATH+1];
+    FILE *newindex = NULL, *newcache = NULL, *newexpungeindex = NULL;
+    unsigned long *offsets = NULL, *eoffsets = NULL;
+    unsigned long exists, msgno, expunge_exists = 0, snap_exists;
+    const char *expunge_index_base = NULL;
+    unsigned long expunge_index_len = 0;
+    ino_t snap_ino;
+    struct stat sbuf;
+    bit32 generation, genbuf;
+    size_t n, copied = 0;
+    time_t start;
+    int expunge_fd = -1;
+
+    /* initialize the paths */
+    mailbox_meta_get_fname(&fpath, mailbox, 0);
+    fname = mailbox_meta_get_fname(&fpath, mailbox,
+				   IMAP_ENUM_METAPARTITION_FILES_INDEX);
+    strlcpy(indexfname, fname->buf, sizeof(indexfname));
+    fname = mailbox_meta_get_fname(&fpath, mailbox,
+				   IMAP_ENUM_METAPARTITION_FILES_CACHE);
+    strlcpy(cachefname, fname->buf, sizeof(cachefname));
+    fname = mailbox_meta_get_fname(&fpath, mailbox,
+				   IMAP_ENUM_METAPARTITION_FILES_EXPUNGE);
+    strlcpy(expungefname, fname->buf, sizeof(expungefname));
+
+    /* Take a snapshot of the index */
+    r = mailbox_lock_index(mailbox);
+    if (r) return r;
+
+    snap_ino = mailbox->index_ino;
+    snap_exists = exists = mailbox->exists;
+    generation = mailbox->generation_no + 1;
+
+    expunge_fd = open(expungefname, O_RDWR, 0666);
+    if (expunge_fd != -1) {
+	if (fstat(expunge_fd, &sbuf) == -1 ||
+	    sbuf.st_size < mailbox->start_offset) {
+	    close(expunge_fd);
+	    expunge_fd = -1;
+	}
+	else {
+	    map_refresh(expunge_fd, 1, &expunge_index_base,
+			&expunge_index_len, sbuf.st_size, "expunge",
+			mailbox->name);
+	    expunge_exists =
+		ntohl(*((bit32 *)(expunge_index_base+OFFSET_EXISTS)));
+	}
+    }
+
+    if (fstat(mailbox->cache_fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstating cache for %s: %m", mailbox->name);
+	fatal("can't fstat cache file", EC_OSFILE);
+    }
+    mailbox->cache_size = sbuf.st_size;
+    map_refresh(mailbox->cache_fd, 0, &mailbox->cache_base,
+		&mailbox->cache_len, mailbox->cache_size,
+		"cache", mailbox->name);
+
+    mailbox_unlock_index(mailbox);
+
+    /* Copy the cache records we know about, without the lock */
+    strlcpy(fnamebufnew, cachefname, sizeof(fnamebufnew));
+    strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+    newcache = fopen(fnamebufnew, "w+");
+    if (!newcache) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", fnamebufnew);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+    genbuf = htonl(generation);
+    fwrite(&genbuf, 1, sizeof(bit32), newcache);
+
+    offsets = (unsigned long *) xmalloc((exists + 1) * sizeof(unsigned long));
+    if (expunge_exists) {
+	eoffsets = (unsigned long *)
+	    xmalloc(expunge_exists * sizeof(unsigned long));
+    }
+
+    start = time(NULL);
+    for (msgno = 1; msgno <= snap_exists + expunge_exists; msgno++) {
+	const char *rec;
+	unsigned long *offp;
+
+	if (msgno <= snap_exists) {
+	    rec = mailbox->index_base + mailbox->start_offset +
+		(msgno - 1) * mailbox->record_size;
+	    offp = &offsets[msgno-1];
+	}
+	else {
+	    rec = expunge_index_base + mailbox->start_offset +
+		(msgno - snap_exists - 1) * mailbox->record_size;
+	    offp = &eoffsets[msgno - snap_exists - 1];
+	}
+
+	n = compact_copy_cache(mailbox, rec, newcache, offp);
+	if (!n) {
+	    syslog(LOG_ERR, "IOERROR: bad cache record %lu in %s",
+		   msgno, mailbox->name);
+	    r = IMAP_IOERROR;
+	    goto done;
+	}
+	copied += n;
+
+	/* Stay within our I/O budget */
+	while (iolimit && copied > iolimit * (time(NULL) - start + 1)) {
+	    fflush(newcache);
+	    sleep(1);
+	}
+    }
+
+    /* Lock the mailbox and catch up with what happened meanwhile */
+    r = mailbox_lock_header(mailbox);
+    if (!r) {
+	r = mailbox_lock_index(mailbox);
+	if (r) mailbox_unlock_header(mailbox);
+    }
+    if (r) goto done;
+
+    if (mailbox->index_ino != snap_ino || mailbox->exists < snap_exists) {
+	/* Expunged or reconstructed under us; try again later */
+	r = IMAP_AGAIN;
+	goto unlock;
+    }
+
+    if (fstat(mailbox->cache_fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstating cache for %s: %m", mailbox->name);
+	fatal("can't fstat cache file", EC_OSFILE);
+    }
+    mailbox->cache_size = sbuf.st_size;
+    map_refresh(mailbox->cache_fd, 0, &mailbox->cache_base,
+		&mailbox->cache_len, mailbox->cache_size,
+		"cache", mailbox->name);
+
+    exists = mailbox->exists;
+    if (exists > snap_exists) {
+	offsets = (unsigned long *)
+	    xrealloc(offsets, (exists + 1) * sizeof(unsigned long));
+    }
+    for (msgno = snap_exists + 1; msgno <= exists; msgno++) {
+	if (!compact_copy_cache(mailbox,
+				mailbox->index_base + mailbox->start_offset +
+				(msgno - 1) * mailbox->record_size,
+				newcache, &offsets[msgno-1])) {
+	    syslog(LOG_ERR, "IOERROR: bad cache record %lu in %s",
+		   msgno, mailbox->name);
+	    r = IMAP_IOERROR;
+	    goto unlock;
+	}
+    }
+
+    /* Write the new index and expunge index */
+    strlcpy(fnamebufnew, indexfname, sizeof(fnamebufnew));
+    strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+    newindex = fopen(fnamebufnew, "w+");
+    if (!newindex) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", fnamebufnew);
+	r = IMAP_IOERROR;
+	goto unlock;
+    }
+    compact_write_index(mailbox, newindex, mailbox->index_base, exists,
+			offsets, generation);
+
+    if (expunge_index_base) {
+	strlcpy(fnamebufnew, expungefname, sizeof(fnamebufnew));
+	strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+	newexpungeindex = fopen(fnamebufnew, "w+");
+	if (!newexpungeindex) {
+	    syslog(LOG_ERR, "IOERROR: creating %s: %m", fnamebufnew);
+	    r = IMAP_IOERROR;
+	    goto unlock;
+	}
+	compact_write_index(mailbox, newexpungeindex, expunge_index_base,
+			    expunge_exists, eoffsets, generation);
+    }
+
+    /* Ensure everything made it to disk */
+    fflush(newindex);
+    fflush(newcache);
+    if (newexpungeindex) fflush(newexpungeindex);
+    if (ferror(newindex) || fsync(fileno(newindex)) ||
+	ferror(newcache) || fsync(fileno(newcache)) ||
+	(newexpungeindex &&
+	 (ferror(newexpungeindex) || fsync(fileno(newexpungeindex))))) {
+	syslog(LOG_ERR, "IOERROR: writing index/cache/expunge for %s: %m",
+	       mailbox->name);
+	r = IMAP_IOERROR;
+	goto unlock;
+    }
+
+    /* Rename our files into place */
+    strlcpy(fnamebufnew, indexfname, sizeof(fnamebufnew));
+    strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+    if (rename(fnamebufnew, indexfname)) {
+	syslog(LOG_ERR, "IOERROR: renaming index file for %s: %m",
+	       mailbox->name);
+	r = IMAP_IOERROR;
+	goto unlock;
+    }
+
+    strlcpy(fnamebufnew, cachefname, sizeof(fnamebufnew));
+    strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+    if (rename(fnamebufnew, cachefname)) {
+	syslog(LOG_CRIT,
+	       "CRITICAL IOERROR: renaming cache file for %s, need to reconstruct: %m",
+	       mailbox->name);
+	r = IMAP_IOERROR;
+    }
+
+    if (newexpungeindex) {
+	strlcpy(fnamebufnew, expungefname, sizeof(fnamebufnew));
+	strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+	if (rename(fnamebufnew, expungefname)) {
+	    syslog(LOG_CRIT,
+		   "CRITICAL IOERROR: renaming expunge index for %s, need to reconstruct: %m",
+		   mailbox->name);
+	    r = IMAP_IOERROR;
+	}
+    }
+
+    if (!r) {
+	syslog(LOG_NOTICE, "Compacted cache of %s: %lu leaked records removed",
+	       mailbox->name, mailbox->leaked_cache_records);
+	if (updatenotifier) updatenotifier(mailbox);
+    }
+
+ unlock:
+    mailbox_unlock_index(mailbox);
+    mailbox_unlock_header(mailbox);
+
+ done:
+    if (r) {
+	/* Clean up after ourselves */
+	strlcpy(fnamebufnew, cachefname, sizeof(fnamebufnew));
+	strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+	if (newcache) unlink(fnamebufnew);
+	strlcpy(fnamebufnew, indexfname, sizeof(fnamebufnew));
+	strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+	if (newindex) unlink(fnamebufnew);
+	strlcpy(fnamebufnew, expungefname, sizeof(fnamebufnew));
+	strlcat(fnamebufnew, ".NEW", sizeof(fnamebufnew));
+	if (newexpungeindex) unlink(fnamebufnew);
+    }
+    if (newindex) fclose(newindex);
+    if (newcache) fclose(newcache);
+    if (newexpungeindex) fclose(newexpungeindex);
+    if (expunge_index_base) map_free(&expunge_index_base, &expunge_index_len);
+    if (expunge_fd != -1) close(expunge_fd);
+    if (offsets) free(offsets);
+    if (eoffsets) free(eoffsets);
+
+    return r;
+}
+
 int mailbox_create(const char *name,
 		   char *partition,
 		   const char *acl,
@@ -86,13 +86,17 @@ typedef unsigned long int modseq_t;
 #define MAILBOX_FORMAT_NORMAL	0
 #define MAILBOX_FORMAT_NETNEWS	1
 
-#define MAILBOX_MINOR_VERSION	9
-#define MAILBOX_CACHE_MINOR_VERSION 2
+#define MAILBOX_MINOR_VERSION	10
+#define MAILBOX_CACHE_MINOR_VERSION 3
+
+/* Cache records of this version and later begin with a field directory */
+#define MAILBOX_CACHE_DIR_VERSION 3
 
 #define FNAME_HEADER "/cyrus.header"
 #define FNAME_INDEX "/cyrus.index"
 #define FNAME_CACHE "/cyrus.cache"
 #define FNAME_SQUAT_INDEX "/cyrus.squat"
+#define FNAME_HEADER_INDEX "/cyrus.hindex"
 #define FNAME_EXPUNGE_INDEX "/cyrus.expunge"
 
 #define MAILBOX_FNAME_LEN 256
@@ -248,6 +252,28 @@ struct index_record {
 /* Number of fields in an individual message's cache record */
 #define NUM_CACHE_FIELDS 10
 
+/* Cache record fields, in the order they are stored */
+enum {
+    CACHE_ENVELOPE = 0,
+    CACHE_BODYSTRUCTURE,
+    CACHE_BODY,
+    CACHE_SECTION,
+    CACHE_HEADERS,
+    CACHE_FROM,
+    CACHE_TO,
+    CACHE_CC,
+    CACHE_BCC,
+    CACHE_SUBJECT
+};
+
+/*
+ * The field directory is stored as an ordinary cache item ahead of the
+ * fields: NUM_CACHE_FIELDS+1 bit32 offsets from the start of the cache
+ * record, the last one being the size of the whole record.
+ */
+#define CACHE_DIR_LEN ((NUM_CACHE_FIELDS+1) * sizeof(bit32))
+#define CACHE_DIR_SIZE (sizeof(bit32) + CACHE_DIR_LEN)
+
 #define FLAG_ANSWERED (1<<0)
 #define FLAG_FLAGGED (1<<1)
 #define FLAG_DELETED (1<<2)
@@ -257,25 +283,24 @@ struct index_record {
 #define OPT_IMAP_CONDSTORE (1<<1)	/* added for CONDSTORE extension */
 
 
-struct mailbox_header_cache {
-    const char *name; /* Name of header */
-    bit32 min_cache_version; /* Cache version it appeared in */
-};
-
 #define MAX_CACHED_HEADER_SIZE 32 /* Max size of a cached header name */
-extern const struct mailbox_header_cache mailbox_cache_headers[];
-extern const int MAILBOX_NUM_CACHE_HEADERS;
 
 /* Bitmasks for expunging */
 enum {
     EXPUNGE_FORCE =		(1<<0),
-    EXPUNGE_CLEANUP =		(1<<1)
+    EXPUNGE_CLEANUP =		(1<<1),
+    EXPUNGE_KEEPCACHE =		(1<<2)	/* leave cache to mailbox_compact() */
 };
 
+struct hdrhash_entry;
 int mailbox_cached_header(const char *s);
 int mailbox_cached_header_inline(const char *text);
+int mailbox_cached_hdrhash(const struct hdrhash_entry *h,
+			   const char *hdr, int len);
 
 unsigned long mailbox_cache_size(struct mailbox *mailbox, unsigned msgno);
+const char *mailbox_cache_walk(const char *cacherec, int field);
+unsigned long mailbox_cache_count_old(struct mailbox *mailbox);
 
 typedef int mailbox_decideproc_t(struct mailbox *mailbox, void *rock,
 				 char *indexbuf, int expunge_flags);
@@ -300,6 +325,7 @@ extern int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
 extern void mailbox_unmap_message(struct mailbox *mailbox,
 				  unsigned long uid,
 				  const char **basep, unsigned long *lenp);
+extern int mailbox_open_message(struct mailbox *mailbox, unsigned long uid);
 
 extern void mailbox_reconstructmode(void);
 
@@ -353,6 +379,7 @@ extern int mailbox_append_index(struct mailbox *mailbox,
 extern int mailbox_expunge(struct mailbox *mailbox,
 			   mailbox_decideproc_t *decideproc, void *deciderock,
 			   int flags);
+extern int mailbox_compact(struct mailbox *mailbox, unsigned long iolimit);
 extern int mailbox_cleanup(struct mailbox *mailbox, int iscurrentdir,
 			   mailbox_decideproc_t *decideproc, void *deciderock);
 
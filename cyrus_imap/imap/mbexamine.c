@@ -339,7 +339,8 @@ int do_examine(char *name,
 	}
 	printf("\n");
 
-	cacheitem = mailbox.cache_base + CACHE_OFFSET(i);
+	cacheitem = CACHE_ITEM(mailbox.cache_base + CACHE_OFFSET(i),
+			       CACHE_VERSION(i), CACHE_ENVELOPE);
 	
 	printf(" Envel>{%d}%s\n", CACHE_ITEM_LEN(cacheitem),
 	       cacheitem + CACHE_ITEM_SIZE_SKIP);
@@ -73,6 +73,7 @@
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
 #include "global.h"
+#include "hdrhash.h"
 #include "retry.h"
 
 /* Message being parsed */
@@ -610,6 +611,7 @@ struct index_record *message_index;
     message_index->content_offset = body.content_offset;
 
     message_index->cache_offset = lseek(cache_fd, 0, SEEK_CUR);
+    message_index->cache_version = MAILBOX_CACHE_MINOR_VERSION;
     n = message_write_cache(cache_fd, &body);
     message_free_body(&body);
 
@@ -705,8 +707,9 @@ struct boundary *boundaries;
 {
     static int alloced = 0;
     static char *headers;
-    int left, len;
-    char *next;
+    int left, len, namelen;
+    char *next, *line, *eol, *colon, *end;
+    const struct hdrhash_entry *hdr;
     int sawboundary = 0;
 
     body->header_offset = msg->offset;
@@ -758,148 +761,126 @@ struct boundary *boundaries;
     body->content_offset = msg->offset;
     body->header_size = strlen(headers+1);
 
-    /* Scan over the slurped-up headers for interesting header information */
+    /* Scan over the slurped-up headers for interesting header information:
+     * find each line and the colon ending its name with memchr() and look
+     * the name up in the header hash, rather than comparing byte by byte */
     body->header_lines = -1;	/* Correct for leading newline */
-    for (next = headers; *next; next++) {
-	if (*next == '\n') {
-	    body->header_lines++;
-
-	    /* Check for headers in generic cache */
-	    if (body->cacheheaders.start &&
-		(next[1] != ' ') && (next[1] != '\t') &&
-		mailbox_cached_header_inline(next+1) != BIT32_MAX) {
-		    message_parse_header(next+1, &body->cacheheaders);
-	    }
+    end = headers + 1 + body->header_size;
+    for (next = headers; next; next = eol) {
+	body->header_lines++;
+	line = next + 1;
+	eol = memchr(line, '\n', end - line);
+
+	/* continuation lines don't start a header */
+	if (*line == ' ' || *line == '\t') continue;
+
+	colon = memchr(line, ':', (eol ? eol : end) - line);
+	if (!colon) continue;
+	namelen = colon - line;
+	if (memchr(line, '\r', namelen)) continue;
+
+	hdr = hdrhash_lookup(line, namelen);
+
+	/* Check for headers in generic cache */
+	if (body->cacheheaders.start &&
+	    mailbox_cached_hdrhash(hdr, line, namelen) != BIT32_MAX) {
+	    message_parse_header(line, &body->cacheheaders);
+	}
 
-	    switch (next[1]) {
-	    case 'b':
-	    case 'B':
-		if (!strncasecmp(next+2, "cc:", 3)) {
-		    message_parse_address(next+5, &body->bcc);
-		}
-		break;
-		
-	    case 'c':
-	    case 'C':
-		if (!strncasecmp(next+2, "c:", 2)) {
-		    message_parse_address(next+4, &body->cc);
-		}
-		if (!strncasecmp(next+2, "ontent-", 7)) {
-		    switch (next[9]) {
-		    case 'd':
-		    case 'D':
-			if (!strncasecmp(next+10, "escription:", 11)) {
-			    message_parse_string(next+21, &body->description);
-			}
-			else if (!strncasecmp(next+10, "isposition:", 11)) {
-			    message_parse_disposition(next+21, body);
-			}
-			break;
+#ifdef APPLE_OS_X_SERVER
+	/* a prefix match, so this also takes Received-SPF: and friends,
+	 * whichever comes first */
+	if (!body->received && namelen >= 8 &&
+	    !strncasecmp(line, "Received", 8)) {
+	    message_parse_string(line+8, &body->received);
+	}
+#endif
 
-		    case 'i':
-		    case 'I':
-			if (!strncasecmp(next+10, "d:", 2)) {
-			    message_parse_string(next+12, &body->id);
-			}
-			break;
+	if (!hdr) continue;
 
-		    case 'l':
-		    case 'L':
-			if (!strncasecmp(next+10, "anguage:", 8)) {
-			    message_parse_language(next+18, &body->language);
-			}
-			break;
+	switch (hdr->id) {
+	case HDR_BCC:
+	    message_parse_address(colon+1, &body->bcc);
+	    break;
 
-		    case 'm':
-		    case 'M':
-			if (!strncasecmp(next+10, "d5:", 3)) {
-			    message_parse_string(next+13, &body->md5);
-			}
-			break;
+	case HDR_CC:
+	    message_parse_address(colon+1, &body->cc);
+	    break;
 
-		    case 't':
-		    case 'T':
-			if (!strncasecmp(next+10, "ransfer-encoding:", 17)) {
-			    message_parse_encoding(next+27, &body->encoding);
-
-			    /* If we're encoding binary, replace "binary"
-			       with "base64" in CTE header body */
-			    if (msg->encode &&
-				!strcmp(body->encoding, "BINARY")) {
-				char *p = (char*)
-				    stristr(msg->base + body->header_offset +
-					    (next - headers) + 27,
-					    "binary");
-				memcpy(p, "base64", 6);
-			    }
-			}
-			else if (!strncasecmp(next+10, "ype:", 4)) {
-			    message_parse_type(next+14, body);
-			}
-			break;
-		    }
-		}
-		break;
+	case HDR_CONTENT_DESCRIPTION:
+	    message_parse_string(colon+1, &body->description);
+	    break;
 
-	    case 'd':
-	    case 'D':
-		if (!strncasecmp(next+2, "ate:", 4)) {
-		    message_parse_string(next+6, &body->date);
-		}
-		break;
+	case HDR_CONTENT_DISPOSITION:
+	    message_parse_disposition(colon+1, body);
+	    break;
 
-	    case 'f':
-	    case 'F':
-		if (!strncasecmp(next+2, "rom:", 4)) {
-		    message_parse_address(next+6, &body->from);
-		}
-		break;
+	case HDR_CONTENT_ID:
+	    message_parse_string(colon+1, &body->id);
+	    break;
 
-	    case 'i':
-	    case 'I':
-		if (!strncasecmp(next+2, "n-reply-to:", 11)) {
-		    message_parse_string(next+13, &body->in_reply_to);
-		}
-		break;
+	case HDR_CONTENT_LANGUAGE:
+	    message_parse_language(colon+1, &body->language);
+	    break;
 
-	    case 'm':
-	    case 'M':
-		if (!strncasecmp(next+2, "essage-id:", 10)) {
-		    message_parse_string(next+12, &body->message_id);
-		}
-		break;
+	case HDR_CONTENT_MD5:
+	    message_parse_string(colon+1, &body->md5);
+	    break;
 
-	    case 'r':
-	    case 'R':
-		if (!strncasecmp(next+2, "eply-to:", 8)) {
-		    message_parse_address(next+10, &body->reply_to);
-		}
-#ifdef APPLE_OS_X_SERVER
-		else if (!strncasecmp(next+2, "eceived", 7)&&(!body->received)) {
-		    message_parse_string(next+9, &body->received);
-		}
-#endif
+	case HDR_CONTENT_TRANSFER_ENCODING:
+	    message_parse_encoding(colon+1, &body->encoding);
+
+	    /* If we're encoding binary, replace "binary"
+	       with "base64" in CTE header body */
+	    if (msg->encode &&
+		!strcmp(body->encoding, "BINARY")) {
+		char *p = (char*)
+		    stristr(msg->base + body->header_offset +
+			    (colon - headers),
+			    "binary");
+		memcpy(p, "base64", 6);
+	    }
+	    break;
 
-		break;
+	case HDR_CONTENT_TYPE:
+	    message_parse_type(colon+1, body);
+	    break;
 
-	    case 's':
-	    case 'S':
-		if (!strncasecmp(next+2, "ubject:", 7)) {
-		    message_parse_string(next+9, &body->subject);
-		}
-		if (!strncasecmp(next+2, "ender:", 6)) {
-		    message_parse_address(next+8, &body->sender);
-		}
-		break;
+	case HDR_DATE:
+	    message_parse_string(colon+1, &body->date);
+	    break;
 
-	    case 't':
-	    case 'T':
-		if (!strncasecmp(next+2, "o:", 2)) {
-		    message_parse_address(next+4, &body->to);
-		}
-		break;
-	    } /* switch(next[1]) */
-	} /* if (*next == '\n') */
+	case HDR_FROM:
+	    message_parse_address(colon+1, &body->from);
+	    break;
+
+	case HDR_IN_REPLY_TO:
+	    message_parse_string(colon+1, &body->in_reply_to);
+	    break;
+
+	case HDR_MESSAGE_ID:
+	    message_parse_string(colon+1, &body->message_id);
+	    break;
+
+	case HDR_REPLY_TO:
+	    message_parse_address(colon+1, &body->reply_to);
+	    break;
+
+	case HDR_SUBJECT:
+	    message_parse_string(colon+1, &body->subject);
+	    break;
+
+	case HDR_SENDER:
+	    message_parse_address(colon+1, &body->sender);
+	    break;
+
+	case HDR_TO:
+	    message_parse_address(colon+1, &body->to);
+	    break;
+
+	default:
+	    break;
+	} /* switch (hdr->id) */
     }
 
     /* If didn't find Content-Type: header, use the passed-in default type */
@@ -1952,18 +1933,24 @@ char *s;
 unsigned n;
 struct msg *msg;
 {
-    char *rval = s;
+    const char *p, *nl;
+    unsigned len;
 
     if (n == 0) return 0;
     n--;			/* Allow for terminating nul */
 
-    while (msg->offset < msg->len && n--) {
-	if ((*s++ = msg->base[msg->offset++]) == '\n') break;
-    }
-    *s = '\0';
+    /* copy up to and including the next newline, if it fits */
+    p = msg->base + msg->offset;
+    len = (msg->offset < msg->len) ? msg->len - msg->offset : 0;
+    if (len > n) len = n;
+    if ((nl = memchr(p, '\n', len)) != NULL) len = nl - p + 1;
+
+    memcpy(s, p, len);
+    s[len] = '\0';
+    msg->offset += len;
 
-    if (s == rval) return 0;
-    return rval;
+    if (len == 0) return 0;
+    return s;
 }
 
 
@@ -2015,8 +2002,10 @@ struct body *body;
     struct ibuf section, envelope, bodystructure, oldbody;
     struct ibuf from, to, cc, bcc, subject;
     struct body toplevel;
-    int n;
+    int n, i;
     struct iovec iov[15];
+    bit32 dir[1 + NUM_CACHE_FIELDS + 1];
+    unsigned long offset;
     char* t;
 
     toplevel.type = "MESSAGE";
@@ -2052,18 +2041,29 @@ struct body *body;
     message_write_nstring(&subject, t);
     free(t);
 
-    message_ibuf_iov(&iov[0], &envelope);
-    message_ibuf_iov(&iov[1], &bodystructure);
-    message_ibuf_iov(&iov[2], &oldbody);
-    message_ibuf_iov(&iov[3], &section);
-    message_ibuf_iov(&iov[4], &body->cacheheaders);
-    message_ibuf_iov(&iov[5], &from);
-    message_ibuf_iov(&iov[6], &to);
-    message_ibuf_iov(&iov[7], &cc);
-    message_ibuf_iov(&iov[8], &bcc);
-    message_ibuf_iov(&iov[9], &subject);
-
-    n = retry_writev(outfd, iov, 10);
+    message_ibuf_iov(&iov[1+CACHE_ENVELOPE], &envelope);
+    message_ibuf_iov(&iov[1+CACHE_BODYSTRUCTURE], &bodystructure);
+    message_ibuf_iov(&iov[1+CACHE_BODY], &oldbody);
+    message_ibuf_iov(&iov[1+CACHE_SECTION], &section);
+    message_ibuf_iov(&iov[1+CACHE_HEADERS], &body->cacheheaders);
+    message_ibuf_iov(&iov[1+CACHE_FROM], &from);
+    message_ibuf_iov(&iov[1+CACHE_TO], &to);
+    message_ibuf_iov(&iov[1+CACHE_CC], &cc);
+    message_ibuf_iov(&iov[1+CACHE_BCC], &bcc);
+    message_ibuf_iov(&iov[1+CACHE_SUBJECT], &subject);
+
+    /* Field directory goes first, so readers can jump straight to a field */
+    dir[0] = htonl(CACHE_DIR_LEN);
+    offset = CACHE_DIR_SIZE;
+    for (i = 0; i < NUM_CACHE_FIELDS; i++) {
+	dir[1+i] = htonl(offset);
+	offset += iov[1+i].iov_len;
+    }
+    dir[1+NUM_CACHE_FIELDS] = htonl(offset);
+    iov[0].iov_base = (char *)dir;
+    iov[0].iov_len = CACHE_DIR_SIZE;
+
+    n = retry_writev(outfd, iov, 1+NUM_CACHE_FIELDS);
 
     message_ibuf_free(&envelope);
     message_ibuf_free(&bodystructure);
@@ -0,0 +1,187 @@
+/* msgparsebench.c -- measure message parsing throughput
+ * $Id$
+ *
+ * Copyright (c) 1998-2005 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+
+/*
+ * usage: msgparsebench [-C <alt_config>] [-n iterations] [-o cachefile]
+ *                      file...
+ *
+ * Each file is one RFC 822 message, as found in a mailbox partition.
+ * Every message is run through message_parse_mapped_async() -- the
+ * parse done for each delivery and reconstruct -- the given number of
+ * times, and the rate at which messages and bytes go through it is
+ * reported.  With -o, the cyrus.cache records of the first pass are
+ * written to cachefile, so that the output of two builds can be
+ * compared.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "exitcodes.h"
+#include "global.h"
+#include "mailbox.h"
+#include "map.h"
+#include "message.h"
+#include "xmalloc.h"
+
+extern int optind;
+extern char *optarg;
+
+/* config.c stuff */
+const int config_need_data = 0;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: msgparsebench [-C <alt_config>] "
+	    "[-n iterations] [-o cachefile] file...\n");
+    exit(EC_USAGE);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, j, nfiles, iterations = 100;
+    char *alt_config = NULL, *cachefile = NULL;
+    const char **base;
+    unsigned long *len, total = 0;
+    struct index_record record;
+    int fd, nullfd, cachefd;
+    struct stat sbuf;
+    double start, elapsed;
+
+    while ((opt = getopt(argc, argv, "C:n:o:")) != EOF) {
+	switch (opt) {
+	case 'C': /* alt config file */
+	    alt_config = optarg;
+	    break;
+
+	case 'n':
+	    iterations = atoi(optarg);
+	    if (iterations < 1) usage();
+	    break;
+
+	case 'o':
+	    cachefile = optarg;
+	    break;
+
+	default:
+	    usage();
+	}
+    }
+    if (optind == argc) usage();
+
+    cyrus_init(alt_config, "msgparsebench", 0);
+
+    nfiles = argc - optind;
+    base = (const char **) xzmalloc(nfiles * sizeof(const char *));
+    len = (unsigned long *) xzmalloc(nfiles * sizeof(unsigned long));
+    for (i = 0; i < nfiles; i++) {
+	fd = open(argv[optind + i], O_RDONLY);
+	if (fd == -1 || fstat(fd, &sbuf) == -1) {
+	    perror(argv[optind + i]);
+	    exit(EC_NOINPUT);
+	}
+	map_refresh(fd, 1, &base[i], &len[i], sbuf.st_size,
+		    argv[optind + i], NULL);
+	close(fd);
+	total += len[i];
+    }
+
+    nullfd = open("/dev/null", O_WRONLY);
+    if (nullfd == -1) {
+	perror("/dev/null");
+	exit(EC_OSFILE);
+    }
+    cachefd = nullfd;
+    if (cachefile) {
+	cachefd = open(cachefile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cachefd == -1) {
+	    perror(cachefile);
+	    exit(EC_CANTCREAT);
+	}
+    }
+
+    start = now();
+    for (j = 0; j < iterations; j++) {
+	for (i = 0; i < nfiles; i++) {
+	    memset(&record, 0, sizeof(record));
+	    if (message_parse_mapped_async(base[i], len[i],
+					   MAILBOX_FORMAT_NORMAL,
+					   cachefd, &record)) {
+		fprintf(stderr, "%s: parse failed\n", argv[optind + i]);
+		exit(EC_SOFTWARE);
+	    }
+	}
+	cachefd = nullfd;
+    }
+    elapsed = now() - start;
+
+    printf("%d messages, %lu bytes, %d iterations\n",
+	   nfiles, total, iterations);
+    printf("parse: %.3f s, %.0f msgs/s, %.1f MB/s\n", elapsed,
+	   elapsed > 0 ? nfiles * (double) iterations / elapsed : 0.0,
+	   elapsed > 0 ?
+	   total * (double) iterations / elapsed / 1048576 : 0.0);
+
+    for (i = 0; i < nfiles; i++) {
+	map_free(&base[i], &len[i]);
+    }
+    cyrus_done();
+
+    return 0;
+}
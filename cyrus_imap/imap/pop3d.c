@@ -109,6 +109,8 @@ enum {
 struct notify_message {
     int message;
     pid_t service_pid;
+    int backlog;
+    unsigned int wait;
 	time_t	p_start_time;
 	char p_user_buf[64+1];
 	char p_host_buf[64+1];
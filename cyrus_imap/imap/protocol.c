@@ -177,6 +177,7 @@ struct protocol_t protocol[] = {
       { NULL, "* OK", NULL,
 	{ { "* SASL ", CAPA_AUTH },
 	  { "* STARTTLS", CAPA_STARTTLS },
+	  { "* COMPRESS DEFLATE", CAPA_COMPRESS },
 	  { NULL, 0 } } },
       { "STARTTLS", "OK", "NO" },
       { "AUTHENTICATE", INT_MAX, 0, "OK", "NO", "+ ", "*", NULL },
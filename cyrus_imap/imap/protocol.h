@@ -60,7 +60,10 @@ enum {
 
     /* LMTP capabilities */
     CAPA_PIPELINING	= (1 << 2),
-    CAPA_IGNOREQUOTA	= (1 << 3)
+    CAPA_IGNOREQUOTA	= (1 << 3),
+
+    /* CSYNC capabilities */
+    CAPA_COMPRESS	= (1 << 2)
 };
 
 #define MAX_CAPA 7
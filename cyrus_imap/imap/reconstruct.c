@@ -101,6 +101,7 @@
 #include "convert_code.h"
 #include "util.h"
 #include "sync_log.h"
+#include "headerindex.h"
 
 #ifdef APPLE_OS_X_SERVER
 #include "AppleOD.h"
@@ -955,6 +956,7 @@ int reconstruct(char *name, struct discovered *found)
     struct index_record message_index, old_index;
     static struct index_record zero_index;
     struct body *body = NULL;
+    struct headerindex_txn *hindex = NULL;
 
 #ifdef APPLE_OS_X_SERVER
     FILE *flagsfile;
@@ -1280,6 +1282,7 @@ int reconstruct(char *name, struct discovered *found)
 	}	
 	if (((r = message_parse_file(msgfile, NULL, NULL, &body)) != 0) ||
 	    ((r = message_create_record(&mailbox, &message_index, body)) != 0)) {
+	    headerindex_abort(&hindex);
 	    fclose(msgfile);
 	    fclose(newindex);
 	    mailbox_close(&mailbox);
@@ -1298,6 +1301,7 @@ int reconstruct(char *name, struct discovered *found)
 
 	n = fwrite(buf, 1, INDEX_RECORD_SIZE, newindex);
 	if (n != INDEX_RECORD_SIZE) {
+	    headerindex_abort(&hindex);
 	    fclose(newindex);
 	    mailbox_close(&mailbox);
 	    free(uid);
@@ -1306,6 +1310,8 @@ int reconstruct(char *name, struct discovered *found)
 		}
 	    return IMAP_IOERROR;
 	}
+	headerindex_addmsgfile(&hindex, &mailbox, message_index.uid,
+			       message_index.header_size);
 	new_exists++;
 	if (message_index.system_flags & FLAG_ANSWERED) new_answered++;
 	if (message_index.system_flags & FLAG_FLAGGED) new_flagged++;
@@ -1374,6 +1380,7 @@ int reconstruct(char *name, struct discovered *found)
     fflush(newindex);
     if (n != INDEX_HEADER_SIZE || ferror(newindex) 
 	|| fsync(fileno(newindex)) || fsync(newcache_fd)) {
+	headerindex_abort(&hindex);
 	fclose(newindex);
 	mailbox_close(&mailbox);
 	return IMAP_IOERROR;
@@ -1405,6 +1412,7 @@ int reconstruct(char *name, struct discovered *found)
     /* Write header */
     r = mailbox_write_header(&mailbox);
     if (r) {
+	headerindex_abort(&hindex);
 	mailbox_close(&mailbox);
 	return r;
     }
@@ -1419,6 +1427,7 @@ int reconstruct(char *name, struct discovered *found)
     strlcpy(newfnamebuf, fnamebuf, sizeof(newfnamebuf));
     strlcat(newfnamebuf, ".NEW", sizeof(fnamebuf));
     if (rename(newfnamebuf, fnamebuf)) {
+	headerindex_abort(&hindex);
 	fclose(newindex);
 	mailbox_close(&mailbox);
 	return IMAP_IOERROR;
@@ -1432,12 +1441,17 @@ int reconstruct(char *name, struct discovered *found)
     strlcpy(newfnamebuf, fnamebuf, sizeof(newfnamebuf));
     strlcat(newfnamebuf, ".NEW", sizeof(newfnamebuf));
     if (rename(newfnamebuf, fnamebuf)) {
+	headerindex_abort(&hindex);
 	fclose(newindex);
 	mailbox_close(&mailbox);
 	return IMAP_IOERROR;
     }
     
     fclose(newindex);
+
+    /* Rebuild the header index from every message we just read */
+    headerindex_rebuild(&mailbox, &hindex);
+
     r = seen_reconstruct(&mailbox, (time_t)0, (time_t)0, (int (*)())0, (void *)0);
     if (syncflag) {
 	sync_log_mailbox(mailbox.name);
@@ -61,17 +61,20 @@
 
 #include "squat.h"
 
+/* What we know about the documents in a SQUAT index. Document IDs
+   are positions in the index's document list. */
 typedef struct {
-  unsigned char* vector;
   struct mailbox* mailbox;
-  char const* part_types;
+  int num_docs;
+  int docs_size;          /* The allocated size of the arrays below */
+  char* doc_parts;        /* doc_parts[i] is the part type of document i */
+  int* doc_msgnos;        /* doc_msgnos[i] is the message number of
+                             document i, or 0 if it isn't a message */
+  SquatDocSet* indexed;   /* the messages with any indexed part;
+                             these are all SQUAT can tell us about */
   int found_validity;
 } SquatSearchResult;
 
-static int vector_len() {
-  return (imapd_exists >> 3) + 1;
-}
-
 /* The document name is of the form
 
    pnnn.vvv
@@ -81,12 +84,12 @@ static int vector_len() {
    is the UID validity value.
 
    This function parses the document name and returns the message
-   UID only if the name has the right part type and it corresponds
-   to a real message UID.
+   sequence number only if the name has a known part type and
+   corresponds to a real message UID.
 */
 static int parse_doc_name(SquatSearchResult* r, char const* doc_name) {
   int ch = doc_name[0];
-  char const* t = r->part_types;
+  char const* t = "tfcbsmh";
   int doc_UID, index;
 
   if (ch == 'v' && strncmp(doc_name, "validity.", 9) == 0) {
@@ -96,8 +99,7 @@ static int parse_doc_name(SquatSearchResult* r, char const* doc_name) {
     return -1;
   }
 
-  /* make sure that the document part type is one of the ones we're
-     accepting */
+  /* make sure that the document part type is one of the ones we know */
   while (*t != 0 && *t != ch) {
     t++;
   }
@@ -122,125 +124,155 @@ static int parse_doc_name(SquatSearchResult* r, char const* doc_name) {
   return index;
 }
 
-static int drop_indexed_docs(void* closure, SquatListDoc const* doc) {
+static int record_indexed_doc(void* closure, SquatListDoc const* doc) {
   SquatSearchResult* r = (SquatSearchResult*)closure;
-  int doc_ID = parse_doc_name(r, doc->doc_name);
+  int msgno = parse_doc_name(r, doc->doc_name);
 
-  if (doc_ID >= 0) {
-    unsigned char* vect = r->vector;
-    vect[doc_ID >> 3] &= ~(1 << (doc_ID & 0x7));
+  if (r->num_docs >= r->docs_size) {
+    r->docs_size = r->docs_size ? 2*r->docs_size : 1024;
+    r->doc_parts = xrealloc(r->doc_parts, r->docs_size);
+    r->doc_msgnos = xrealloc(r->doc_msgnos, r->docs_size*sizeof(int));
   }
-  return SQUAT_CALLBACK_CONTINUE;
-}
-
-static int fill_with_hits(void* closure, char const* doc) {
-  SquatSearchResult* r = (SquatSearchResult*)closure;
-  int doc_ID = parse_doc_name(r, doc);
 
-  if (doc_ID >= 0) {
-    unsigned char* vect = r->vector;
-    vect[doc_ID >> 3] |= 1 << (doc_ID & 0x7);
+  if (msgno > 0) {
+    r->doc_parts[r->num_docs] = doc->doc_name[0];
+    r->doc_msgnos[r->num_docs] = msgno;
+    squat_docset_add(r->indexed, msgno);
+  } else {
+    r->doc_parts[r->num_docs] = 0;
+    r->doc_msgnos[r->num_docs] = 0;
   }
+  r->num_docs++;
+
   return SQUAT_CALLBACK_CONTINUE;
 }
 
-static int search_strlist(SquatSearchIndex* index, struct mailbox* mailbox,
-  unsigned char* output, unsigned char* tmp, struct strlist* strs,
-  char const* part_types) {
-  SquatSearchResult r;
-  int i;
-  int len = vector_len();
-
-  r.part_types = part_types;
-  r.vector = tmp;
-  r.mailbox = mailbox;
+/* Intersect 'output' with the messages which may contain every string
+   in 'strs' in one of the parts in 'part_types'. */
+static int search_strlist(SquatSearchIndex* index, SquatSearchResult* r,
+  SquatDocSet* output, struct strlist* strs, char const* part_types) {
   while (strs != NULL) {
     char const* s = strs->s;
+    SquatDocSet* docs = squat_docset_new();
+    SquatDocSet* msgs;
+    int doc;
 
-    memset(tmp, 0, len);
-    if (squat_search_execute(index, s, strlen(s), fill_with_hits, &r)
-        != SQUAT_OK) {
+    if (squat_search_execute_docs(index, s, strlen(s), docs) != SQUAT_OK) {
       syslog(LOG_DEBUG, "SQUAT string list search failed on string %s "
              "with part types %s", s, part_types);
+      squat_docset_free(docs);
       return 0;
     }
-    for (i = 0; i < len; i++) {
-      output[i] &= tmp[i];
+
+    /* map matching documents to their messages */
+    msgs = squat_docset_new();
+    for (doc = squat_docset_next(docs, -1); doc >= 0;
+         doc = squat_docset_next(docs, doc)) {
+      if (doc < r->num_docs && r->doc_msgnos[doc] > 0
+          && strchr(part_types, r->doc_parts[doc]) != NULL) {
+        squat_docset_add(msgs, r->doc_msgnos[doc]);
+      }
     }
+    squat_docset_and(output, msgs);
+
+    squat_docset_free(msgs);
+    squat_docset_free(docs);
 
     strs = strs->next;
   }
   return 1;
 }
 
-static unsigned char* search_squat_do_query(SquatSearchIndex* index,
-  struct mailbox* mailbox, struct searchargs* args) {
-  int vlen = vector_len();
-  unsigned char* vect = xmalloc(vlen);
-  unsigned char* t_vect = xmalloc(vlen);
-  unsigned char* result = vect;
+/* Does 'args' have any criteria of its own, apart from its sublists? */
+static int has_criteria(struct searchargs* args) {
+  int i;
+
+  if (args->flags || args->smaller || args->larger
+      || args->before || args->after
+      || args->sentbefore || args->sentafter
+      || args->system_flags_set || args->system_flags_unset
+      || args->sequence || args->uidsequence
+      || args->from || args->to || args->cc || args->bcc
+      || args->subject || args->messageid || args->body || args->text
+      || args->header_name || args->header || args->modseq) {
+    return 1;
+  }
+  for (i = 0; i < MAX_USER_FLAGS/32; i++) {
+    if (args->user_flags_set[i] || args->user_flags_unset[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Work out which indexed messages may match 'args' ('*maybe') and
+   which surely match it ('*sure'). SQUAT only ever tells us that a
+   message might contain a string, so on its own it can't prove a
+   match; but keeping track of sure matches lets us handle NOT
+   properly: a message may match NOT x unless it surely matches x, and
+   surely matches NOT x if it can't match x. */
+static int search_squat_do_query(SquatSearchIndex* index,
+  SquatSearchResult* r, struct searchargs* args,
+  SquatDocSet** maybe_out, SquatDocSet** sure_out) {
+  SquatDocSet* maybe = squat_docset_copy(r->indexed);
+  SquatDocSet* sure;
   struct searchsub* sub;
     
-  memset(vect, 255, vlen);
-  
-  if (!(search_strlist(index, mailbox, vect, t_vect, args->to, "t")
-      && search_strlist(index, mailbox, vect, t_vect, args->from, "f")
-      && search_strlist(index, mailbox, vect, t_vect, args->cc, "c")
-      && search_strlist(index, mailbox, vect, t_vect, args->bcc, "b")
-      && search_strlist(index, mailbox, vect, t_vect, args->subject, "s")
-      && search_strlist(index, mailbox, vect, t_vect, args->header_name, "h")
-      && search_strlist(index, mailbox, vect, t_vect, args->header, "h")
-      && search_strlist(index, mailbox, vect, t_vect, args->body, "m")
-      && search_strlist(index, mailbox, vect, t_vect, args->text, "mh"))) {
-    result = NULL;
-    goto cleanup;
+  if (!(search_strlist(index, r, maybe, args->to, "t")
+      && search_strlist(index, r, maybe, args->from, "f")
+      && search_strlist(index, r, maybe, args->cc, "c")
+      && search_strlist(index, r, maybe, args->bcc, "b")
+      && search_strlist(index, r, maybe, args->subject, "s")
+      && search_strlist(index, r, maybe, args->header_name, "h")
+      && search_strlist(index, r, maybe, args->header, "h")
+      && search_strlist(index, r, maybe, args->body, "m")
+      && search_strlist(index, r, maybe, args->text, "mh"))) {
+    squat_docset_free(maybe);
+    return 0;
   }
 
-  sub = args->sublist;
-  while (sub != NULL) {
-    if (args->sublist->sub2 == NULL) {
-      /* do nothing; because our search is conservative (may include false
-         positives) we can't compute the NOT (since the result might include
-         false negatives, which we do not allow) */
-      /* Note that it's OK to do nothing. We'll just be returning more
-         false positives. */
-    } else {
-      unsigned char* sub1_vect =
-        search_squat_do_query(index, mailbox, args->sublist->sub1);
-      unsigned char* sub2_vect;
-      int i;
-
-      if (sub1_vect == NULL) {
-        result = NULL;
-        goto cleanup;
-      }
+  /* We can't be sure of any criteria we don't evaluate here */
+  sure = has_criteria(args) ? squat_docset_new()
+    : squat_docset_copy(r->indexed);
 
-      sub2_vect = search_squat_do_query(index, mailbox, args->sublist->sub2);
+  for (sub = args->sublist; sub != NULL; sub = sub->next) {
+    SquatDocSet *maybe1, *sure1, *maybe2, *sure2;
 
-      if (sub2_vect == NULL) {
-        result = NULL;
-        free(sub1_vect);
-        goto cleanup;
-      }
+    if (!search_squat_do_query(index, r, sub->sub1, &maybe1, &sure1)) {
+      goto fail;
+    }
 
-      for (i = 0; i < vlen; i++) {
-        vect[i] &= sub1_vect[i] | sub2_vect[i];
+    if (sub->sub2 == NULL) {
+      /* NOT sub1 */
+      squat_docset_andnot(maybe, sure1);
+      squat_docset_andnot(sure, maybe1);
+    } else {
+      /* sub1 OR sub2 */
+      if (!search_squat_do_query(index, r, sub->sub2, &maybe2, &sure2)) {
+        squat_docset_free(maybe1);
+        squat_docset_free(sure1);
+        goto fail;
       }
-
-      free(sub1_vect);
-      free(sub2_vect);
+      squat_docset_or(maybe1, maybe2);
+      squat_docset_or(sure1, sure2);
+      squat_docset_and(maybe, maybe1);
+      squat_docset_and(sure, sure1);
+      squat_docset_free(maybe2);
+      squat_docset_free(sure2);
     }
 
-    sub = sub->next;
+    squat_docset_free(maybe1);
+    squat_docset_free(sure1);
   }
 
-cleanup:
-  free(t_vect);
-  if (result != vect) {
-    free(vect);
-  }
-  
-  return result;
+  *maybe_out = maybe;
+  *sure_out = sure;
+  return 1;
+
+fail:
+  squat_docset_free(maybe);
+  squat_docset_free(sure);
+  return 0;
 }
 
 static int search_squat(unsigned* msg_list, struct mailbox *mailbox,
@@ -248,7 +280,8 @@ static int search_squat(unsigned* msg_list, struct mailbox *mailbox,
   char index_file_name[MAX_MAILBOX_PATH+1], *path;
   int fd;
   SquatSearchIndex* index;
-  unsigned char* msg_vector;
+  SquatSearchResult r;
+  SquatDocSet *maybe, *sure;
   int result;
 
   path = mailbox->mpath &&
@@ -265,43 +298,44 @@ static int search_squat(unsigned* msg_list, struct mailbox *mailbox,
     close(fd);
     return -1;
   }
-  if ((msg_vector = search_squat_do_query(index, mailbox, searchargs))
-      == NULL) {
+
+  memset(&r, 0, sizeof(r));
+  r.mailbox = mailbox;
+  r.indexed = squat_docset_new();
+
+  if (squat_search_list_docs(index, record_indexed_doc, &r) != SQUAT_OK) {
+    syslog(LOG_DEBUG, "SQUAT failed to get list of indexed documents");
+    result = -1;
+  } else if (!r.found_validity) {
+    syslog(LOG_DEBUG, "SQUAT didn't find validity record");
+    result = -1;
+  } else if (!search_squat_do_query(index, &r, searchargs, &maybe, &sure)) {
     result = -1;
   } else {
-    int i;
-    int vlen = vector_len();
-    unsigned char* unindexed_vector = xmalloc(vlen);
-    SquatSearchResult r;
-    
-    memset(unindexed_vector, 255, vlen);
-    r.vector = unindexed_vector;
-    r.mailbox = mailbox;
-    r.part_types = "tfcbsmh";
-    r.found_validity = 0;
-    if (squat_search_list_docs(index, drop_indexed_docs, &r) != SQUAT_OK) {
-      syslog(LOG_DEBUG, "SQUAT failed to get list of indexed documents");
-      result = -1;
-    } else if (!r.found_validity) {
-      syslog(LOG_DEBUG, "SQUAT didn't find validity record");
-      result = -1;
-    } else {
-      /* Add in any unindexed messages. They must be searched manually. */
-      for (i = 0; i < vlen; i++) {
-        msg_vector[i] |= unindexed_vector[i];
-      }
+    SquatDocSet* unindexed = squat_docset_new();
+    int msgno;
 
-      result = 0;
-      for (i = 1; i <= imapd_exists; i++) {
-        if ((msg_vector[i >> 3] & (1 << (i & 7))) != 0) {
-          msg_list[result] = i;
-          result++;
-        }
-      }
+    /* Add in any unindexed messages. They must be searched manually. */
+    if (imapd_exists > 0) {
+      squat_docset_add_range(unindexed, 1, imapd_exists);
+    }
+    squat_docset_andnot(unindexed, r.indexed);
+    squat_docset_or(maybe, unindexed);
+    squat_docset_free(unindexed);
+
+    result = 0;
+    for (msgno = squat_docset_next(maybe, 0); msgno >= 0;
+         msgno = squat_docset_next(maybe, msgno)) {
+      msg_list[result++] = msgno;
     }
-    free(msg_vector);
-    free(unindexed_vector);
+
+    squat_docset_free(maybe);
+    squat_docset_free(sure);
   }
+
+  squat_docset_free(r.indexed);
+  free(r.doc_parts);
+  free(r.doc_msgnos);
   squat_search_close(index);
   close(fd);
   return result;
@@ -75,7 +75,8 @@
 
 enum {
     SEEN_VERSION = 1,
-    SEEN_DEBUG = 0
+    SEEN_DEBUG = 0,
+    SEEN_MERGE_BATCH = 256	/* entries per fetchmany() in seen_merge() */
 };
 
 struct seen {
@@ -588,24 +589,13 @@ struct seen_merge_rock
     struct txn *tid;
 };
 
-/* Look up the unique id in the tgt file, if it is there, compare the
- * last change times, and ensure that the tgt database uses the newer of
- * the two */
-static int seen_merge_cb(void *rockp,
-			 const char *key, int keylen,
-			 const char *tmpdata, int tmpdatalen) 
+/* Compare the tmp and tgt entries for a unique id; returns 1 if the
+ * tgt database should take the tmp entry */
+static int seen_merge_newer(const char *tmpdata, const char *tgtdata)
 {
-    int r;
-    struct seen_merge_rock *rockdata = (struct seen_merge_rock *)rockp;
-    struct db *tgtdb = rockdata->db;
-    const char *tgtdata;
-    int tgtdatalen, dirty = 0;
+    int dirty = 0;
 
-    if(!tgtdb) return IMAP_INTERNAL;
-
-    r = DB->fetchlock(tgtdb, key, keylen, &tgtdata, &tgtdatalen,
-		      &(rockdata->tid));
-    if(!r && tgtdata) {
+    if(tgtdata) {
 	/* compare timestamps */
 	int version, tmplast, tgtlast, tmpuid, tgtuid;
 	char *p;
@@ -636,8 +626,29 @@ static int seen_merge_cb(void *rockp,
     } else {
 	dirty = 1;
     }
+
+    return dirty;
+}
+
+/* Look up the unique id in the tgt file, if it is there, compare the
+ * last change times, and ensure that the tgt database uses the newer of
+ * the two */
+static int seen_merge_cb(void *rockp,
+			 const char *key, int keylen,
+			 const char *tmpdata, int tmpdatalen) 
+{
+    int r;
+    struct seen_merge_rock *rockdata = (struct seen_merge_rock *)rockp;
+    struct db *tgtdb = rockdata->db;
+    const char *tgtdata;
+    int tgtdatalen;
+
+    if(!tgtdb) return IMAP_INTERNAL;
+
+    r = DB->fetchlock(tgtdb, key, keylen, &tgtdata, &tgtdatalen,
+		      &(rockdata->tid));
     
-    if(dirty) {
+    if(seen_merge_newer(tmpdata, !r ? tgtdata : NULL)) {
 	/* write back data from new entry */
 	return DB->store(tgtdb, key, keylen, tmpdata, tmpdatalen,
 			 &(rockdata->tid));
@@ -646,6 +657,71 @@ static int seen_merge_cb(void *rockp,
     }
 }
 
+/* Same as seen_merge_cb() over all of 'tmp', for backends with cursors
+ * and fetchmany(): the tmp entries come in key order, so the tgt
+ * entries are looked up SEEN_MERGE_BATCH at a time */
+static int seen_merge_batched(struct db *tmp, struct seen_merge_rock *rock)
+{
+    struct cursor *cur = NULL;
+    char *keys[SEEN_MERGE_BATCH], *datas[SEEN_MERGE_BATCH];
+    int keylens[SEEN_MERGE_BATCH], datalens[SEEN_MERGE_BATCH];
+    const char *tgtdatas[SEEN_MERGE_BATCH];
+    int tgtdatalens[SEEN_MERGE_BATCH], dirty[SEEN_MERGE_BATCH];
+    const char *key, *data;
+    int keylen, datalen;
+    int r, i, n, done = 0;
+
+    r = DB->cursor_open(tmp, NULL, 0, NULL, 0, &cur, NULL);
+    if (r) return r;
+
+    while (!r && !done) {
+	/* copy out the next batch; the cursor reuses its buffers */
+	for (n = 0; n < SEEN_MERGE_BATCH; n++) {
+	    r = DB->cursor_next(cur, &key, &keylen, &data, &datalen);
+	    if (r) break;
+
+	    keys[n] = xmalloc(keylen + 1);
+	    memcpy(keys[n], key, keylen);
+	    keys[n][keylen] = '\0';
+	    keylens[n] = keylen;
+	    datas[n] = xmalloc(datalen + 1);
+	    memcpy(datas[n], data, datalen);
+	    datas[n][datalen] = '\0';
+	    datalens[n] = datalen;
+	}
+	if (r == CYRUSDB_DONE) {
+	    done = 1;
+	    r = 0;
+	}
+
+	if (!r && n) {
+	    r = DB->fetchmany(rock->db, n, (const char * const *) keys,
+			      keylens, tgtdatas, tgtdatalens, &rock->tid);
+	}
+	if (!r) {
+	    /* decide before storing, which invalidates tgtdatas */
+	    for (i = 0; i < n; i++) {
+		dirty[i] = seen_merge_newer(datas[i], tgtdatas[i]);
+	    }
+	    for (i = 0; !r && i < n; i++) {
+		if (dirty[i]) {
+		    r = DB->store(rock->db, keys[i], keylens[i],
+				  datas[i], datalens[i], &rock->tid);
+		}
+	    }
+	}
+
+	for (i = 0; i < n; i++) {
+	    free(keys[i]);
+	    free(datas[i]);
+	}
+    }
+
+    DB->cursor_close(cur);
+
+    return r;
+}
+
 int seen_merge(const char *tmpfile, const char *tgtfile) 
 {
     int r = 0;
@@ -662,7 +738,11 @@ int seen_merge(const char *tmpfile, const char *tgtfile)
     rock.db = tgt;
     rock.tid = NULL;
     
-    r = DB->foreach(tmp, "", 0, NULL, seen_merge_cb, &rock, &rock.tid);
+    if (DB->cursor_open && DB->fetchmany) {
+	r = seen_merge_batched(tmp, &rock);
+    } else {
+	r = DB->foreach(tmp, "", 0, NULL, seen_merge_cb, &rock, &rock.tid);
+    }
 
     if(r) DB->abort(rock.db, rock.tid);
     else DB->commit(rock.db, rock.tid);
@@ -68,6 +68,8 @@ struct _SquatSearchIndex {
   char const* doc_ID_list;            /* where does the doc-ID-list
 					 array start in memory */
   char const* data_end;               /* the end of the mmaped file */
+  int         positions;              /* does the word trie record
+					 word positions? */
   unsigned char valid_char_bits[32];  /* which characters are valid in
 					 queries according to whoever
 					 created the index */
@@ -129,7 +131,8 @@ SquatSearchIndex* squat_search_open(int fd) {
 
   /* Do some sanity checking in case the header was corrupted. We wouldn't
      want to dereference any bad pointers... */
-  if (memcmp(header->header_text, squat_index_file_header, 8) != 0
+  if ((memcmp(header->header_text, squat_index_file_header, 8) != 0
+       && memcmp(header->header_text, squat_index_file_header_v1, 8) != 0)
       || doc_list_offset < 0 || doc_list_offset >= data_len
       || word_list_offset < 0 || word_list_offset >= data_len
       || doc_ID_list_offset < 0 || doc_ID_list_offset >= data_len
@@ -142,6 +145,8 @@ SquatSearchIndex* squat_search_open(int fd) {
   index->word_list = index->data + word_list_offset;
   index->doc_ID_list = index->data + doc_ID_list_offset;
   index->data_end = index->data + data_len;
+  index->positions =
+    memcmp(header->header_text, squat_index_file_header, 8) == 0;
   memcpy(index->valid_char_bits, header->valid_char_bits,
          sizeof(index->valid_char_bits));
 
@@ -257,8 +262,20 @@ static char const* lookup_word_docs(SquatSearchIndex* index,
           
         if ((v & 1) != 0) {
           s = t;  /* singleton; no more data to eat for this word */
+          if (index->positions) {
+            s++;  /* ... except its position mask */
+          }
         } else {
           s = t + (v >> 1); /* run-list; size is in v>>1 */
+          if (index->positions) {
+            int n = (int)squat_decode_I(&s);
+
+            if (n < 0 || s + n >= index->data_end) {
+              *invalid_file = 1;
+              return NULL;
+            }
+            s += n;       /* followed by a position mask per document */
+          }
         }
       }
     }
@@ -284,6 +301,9 @@ static int count_docs_containing_word(SquatSearchIndex* index,
 
   i = (int)squat_decode_I(&raw_doc_list);
   if ((i & 1) != 0) {
+    if (index->positions && raw_doc_list >= index->data_end) {
+      return -1;
+    }
     return 1; /* singleton */
   } else {
     int size = i >> 1;
@@ -308,179 +328,574 @@ static int count_docs_containing_word(SquatSearchIndex* index,
       return -1;
     }
 
+    if (index->positions) {
+      /* check that the position masks are all there */
+      if ((int)squat_decode_I(&s) != count || s + count >= index->data_end) {
+        return -1;
+      }
+    }
+
     return count;
   }
 }
 
-/* We store a set of documents in this little structure. The set
-   also maintains a 'current' document pointer. */
+/* SquatDocSet. Each chunk holds the values whose upper 16 bits are
+   'key'. A chunk with at most DOCSET_ARRAY_MAX values keeps their
+   lower 16 bits in a sorted array; a fuller chunk uses a 65536-bit
+   vector instead, which is never larger. Empty chunks are removed. */
+#define DOCSET_ARRAY_MAX  4096
+#define DOCSET_BITS_WORDS (65536/32)
+
 typedef struct {
-  int array_len;   /* The length of the array below */
-  int* array_data; /* An array of document IDs, sorted by increasing
-		      document ID. It can also contain elements equal
-		      to -1, which means "no document".
-		   */
-  int index;       /* The index of the 'current' document within the array. */
-} SquatDocSet;
-
-/* Extract the list of documents containing the word 'data' into a
-   SquatDocSet. The list is extracted from the index file data
-   'doc_list' which refers to 'doc_count' documents.
-*/
-static int
-set_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
-			    SquatDocSet* set,
-			    char const* data __attribute__((unused)),
-			    int doc_count, char const* doc_list)
-{
+  int             key;        /* upper 16 bits of the values */
+  int             count;      /* number of values in the chunk */
+  unsigned short* array;      /* sorted lower 16 bits, or NULL */
+  int             array_size; /* The allocated size of 'array' */
+  unsigned int*   bits;       /* bit vector of lower 16 bits, or NULL */
+} SquatDocSetChunk;
+
+struct _SquatDocSet {
+  SquatDocSetChunk* chunks;      /* sorted by increasing key */
+  int               num_chunks;
+  int               chunks_size; /* The allocated size of 'chunks' */
+};
+
+static int popcount32(unsigned int v) {
+  v = v - ((v >> 1) & 0x55555555);
+  v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+  return (int)((((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+}
+
+/* Index of the lowest bit set in 'v', which must not be zero */
+static int lowest_bit(unsigned int v) {
+  int b = 0;
+
+  if ((v & 0xFFFF) == 0) { v >>= 16; b += 16; }
+  if ((v & 0xFF) == 0)   { v >>= 8;  b += 8; }
+  if ((v & 0xF) == 0)    { v >>= 4;  b += 4; }
+  if ((v & 0x3) == 0)    { v >>= 2;  b += 2; }
+  if ((v & 0x1) == 0)    { b += 1; }
+  return b;
+}
+
+static void chunk_clear(SquatDocSetChunk* c) {
+  free(c->array);
+  free(c->bits);
+  c->array = NULL;
+  c->array_size = 0;
+  c->bits = NULL;
+  c->count = 0;
+}
+
+/* Find the position of the first array element >= 'low' */
+static int chunk_find(SquatDocSetChunk const* c, int low) {
+  int lo = 0, hi = c->count;
+
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+
+    if (c->array[mid] < low) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static int chunk_contains(SquatDocSetChunk const* c, int low) {
+  if (c->bits != NULL) {
+    return (c->bits[low >> 5] & (1U << (low & 31))) != 0;
+  } else {
+    int pos = chunk_find(c, low);
+
+    return pos < c->count && c->array[pos] == low;
+  }
+}
+
+/* Switch a chunk to the bit vector representation */
+static void chunk_to_bits(SquatDocSetChunk* c) {
   int i;
 
-  set->array_len = doc_count;
-  set->array_data = (int*)xmalloc(sizeof(int)*set->array_len);
-  
-  i = (int)squat_decode_I(&doc_list);
-  if ((i & 1) != 0) {
-    set->array_data[0] = i >> 1;
+  if (c->bits != NULL) {
+    return;
+  }
+  c->bits = (unsigned int*)xzmalloc(DOCSET_BITS_WORDS*sizeof(unsigned int));
+  for (i = 0; i < c->count; i++) {
+    c->bits[c->array[i] >> 5] |= 1U << (c->array[i] & 31);
+  }
+  free(c->array);
+  c->array = NULL;
+  c->array_size = 0;
+}
+
+/* Recount a bit vector chunk after it was modified a word at a time,
+   and switch it back to an array if it has become sparse. */
+static void chunk_normalize(SquatDocSetChunk* c) {
+  int i, j, n = 0;
+
+  if (c->bits == NULL) {
+    return;
+  }
+  for (i = 0; i < DOCSET_BITS_WORDS; i++) {
+    n += popcount32(c->bits[i]);
+  }
+  c->count = n;
+  if (n > DOCSET_ARRAY_MAX) {
+    return;
+  }
+
+  c->array_size = n > 0 ? n : 1;
+  c->array = (unsigned short*)xmalloc(c->array_size*sizeof(unsigned short));
+  for (i = 0, j = 0; i < DOCSET_BITS_WORDS; i++) {
+    unsigned int w = c->bits[i];
+
+    while (w != 0) {
+      c->array[j++] = (unsigned short)(i*32 + lowest_bit(w));
+      w &= w - 1;
+    }
+  }
+  free(c->bits);
+  c->bits = NULL;
+}
+
+static void chunk_add(SquatDocSetChunk* c, int low) {
+  int pos;
+
+  if (c->bits == NULL && c->count >= DOCSET_ARRAY_MAX) {
+    chunk_to_bits(c);
+  }
+  if (c->bits != NULL) {
+    unsigned int mask = 1U << (low & 31);
+
+    if ((c->bits[low >> 5] & mask) == 0) {
+      c->bits[low >> 5] |= mask;
+      c->count++;
+    }
+    return;
+  }
+
+  pos = chunk_find(c, low);
+  if (pos < c->count && c->array[pos] == low) {
+    return;
+  }
+  if (c->count >= c->array_size) {
+    c->array_size = c->array_size ? 2*c->array_size : 4;
+    c->array = (unsigned short*)xrealloc(c->array,
+                 c->array_size*sizeof(unsigned short));
+  }
+  memmove(c->array + pos + 1, c->array + pos,
+          (c->count - pos)*sizeof(unsigned short));
+  c->array[pos] = (unsigned short)low;
+  c->count++;
+}
+
+/* c = c AND o */
+static void chunk_and(SquatDocSetChunk* c, SquatDocSetChunk const* o) {
+  int i, n = 0;
+
+  if (c->bits == NULL) {
+    for (i = 0; i < c->count; i++) {
+      if (chunk_contains(o, c->array[i])) {
+        c->array[n++] = c->array[i];
+      }
+    }
+    c->count = n;
+  } else if (o->bits != NULL) {
+    for (i = 0; i < DOCSET_BITS_WORDS; i++) {
+      c->bits[i] &= o->bits[i];
+    }
+    chunk_normalize(c);
   } else {
-    int size = i >> 1;
-    char const* s = doc_list;
-    int last_doc = 0;
-    int j = 0;
-    
-    while (s - doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        last_doc = set->array_data[j++] = last_doc + (i >> 1);
-      } else {
-        int count = i >> 1;
-        int delta = squat_decode_I(&s);
+    /* the result is no bigger than o, so it's an array */
+    unsigned short* array =
+      (unsigned short*)xmalloc((o->count ? o->count : 1)*sizeof(unsigned short));
 
-        last_doc += delta;
-        set->array_data[j++] = last_doc;
-        while (--count > 0) {
-          last_doc++;
-          set->array_data[j++] = last_doc;
-        }
+    for (i = 0; i < o->count; i++) {
+      if (chunk_contains(c, o->array[i])) {
+        array[n++] = o->array[i];
       }
     }
+    chunk_clear(c);
+    c->array = array;
+    c->array_size = o->count ? o->count : 1;
+    c->count = n;
   }
+}
 
-  return SQUAT_OK;
+/* c = c AND NOT o */
+static void chunk_andnot(SquatDocSetChunk* c, SquatDocSetChunk const* o) {
+  int i, n = 0;
+
+  if (c->bits == NULL) {
+    for (i = 0; i < c->count; i++) {
+      if (!chunk_contains(o, c->array[i])) {
+        c->array[n++] = c->array[i];
+      }
+    }
+    c->count = n;
+  } else {
+    if (o->bits != NULL) {
+      for (i = 0; i < DOCSET_BITS_WORDS; i++) {
+        c->bits[i] &= ~o->bits[i];
+      }
+    } else {
+      for (i = 0; i < o->count; i++) {
+        c->bits[o->array[i] >> 5] &= ~(1U << (o->array[i] & 31));
+      }
+    }
+    chunk_normalize(c);
+  }
 }
 
-/* Advance the "current document" in the set to the first document
-   with ID > 'doc'. Remove any documents found along the way that were
-   not 'doc'.
-*/
-static void filter_doc(SquatDocSet* set, int doc) {
-  int i = set->index;
+/* c = c OR o */
+static void chunk_or(SquatDocSetChunk* c, SquatDocSetChunk const* o) {
+  int i;
 
-  while (i < set->array_len && set->array_data[i] < doc) {
-    /* this document is not in the currently filtered set */
-    set->array_data[i] = -1;
-    i++;
+  if (c->bits == NULL && o->bits == NULL
+      && c->count + o->count <= DOCSET_ARRAY_MAX) {
+    /* merge two arrays */
+    int size = c->count + o->count;
+    unsigned short* array =
+      (unsigned short*)xmalloc((size ? size : 1)*sizeof(unsigned short));
+    int j = 0, n = 0;
+
+    i = 0;
+    while (i < c->count || j < o->count) {
+      if (j >= o->count || (i < c->count && c->array[i] < o->array[j])) {
+        array[n++] = c->array[i++];
+      } else if (i >= c->count || o->array[j] < c->array[i]) {
+        array[n++] = o->array[j++];
+      } else {
+        array[n++] = c->array[i++];
+        j++;
+      }
+    }
+    free(c->array);
+    c->array = array;
+    c->array_size = size ? size : 1;
+    c->count = n;
+    return;
   }
 
-  /* skip over the matched document, if we matched */
-  if (i < set->array_len && set->array_data[i] == doc) {
-    i++;
+  chunk_to_bits(c);
+  if (o->bits != NULL) {
+    for (i = 0; i < DOCSET_BITS_WORDS; i++) {
+      c->bits[i] |= o->bits[i];
+    }
+  } else {
+    for (i = 0; i < o->count; i++) {
+      c->bits[o->array[i] >> 5] |= 1U << (o->array[i] & 31);
+    }
   }
+  chunk_normalize(c);
+}
 
-  set->index = i;
+/* Find the position of the first chunk with key >= 'key' */
+static int docset_find(SquatDocSet const* set, int key) {
+  int lo = 0, hi = set->num_chunks;
+
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+
+    if (set->chunks[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
 }
 
-/* Remove from a SquatDocSet any documents not in the list of
-   documents containing the word 'data'. The list is extracted from
-   the index file data 'doc_list'.
-*/
-static void
-filter_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
-			       SquatDocSet* set,
-			       char const* data __attribute__((unused)),
-			       char const* doc_list)
-{
-  int i = (int)squat_decode_I(&doc_list);
+/* Get the chunk for 'key', creating an empty one if necessary */
+static SquatDocSetChunk* docset_get_chunk(SquatDocSet* set, int key) {
+  int pos = docset_find(set, key);
+  SquatDocSetChunk* c;
 
-  set->index = 0;
+  if (pos < set->num_chunks && set->chunks[pos].key == key) {
+    return set->chunks + pos;
+  }
 
-  if ((i & 1) != 0) {
-    filter_doc(set, i >> 1); 
-  } else {
-    int size = i >> 1;
-    char const* s = doc_list;
-    int last_doc = 0;
-    
-    while (s - doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        filter_doc(set, last_doc += i >> 1);
-      } else {
-        int count = i >> 1;
-        int delta = squat_decode_I(&s);
+  if (set->num_chunks >= set->chunks_size) {
+    set->chunks_size = set->chunks_size ? 2*set->chunks_size : 4;
+    set->chunks = (SquatDocSetChunk*)xrealloc(set->chunks,
+                    set->chunks_size*sizeof(SquatDocSetChunk));
+  }
+  memmove(set->chunks + pos + 1, set->chunks + pos,
+          (set->num_chunks - pos)*sizeof(SquatDocSetChunk));
+  set->num_chunks++;
+
+  c = set->chunks + pos;
+  memset(c, 0, sizeof(*c));
+  c->key = key;
+  return c;
+}
 
-        last_doc += delta;
-        filter_doc(set, last_doc);
-        while (--count > 0) {
-          last_doc++;
-          filter_doc(set, last_doc);
-        }
+/* Drop the chunks which an operation has emptied */
+static void docset_compact(SquatDocSet* set) {
+  int i, n = 0;
+
+  for (i = 0; i < set->num_chunks; i++) {
+    if (set->chunks[i].count > 0) {
+      set->chunks[n++] = set->chunks[i];
+    } else {
+      chunk_clear(set->chunks + i);
+    }
+  }
+  set->num_chunks = n;
+}
+
+SquatDocSet* squat_docset_new(void) {
+  return (SquatDocSet*)xzmalloc(sizeof(SquatDocSet));
+}
+
+SquatDocSet* squat_docset_copy(SquatDocSet const* set) {
+  SquatDocSet* copy = squat_docset_new();
+  int i;
+
+  copy->num_chunks = copy->chunks_size = set->num_chunks;
+  if (set->num_chunks == 0) {
+    return copy;
+  }
+  copy->chunks = (SquatDocSetChunk*)xmalloc(set->num_chunks*
+                                            sizeof(SquatDocSetChunk));
+  for (i = 0; i < set->num_chunks; i++) {
+    SquatDocSetChunk const* c = set->chunks + i;
+    SquatDocSetChunk* d = copy->chunks + i;
+
+    *d = *c;
+    if (c->bits != NULL) {
+      d->bits = (unsigned int*)xmalloc(DOCSET_BITS_WORDS*sizeof(unsigned int));
+      memcpy(d->bits, c->bits, DOCSET_BITS_WORDS*sizeof(unsigned int));
+    } else {
+      d->array_size = c->count ? c->count : 1;
+      d->array = (unsigned short*)xmalloc(d->array_size*sizeof(unsigned short));
+      memcpy(d->array, c->array, c->count*sizeof(unsigned short));
+    }
+  }
+  return copy;
+}
+
+void squat_docset_free(SquatDocSet* set) {
+  int i;
+
+  for (i = 0; i < set->num_chunks; i++) {
+    chunk_clear(set->chunks + i);
+  }
+  free(set->chunks);
+  free(set);
+}
+
+void squat_docset_add(SquatDocSet* set, int doc) {
+  assert(doc >= 0);
+  chunk_add(docset_get_chunk(set, doc >> 16), doc & 0xFFFF);
+}
+
+void squat_docset_add_range(SquatDocSet* set, int first, int last) {
+  while (first <= last) {
+    SquatDocSetChunk* c = docset_get_chunk(set, first >> 16);
+    int end = (first | 0xFFFF) < last ? (first | 0xFFFF) : last;
+
+    if (end - first >= DOCSET_ARRAY_MAX) {
+      chunk_to_bits(c);
+    }
+    for (; first <= end; first++) {
+      chunk_add(c, first & 0xFFFF);
+    }
+  }
+}
+
+int squat_docset_contains(SquatDocSet const* set, int doc) {
+  int pos = docset_find(set, doc >> 16);
+
+  return doc >= 0 && pos < set->num_chunks
+    && set->chunks[pos].key == doc >> 16
+    && chunk_contains(set->chunks + pos, doc & 0xFFFF);
+}
+
+int squat_docset_count(SquatDocSet const* set) {
+  int i, n = 0;
+
+  for (i = 0; i < set->num_chunks; i++) {
+    n += set->chunks[i].count;
+  }
+  return n;
+}
+
+int squat_docset_next(SquatDocSet const* set, int doc) {
+  int key = (doc + 1) >> 16;
+  int low = (doc + 1) & 0xFFFF;
+  int i;
+
+  for (i = docset_find(set, key); i < set->num_chunks; i++) {
+    SquatDocSetChunk const* c = set->chunks + i;
+
+    if (c->key > key) {
+      low = 0;
+    }
+    if (c->bits != NULL) {
+      int w = low >> 5;
+      unsigned int bits = c->bits[w] & (~0U << (low & 31));
+
+      while (bits == 0 && ++w < DOCSET_BITS_WORDS) {
+        bits = c->bits[w];
+      }
+      if (bits != 0) {
+        return (c->key << 16) | (w*32 + lowest_bit(bits));
+      }
+    } else {
+      int pos = chunk_find(c, low);
+
+      if (pos < c->count) {
+        return (c->key << 16) | c->array[pos];
       }
     }
   }
+  return -1;
 }
 
-/* Advance the "current document" pointer to the first document in the set. */
-static void select_first_doc(SquatDocSet* set) {
-  set->index = 0;
-  while (set->index < set->array_len && set->array_data[set->index] < 0) {
-    set->index++;
+void squat_docset_and(SquatDocSet* set, SquatDocSet const* other) {
+  int i, j = 0;
+
+  for (i = 0; i < set->num_chunks; i++) {
+    SquatDocSetChunk* c = set->chunks + i;
+
+    while (j < other->num_chunks && other->chunks[j].key < c->key) {
+      j++;
+    }
+    if (j < other->num_chunks && other->chunks[j].key == c->key) {
+      chunk_and(c, other->chunks + j);
+    } else {
+      chunk_clear(c);
+    }
   }
+  docset_compact(set);
 }
 
-/* Is the "current document" pointer pointing to any real document? */
-static int has_more_docs(SquatDocSet* set) {
-  return set->index < set->array_len;
+void squat_docset_andnot(SquatDocSet* set, SquatDocSet const* other) {
+  int i, j = 0;
+
+  for (i = 0; i < set->num_chunks; i++) {
+    SquatDocSetChunk* c = set->chunks + i;
+
+    while (j < other->num_chunks && other->chunks[j].key < c->key) {
+      j++;
+    }
+    if (j < other->num_chunks && other->chunks[j].key == c->key) {
+      chunk_andnot(c, other->chunks + j);
+    }
+  }
+  docset_compact(set);
 }
 
-/* Advance the "current document" pointer to the next document in the set,
-   and return its old value */
-static int get_next_doc(SquatDocSet* set) {
-  int doc = set->array_data[set->index];
+void squat_docset_or(SquatDocSet* set, SquatDocSet const* other) {
+  int j;
 
-  set->index++;
-  while (set->index < set->array_len && set->array_data[set->index] < 0) {
-    set->index++;
+  for (j = 0; j < other->num_chunks; j++) {
+    chunk_or(docset_get_chunk(set, other->chunks[j].key), other->chunks + j);
   }
+}
+
+/* We walk the document lists in the index file with this little
+   iterator, which also hands out each document's position mask. */
+typedef struct {
+  char const*          s;         /* the next encoded run */
+  char const*          end;       /* the end of the run list */
+  unsigned char const* positions; /* the next position mask, or NULL if
+				     the index has none */
+  int                  run;       /* documents left in the current run */
+  int                  doc;       /* the current document ID, or -1
+				     at the end of the list */
+  int                  mask;      /* the position mask of 'doc' */
+} SquatDocListIter;
+
+static void doc_list_next(SquatDocListIter* it) {
+  if (it->run > 0) {
+    it->run--;
+    it->doc++;
+  } else if (it->s < it->end) {
+    int i = (int)squat_decode_I(&it->s);
+
+    if ((i & 1) == 1) {
+      it->doc += i >> 1;
+    } else {
+      it->run = (i >> 1) - 1;
+      it->doc += (int)squat_decode_I(&it->s);
+    }
+  } else {
+    it->doc = -1;
+    return;
+  }
+  it->mask = it->positions != NULL ? *it->positions++ : 0xFF;
+}
+
+/* Start walking the document list at 'doc_list'. The list must have
+   been checked by count_docs_containing_word. */
+static void doc_list_start(SquatSearchIndex* index, SquatDocListIter* it,
+                           char const* doc_list) {
+  int i = (int)squat_decode_I(&doc_list);
 
-  return doc;
+  it->run = 0;
+  if ((i & 1) != 0) {
+    /* singleton; there's nothing more to walk after this one */
+    it->s = it->end = doc_list;
+    it->positions =
+      index->positions ? (unsigned char const*)doc_list : NULL;
+    it->doc = i >> 1;
+    it->mask = it->positions != NULL ? *it->positions++ : 0xFF;
+  } else {
+    it->s = doc_list;
+    it->end = doc_list + (i >> 1);
+    if (index->positions) {
+      char const* p = it->end;
+
+      squat_decode_I(&p); /* the count, which we already checked */
+      it->positions = (unsigned char const*)p;
+    } else {
+      it->positions = NULL;
+    }
+    it->doc = 0;
+    doc_list_next(it);
+  }
 }
 
-static void destroy_docset(SquatDocSet* set) {
-  free(set->array_data);
+/* Turn the position mask of the subword at 'offset' in a search string
+   into a mask of where the whole string could start, modulo 8. */
+static int align_positions(int mask, int offset) {
+  offset &= 7;
+  return ((mask >> offset) | (mask << (8 - offset))) & 0xFF;
 }
 
 /* The basic strategy here is pretty simple. We just want to find the
    documents that contain every subword of the search string. The
    index tells us which documents contain each subword so it's just a
    matter of doing O(N) lookups into the index. We construct an
-   explicit document list for one of the subwords and then iterate
-   through that list for each other subword, throwing out any
-   documents that don't contain that subword.
+   explicit document list for one of the subwords and then walk each
+   other subword's list alongside it, throwing out any documents that
+   don't contain that subword.
 
    The only trick is that some subwords may occur in lots of documents
    while others only occur in a few (or no) documents. In that case we
    would rather construct the list with the smallest possible number
    of documents, to save memory and the cost of traversing that list
    several times.
+
+   If the index records positions, we also keep, for each candidate
+   document, the offsets (modulo 8) at which the whole string could
+   start given the subwords seen so far. Subword i must start at
+   offset i from the start of the string, so we rotate its mask by i
+   before intersecting. A document is dropped when no offset is left.
 */
-int squat_search_execute(SquatSearchIndex* index, char const* data,
-  int data_len, SquatSearchResultCallback handler, void* closure) {
-  int i;
+int squat_search_execute_docs(SquatSearchIndex* index, char const* data,
+  int data_len, SquatDocSet* result) {
+  int i, j;
   int min_doc_count_word; /* The subword of 'data' that appears in
 			     fewest documents */
   int min_doc_count;      /* The number of documents that include that
 			     subword */
-  SquatDocSet set;
+  int* docs;
+  unsigned char* starts;
+  SquatDocListIter it;
   char const** run_starts;
 
   /* First, do sanity checking on the string. We wouldn't want invalid
@@ -543,60 +958,287 @@ int squat_search_execute(SquatSearchIndex* index, char const* data,
      of documents, and we'd allocate a huge array and have to iterate
      through it all lots of times.
   */
-  if (set_to_docs_containing_word(index, &set, data + min_doc_count_word,
-        min_doc_count, run_starts[min_doc_count_word]) == SQUAT_ERR) {
-    goto cleanup_run_starts;
+  docs = (int*)xmalloc(sizeof(int)*min_doc_count);
+  starts = (unsigned char*)xmalloc(min_doc_count);
+  doc_list_start(index, &it, run_starts[min_doc_count_word]);
+  for (j = 0; j < min_doc_count; j++) {
+    docs[j] = it.doc;
+    starts[j] = align_positions(it.mask, min_doc_count_word);
+    doc_list_next(&it);
   }
-  /* Scan through the other document lists and throw out any documents
-     that aren't in all those lists. */
+
+  /* Walk the other document lists and throw out any documents that
+     aren't in all those lists, or where the subwords can't line up. */
   for (i = 0; i <= data_len - SQUAT_WORD_SIZE; i++) {
-    if (i != min_doc_count_word) {
-      filter_to_docs_containing_word(index, &set, data + i, run_starts[i]);
+    if (i == min_doc_count_word) {
+      continue;
+    }
+    doc_list_start(index, &it, run_starts[i]);
+    for (j = 0; j < min_doc_count; j++) {
+      if (docs[j] < 0) {
+        continue;
+      }
+      while (it.doc >= 0 && it.doc < docs[j]) {
+        doc_list_next(&it);
+      }
+      if (it.doc == docs[j]) {
+        starts[j] &= align_positions(it.mask, i);
+      } else {
+        starts[j] = 0;
+      }
+      if (starts[j] == 0) {
+        docs[j] = -1;
+      }
     }
   }
 
+  for (j = 0; j < min_doc_count; j++) {
+    if (docs[j] >= 0) {
+      squat_docset_add(result, docs[j]);
+    }
+  }
+
+  free(starts);
+  free(docs);
+
+cleanup_run_starts_ok:
+  free(run_starts);
+  return SQUAT_OK;
+
+cleanup_run_starts:
+  free(run_starts);
+  return SQUAT_ERR;
+}
+
+int squat_search_execute(SquatSearchIndex* index, char const* data,
+  int data_len, SquatSearchResultCallback handler, void* closure) {
+  SquatDocSet* set = squat_docset_new();
+  int doc;
+  int r = SQUAT_OK;
+
+  if (squat_search_execute_docs(index, data, data_len, set) != SQUAT_OK) {
+    squat_docset_free(set);
+    return SQUAT_ERR;
+  }
+
   /* Now we have the results. Scan through the set and report each
      element to the callback function. */
-  select_first_doc(&set);
-  while (has_more_docs(&set)) {
-    int next_doc;
+  for (doc = squat_docset_next(set, -1); doc >= 0;
+       doc = squat_docset_next(set, doc)) {
     char const* next_doc_info;
     char const* next_doc_data;
-    int r;
+    int cb;
 
     /* Lookup the document info so we can get the document name to report. */
-    next_doc = get_next_doc(&set);
-    next_doc_info = index->doc_ID_list + next_doc*4;
-    if (next_doc < 0 && next_doc_info >= index->data_end) {
+    next_doc_info = index->doc_ID_list + doc*4;
+    if (next_doc_info >= index->data_end) {
       squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-      goto cleanup_docset;
+      r = SQUAT_ERR;
+      break;
     }
 
     next_doc_data = index->doc_list + squat_decode_32(next_doc_info);
     if (next_doc_data < index->doc_list || next_doc_data >= index->data_end) {
       squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-      goto cleanup_docset;
+      r = SQUAT_ERR;
+      break;
     }
 
-    r = handler(closure, next_doc_data);
-    if (r == SQUAT_CALLBACK_ABORT) {
+    cb = handler(closure, next_doc_data);
+    if (cb == SQUAT_CALLBACK_ABORT) {
       break;
     }
-    assert(r == SQUAT_CALLBACK_CONTINUE);
+    assert(cb == SQUAT_CALLBACK_CONTINUE);
   }
 
-  destroy_docset(&set);
+  squat_docset_free(set);
+  return r;
+}
+
+/* State for squat_search_list_words */
+typedef struct {
+  SquatSearchIndex*     index;
+  SquatListWordCallback handler;
+  void*                 closure;
+  char                  word[SQUAT_WORD_SIZE + 1];
+  int*                  doc_IDs;      /* scratch array for the current
+					 word's document list */
+  unsigned char*        doc_positions;/* and their position masks */
+  int                   doc_IDs_size; /* The allocated size of doc_IDs */
+  int                   aborted;      /* the handler asked us to stop */
+} SquatListWordsState;
+
+/* Decode the 'present' bits at *s into the list of bytes present at
+   this level of the trie, in increasing order. Returns the number of
+   bytes present, or -1 if the index file is corrupt. */
+static int decode_present_bytes(SquatSearchIndex* index, char const** s,
+                                unsigned char* present) {
+  char const* t = *s;
+  char p = *t++;
+  int n = 0;
+
+  if ((p & 0xE0) != 0) { /* singleton */
+    present[n++] = (unsigned char)p;
+  } else {               /* list of bits */
+    int count = (*t++) + 1;
+    int i, j;
+
+    if (t + count > index->data_end) {
+      return -1;
+    }
+    for (i = 0; i < count; i++) {
+      for (j = 0; j < 8; j++) {
+        if ((t[i] & (1 << j)) != 0) {
+          present[n++] = (unsigned char)((p + i)*8 + j);
+        }
+      }
+    }
+    t += count;
+  }
+
+  *s = t;
+  return n;
+}
+
+static void add_doc_ID(SquatListWordsState* st, int count, int doc_ID) {
+  if (count >= st->doc_IDs_size) {
+    st->doc_IDs_size = st->doc_IDs_size ? 2*st->doc_IDs_size : 64;
+    st->doc_IDs = (int*)xrealloc(st->doc_IDs, sizeof(int)*st->doc_IDs_size);
+    st->doc_positions = (unsigned char*)xrealloc(st->doc_positions,
+                                                 st->doc_IDs_size);
+  }
+  st->doc_IDs[count] = doc_ID;
+  st->doc_positions[count] = 0xFF;
+}
+
+/* Decode the document list at *s into st->doc_IDs, and its position
+   masks (if any) into st->doc_positions. Unlike doc_list_start, this
+   doesn't know the count up front. Returns the number of documents,
+   or -1 if the index file is corrupt. */
+static int decode_doc_list(SquatListWordsState* st, char const** s) {
+  char const* t = *s;
+  int i = (int)squat_decode_I(&t);
+  int single = (i & 1) != 0;
+  int count = 0;
+
+  if (single) {
+    add_doc_ID(st, count++, i >> 1);
+  } else {
+    int size = i >> 1;
+    char const* start = t;
+    int last_doc = 0;
+
+    if (size < 0 || start + size >= st->index->data_end) {
+      return -1;
+    }
+
+    while (t - start < size) {
+      i = (int)squat_decode_I(&t);
+      if ((i & 1) == 1) {
+        last_doc += i >> 1;
+        add_doc_ID(st, count++, last_doc);
+      } else {
+        int run = i >> 1;
+
+        last_doc += (int)squat_decode_I(&t);
+        add_doc_ID(st, count++, last_doc);
+        while (--run > 0) {
+          last_doc++;
+          add_doc_ID(st, count++, last_doc);
+        }
+      }
+    }
+
+    if (t != start + size) {
+      return -1;
+    }
+  }
+
+  if (st->index->positions) {
+    if (!single && (int)squat_decode_I(&t) != count) {
+      return -1;
+    }
+    if (t + count >= st->index->data_end) {
+      return -1;
+    }
+    memcpy(st->doc_positions, t, count);
+    t += count;
+  }
+
+  *s = t;
+  return count;
+}
+
+/* Walk one level of the word trie starting at 's', which is the
+   trie branch for the first 'level' bytes of st->word. */
+static int list_words_level(SquatListWordsState* st, char const* s,
+                            int level) {
+  unsigned char present[256];
+  char const* branch_start = s;
+  int n, i;
+
+  if (s < st->index->data || s >= st->index->data_end
+      || (n = decode_present_bytes(st->index, &s, present)) < 0) {
+    squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+    return SQUAT_ERR;
+  }
+
+  for (i = 0; i < n && !st->aborted; i++) {
+    st->word[level] = (char)present[i];
+
+    if (level < SQUAT_WORD_SIZE - 1) {
+      /* branch data is at a backward offset from branch_start */
+      int next_offset = (int)squat_decode_I(&s);
+
+      if (next_offset < 0
+          || list_words_level(st, branch_start - next_offset, level + 1)
+             != SQUAT_OK) {
+        squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+        return SQUAT_ERR;
+      }
+    } else {
+      int count = decode_doc_list(st, &s);
+      int r;
+
+      if (count < 0) {
+        squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+        return SQUAT_ERR;
+      }
+
+      r = st->handler(st->closure, st->word, st->doc_IDs,
+                      st->doc_positions, count);
+      if (r == SQUAT_CALLBACK_ABORT) {
+        st->aborted = 1;
+      } else {
+        assert(r == SQUAT_CALLBACK_CONTINUE);
+      }
+    }
+  }
 
-cleanup_run_starts_ok:
-  free(run_starts);
   return SQUAT_OK;
+}
 
-cleanup_docset:
-  destroy_docset(&set);
+int squat_search_list_words(SquatSearchIndex* index,
+  SquatListWordCallback handler, void* closure) {
+  SquatListWordsState st;
+  int r;
 
-cleanup_run_starts:
-  free(run_starts);
-  return SQUAT_ERR;
+  squat_set_last_error(SQUAT_ERR_OK);
+
+  st.index = index;
+  st.handler = handler;
+  st.closure = closure;
+  memset(st.word, 0, sizeof(st.word));
+  st.doc_IDs = NULL;
+  st.doc_positions = NULL;
+  st.doc_IDs_size = 0;
+  st.aborted = 0;
+
+  r = list_words_level(&st, index->word_list, 0);
+
+  free(st.doc_IDs);
+  free(st.doc_positions);
+  return r;
 }
 
 int squat_search_close(SquatSearchIndex* index) {
@@ -128,8 +128,11 @@ typedef struct _SquatSearchIndex SquatSearchIndex;
 typedef long long SquatInt64;
 typedef int       SquatInt32;
 
-/* All SQUAT index files start with this magic 8 bytes */
-extern char const squat_index_file_header[8]; /* "SQUAT 1\n" */
+/* All SQUAT index files start with this magic 8 bytes. New indexes
+   record word positions; indexes written by older versions of SQUAT
+   start with squat_index_file_header_v1 and are still readable. */
+extern char const squat_index_file_header[8];    /* "SQUAT 2\n" */
+extern char const squat_index_file_header_v1[8]; /* "SQUAT 1\n" */
 
 /* SQUAT return values */
 #define SQUAT_OK           1
@@ -251,6 +254,20 @@ int         squat_index_append_document(SquatIndex* index, char const* data,
 int         squat_index_close_document(SquatIndex* index);
 
 
+/* Carry documents over from an existing index 'old' without their
+   text. Each document for which 'keep' returns nonzero (every
+   document, if 'keep' is NULL) is added under the same name and size
+   and is recorded as containing the same words as before. This lets
+   a client update an index by adding only its new documents. Call
+   this after successfully calling squat_index_init, before adding any
+   other documents; the client still owns 'old' and closes it
+   afterwards. */
+typedef int (* SquatKeepDocCallback)(void* closure, char const* doc_name);
+int         squat_index_add_existing(SquatIndex* index,
+               SquatSearchIndex* old, SquatKeepDocCallback keep,
+               void* closure);
+
+
 /* Notify SQUAT that there are no more documents. SQUAT will finish
    generating the index. It is the client's responsibility to close
    the original index file. All SQUAT resources associated with the
@@ -312,6 +329,63 @@ int               squat_search_execute(SquatSearchIndex* index, char const* data
                     int data_len, SquatSearchResultCallback handler, void* closure);
 
 
+/* Get every word in the index together with the documents that
+   contain it. Documents are identified by their position in the
+   sequence reported by squat_search_list_docs, counting from
+   zero. The callback function is called once for each word, in
+   increasing byte order; 'word' is SQUAT_WORD_SIZE bytes (plus a
+   terminating null) and 'doc_IDs' holds 'doc_count' increasing IDs.
+   'doc_positions[i]' has bit j set if the word starts at an offset
+   equal to j modulo 8 in document doc_IDs[i]; all bits are set if the
+   index does not record positions. None of these are valid after the
+   callback returns. The callback function returns one of the above
+   results to control the progress of the operation. Call this after
+   successfully calling squat_search_open, squat_search_list_docs, or
+   squat_search_execute. */
+typedef int (* SquatListWordCallback)(void* closure, char const* word,
+                                      int const* doc_IDs,
+                                      unsigned char const* doc_positions,
+                                      int doc_count);
+int               squat_search_list_words(SquatSearchIndex* index,
+                    SquatListWordCallback handler, void* closure);
+
+
+/* A set of document IDs (or any other non-negative integers, such as
+   message numbers) stored as a compressed bitmap. The values are split
+   into chunks of 65536; sparse chunks are kept as sorted arrays and
+   dense chunks as bit vectors, so large sets stay small and set
+   operations run a word at a time where it matters. */
+typedef struct _SquatDocSet SquatDocSet;
+
+SquatDocSet*      squat_docset_new(void);
+SquatDocSet*      squat_docset_copy(SquatDocSet const* set);
+void              squat_docset_free(SquatDocSet* set);
+void              squat_docset_add(SquatDocSet* set, int doc);
+/* Add every value from 'first' to 'last' inclusive. */
+void              squat_docset_add_range(SquatDocSet* set, int first, int last);
+int               squat_docset_contains(SquatDocSet const* set, int doc);
+int               squat_docset_count(SquatDocSet const* set);
+/* Return the smallest value in the set greater than 'doc', or -1 if
+   there is none. Pass -1 to get the first value. */
+int               squat_docset_next(SquatDocSet const* set, int doc);
+/* set = set AND other, set OR other, set AND NOT other */
+void              squat_docset_and(SquatDocSet* set, SquatDocSet const* other);
+void              squat_docset_or(SquatDocSet* set, SquatDocSet const* other);
+void              squat_docset_andnot(SquatDocSet* set,
+                    SquatDocSet const* other);
+
+
+/* Add to 'result' the IDs of the documents that may include the given
+   search string. This is squat_search_execute without the names. If
+   the index records word positions, documents which contain every
+   word of the string but never at compatible offsets are left out,
+   which removes most false matches for longer strings. Call this
+   after successfully calling squat_search_open, squat_search_list_docs,
+   or squat_search_execute. */
+int               squat_search_execute_docs(SquatSearchIndex* index,
+                    char const* data, int data_len, SquatDocSet* result);
+
+
 /* Release the SQUAT resources associated with an index. The resources
    are released whether this call succeeds or fails.
    Call this anytime. */
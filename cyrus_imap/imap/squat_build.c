@@ -87,6 +87,12 @@
   Each "all document" trie assumes a fixed first word byte, and
   therefore is only of depth 3. The leaves store the list of document
   IDs containing the word.
+
+  Alongside each word, both kinds of trie keep a one-byte mask of the
+  offsets (modulo 8) at which the word starts in the document. The
+  masks travel through the temporary files with the words and end up
+  after each document list in the index file, where searches use them
+  to check that the words of a search string can be adjacent.
 */
 
 #include <config.h>
@@ -178,6 +184,7 @@ static int flush_and_reset_buffered_writes(SquatWriteBuffer* b) {
 typedef struct _WordDocEntry {
   struct _WordDocEntry* next;
   int doc_ID;
+  unsigned char positions;  /* The word's position mask in the document */
 } WordDocEntry;
 
 /* These form the leaves of the "all documents" tries. For each of the
@@ -209,7 +216,8 @@ typedef struct {
 
 /* These form the leaves of the "per document" tries. For each of the
    256 words with trailing byte 'i', presence[i >> 3] & (1 << (i & 7))
-   is 1 if the word occurs in the document, otherwise 0. */
+   is 1 if the word occurs in the document, otherwise 0, and
+   positions[i] is the word's position mask. */
 typedef struct {
   short first_valid_entry;  /* We record the first and last valid
 			       entries in the bit vector below. These
@@ -218,14 +226,21 @@ typedef struct {
 			       by maintaining them here. */
   short last_valid_entry;
   char presence[32];
+  unsigned char positions[256];
 } SquatWordTableLeafPresence;
 
+/* The size of a word record in a temporary file: the word without its
+   first byte, followed by its position mask */
+#define SQUAT_TEMP_WORD_SIZE SQUAT_WORD_SIZE
+
 /* This is an entry in a trie. */
 typedef union _SquatWordTableEntry {
   struct _SquatWordTable* table;   /* This is a branch node */
 
   /* These variants are used for leaves of "per document" tries.
-     They are distinguished by the value of the low bit. */
+     They are distinguished by the value of the low bit. A singleton
+     holds the word's last byte in bits 1-8 and its position mask in
+     bits 9-16. */
   SquatWordTableLeafPresence* leaf_presence;    /* low bit is 0 */
   int leaf_presence_singleton;                  /* low bit is 1 */
 
@@ -514,11 +529,12 @@ static int set_presence_bit(SquatWordTableLeafPresence* p, int ch) {
 
 /* Add a word to the SquatWordTable trie.
    If word_entry is NULL then we are in "per document" mode and just record
-   the presence or absence of a word, not the actual document.
+   the presence or absence of a word, not the actual document, together
+   with the 'position' bit for this occurrence.
    We return SQUAT_ADD_NEW_WORD if this is the first occurrence of the
    word in the trie. */
 static int add_to_table(SquatIndex* index, char const* data, int data_len,
-                        WordDocEntry* word_entry) {
+                        WordDocEntry* word_entry, int position) {
   SquatWordTable* t = index->doc_word_table;
   int ch;
   SquatWordTableEntry* e;
@@ -570,11 +586,14 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
     /* We are in "per document" mode. */
     if (((int)e->leaf_presence & 1) != 0) {
       /* We currently have a singleton here. */
-      int oldch = e->leaf_presence_singleton >> 1;
+      int oldch = (e->leaf_presence_singleton >> 1) & 0xFF;
+      int oldpos = (e->leaf_presence_singleton >> 9) & 0xFF;
 
       /* If the singleton indicates the same word as the current word,
-	 then we don't have to do anything. */
-      if (oldch != ch) {
+	 then we just note the position. */
+      if (oldch == ch) {
+        e->leaf_presence_singleton |= position << 9;
+      } else {
 	/* Otherwise we have to add the new word. This means we have
 	   to convert the singleton to a bit vector. */
         SquatWordTableLeafPresence* p;
@@ -585,9 +604,12 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
         p->first_valid_entry = 256;
         p->last_valid_entry = 0;
         memset(p->presence, 0, sizeof(p->presence));
+        memset(p->positions, 0, sizeof(p->positions));
         e->leaf_presence = p;
 
 	/* Update the bit vector */
+        p->positions[ch] = position;
+        p->positions[oldch] = oldpos;
         set_presence_bit(p, ch);
         return set_presence_bit(p, oldch); /* will always be SQUAT_ADD_NEW_WORD */
       }
@@ -597,10 +619,11 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
 	 sizeof(int). We make sure that the low bit of the pointer in
 	 leaf_presence is definitely 1. */
       e->leaf_presence = (void*)1;
-      e->leaf_presence_singleton = (ch << 1) | 1;
+      e->leaf_presence_singleton = (position << 9) | (ch << 1) | 1;
       return SQUAT_ADD_NEW_WORD;
     } else {
       /* We already have the bit vector, so let's just set another bit in it. */
+      e->leaf_presence->positions[ch] |= position;
       return set_presence_bit(e->leaf_presence, ch);
     }
   } else {
@@ -652,17 +675,20 @@ static int add_to_table(SquatIndex* index, char const* data, int data_len,
 /* Add 'doc_ID' to the list of document IDs for word 'word_ptr'
    in the "all documents" trie. */
 static int add_word_to_trie(SquatIndex* index, char const* word_ptr,
-                            int doc_ID) {
+                            int doc_ID, int positions) {
   WordDocEntry* word_entry = index->word_doc_allocator++;
 
   word_entry->doc_ID = doc_ID;
-  add_to_table(index, word_ptr, SQUAT_WORD_SIZE - 1, word_entry);
+  word_entry->positions = (unsigned char)positions;
+  add_to_table(index, word_ptr, SQUAT_WORD_SIZE - 1, word_entry, 0);
 
   return SQUAT_OK;
 }
 
-/* Add the word 'data' to the "per document" trie for the current document. */
-static int add_word_to_table(SquatIndex* index, char const* data) {
+/* Add the word 'data', which starts at offset 'offset' in the current
+   document, to the "per document" trie for the current document. */
+static int add_word_to_table(SquatIndex* index, char const* data,
+                             int offset) {
   int r;
   int i;
   
@@ -677,7 +703,7 @@ static int add_word_to_table(SquatIndex* index, char const* data) {
     }
   }
 
-  r = add_to_table(index, data, SQUAT_WORD_SIZE, NULL);
+  r = add_to_table(index, data, SQUAT_WORD_SIZE, NULL, 1 << (offset & 7));
   if (r == SQUAT_ADD_NEW_WORD) {
     /* Remember how many unique words in this document started with
        the given first character. */
@@ -713,7 +739,8 @@ int squat_index_append_document(SquatIndex* index, char const* data,
       memcpy(buf, index->runover_buf + i, index->runover_len - i);
       memcpy(buf + index->runover_len - i, data,
              SQUAT_WORD_SIZE - (index->runover_len - i));
-      if (add_word_to_table(index, buf) != SQUAT_OK) {
+      if (add_word_to_table(index, buf, index->current_doc_len
+                            - (index->runover_len - i)) != SQUAT_OK) {
         return SQUAT_ERR;
       }
     }
@@ -721,7 +748,8 @@ int squat_index_append_document(SquatIndex* index, char const* data,
 
   /* Scan main text */
   for (i = 0; i <= data_len - SQUAT_WORD_SIZE; i++) {
-    if (add_word_to_table(index, data + i) != SQUAT_OK) {
+    if (add_word_to_table(index, data + i, index->current_doc_len + i)
+        != SQUAT_OK) {
       return SQUAT_ERR;
     }
   }
@@ -755,17 +783,18 @@ int squat_index_append_document(SquatIndex* index, char const* data,
   return SQUAT_OK;
 }
 
-/* Write the word to the given temporary file. Since each temporary
-   file is dedicated to a given initial byte, the word passed to us
-   has the initial byte removed. */
-static int output_word(SquatWriteBuffer* b, char const* word) {
-  char* buf = prepare_buffered_write(b, SQUAT_WORD_SIZE - 1);
+/* Write the word and its position mask to the given temporary
+   file. Since each temporary file is dedicated to a given initial
+   byte, the word passed to us has the initial byte removed. */
+static int output_word(SquatWriteBuffer* b, char const* word, int positions) {
+  char* buf = prepare_buffered_write(b, SQUAT_TEMP_WORD_SIZE);
   
   if (buf == NULL) {
     return SQUAT_ERR;
   }
   memcpy(buf, word, SQUAT_WORD_SIZE - 1);
-  complete_buffered_write(b, buf + SQUAT_WORD_SIZE - 1);
+  buf[SQUAT_WORD_SIZE - 1] = (char)positions;
+  complete_buffered_write(b, buf + SQUAT_TEMP_WORD_SIZE);
 
   return SQUAT_OK;
 }
@@ -789,9 +818,12 @@ static int write_words(SquatIndex* index, SquatWriteBuffer* b,
 
       if (((int)e->leaf_presence & 1) != 0) {
 	/* Got a singleton at this branch point. Just output the single word. */
+        int positions = (e->leaf_presence_singleton >> 9) & 0xFF;
+
         word[1] = (char)(e->leaf_presence_singleton >> 1);
         e->leaf_presence = NULL; /* clear the leaf out */
-        if (output_word(b, word - (SQUAT_WORD_SIZE - 3)) != SQUAT_OK) {
+        if (output_word(b, word - (SQUAT_WORD_SIZE - 3), positions)
+            != SQUAT_OK) {
           return SQUAT_ERR;
         }
       } else if (e->leaf_presence != NULL) {
@@ -814,7 +846,8 @@ static int write_words(SquatIndex* index, SquatWriteBuffer* b,
 		    if ((bits & 1) != 0) {
 			/* Output a word for each bit that is set */
 			word[1] = (char)(i*8 + j);
-			if (output_word(b, word - (SQUAT_WORD_SIZE - 3)) != SQUAT_OK) {
+			if (output_word(b, word - (SQUAT_WORD_SIZE - 3),
+					p->positions[i*8 + j]) != SQUAT_OK) {
 			    return SQUAT_ERR;
 			}
 		    }
@@ -893,9 +926,9 @@ int squat_index_close_document(SquatIndex* index) {
 
       /* Write out the document ID and the number of words in this
 	 document that start with the initial byte. Then we write out
-	 the list of words themselves, SQUAT_WORD_SIZE-1 bytes
-	 each. Very simple format for the temporary files. We could
-	 compress them more but why bother? */
+	 the list of words themselves, SQUAT_WORD_SIZE-1 bytes each
+	 plus a position mask. Very simple format for the temporary
+	 files. We could compress them more but why bother? */
       write_ptr = prepare_buffered_write(index->index_buffers + i, 20);
       if (write_ptr == NULL) {
         return SQUAT_ERR;
@@ -915,7 +948,7 @@ int squat_index_close_document(SquatIndex* index) {
 	 we thought we added to the trie. It's really easy to break
 	 this invariant with bugs in the above code! */
       assert(index->index_buffers[i].total_output_bytes - cur_offset
-             == (SQUAT_WORD_SIZE - 1)*index->doc_words[i]);
+             == SQUAT_TEMP_WORD_SIZE*index->doc_words[i]);
     }
   }
 
@@ -926,6 +959,137 @@ int squat_index_close_document(SquatIndex* index) {
   return SQUAT_OK;
 }
 
+/* State for squat_index_add_existing */
+typedef struct {
+  SquatIndex*          index;
+  SquatKeepDocCallback keep;
+  void*                closure;
+  int*                 doc_map;      /* maps old document IDs to new
+					document IDs, or -1 for
+					documents we dropped */
+  int                  num_docs;     /* How many old documents have
+					we seen? */
+  int                  doc_map_size; /* The allocated size of doc_map */
+  int                  r;
+} SquatAddExistingState;
+
+/* Copy one old document record (name and size, no text) into the new
+   index, or drop it. */
+static int add_existing_doc(void* closure, SquatListDoc const* doc) {
+  SquatAddExistingState* st = (SquatAddExistingState*)closure;
+  SquatIndex* index = st->index;
+
+  if (st->num_docs >= st->doc_map_size) {
+    st->doc_map_size = st->doc_map_size ? 2*st->doc_map_size : 1000;
+    st->doc_map = (int*)xrealloc(st->doc_map, sizeof(int)*st->doc_map_size);
+  }
+
+  if (st->keep != NULL && !st->keep(st->closure, doc->doc_name)) {
+    st->doc_map[st->num_docs++] = -1;
+    return SQUAT_CALLBACK_CONTINUE;
+  }
+
+  st->doc_map[st->num_docs++] = index->current_doc_ID;
+  if (squat_index_open_document(index, doc->doc_name) != SQUAT_OK) {
+    st->r = SQUAT_ERR;
+    return SQUAT_CALLBACK_ABORT;
+  }
+  index->current_doc_len = (int)doc->size;
+  if (squat_index_close_document(index) != SQUAT_OK) {
+    st->r = SQUAT_ERR;
+    return SQUAT_CALLBACK_ABORT;
+  }
+
+  return SQUAT_CALLBACK_CONTINUE;
+}
+
+/* Record an old word as occurring in each of the kept documents that
+   contained it. We write the same records to the temporary files that
+   squat_index_close_document does, one word per record. The kept
+   documents have the lowest IDs in the new index, so each word's
+   document list stays strictly increasing. */
+static int add_existing_word(void* closure, char const* word,
+                             int const* doc_IDs,
+                             unsigned char const* doc_positions,
+                             int doc_count) {
+  SquatAddExistingState* st = (SquatAddExistingState*)closure;
+  SquatIndex* index = st->index;
+  int ch = (unsigned char)word[0];
+  SquatWriteBuffer* b = index->index_buffers + ch;
+  int i;
+
+  /* Drop the word if the new index doesn't allow one of its
+     characters. */
+  for (i = 0; i < SQUAT_WORD_SIZE; i++) {
+    int c = (unsigned char)word[i];
+
+    if ((index->valid_char_bits[c >> 3] & (1 << (c & 7))) == 0) {
+      return SQUAT_CALLBACK_CONTINUE;
+    }
+  }
+
+  for (i = 0; i < doc_count; i++) {
+    int doc_ID;
+    char* write_ptr;
+
+    if (doc_IDs[i] < 0 || doc_IDs[i] >= st->num_docs) {
+      squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+      st->r = SQUAT_ERR;
+      return SQUAT_CALLBACK_ABORT;
+    }
+    doc_ID = st->doc_map[doc_IDs[i]];
+    if (doc_ID < 0) {
+      continue;
+    }
+
+    if (b->buf == NULL && init_write_buffer_to_temp(index, b) != SQUAT_OK) {
+      st->r = SQUAT_ERR;
+      return SQUAT_CALLBACK_ABORT;
+    }
+
+    write_ptr = prepare_buffered_write(b, 20 + SQUAT_TEMP_WORD_SIZE);
+    if (write_ptr == NULL) {
+      st->r = SQUAT_ERR;
+      return SQUAT_CALLBACK_ABORT;
+    }
+    write_ptr = squat_encode_I(write_ptr, doc_ID);
+    write_ptr = squat_encode_I(write_ptr, 1);
+    memcpy(write_ptr, word + 1, SQUAT_WORD_SIZE - 1);
+    write_ptr[SQUAT_WORD_SIZE - 1] = (char)doc_positions[i];
+    complete_buffered_write(b, write_ptr + SQUAT_TEMP_WORD_SIZE);
+
+    index->total_num_words[ch]++;
+  }
+
+  return SQUAT_CALLBACK_CONTINUE;
+}
+
+int squat_index_add_existing(SquatIndex* index, SquatSearchIndex* old,
+                             SquatKeepDocCallback keep, void* closure) {
+  SquatAddExistingState st;
+
+  squat_set_last_error(SQUAT_ERR_OK);
+
+  st.index = index;
+  st.keep = keep;
+  st.closure = closure;
+  st.doc_map = NULL;
+  st.num_docs = 0;
+  st.doc_map_size = 0;
+  st.r = SQUAT_OK;
+
+  if (squat_search_list_docs(old, add_existing_doc, &st) != SQUAT_OK) {
+    st.r = SQUAT_ERR;
+  }
+  if (st.r == SQUAT_OK
+      && squat_search_list_words(old, add_existing_word, &st) != SQUAT_OK) {
+    st.r = SQUAT_ERR;
+  }
+
+  free(st.doc_map);
+  return st.r;
+}
+
 /* Dump out a branch node of an "all documents" trie to the index
    file. It's dumped as a presence table (telling us which branches
    are non-NULL) followed by a list of relative file offsets in
@@ -1106,7 +1270,8 @@ static int dump_doc_list_docs(SquatIndex* index,
       }
 
       /* reserve more than enough space in the buffer */
-      if ((buf = prepare_buffered_write(&index->out, 10 + run_size))
+      if ((buf = prepare_buffered_write(&index->out,
+                                        20 + run_size + doc_count))
           == NULL) {
         return SQUAT_ERR;
       }
@@ -1114,6 +1279,7 @@ static int dump_doc_list_docs(SquatIndex* index,
       /* If there's only one document, use singleton document format */
       if (doc_count == 1) {
         buf = squat_encode_I(buf, (doc->doc_ID << 1) | 1);
+        *buf++ = (char)doc->positions;
       } else {
 	/* Store the entire document list, with its size first. */
         buf = squat_encode_I(buf, run_size << 1);
@@ -1147,6 +1313,13 @@ static int dump_doc_list_docs(SquatIndex* index,
             buf = squat_encode_I(buf, (run_seq_delta << 1) | 1);
           }
         }
+
+        /* Then the position masks, in the same order */
+        buf = squat_encode_I(buf, doc_count);
+        do {
+          *buf++ = (char)doc->positions;
+          doc = doc->next;
+        } while (doc != first_doc);
       }
 
       complete_buffered_write(&index->out, buf);
@@ -1173,7 +1346,11 @@ static int write_trie_word_data(SquatIndex* index, SquatWordTable* t, int len,
     for (i = t->first_valid_entry; i <= t->last_valid_entry; i++) {
       SquatWordTable* new_t = entries[i].table;
 
-      if (new_t != NULL) {
+      /* Branches left over from the trie for an earlier initial byte
+	 are still allocated but empty. Don't write them out; an empty
+	 presence table reads like a table for bytes 0-7. */
+      if (new_t != NULL
+          && new_t->first_valid_entry <= new_t->last_valid_entry) {
         if (write_trie_word_data(index, new_t, len - 1, offsets + i)
             != SQUAT_OK) {
           return SQUAT_ERR;
@@ -1259,12 +1436,13 @@ static int dump_index_trie_words(SquatIndex* index, int first_char,
     num_words -= doc_words;
 
     while (doc_words > 0) {
-      if (add_word_to_trie(index, word_ptr, doc_ID)
+      if (add_word_to_trie(index, word_ptr, doc_ID,
+                           (unsigned char)word_ptr[SQUAT_WORD_SIZE - 1])
           != SQUAT_OK) {
         r = SQUAT_ERR;
         goto cleanup_map;
       }
-      word_ptr += SQUAT_WORD_SIZE - 1;
+      word_ptr += SQUAT_TEMP_WORD_SIZE;
       doc_words--;
     }
   }
@@ -105,7 +105,7 @@
 /* The format of a SQUAT index file. This record is stored at the
    beginning of the file. */
 typedef struct {
-  char header_text[8];       /* "SQUAT 1\n" */
+  char header_text[8];       /* "SQUAT 2\n" (or "SQUAT 1\n") */
   char doc_list_offset[8];   /* offset to a doc-list structure (see below) */
   char doc_ID_list_offset[8];/* offset to a doc-ID-list structure (see below) */
   char word_list_offset[8];  /* offset to a word-list structure (see below) */
@@ -141,7 +141,9 @@ typedef struct {
    <word-list-trie-1> = <word-list-trie-2>* <trie-index>
    ...
    <word-list-trie-K> = <present-bits> <word-trie-info>*
-   <word-trie-info> = <index-run>"documents"
+   <word-trie-info> = <index-run>"documents" <positions>
+   <positions> = 8"position-mask"                (after a single index)
+               | I"count" 8"position-mask"*      (after a run list)
    <index-run> = I"adjusted-single-index"
                | I"adjusted-run-size" <index-run-list>*
    <index-run-list> = I"adjusted-single-index-delta"
@@ -155,6 +157,12 @@ typedef struct {
    with the bottom bit set to 1.
    The adjusted-run-length is the length of the run of consecutive indices
    shifted left one bit with the bottom bit set to 0.
+   There is one position-mask per document in the run. Bit j is set if
+   the word starts at an offset equal to j modulo 8 in that document.
+   Since the words of a search string must start at consecutive offsets,
+   this lets a search throw out documents which contain all the words
+   but never next to each other. <positions> is absent in "SQUAT 1\n"
+   files.
 
    The last SQUAT_SAFETY_ZONE bytes of the index file must be 0.
    This helps protect us against corrupt index files.
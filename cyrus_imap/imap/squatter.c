@@ -60,11 +60,21 @@
   the UIDs have been renumbered since we created the index (in which
   case the index is useless and is ignored).
 
-  This tool creates new indexes for one or more mailboxes. (We do not
-  support incremental updates to an index yet.) The index is created
-  in "cyrus.squat.tmp" and then, if creation was successful, it is
-  atomically renamed to "cyrus.squat". This guarantees that we don't
-  interfere with anyone who has the old index open.
+  This tool creates new indexes for one or more mailboxes. The index
+  is created in "cyrus.squat.NEW" and then, if creation was
+  successful, it is atomically renamed to "cyrus.squat". This
+  guarantees that we don't interfere with anyone who has the old
+  index open.
+
+  With -i the new index is built incrementally: the documents of
+  messages that are still in the mailbox are carried over from the old
+  index (words and all) and only messages with UIDs above the highest
+  one in the old index are read and indexed.
+
+  With -j N the mailboxes to index are collected up front and handed
+  out to N worker processes through a pipe. With -R the name of each
+  mailbox is appended to a checkpoint file as soon as it is done, so
+  that a run which is interrupted can be resumed where it stopped.
 */
 
 #include <config.h>
@@ -76,9 +86,12 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <string.h>
+#include <signal.h>
+#include <ctype.h>
 
 #include "annotate.h"
 #include "assert.h"
@@ -96,6 +109,11 @@
 #include "map.h"
 #include "squat.h"
 #include "imapd.h"
+#include "hash.h"
+#include "libcyr_cfg.h"
+
+/* records the mailboxes finished by a resumable (-R) run */
+#define FNAME_SQUAT_CHECKPOINT "/squatter.checkpoint"
 
 /* global state */
 const int config_need_data = CONFIG_NEED_PARTITION_DATA;
@@ -132,9 +150,28 @@ const int SKIP_FUZZ = 60;
 
 static int verbose = 0;
 static int mailbox_count = 0;
+static int mailbox_failed = 0;
 static int skip_unmodified = 0;
+static int incremental = 0;
+static int workers = 1;
+static int resumable = 0;
 static SquatStats total_stats;
 
+/* The mailboxes we have been asked to index */
+static char** mailboxes = NULL;
+static int num_mailboxes = 0;
+static int mailboxes_alloc = 0;
+
+static int checkpoint_fd = -1;
+static hash_table checkpoint_done; /* mailboxes a previous run finished */
+
+/* What each worker process reports back when it is done */
+typedef struct {
+  int mailbox_count;
+  int mailbox_failed;
+  SquatStats stats;
+} SquatWorkerTotals;
+
 static void start_stats(SquatStats* stats) {
   stats->index_size = 0;
   stats->indexed_bytes = 0;
@@ -156,7 +193,8 @@ static void print_stats(FILE* out, SquatStats* stats) {
 static int usage(const char *name)
 {
     fprintf(stderr,
-	    "usage: %s [-C <alt_config>] [-r] [-s] [-a] [-v] [mailbox...]\n",
+	    "usage: %s [-C <alt_config>] [-r] [-s] [-a] [-i] [-j <workers>]"
+	    " [-R] [-v] [mailbox...]\n",
 	    name);
  
     exit(EC_USAGE);
@@ -286,6 +324,91 @@ static void stats_callback(void* closure __attribute__((unused)),
   }
 }
 
+/* What we learned from an existing index, for incremental updates. */
+typedef struct {
+  char const* validity;   /* the validity document we expect */
+  int valid;              /* did we find it? */
+  unsigned long last_uid; /* the highest UID in the index */
+  int stale;              /* documents we are going to drop */
+} SquatOldIndexInfo;
+
+/* Get the UID out of a source document name 'xUID' (see above).
+   Returns 0 for anything else. */
+static unsigned long doc_uid(char const* doc_name) {
+  char* end;
+  unsigned long uid;
+
+  if (doc_name[0] == '\0' || strchr("ftcbshm", doc_name[0]) == NULL
+      || !isdigit((unsigned char)doc_name[1])) {
+    return 0;
+  }
+  uid = strtoul(doc_name + 1, &end, 10);
+  return *end == '\0' ? uid : 0;
+}
+
+/* Is the message with this UID still in the currently open mailbox? */
+static int uid_exists(unsigned long uid) {
+  int msgno = index_finduid(uid);
+
+  return msgno > 0 && (unsigned long)index_getuid(msgno) == uid;
+}
+
+static int scan_old_doc(void* closure, SquatListDoc const* doc) {
+  SquatOldIndexInfo* info = (SquatOldIndexInfo*)closure;
+  unsigned long uid;
+
+  if (strcmp(doc->doc_name, info->validity) == 0) {
+    info->valid = 1;
+  } else if ((uid = doc_uid(doc->doc_name)) != 0) {
+    if (uid > info->last_uid) {
+      info->last_uid = uid;
+    }
+    if (!uid_exists(uid)) {
+      info->stale++;
+    }
+  } else {
+    info->stale++;
+  }
+
+  return SQUAT_CALLBACK_CONTINUE;
+}
+
+/* Carry over the documents of messages that are still there. The
+   validity document is written afresh. */
+static int keep_old_doc(void* closure __attribute__((unused)),
+                        char const* doc_name) {
+  unsigned long uid = doc_uid(doc_name);
+
+  return uid != 0 && uid_exists(uid);
+}
+
+/* Open the existing index of the currently open mailbox, if there is
+   a usable one. */
+static SquatSearchIndex* open_old_index(char const* file_name, int* fd,
+                                        SquatOldIndexInfo* info) {
+  SquatSearchIndex* old;
+
+  if ((*fd = open(file_name, O_RDONLY)) < 0) {
+    return NULL;
+  }
+
+  old = squat_search_open(*fd);
+  if (old != NULL
+      && squat_search_list_docs(old, scan_old_doc, info) == SQUAT_OK
+      && info->valid) {
+    return old;
+  }
+
+  /* missing, corrupt or for different UIDs: start from scratch */
+  if (old != NULL) {
+    squat_search_close(old);
+  }
+  close(*fd);
+  *fd = -1;
+  info->last_uid = 0;
+  return NULL;
+}
+
 /* This is called once for each mailbox we're told to index. */
 static int index_me(char *name, int matchlen __attribute__((unused)),
 		    int maycreate __attribute__((unused)),
@@ -304,6 +427,9 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
     char extname[MAX_MAILBOX_NAME+1];
     int use_annot = *((int *) rock);
     int mbtype;
+    SquatSearchIndex* old_index = NULL;
+    SquatOldIndexInfo old_info;
+    int old_fd = -1;
 
     /* Convert internal name to external */
     (*squat_namespace.mboxname_toexternal)(&squat_namespace, name,
@@ -404,14 +530,41 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
         }
     }
 
+    mailbox_read_index_header(&m);
+    index_operatemailbox(&m);
+
+    snprintf(uid_validity_buf, sizeof(uid_validity_buf), 
+	     "validity.%ld", m.uidvalidity);
+
+    memset(&old_info, 0, sizeof(old_info));
+    old_info.validity = uid_validity_buf;
+    if (incremental) {
+      old_index = open_old_index(squat_file_name, &old_fd, &old_info);
+
+      /* nothing expunged and nothing new? */
+      if (old_index != NULL && old_info.stale == 0
+          && index_finduid(old_info.last_uid) == imapd_exists) {
+        if (verbose > 0) {
+          printf("Index of mailbox %s is up to date\n", extname);
+        }
+        squat_search_close(old_index);
+        close(old_fd);
+        index_closemailbox(&m);
+        mailbox_close(&m);
+        return 0;
+      }
+    }
+
     strlcpy(new_file_name, squat_file_name, sizeof(new_file_name));
     strlcat(new_file_name, ".NEW", sizeof(new_file_name));
 
     syslog(LOG_INFO, "indexing mailbox %s... ", extname);
     if (verbose > 0) {
-      printf("Indexing mailbox %s... ", extname);
+      printf("Indexing mailbox %s%s... ", extname,
+             old_index != NULL ? " incrementally" : "");
     }
 
+ restart:
     if ((fd = open(new_file_name,
 		   O_CREAT | O_TRUNC | O_WRONLY, S_IREAD | S_IWRITE))
         < 0) {
@@ -427,10 +580,25 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
       fatal_squat_error("Initializing index");
     }
 
-    /* write an empty document at the beginning to record the validity
-       nonce */
-    snprintf(uid_validity_buf, sizeof(uid_validity_buf), 
-	     "validity.%ld", m.uidvalidity);
+    if (old_index != NULL) {
+      r = squat_index_add_existing(data.index, old_index, keep_old_doc, NULL);
+      squat_search_close(old_index);
+      close(old_fd);
+      old_index = NULL;
+
+      if (r != SQUAT_OK) {
+        /* the old index is no good after all; index everything */
+        syslog(LOG_WARNING, "unable to reuse SQUAT index of %s, "
+               "rebuilding it", extname);
+        squat_index_destroy(data.index);
+        close(fd);
+        old_info.last_uid = 0;
+        goto restart;
+      }
+    }
+
+    /* write an empty document before the new messages to record the
+       validity nonce */
     if (squat_index_open_document(data.index, uid_validity_buf) != SQUAT_OK
         || squat_index_close_document(data.index) != SQUAT_OK) {
       fatal_squat_error("Writing index");
@@ -438,10 +606,8 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
 
     start_stats(&stats);
 
-    mailbox_read_index_header(&m);
-    index_operatemailbox(&m);
-
-    index_getsearchtext(&m, search_text_receiver, &data);
+    index_getsearchtext_since(&m, old_info.last_uid,
+                              search_text_receiver, &data);
 
     index_closemailbox(&m);
     mailbox_close(&m);
@@ -477,6 +643,212 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
     return 0;
 }
 
+/* Read the checkpoint left by an interrupted resumable run, then
+   start recording the mailboxes we finish in it. */
+static void checkpoint_open(void)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+    char buf[MAX_MAILBOX_NAME+2];
+    FILE* f;
+    int n = 0;
+
+    snprintf(fname, sizeof(fname), "%s%s", config_dir,
+	     FNAME_SQUAT_CHECKPOINT);
+
+    construct_hash_table(&checkpoint_done, 1000, 0);
+    if ((f = fopen(fname, "r")) != NULL) {
+	while (fgets(buf, sizeof(buf), f)) {
+	    size_t len = strlen(buf);
+
+	    if (len == 0 || buf[len-1] != '\n') continue; /* torn write */
+	    buf[len-1] = '\0';
+	    hash_insert(buf, (void *) 1, &checkpoint_done);
+	    n++;
+	}
+	fclose(f);
+    }
+    if (n) {
+	syslog(LOG_NOTICE, "resuming: %d mailboxes already indexed", n);
+	if (verbose > 0) {
+	    printf("Resuming: skipping %d mailboxes already indexed\n", n);
+	}
+    }
+
+    checkpoint_fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (checkpoint_fd < 0) {
+	fatal_syserror("Unable to open checkpoint file");
+    }
+}
+
+/* Record that we are done with a mailbox. One write per name, so
+   workers appending at the same time don't interleave. */
+static void checkpoint_mark(const char *name)
+{
+    char buf[MAX_MAILBOX_NAME+2];
+    int len;
+
+    if (checkpoint_fd < 0) return;
+
+    len = snprintf(buf, sizeof(buf), "%s\n", name);
+    if (len < 0 || len >= (int) sizeof(buf) ||
+	write(checkpoint_fd, buf, len) != len) {
+	syslog(LOG_ERR, "IOERROR: writing squatter checkpoint: %m");
+    }
+}
+
+/* A complete run doesn't need its checkpoint any more. */
+static void checkpoint_remove(void)
+{
+    char fname[MAX_MAILBOX_PATH+1];
+
+    if (checkpoint_fd < 0) return;
+
+    close(checkpoint_fd);
+    checkpoint_fd = -1;
+    snprintf(fname, sizeof(fname), "%s%s", config_dir,
+	     FNAME_SQUAT_CHECKPOINT);
+    unlink(fname);
+}
+
+/* Queue a mailbox for indexing, unless a previous run already did it */
+static int add_mailbox(char *name, int matchlen __attribute__((unused)),
+		       int maycreate __attribute__((unused)),
+		       void *rock __attribute__((unused)))
+{
+    if (checkpoint_fd >= 0 && hash_lookup(name, &checkpoint_done)) {
+	return 0;
+    }
+
+    if (num_mailboxes == mailboxes_alloc) {
+	mailboxes_alloc = mailboxes_alloc ? 2 * mailboxes_alloc : 100;
+	mailboxes = (char **) xrealloc(mailboxes,
+				       mailboxes_alloc * sizeof(char *));
+    }
+    mailboxes[num_mailboxes++] = xstrdup(name);
+
+    return 0;
+}
+
+static void index_mailbox(char *name, int *use_annot)
+{
+    if (index_me(name, 0, 0, use_annot) == 0) {
+	checkpoint_mark(name);
+    } else {
+	mailbox_failed++;
+    }
+}
+
+static void open_databases(void)
+{
+    annotatemore_init(0, NULL, NULL);
+    annotatemore_open(NULL);
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+}
+
+static void close_databases(void)
+{
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+    annotatemore_done();
+}
+
+/* A worker process: index the mailboxes whose numbers we read from
+   'jobs' until the parent closes it, then report back on 'results'. */
+static void run_worker(int jobs, int results, int *use_annot)
+{
+    SquatWorkerTotals totals;
+    int i;
+
+    libcyrus_init();
+    open_databases();
+
+    while (read(jobs, &i, sizeof(i)) == sizeof(i)) {
+	index_mailbox(mailboxes[i], use_annot);
+    }
+
+    seen_done();
+    close_databases();
+
+    totals.mailbox_count = mailbox_count;
+    totals.mailbox_failed = mailbox_failed;
+    totals.stats = total_stats;
+    if (write(results, &totals, sizeof(totals)) != sizeof(totals)) {
+	syslog(LOG_ERR, "squatter worker: unable to report totals: %m");
+    }
+
+    cyrus_done();
+    exit(0);
+}
+
+/* Index all the mailboxes with 'workers' processes sharing one queue.
+   Returns the number of workers that failed. */
+static int run_workers(int *use_annot)
+{
+    int jobs[2], results[2];
+    pid_t *pids;
+    SquatWorkerTotals totals;
+    int i, status, failed = 0;
+
+    if (pipe(jobs) < 0 || pipe(results) < 0) {
+	fatal_syserror("Unable to create work queue");
+    }
+
+    /* if every worker dies we get EPIPE, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the workers open the databases for themselves */
+    close_databases();
+    libcyrus_done();
+
+    pids = (pid_t *) xmalloc(workers * sizeof(pid_t));
+    for (i = 0; i < workers; i++) {
+	if ((pids[i] = fork()) < 0) {
+	    fatal_syserror("Unable to fork worker");
+	}
+	if (pids[i] == 0) {
+	    close(jobs[1]);
+	    close(results[0]);
+	    run_worker(jobs[0], results[1], use_annot);
+	}
+    }
+    close(jobs[0]);
+    close(results[1]);
+
+    /* Writes this small are atomic, and so are the workers' reads */
+    for (i = 0; i < num_mailboxes; i++) {
+	if (write(jobs[1], &i, sizeof(i)) != sizeof(i)) {
+	    syslog(LOG_ERR, "squatter: work queue: %m");
+	    break;
+	}
+    }
+    close(jobs[1]);
+
+    while (read(results[0], &totals, sizeof(totals)) == sizeof(totals)) {
+	mailbox_count += totals.mailbox_count;
+	mailbox_failed += totals.mailbox_failed;
+	total_stats.indexed_bytes += totals.stats.indexed_bytes;
+	total_stats.indexed_messages += totals.stats.indexed_messages;
+	total_stats.index_size += totals.stats.index_size;
+    }
+    close(results[0]);
+
+    for (i = 0; i < workers; i++) {
+	if (waitpid(pids[i], &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    failed++;
+	}
+    }
+    free(pids);
+
+    libcyrus_init();
+    open_databases();
+
+    return failed;
+}
+
 int main(int argc, char **argv)
 {
     int opt;
@@ -484,14 +856,14 @@ int main(int argc, char **argv)
     int rflag = 0, use_annot = 0;
     int i;
     char buf[MAX_MAILBOX_PATH+1];
-    int r;
+    int r, failed = 0;
 
     if(geteuid() == 0)
         fatal("must run as the Cyrus user", EC_USAGE);
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:rsav")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:rsaij:Rv")) != EOF) {
 	switch (opt) {
 	case 'C': /* alt config file */
           alt_config = optarg;
@@ -513,6 +885,19 @@ int main(int argc, char **argv)
 	  use_annot = 1;
 	  break;
 
+	case 'i': /* incremental */
+	  incremental = 1;
+	  break;
+
+	case 'j': /* number of worker processes */
+	  workers = atoi(optarg);
+	  if (workers < 1) usage("squatter");
+	  break;
+
+	case 'R': /* resumable */
+	  resumable = 1;
+	  break;
+
 	default:
 	    usage("squatter");
 	}
@@ -527,13 +912,11 @@ int main(int argc, char **argv)
 	fatal(error_message(r), EC_CONFIG);
     }
 
-    annotatemore_init(0, NULL, NULL);
-    annotatemore_open(NULL);
-
-    mboxlist_init(0);
-    mboxlist_open(NULL);
+    open_databases();
     mailbox_initialize();
 
+    if (resumable) checkpoint_open();
+
     start_stats(&total_stats);
 
     if (optind == argc) {
@@ -544,18 +927,27 @@ int main(int argc, char **argv)
 	assert(!rflag);
 	strlcpy(buf, "*", sizeof(buf));
 	(*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
-					    0, 0, index_me, &use_annot);
+					    0, 0, add_mailbox, NULL);
     }
 
     for (i = optind; i < argc; i++) {
 	/* Translate any separators in mailboxname */
 	(*squat_namespace.mboxname_tointernal)(&squat_namespace, argv[i],
 					       NULL, buf);
-	index_me(buf, 0, 0, &use_annot);
+	add_mailbox(buf, 0, 0, NULL);
 	if (rflag) {
 	    strlcat(buf, ".*", sizeof(buf));
 	    (*squat_namespace.mboxlist_findall)(&squat_namespace, buf, 1,
-						0, 0, index_me, &use_annot);
+						0, 0, add_mailbox, NULL);
+	}
+    }
+
+    if (workers > 1 && num_mailboxes > 1) {
+	if (workers > num_mailboxes) workers = num_mailboxes;
+	failed = run_workers(&use_annot);
+    } else {
+	for (i = 0; i < num_mailboxes; i++) {
+	    index_mailbox(mailboxes[i], &use_annot);
 	}
     }
 
@@ -565,15 +957,31 @@ int main(int argc, char **argv)
       print_stats(stdout, &total_stats);
     }
 
-    syslog(LOG_NOTICE, "done indexing mailboxes");
+    if (failed || mailbox_failed) {
+	/* leave the checkpoint for -R to pick up */
+	if (failed) {
+	    syslog(LOG_ERR, "%d squatter workers failed", failed);
+	    fprintf(stderr, "squatter: %d workers failed\n", failed);
+	}
+	if (mailbox_failed) {
+	    syslog(LOG_ERR, "%d mailboxes could not be indexed",
+		   mailbox_failed);
+	    fprintf(stderr, "squatter: %d mailboxes could not be indexed\n",
+		    mailbox_failed);
+	}
+    } else {
+	syslog(LOG_NOTICE, "done indexing mailboxes");
+	checkpoint_remove();
+    }
+
+    for (i = 0; i < num_mailboxes; i++) free(mailboxes[i]);
+    free(mailboxes);
+    if (resumable) free_hash_table(&checkpoint_done, NULL);
 
     seen_done();
-    mboxlist_close();
-    mboxlist_done();
-    annotatemore_close();
-    annotatemore_done();
+    close_databases();
 
     cyrus_done();
     
-    return 0;
+    return (failed || mailbox_failed) ? EC_TEMPFAIL : 0;
 }
@@ -3191,6 +3191,26 @@ struct backend *replica_connect(struct backend *be, const char *servername,
 	_exit(1);
     }
 
+#ifdef HAVE_ZLIB
+    /* compress the channel if we can, bandwidth is usually scarcer
+       than CPU between a master and its replica */
+    if (config_getswitch(IMAPOPT_SYNC_COMPRESS) &&
+	CAPA(be, CAPA_COMPRESS)) {
+	prot_printf(be->out, "COMPRESS DEFLATE\r\n");
+	prot_flush(be->out);
+
+	if (sync_parse_code("COMPRESS", be->in,
+			    SYNC_PARSE_EAT_OKLINE, NULL) == 0) {
+	    if (prot_setcompress(be->in) == EOF ||
+		prot_setcompress(be->out) == EOF) {
+		fatal("prot_setcompress() failed", EC_TEMPFAIL);
+	    }
+	    if (verbose) printf("Compressing connection to '%s'\n",
+				servername);
+	}
+    }
+#endif /* HAVE_ZLIB */
+
     return be;
 }
 
@@ -79,6 +79,7 @@
 #include "retry.h"
 #include "sync_support.h"
 #include "sync_commit.h"
+#include "headerindex.h"
 
 /* ====================================================================== */
 
@@ -109,6 +110,7 @@ sync_combine_commit(struct mailbox *mailbox,
     int   n, r = 0, rc;
     struct txn *tid = NULL;
     modseq_t highestmodseq = 0;
+    struct headerindex_txn *hindex = NULL;
 
     if (upload_list->count == 0) return(0);   /* NOOP */
 
@@ -208,6 +210,9 @@ sync_combine_commit(struct mailbox *mailbox,
                    1, mailbox_cache_size(mailbox, msgno), newcache);
             fwrite(buf, 1, mailbox->record_size, newindex);
 
+            headerindex_addmsgfile(&hindex, mailbox,
+                                   record.uid, record.header_size);
+
             if (++msgno <= mailbox->exists)
                 mailbox_read_index_record(mailbox, msgno, &record);
         } else {
@@ -260,6 +265,9 @@ sync_combine_commit(struct mailbox *mailbox,
 
             fwrite(buf, 1, mailbox->record_size, newindex);
 
+            headerindex_addmsgfile(&hindex, mailbox,
+                                   item->uid, message->hdr_size);
+
             /* Discard existing msg on server because of UUID conflict */
             /* Need to reclaim allocated space and resources */
             if (record.uid == item->uid) {
@@ -381,6 +389,10 @@ sync_combine_commit(struct mailbox *mailbox,
         goto fail;
     }
 
+    /* Messages went in among the existing ones, so the header index
+     * can't just carry on: replace it (we saw every message above) */
+    headerindex_rebuild(mailbox, &hindex);
+
     /* No more fail clauses after this point: just clean up */
     free(buf);
     fclose(newindex);
@@ -388,6 +400,7 @@ sync_combine_commit(struct mailbox *mailbox,
     return(r);
 
  fail:
+    headerindex_abort(&hindex);
     if (buf) free(buf);
     if (newindex) fclose(newindex);
     if (newcache) fclose(newcache);
@@ -476,6 +489,8 @@ sync_append_commit(struct mailbox *mailbox,
     int   n, r = 0;
     struct txn *tid = NULL;
     modseq_t highestmodseq = 0;
+    struct headerindex_txn *hindex = NULL;
+    struct index_record last;
 
     if (upload_list->count == 0) return(0);   /* NOOP */
 
@@ -660,6 +675,19 @@ sync_append_commit(struct mailbox *mailbox,
 	}
     }
 
+    /* Record the new messages' header fields while still locked */
+    if (headerindex_enabled()) {
+	if (!mailbox->exists) headerindex_setprev(&hindex, 0);
+	else if (!mailbox_read_index_record(mailbox, mailbox->exists, &last)) {
+	    headerindex_setprev(&hindex, last.uid);
+	}
+	for (item = upload_list->head ; item ; item = item->next) {
+	    headerindex_addmsgfile(&hindex, mailbox,
+				   item->uid, item->message->hdr_size);
+	}
+	headerindex_commit(mailbox, &hindex);
+    }
+
     free(hbuf);
     free(index_chunk);
     free(cache_iovec);
@@ -797,7 +825,7 @@ sync_setflags_commit(struct mailbox *mailbox, struct sync_flag_list *flag_list)
     struct index_record record;
     struct sync_flag_item *item = flag_list->head;
     unsigned long msgno = 1;
-    int n, r = 0;
+    int n, r = 0, dirty = 0;
     time_t now = time(NULL);
 
     if (!r) r = mailbox_lock_header(mailbox);
@@ -841,12 +869,22 @@ sync_setflags_commit(struct mailbox *mailbox, struct sync_flag_list *flag_list)
             }
             record.last_updated = ((record.last_updated >= now) ?
                                    record.last_updated + 1 : now);
+	    if (mailbox->options & OPT_IMAP_CONDSTORE) {
+		/* bump MODSEQ so index_check() notices the change */
+		record.modseq = mailbox->highestmodseq + 1;
+	    }
             mailbox_write_index_record(mailbox, msgno, &record, 0);
+	    dirty++;
             item = item->next;
         }
         msgno++;
     }
 
+    if (dirty && (mailbox->options & OPT_IMAP_CONDSTORE)) {
+	/* bump HIGHESTMODSEQ */
+	mailbox->highestmodseq++;
+    }
+
     if (!r) r = mailbox_write_index_header(mailbox);
     if (!r) mailbox_unlock_index(mailbox);
     if (!r) mailbox_unlock_header(mailbox);
@@ -69,6 +69,10 @@
 #include <sasl/sasl.h>
 #include <sasl/saslutil.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
 #include "acl.h"
 #include "annotate.h"
 #include "append.h"
@@ -146,10 +150,14 @@ struct protstream *sync_in = NULL;
 static int sync_logfd = -1;
 
 int sync_starttls_done = 0;
+static int sync_compress_done = 0;
 
 static void cmdloop(void);
 static void cmd_authenticate(char *mech, char *resp);
 static void cmd_starttls(void);
+#ifdef HAVE_ZLIB
+static void cmd_compress(char *alg);
+#endif
 static void cmd_lock(struct sync_lock *lock);
 static void cmd_unlock(struct sync_lock *lock, int restart);
 static void cmd_select(struct mailbox **mailboxp, char *name);
@@ -273,6 +281,7 @@ static void sync_reset(void)
 	sync_saslconn = NULL;
     }
     sync_starttls_done = 0;
+    sync_compress_done = 0;
 
     if(saslprops.iplocalport) {
        free(saslprops.iplocalport);
@@ -379,6 +388,11 @@ static void dobanner(void)
     if (tls_enabled() && !sync_starttls_done) {
 	prot_printf(sync_out, "* STARTTLS\r\n");
     }
+#ifdef HAVE_ZLIB
+    if (!sync_compress_done) {
+	prot_printf(sync_out, "* COMPRESS DEFLATE\r\n");
+    }
+#endif
 
     prot_printf(sync_out,
 		"* OK %s Cyrus sync server %s\r\n",
@@ -696,6 +710,18 @@ static void cmdloop(void)
             }
             break;
 	case 'C':
+#ifdef HAVE_ZLIB
+            if (!strcmp(cmd.s, "Compress")) {
+		if (c != ' ') goto missingargs;
+		c = getword(sync_in, &arg1);
+		if (c == EOF) goto missingargs;
+		if (c == '\r') c = prot_getc(sync_in);
+		if (c != '\n') goto extraargs;
+
+		cmd_compress(arg1.s);
+		continue;
+	    }
+#endif
             if (!strcmp(cmd.s, "Create")) {
 		if (c != ' ') goto missingargs;
 		c = getastring(sync_in, sync_out, &arg1);
@@ -1378,6 +1404,36 @@ static void cmd_starttls(void)
 }
 #endif /* HAVE_SSL */
 
+#ifdef HAVE_ZLIB
+static void cmd_compress(char *alg)
+{
+    if (sync_compress_done) {
+	prot_printf(sync_out, "NO %s\r\n", "Compression already active");
+	return;
+    }
+    if (strcasecmp(alg, "DEFLATE")) {
+	prot_printf(sync_out, "NO Unknown COMPRESS algorithm: %s\r\n", alg);
+	return;
+    }
+    if (ZLIB_VERSION[0] != zlibVersion()[0]) {
+	prot_printf(sync_out,
+		    "NO Error initializing %s (incompatible zlib version)\r\n",
+		    alg);
+	return;
+    }
+
+    prot_printf(sync_out, "OK %s active\r\n", alg);
+
+    /* everything after the response is compressed */
+    if (prot_setcompress(sync_in) == EOF ||
+	prot_setcompress(sync_out) == EOF) {
+	fatal("prot_setcompress() failed: cmd_compress()", EC_TEMPFAIL);
+    }
+
+    sync_compress_done = 1;
+}
+#endif /* HAVE_ZLIB */
+
 static int
 user_master_is_local(char *user)
 {
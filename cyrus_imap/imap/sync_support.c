@@ -1315,6 +1315,7 @@ int sync_getsimple(struct protstream *input, struct protstream *output,
     map_free(&msg_base, &msg_len);
 
     message->hdr_size     = record.header_size;
+    message->cache_version = record.cache_version;
     message->cache_offset = record.cache_offset;
     message->cache_size 
         = lseek(list->cache_fd, 0, SEEK_CUR) - record.cache_offset;
@@ -120,7 +120,7 @@ void list_expunged(struct mailbox *mailbox,
 {
     const char *rec;
     unsigned msgno;
-    unsigned long uid, size, cache_offset;
+    unsigned long uid, size, cache_offset, cache_version;
     time_t internaldate, sentdate, last_updated;
     const char *cacheitem;
 
@@ -134,6 +134,7 @@ void list_expunged(struct mailbox *mailbox,
 	sentdate = ntohl(*((bit32 *)(rec+OFFSET_SENTDATE)));
 	size = ntohl(*((bit32 *)(rec+OFFSET_SIZE)));
 	cache_offset = ntohl(*((bit32 *)(rec+OFFSET_CACHE_OFFSET)));
+	cache_version = ntohl(*((bit32 *)(rec+OFFSET_CACHE_VERSION)));
 	last_updated = ntohl(*((bit32 *)(rec+OFFSET_LAST_UPDATED)));
 
 	printf("UID: %lu\n", uid);
@@ -142,12 +143,8 @@ void list_expunged(struct mailbox *mailbox,
 	printf("\tRecv: %s", ctime(&internaldate));
 	printf("\tExpg: %s", ctime(&last_updated));
 
-	cacheitem = mailbox->cache_base + cache_offset;
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip envelope */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body structure */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip body */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip binary body */
-	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip cached headers */
+	cacheitem = CACHE_ITEM(mailbox->cache_base + cache_offset,
+			       cache_version, CACHE_FROM);
 
 	printf("\tFrom: %s\n", cacheitem + CACHE_ITEM_SIZE_SKIP);
 	cacheitem = CACHE_ITEM_NEXT(cacheitem); /* skip from */
@@ -46,6 +46,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* SSE2/AVX2 search kernels, picked at runtime */
+#if defined(HAVE___ATTRIBUTE__) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define HAVE_SEARCH_SIMD
+#include <immintrin.h>
+#endif
+
 #include "assert.h"
 #include "charset.h"
 #include "xmalloc.h"
@@ -448,22 +456,32 @@ void charset_freepat(comp_pat *pat)
 }
 
 /*
- * Search for the string 'substr', with compiled pattern 'pat'
- * in the string 's', with length 'len'.  Return nonzero if match
+ * Substring search kernels.  Each returns nonzero iff the PATLEN(pat)
+ * bytes of 'substr' occur in the 'len' bytes at 's'; with 'fold' set,
+ * ASCII letters match regardless of case.
+ *
+ * search_bmh() is the portable Boyer-Moore-Horspool loop.  On x86 the
+ * SSE2 and AVX2 kernels instead compare the first and the last byte of
+ * the pattern against 16 or 32 positions at a time and only look at
+ * the rest of the pattern where both match.  The kernel is picked on
+ * first use according to what the CPU supports.
  */
-int charset_searchstring(const char *substr, comp_pat *pat,
-    const char *s, int len)
+typedef int search_kernel_t(const char *substr, comp_pat *pat, int fold,
+			    const char *s, int len);
+
+static int search_bmh(const char *substr, comp_pat *pat, int fold,
+		      const char *s, int len)
 {
+    int *skip = fold ? PATASCII(pat) : pat;
     int i, j, large;
-    
-    assert(pat != NULL);
+
     i = PATLEN(pat) - 1;
-    if (i < 0) return 1;
-    pat[PATLASTCHAR(pat)] = large = len + i + 2;
+    skip[PATLASTCHAR(pat)] = large = len + i + 2;
+    if (fold) skip[PATOTHERLASTCHAR(pat)] = large;
     for (;;) {
 	/* Inner loop -- scan until last char match or end of string */
 	while (i < len) {
-	    i += pat[(unsigned char)s[i]];
+	    i += skip[(unsigned char)s[i]];
 	}
 
 	/* End of string */
@@ -472,19 +490,157 @@ int charset_searchstring(const char *substr, comp_pat *pat,
 	/* Last char match--back up and do compare */
 	i -= large + 1;
 	j = PATLEN(pat) - 2;
-	while (j >= 0 && s[i] == substr[j]) {
+	while (j >= 0 && (fold ? TOLOWER(s[i]) == TOLOWER(substr[j]) :
+			  s[i] == substr[j])) {
 	    i--;
 	    j--;
 	}
 	if (j < 0) return 1;	/* Found match */
-	if (pat[(unsigned char)s[i]] == large ||
-	    pat[(unsigned char)s[i]] < PATLEN(pat)-j) {
+	if (skip[(unsigned char)s[i]] == large ||
+	    skip[(unsigned char)s[i]] < PATLEN(pat)-j) {
 	    i += PATLEN(pat) - j;
 	}
 	else {
-	    i += pat[(unsigned char)s[i]];
+	    i += skip[(unsigned char)s[i]];
+	}
+    }
+}
+
+#ifdef HAVE_SEARCH_SIMD
+/* Does the pattern occur at 's'?  The caller has checked both ends. */
+static int search_matchat(const char *substr, int patlen, int fold,
+			  const char *s)
+{
+    int j;
+
+    if (!fold) return !memcmp(s, substr, patlen);
+    for (j = 1; j < patlen - 1; j++) {
+	if (TOLOWER(s[j]) != TOLOWER(substr[j])) return 0;
+    }
+    return 1;
+}
+
+/*
+ * The bits to OR into a byte of text so that a case-insensitive
+ * compare against 'c' becomes an exact one: 0x20 for ASCII letters.
+ */
+#define SEARCH_FOLDBITS(fold, c) \
+    (((fold) && TOLOWER(c) != TOUPPER(c)) ? 0x20 : 0)
+
+/* Check the positions too close to the end for a whole vector. */
+static int search_tail(const char *substr, int patlen, int fold,
+		       const char *s, int i, int len)
+{
+    int first = (unsigned char)substr[0], last = (unsigned char)substr[patlen-1];
+    int ffirst = SEARCH_FOLDBITS(fold, first);
+    int flast = SEARCH_FOLDBITS(fold, last);
+
+    for (; i + patlen <= len; i++) {
+	if (((unsigned char)s[i] | ffirst) == (first | ffirst) &&
+	    ((unsigned char)s[i+patlen-1] | flast) == (last | flast) &&
+	    search_matchat(substr, patlen, fold, s + i)) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static int search_sse2(const char *substr, comp_pat *pat, int fold,
+		       const char *s, int len)
+{
+    int patlen = PATLEN(pat);
+    int first = (unsigned char)substr[0], last = (unsigned char)substr[patlen-1];
+    int ffirst = SEARCH_FOLDBITS(fold, first);
+    int flast = SEARCH_FOLDBITS(fold, last);
+    __m128i vfirst = _mm_set1_epi8((char)(first | ffirst));
+    __m128i vlast = _mm_set1_epi8((char)(last | flast));
+    __m128i vffirst = _mm_set1_epi8((char)ffirst);
+    __m128i vflast = _mm_set1_epi8((char)flast);
+    int i;
+
+    for (i = 0; i + patlen - 1 + 16 <= len; i += 16) {
+	__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(s + i + patlen - 1));
+	unsigned mask;
+
+	a = _mm_cmpeq_epi8(_mm_or_si128(a, vffirst), vfirst);
+	b = _mm_cmpeq_epi8(_mm_or_si128(b, vflast), vlast);
+	mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(a, b));
+	while (mask) {
+	    if (search_matchat(substr, patlen, fold,
+			       s + i + __builtin_ctz(mask))) {
+		return 1;
+	    }
+	    mask &= mask - 1;
+	}
+    }
+    return search_tail(substr, patlen, fold, s, i, len);
+}
+
+__attribute__((target("avx2")))
+static int search_avx2(const char *substr, comp_pat *pat, int fold,
+		       const char *s, int len)
+{
+    int patlen = PATLEN(pat);
+    int first = (unsigned char)substr[0], last = (unsigned char)substr[patlen-1];
+    int ffirst = SEARCH_FOLDBITS(fold, first);
+    int flast = SEARCH_FOLDBITS(fold, last);
+    __m256i vfirst = _mm256_set1_epi8((char)(first | ffirst));
+    __m256i vlast = _mm256_set1_epi8((char)(last | flast));
+    __m256i vffirst = _mm256_set1_epi8((char)ffirst);
+    __m256i vflast = _mm256_set1_epi8((char)flast);
+    int i;
+
+    for (i = 0; i + patlen - 1 + 32 <= len; i += 32) {
+	__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+	__m256i b = _mm256_loadu_si256((const __m256i *)(s + i + patlen - 1));
+	unsigned mask;
+
+	a = _mm256_cmpeq_epi8(_mm256_or_si256(a, vffirst), vfirst);
+	b = _mm256_cmpeq_epi8(_mm256_or_si256(b, vflast), vlast);
+	mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+	while (mask) {
+	    if (search_matchat(substr, patlen, fold,
+			       s + i + __builtin_ctz(mask))) {
+		return 1;
+	    }
+	    mask &= mask - 1;
 	}
     }
+    return search_tail(substr, patlen, fold, s, i, len);
+}
+#endif /* HAVE_SEARCH_SIMD */
+
+static search_kernel_t *search_kernel = NULL;
+
+static search_kernel_t *search_pick_kernel(void)
+{
+#ifdef HAVE_SEARCH_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return search_avx2;
+    if (__builtin_cpu_supports("sse2")) return search_sse2;
+#endif
+    return search_bmh;
+}
+
+static search_kernel_t *search_get_kernel(void)
+{
+    if (!search_kernel) search_kernel = search_pick_kernel();
+    return search_kernel;
+}
+
+/*
+ * Search for the string 'substr', with compiled pattern 'pat'
+ * in the string 's', with length 'len'.  Return nonzero if match
+ */
+int charset_searchstring(const char *substr, comp_pat *pat,
+    const char *s, int len)
+{
+    assert(pat != NULL);
+    if (PATLEN(pat) == 0) return 1;
+    if (len < PATLEN(pat)) return 0;
+    return search_get_kernel()(substr, pat, 0, s, len);
 }    
 
 static int xlate(int index, char *to) {
@@ -541,6 +697,26 @@ static rawproc_t charset_readqpmapnl;
 static rawproc_t charset_readbase64;
 static rawproc_t charset_readbase64_nospc;
 
+/*
+ * Data moves through the decoders in blocks of this size: raw data is
+ * transfer-decoded a block at a time, converted a block at a time, and
+ * searched or handed to the index receiver a block at a time.
+ */
+#define CHARSET_BLOCKSIZE (64*1024)
+
+/*
+ * Table-driven fast path for converting into canonical searching form.
+ * For each byte in a character set's initial table whose translation
+ * is at most three literal bytes, 'len' is the number of bytes and
+ * 'out' the bytes themselves.  Anything else (table switches, UTF-7
+ * and UTF-8 sequences, long translations) has 'len' -1 and goes
+ * through TRANSLATE.
+ */
+struct canon_map {
+    signed char len[256];
+    unsigned char out[256][4];
+};
+
 /*
  * State for the various charset_searchfile() helper functions
  */
@@ -548,13 +724,16 @@ struct input_state {
     rawproc_t *rawproc;	/* Function to read and transfer-decode data */
     const char *rawbase;	/* Location in mapped file of raw data */
     int rawlen;		/* # bytes raw data left to read from file */
-    char decodebuf[2048];	/* Buffer of data deocded, but not converted
-				 * into canonical searching form */
+    char decodebuf[CHARSET_BLOCKSIZE]; /* Buffer of data deocded, but not
+				 * converted into canonical searching form */
     int decodestart, decodeleft; /* Location/count of decoded data */
     struct decode_state decodestate; /* Charset state to convert decoded data
 				  * into canonical searching form */
+    const struct canon_map *canon; /* Fast path for decodestate, or NULL */
 };
 
+static const struct canon_map *charset_canon_map(int charset);
+
 
 /*
  * Search for the string 'substr' in the next 'len' bytes of 
@@ -567,41 +746,48 @@ struct input_state {
 int charset_searchfile(const char *substr, comp_pat *pat,
     const char *msg_base, int mapnl, int len, int charset, int encoding)
 {
-    int substrlen = PATLEN(pat);
-    char *buf, smallbuf[2048];
+    int found = 0;
+
+    return charset_searchfile_multi(1, &substr, &pat, &found,
+				    msg_base, mapnl, len, charset, encoding);
+}
+
+/*
+ * Search for all of the 'npat' strings 'substr' (with compiled
+ * patterns 'pat') in one pass over the data, which is described as for
+ * charset_searchfile().  Strings whose 'found' entry is already set
+ * are not searched for; the entry is set for each string found.
+ * Returns the number of strings found.
+ */
+int charset_searchfile_multi(int npat, const char * const *substr,
+			     comp_pat * const *pat, int *found,
+			     const char *msg_base, int mapnl, int len,
+			     int charset, int encoding)
+{
+    char *buf, smallbuf[CHARSET_BLOCKSIZE];
+    char *live, smalllive[32];
     int bufsize;
-    int n;
-    int i, j, large;
+    int maxlen = 0, left = 0, nfound = 0;
+    int n, i, carry, fold;
+    int (*readproc)(struct input_state *state, char *buf, int size);
+    search_kernel_t *kernel = search_get_kernel();
     struct input_state state;
     
     /* Initialize character set mapping */
     if (charset < 0 || charset >= chartables_num_charsets) return 0;
     START(state.decodestate, chartables_charset_table[charset].table);
     state.decodeleft = 0;
+    state.canon = charset_canon_map(charset);
 
-    /* check for trivial search */
-    if (substrlen == 0) return 1;
-
-    /*
-     * Select buffer to hold canonical searching fomat data to
-     * search
-     */
-    if (substrlen < sizeof(smallbuf)/2) {
-	bufsize = sizeof(smallbuf);
-	buf = smallbuf;
-    }
-    else {
-	bufsize = substrlen+sizeof(smallbuf);
-	buf = xmalloc(bufsize);
-    }
-
-    /* Optimized searching of us-ascii, using boyer-moore */
+    /* Initialize transfer-decoding */
+    state.rawbase = msg_base;
+    state.rawlen = len;
     if (charset == 0) {
-	/* Initialize transfer-decoding */
-	state.rawbase = msg_base;
-	state.rawlen = len;
-	/* don't need to special case mapnl since all such chars will
-	   be ignored, anyway */
+	/*
+	 * Optimized searching of us-ascii: search the raw text without
+	 * converting it, ignoring case. Don't need to special case mapnl
+	 * since all such chars will be ignored, anyway
+	 */
 	switch (encoding) {
 	case ENCODING_NONE:
 	    state.rawproc = charset_readplain_nospc;
@@ -622,148 +808,104 @@ int charset_searchfile(const char *substr, comp_pat *pat,
 	    /* Don't know encoding--nothing can match */
 	    return 0;
 	}
-	
-	if (PATASCII(pat)[0x80] == 0) {
-	    /* 8-bit chars in pattern--search must fail */
-	    if (buf != smallbuf) free(buf);
-	    return 0;
-	}
+	readproc = state.rawproc;
+	fold = 1;
+    }
+    else {
+	/* Do the (generalized) search */
+	switch (encoding) {
+	case ENCODING_NONE:
+	    state.rawproc = mapnl ? charset_readmapnl : charset_readplain;
+	    break;
 
-	n = (*state.rawproc)(&state, buf, bufsize);
-	if (n < substrlen) {
-	    if (buf != smallbuf) free(buf);
-	    return 0;
-	}
-	i = substrlen - 1;
-	PATASCII(pat)[PATLASTCHAR(pat)] =
-	  PATASCII(pat)[PATOTHERLASTCHAR(pat)] = large = bufsize + i + 2;
-
-	for (;;) {
-	    /* Inner loop -- scan until last char match or end of buffer */
-	    while (i < n) {
-		i += PATASCII(pat)[(unsigned char)buf[i]];
-	    }
+	case ENCODING_QP:
+	    state.rawproc = mapnl ? charset_readqpmapnl : charset_readqp;
+	    break;
 
-	    /* End of buffer */
-	    if (i < large) {
-		/* Read in more stuff */
-		j = i-n;
-		strncpy(buf, buf+i-(substrlen-1), substrlen-1-j);
-		n = (*state.rawproc)(&state, buf+substrlen-1-j, bufsize-substrlen+1+j);
-		i = substrlen-1;
-		if (n > 0) {
-		    n += i-j;
-		    continue;
-		}
-		if (buf != smallbuf) free(buf);
-		return 0;
-	    }
+	case ENCODING_BASE64:
+	    state.rawproc = charset_readbase64;
+	    /* XXX have to have nl-mapping base64 in order to
+	     * properly count \n as 2 raw characters
+	     */
+	    break;
 
-	    /* Last char match--back up and do compare */
-	    i -= large + 1;
-	    j = PATLEN(pat) - 2;
-	    while (j >= 0 && TOLOWER(buf[i]) == TOLOWER(substr[j])) {
-		i--;
-		j--;
-	    }
-	    if (j < 0) {
-		/* Found match */
-		if (buf != smallbuf) free(buf);
-		return 1;
-	    }
-	    if (PATASCII(pat)[(unsigned char)buf[i]] == large ||
-		PATASCII(pat)[(unsigned char)buf[i]] < PATLEN(pat)-j) {
-		i += PATLEN(pat) - j;
-	    }
-	    else {
-		i += PATASCII(pat)[(unsigned char)buf[i]];
-	    }
+	default:
+	    /* Don't know encoding--nothing can match */
+	    return 0;
 	}
-	/* NOTREACHED */
+	readproc = charset_readconvert;
+	fold = 0;
     }
 
-    /* Do the (generalized) search */
-
-    /* Initialize transfer-decoding */
-    state.rawbase = msg_base;
-    state.rawlen = len;
-    switch (encoding) {
-    case ENCODING_NONE:
-	state.rawproc = mapnl ? charset_readmapnl : charset_readplain;
-	break;
+    /* Which strings are we still looking for? */
+    live = npat <= sizeof(smalllive) ? smalllive : xmalloc(npat);
+    for (i = 0; i < npat; i++) {
+	live[i] = 0;
+	if (found[i]) continue;
 
-    case ENCODING_QP:
-	state.rawproc = mapnl ? charset_readqpmapnl : charset_readqp;
-	break;
+	/* check for trivial search */
+	if (PATLEN(pat[i]) == 0) {
+	    found[i] = 1;
+	    nfound++;
+	    continue;
+	}
 
-    case ENCODING_BASE64:
-	state.rawproc = charset_readbase64;
-	/* XXX have to have nl-mapping base64 in order to
-	 * properly count \n as 2 raw characters
-	 */
-	break;
+	/* 8-bit chars in pattern--us-ascii search must fail */
+	if (fold && PATASCII(pat[i])[0x80] == 0) continue;
 
-    default:
-	/* Don't know encoding--nothing can match */
-	return 0;
+	live[i] = 1;
+	left++;
+	if (PATLEN(pat[i]) > maxlen) maxlen = PATLEN(pat[i]);
     }
+    if (!left) goto done;
 
-    n = charset_readconvert(&state, buf, bufsize);
-    if (n < substrlen) {
-	if (buf != smallbuf) free(buf);
-	return 0;
+    /*
+     * Select buffer to hold canonical searching fomat data to
+     * search
+     */
+    if (maxlen < sizeof(smallbuf)/2) {
+	bufsize = sizeof(smallbuf);
+	buf = smallbuf;
+    }
+    else {
+	bufsize = maxlen+sizeof(smallbuf);
+	buf = xmalloc(bufsize);
     }
-    i = substrlen - 1;
-    pat[PATLASTCHAR(pat)] = large = bufsize + i + 2;
-    for (;;) {
-	/* Inner loop -- scan until last char match or end of buffer */
-	while (i < n) {
-	    i += pat[(unsigned char)buf[i]];
-	}
 
-	/* End of buffer */
-	if (i < large) {
-	    /* Read in more stuff */
-	    j = i-n;
-	    strncpy(buf, buf+i-(substrlen-1), substrlen-1-j);
-	    n = charset_readconvert(&state, buf+substrlen-1-j,
-				    bufsize-substrlen+1+j);
-	    i = substrlen-1;
-	    if (n > 0) {
-		n += i-j;
-		continue;
+    /*
+     * Search each bufferful for every string, then keep the last
+     * maxlen-1 bytes for matches that straddle the next read.
+     */
+    n = (*readproc)(&state, buf, bufsize);
+    while (n > 0) {
+	for (i = 0; i < npat; i++) {
+	    if (live[i] && n >= PATLEN(pat[i]) &&
+		kernel(substr[i], pat[i], fold, buf, n)) {
+		live[i] = 0;
+		found[i] = 1;
+		nfound++;
+		left--;
 	    }
-	    if (buf != smallbuf) free(buf);
-	    return 0;
 	}
+	if (!left) break;
 
-	/* Last char match--back up and do compare */
-	i -= large + 1;
-	j = PATLEN(pat) - 2;
-	while (j >= 0 && buf[i] == substr[j]) {
-	    i--;
-	    j--;
-	}
-	if (j < 0) {
-	    /* Found match */
-	    if (buf != smallbuf) free(buf);
-	    return 1;
-	}
-	if (pat[(unsigned char)buf[i]] == large ||
-	    pat[(unsigned char)buf[i]] < PATLEN(pat)-j) {
-	    i += PATLEN(pat) - j;
-	}
-	else {
-	    i += pat[(unsigned char)buf[i]];
-	}
+	carry = n < maxlen - 1 ? n : maxlen - 1;
+	memmove(buf, buf + n - carry, carry);
+	n = (*readproc)(&state, buf + carry, bufsize - carry);
+	if (n > 0) n += carry;
     }
+
+    if (buf != smallbuf) free(buf);
+ done:
+    if (live != smalllive) free(live);
+    return nfound;
 }
 
 /* This is based on charset_searchfile above. */
 int charset_extractfile(index_search_text_receiver_t receiver,
     void* rock, int uid, const char *msg_base, int mapnl, int len, int charset,
     int encoding) {
-    char buf[2048];
+    char buf[CHARSET_BLOCKSIZE];
     int n;
     struct input_state state;
     
@@ -771,6 +913,7 @@ int charset_extractfile(index_search_text_receiver_t receiver,
     if (charset < 0 || charset >= chartables_num_charsets) return 0;
     START(state.decodestate, chartables_charset_table[charset].table);
     state.decodeleft = 0;
+    state.canon = charset_canon_map(charset);
 
     /* Initialize transfer-decoding */
     state.rawbase = msg_base;
@@ -809,6 +952,77 @@ int charset_extractfile(index_search_text_receiver_t receiver,
     return 1;
 }
 
+/*
+ * Build (once) the canonical conversion fast path for 'charset'.
+ */
+static const struct canon_map *charset_canon_map(int charset)
+{
+    static struct canon_map **maps = NULL;
+    const unsigned char (*table)[256][4];
+    struct canon_map *map;
+    int c, j;
+
+    if (!maps) {
+	maps = (struct canon_map **)
+	    xzmalloc(chartables_num_charsets * sizeof(struct canon_map *));
+    }
+    if (maps[charset]) return maps[charset];
+
+    table = chartables_charset_table[charset].table;
+    map = (struct canon_map *) xzmalloc(sizeof(struct canon_map));
+    for (c = 0; c < 256; c++) {
+	map->len[c] = -1;
+	for (j = 0; j < 4; j++) {
+	    unsigned char t = table[0][c][j];
+
+	    if (t == END) {
+		map->len[c] = j;
+		break;
+	    }
+	    /* any other control code needs the full translator */
+	    if (t >= XLT && t < END) break;
+	    map->out[c][j] = t;
+	}
+    }
+
+    maps[charset] = map;
+    return map;
+}
+
+/*
+ * Convert as many decoded bytes as possible into 'buf' (which holds
+ * 'size' bytes, 'retval' of them used) using the fast path.  Stops at
+ * the first byte that needs the full translator.  Returns the number
+ * of decoded bytes consumed.
+ */
+static int charset_canon_run(struct input_state *state, char *buf,
+			     int *retval, int size)
+{
+    const struct canon_map *canon = state->canon;
+    const unsigned char *start =
+	(const unsigned char *) state->decodebuf + state->decodestart;
+    const unsigned char *p = start;
+    const unsigned char *end = start + state->decodeleft;
+    char *out = buf + *retval;
+    char *outend = buf + size - 3;
+
+    while (p < end && out <= outend) {
+	int l = canon->len[*p];
+
+	if (l < 0) break;
+	out[0] = canon->out[*p][0];
+	out[1] = canon->out[*p][1];
+	out[2] = canon->out[*p][2];
+	out += l;
+	p++;
+    }
+
+    *retval = out - buf;
+    state->decodestart += p - start;
+    state->decodeleft -= p - start;
+    return p - start;
+}
+
 /*
  * Helper function to read at most 'size' bytes of converted
  * (into canonical searching format) data into 'buf'.  Returns
@@ -832,6 +1046,11 @@ static int charset_readconvert(struct input_state *state, char *buf, int size)
 	if (retval + charset_max_translation > size) {
 	    return retval;
 	}
+	if (state->canon &&
+	    state->decodestate.curtable == state->decodestate.initialtable &&
+	    charset_canon_run(state, buf, &retval, size)) {
+	    continue;
+	}
 	TRANSLATE(state->decodestate, state->decodebuf[state->decodestart], buf, retval);
 	state->decodestart++;
 	state->decodeleft--;
@@ -944,6 +1163,20 @@ static int charset_readmapnl(struct input_state *state, char *buf, int size)
 	    size--;
 	    state->rawlen--;
 	}
+	else {
+	    /* copy everything up to the next newline in one go */
+	    int run = state->rawlen < size ? state->rawlen : size;
+	    const char *nl = memchr(state->rawbase, '\n', run);
+
+	    if (nl) run = nl - state->rawbase;
+	    memcpy(buf, state->rawbase, run);
+	    buf += run;
+	    state->rawbase += run;
+	    state->rawlen -= run;
+	    retval += run;
+	    size -= run;
+	    continue;
+	}
 	*buf++ = c;
 	state->rawbase++;
 	state->rawlen--;
@@ -980,8 +1213,9 @@ static int charset_readqp(struct input_state *state, char *buf, int size)
 	    }
 	}
 	if (state->rawbase >= endline) {
-	    state->rawbase += nextline - endline;
-	    state->rawlen -= nextline - endline;
+	    /* an escape may have eaten into the trailing whitespace */
+	    state->rawlen -= nextline - state->rawbase;
+	    state->rawbase = nextline;
 	    continue;
 	}
 
@@ -1003,11 +1237,19 @@ static int charset_readqp(struct input_state *state, char *buf, int size)
 	    size--;
 	}
 	else {
-	    state->rawbase++;
-	    state->rawlen--;
-	    *buf++ = (char)c;
-	    retval++;
-	    size--;
+	    /* copy literal text up to the next '=' or end of line */
+	    int run = endline - state->rawbase;
+	    const char *eq;
+
+	    if (run > size) run = size;
+	    eq = memchr(state->rawbase, '=', run);
+	    if (eq) run = eq - state->rawbase;
+	    memcpy(buf, state->rawbase, run);
+	    buf += run;
+	    state->rawbase += run;
+	    state->rawlen -= run;
+	    retval += run;
+	    size -= run;
 	}
     }
     return retval;
@@ -1042,8 +1284,9 @@ static int charset_readqp_nospc(struct input_state *state, char *buf, int size)
 	    }
 	}
 	if (state->rawbase >= endline) {
-	    state->rawbase += nextline - endline;
-	    state->rawlen -= nextline - endline;
+	    /* an escape may have eaten into the trailing whitespace */
+	    state->rawlen -= nextline - state->rawbase;
+	    state->rawbase = nextline;
 	    continue;
 	}
 
@@ -1109,8 +1352,9 @@ static int charset_readqpmapnl(struct input_state *state, char *buf, int size)
 	    }
 	}
 	if (state->rawbase >= endline) {
-	    state->rawbase += nextline - endline;
-	    state->rawlen -= nextline - endline;
+	    /* an escape may have eaten into the trailing whitespace */
+	    state->rawlen -= nextline - state->rawbase;
+	    state->rawbase = nextline;
 	    continue;
 	}
 
@@ -1149,11 +1393,20 @@ static int charset_readqpmapnl(struct input_state *state, char *buf, int size)
 	    size -= 2;
 	}
 	else {
-	    state->rawbase++;
-	    state->rawlen--;
-	    *buf++ = (char)c;
-	    retval++;
-	    size--;
+	    /* copy literal text up to the next '=' or end of line */
+	    int run = endline - state->rawbase;
+	    const char *eq;
+
+	    if (run > size) run = size;
+	    if (run > state->rawlen) run = state->rawlen;
+	    eq = memchr(state->rawbase, '=', run);
+	    if (eq) run = eq - state->rawbase;
+	    memcpy(buf, state->rawbase, run);
+	    buf += run;
+	    state->rawbase += run;
+	    state->rawlen -= run;
+	    retval += run;
+	    size -= run;
 	}
     }
     return retval;
@@ -1170,6 +1423,30 @@ static int charset_readbase64(struct input_state *state, char *buf, int size)
     int c1, c2, c3, c4;
 
     while (size >= 3 && state->rawlen) {
+	/*
+	 * Decode whole quads of valid characters without the per-character
+	 * checks below; anything else ('=', CRLF, junk) drops to the slow
+	 * path.  Invalid characters map to XX, the only value with 0x40 set.
+	 */
+	while (size >= 3 && state->rawlen >= 4) {
+	    const unsigned char *p = (const unsigned char *) state->rawbase;
+
+	    c1 = CHAR64(p[0]);
+	    c2 = CHAR64(p[1]);
+	    c3 = CHAR64(p[2]);
+	    c4 = CHAR64(p[3]);
+	    if ((c1 | c2 | c3 | c4) & 0x40) break;
+
+	    *buf++ = (char)((c1<<2) | (c2>>4));
+	    *buf++ = (char)(((c2&0xf)<<4) | (c3>>2));
+	    *buf++ = (char)(((c3&0x3)<<6) | c4);
+	    state->rawbase += 4;
+	    state->rawlen -= 4;
+	    retval += 3;
+	    size -= 3;
+	}
+	if (size < 3 || !state->rawlen) break;
+
 	do {
 	    c1 = *state->rawbase++;
 	    state->rawlen--;
@@ -1245,6 +1522,39 @@ static int charset_readbase64_nospc(struct input_state *state,
     char dec;
 
     while (size >= 3 && state->rawlen) {
+	/* Whole quads of valid characters first, as in charset_readbase64() */
+	while (size >= 3 && state->rawlen >= 4) {
+	    const unsigned char *p = (const unsigned char *) state->rawbase;
+
+	    c1 = CHAR64(p[0]);
+	    c2 = CHAR64(p[1]);
+	    c3 = CHAR64(p[2]);
+	    c4 = CHAR64(p[3]);
+	    if ((c1 | c2 | c3 | c4) & 0x40) break;
+
+	    state->rawbase += 4;
+	    state->rawlen -= 4;
+	    dec = (char)((c1<<2) | (c2>>4));
+	    if (USASCII(dec) != END) {
+		*buf++ = dec;
+		retval++;
+		size--;
+	    }
+	    dec = (char)(((c2&0xf)<<4) | (c3>>2));
+	    if (USASCII(dec) != END) {
+		*buf++ = dec;
+		retval++;
+		size--;
+	    }
+	    dec = (char)(((c3&0x3)<<6) | c4);
+	    if (USASCII(dec) != END) {
+		*buf++ = dec;
+		retval++;
+		size--;
+	    }
+	}
+	if (size < 3 || !state->rawlen) break;
+
 	do {
 	    c1 = *state->rawbase++;
 	    state->rawlen--;
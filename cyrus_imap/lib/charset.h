@@ -72,6 +72,10 @@ extern int charset_searchstring(const char *substr, comp_pat *pat,
 extern int charset_searchfile(const char *substr, comp_pat *pat,
                               const char *msg_base, int mapnl, int len, 
                               charset_index charset, int encoding);
+extern int charset_searchfile_multi(int npat, const char * const *substr,
+				    comp_pat * const *pat, int *found,
+				    const char *msg_base, int mapnl, int len,
+				    charset_index charset, int encoding);
 extern char *charset_decode_mimebody(const char *msg_base, int len,
 				     int encoding, char **retval, int alloced,
 				     int *outlen);
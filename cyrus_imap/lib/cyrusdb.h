@@ -45,6 +45,7 @@
 
 struct db;
 struct txn;
+struct cursor;
 
 enum cyrusdb_ret {
     CYRUSDB_OK = 0,
@@ -176,6 +177,43 @@ struct cyrusdb_backend {
 
     int (*dump)(struct db *db, int detail);
     int (*consistent)(struct db *db);
+
+    /* the rest is optional; backends that leave these NULL only
+       support the calls above */
+
+    /* fetchmany: look up 'nkeys' keys at once.  'datas[i]' and
+       'datalens[i]' get the data for 'keys[i]', or NULL and 0 if it
+       doesn't exist; a missing key isn't an error.  keys in ascending
+       database order are cheapest, since the backend can carry on from
+       the previous key instead of starting over.  the data stays valid
+       until the next call on 'mydb'.  'mytid' is as for fetch() */
+    int (*fetchmany)(struct db *mydb, int nkeys,
+		     const char * const *keys, const int *keylens,
+		     const char **datas, int *datalens,
+		     struct txn **mytid);
+
+    /* cursors: walk the entries with 'start' <= key < 'end' in
+       database order.  'start' may be NULL for the first entry, 'end'
+       may be NULL for no upper bound, so a prefix is just a range.
+
+       cursor_open() may begin a txn like fetch(); the cursor keeps
+       using it and must be closed before the txn is committed or
+       aborted.  cursor_seek() moves to the first entry >= 'key' (but
+       not before 'start').  cursor_next() returns the next entry, or
+       CYRUSDB_DONE past the end of the range; what it returns stays
+       valid until the next call on the cursor or its database.
+
+       without a txn, changes other processes make while the cursor
+       is open may or may not be seen, as with foreach() */
+    int (*cursor_open)(struct db *mydb,
+		       const char *start, int startlen,
+		       const char *end, int endlen,
+		       struct cursor **cursor, struct txn **mytid);
+    int (*cursor_seek)(struct cursor *cursor, const char *key, int keylen);
+    int (*cursor_next)(struct cursor *cursor,
+		       const char **key, int *keylen,
+		       const char **data, int *datalen);
+    int (*cursor_close)(struct cursor *cursor);
 };
 
 extern struct cyrusdb_backend *cyrusdb_backends[];
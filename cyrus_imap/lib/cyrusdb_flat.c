@@ -509,6 +509,234 @@ static int foreach(struct db *db,
 
 #undef GETENTRY
 
+static int fetchmany(struct db *db, int nkeys,
+		     const char * const *keys, const int *keylens,
+		     const char **datas, int *datalens,
+		     struct txn **mytid)
+{
+    int r = 0;
+    int n;
+    unsigned long start = 0, offset, len;
+    char *tmpkey = NULL;
+    int tmpkeylen = 0;
+    const char *key;
+
+    assert(db);
+
+    r = starttxn_or_refetch(db, mytid);
+    if (r) return r;
+
+    for (n = 0; n < nkeys; n++) {
+	/* keys in order only need to search the rest of the file */
+	if (n && bsearch_ncompare(keys[n], keylens[n],
+				  keys[n - 1], keylens[n - 1]) < 0) {
+	    start = 0;
+	}
+
+	key = keys[n];
+	if (key[keylens[n]] != '\0') {
+	    if (keylens[n] + 1 > tmpkeylen) {
+		tmpkeylen = keylens[n] + 64;
+		tmpkey = xrealloc(tmpkey, tmpkeylen);
+	    }
+	    memcpy(tmpkey, key, keylens[n]);
+	    tmpkey[keylens[n]] = '\0';
+	    key = tmpkey;
+	}
+
+	offset = start + bsearch_mem(key, 1, db->base + start,
+				     db->size - start, 0, &len);
+	if (len) {
+	    datas[n] = db->base + offset + keylens[n] + 1;
+	    /* subtract one for \t, and one for the \n */
+	    datalens[n] = len - keylens[n] - 2;
+	} else {
+	    datas[n] = NULL;
+	    datalens[n] = 0;
+	}
+	start = offset;
+    }
+
+    if (tmpkey) free(tmpkey);
+
+    return r;
+}
+
+/* without a txn, a cursor walks a private map of the file as it was
+   when the cursor was opened, like foreach() does.  with one, it uses
+   the db's own map and finds its place again by key when the txn
+   rewrote the file */
+struct cursor {
+    struct db *db;
+    struct txn *tid;
+
+    char *start;		/* range, NULL if unbounded */
+    int startlen;
+    char *end;
+    int endlen;
+
+    int fd;			/* private map, if no txn */
+    const char *base;
+    unsigned long len;
+    unsigned long size;
+
+    unsigned long offset;	/* the next line to look at */
+    unsigned long ino;		/* db->ino and db->size 'offset' is for */
+    unsigned long dbsize;
+
+    char *key;			/* last key returned, or where to seek to */
+    int keylen;
+    int keyalloc;
+    int seeking;
+};
+
+static void cursor_setkey(struct cursor *c, const char *key, int keylen)
+{
+    if (keylen + 1 > c->keyalloc) {
+	c->keyalloc = keylen + 64;
+	c->key = xrealloc(c->key, c->keyalloc);
+    }
+    memcpy(c->key, key, keylen);
+    c->key[keylen] = '\0';
+    c->keylen = keylen;
+}
+
+/* position 'c' at 'c->key' in the map it's looking at */
+static void cursor_find(struct cursor *c)
+{
+    const char *base = c->tid ? c->db->base : c->base;
+    unsigned long size = c->tid ? c->db->size : c->size;
+    unsigned long len;
+
+    c->offset = c->keylen ? bsearch_mem(c->key, 1, base, size, 0, &len) : 0;
+    if (c->keylen && len && !c->seeking) {
+	/* we already returned this one */
+	c->offset += len;
+    }
+    c->ino = c->db->ino;
+    c->dbsize = c->db->size;
+}
+
+static int cursor_seek(struct cursor *c, const char *key, int keylen)
+{
+    assert(c);
+
+    if (!key || (c->start &&
+		 bsearch_ncompare(key, keylen, c->start, c->startlen) < 0)) {
+	key = c->start ? c->start : "";
+	keylen = c->startlen;
+    }
+    cursor_setkey(c, key, keylen);
+    c->seeking = 1;
+    cursor_find(c);
+
+    return 0;
+}
+
+static int cursor_open(struct db *db,
+		       const char *start, int startlen,
+		       const char *end, int endlen,
+		       struct cursor **cursor, struct txn **mytid)
+{
+    struct cursor *c;
+    int r;
+
+    assert(db && cursor);
+
+    r = starttxn_or_refetch(db, mytid);
+    if (r) return r;
+
+    c = (struct cursor *) xzmalloc(sizeof(struct cursor));
+    c->db = db;
+    c->fd = -1;
+    if (mytid) {
+	c->tid = *mytid;
+    } else {
+	c->fd = dup(db->fd);
+	if (c->fd == -1) {
+	    free(c);
+	    return CYRUSDB_IOERROR;
+	}
+	map_refresh(c->fd, 1, &c->base, &c->len, db->size, db->fname, 0);
+	c->size = db->size;
+    }
+
+    if (start) {
+	c->start = xmalloc(startlen + 1);
+	memcpy(c->start, start, startlen);
+	c->start[startlen] = '\0';
+	c->startlen = startlen;
+    }
+    if (end) {
+	c->end = xmalloc(endlen + 1);
+	memcpy(c->end, end, endlen);
+	c->end[endlen] = '\0';
+	c->endlen = endlen;
+    }
+    cursor_seek(c, NULL, 0);
+
+    *cursor = c;
+    return 0;
+}
+
+static int cursor_next(struct cursor *c,
+		       const char **key, int *keylen,
+		       const char **data, int *datalen)
+{
+    const char *base, *p, *tab, *nl;
+    unsigned long size;
+
+    assert(c);
+
+    if (c->tid && (c->ino != c->db->ino || c->dbsize != c->db->size)) {
+	/* something changed in the file; reseek */
+	cursor_find(c);
+    }
+    base = c->tid ? c->db->base : c->base;
+    size = c->tid ? c->db->size : c->size;
+
+    if (c->offset >= size) return CYRUSDB_DONE;
+
+    p = base + c->offset;
+    tab = memchr(p, '\t', size - c->offset);
+    nl = tab ? memchr(tab, '\n', size - (tab - base)) : NULL;
+    if (!nl) {
+	/* huh, might be corrupted? */
+	return CYRUSDB_IOERROR;
+    }
+
+    if (c->end && bsearch_ncompare(p, tab - p, c->end, c->endlen) >= 0) {
+	return CYRUSDB_DONE;
+    }
+
+    cursor_setkey(c, p, tab - p);
+    c->seeking = 0;
+    c->offset = nl + 1 - base;
+
+    if (key) *key = p;
+    if (keylen) *keylen = tab - p;
+    if (data) *data = tab + 1;
+    if (datalen) *datalen = nl - (tab + 1);
+
+    return 0;
+}
+
+static int cursor_close(struct cursor *c)
+{
+    assert(c);
+
+    if (c->fd != -1) {
+	map_free(&c->base, &c->len);
+	close(c->fd);
+    }
+    if (c->start) free(c->start);
+    if (c->end) free(c->end);
+    if (c->key) free(c->key);
+    free(c);
+
+    return 0;
+}
+
 static int mystore(struct db *db, 
 		   const char *key, int keylen,
 		   const char *data, int datalen,
@@ -741,5 +969,11 @@ struct cyrusdb_backend cyrusdb_flat =
     &abort_txn,
 
     NULL,
-    NULL
+    NULL,
+
+    &fetchmany,
+    &cursor_open,
+    &cursor_seek,
+    &cursor_next,
+    &cursor_close
 };
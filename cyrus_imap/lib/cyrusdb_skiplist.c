@@ -55,6 +55,7 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -104,6 +105,12 @@
      offset where log records start, used mainly to tell when to compress
    last recovery (4 bytes)
      seconds since unix epoch
+   generation (4 bytes) [version_minor >= 3]
+     odd while a writer is changing the file in place, see read_snapshot()
+   synced generation (4 bytes) [version_minor >= 3]
+     every commit up to this generation is on disk, see group_sync()
+   syncing generation (4 bytes) [version_minor >= 3]
+     an fdatasync() in progress will cover commits up to this generation
    
    1 or more skipnodes, one of:
 
@@ -156,6 +163,8 @@ struct db {
     int listsize;
     int logstart;		/* where the log starts from last chkpnt */
     time_t last_recovery;
+    unsigned generation;	/* odd while the file is being changed */
+    unsigned synced;		/* commits up to here are on disk */
 
     /* comparator function to use for sorting */
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
@@ -173,6 +182,9 @@ struct txn {
 
 static time_t global_recovery = 0;
 
+/* can readers without a txn skip the shared lock? (needs a coherent map) */
+static int lockfree_reads = 0;
+
 /* Perform an FSYNC/FDATASYNC if we are *not* operating in UNSAFE mode */
 #define DO_FSYNC (!libcyrus_config_getswitch(CYRUSOPT_SKIPLIST_UNSAFE))
 
@@ -221,6 +233,8 @@ static int myinit(const char *dbdir, int myflags)
     
     snprintf(sfile, sizeof(sfile), "%s/skipstamp", dbdir);
 
+    lockfree_reads = strcmp(map_method_desc, "nommap") != 0;
+
     if (myflags & CYRUSDB_RECOVER) {
 	/* set the recovery timestamp; all databases earlier than this
 	   time need recovery run when opened */
@@ -300,7 +314,7 @@ static int myarchive(const char **fnames, const char *dirname)
 
 enum {
     SKIPLIST_VERSION = 1,
-    SKIPLIST_VERSION_MINOR = 2,
+    SKIPLIST_VERSION_MINOR = 3,
     SKIPLIST_MAXLEVEL = 20,
     SKIPLIST_MINREWRITE = 16834 /* don't rewrite logs smaller than this */
 };
@@ -329,13 +343,22 @@ enum {
     OFFSET_CURLEVEL = 32,
     OFFSET_LISTSIZE = 36,
     OFFSET_LOGSTART = 40,
-    OFFSET_LASTRECOVERY = 44
+    OFFSET_LASTRECOVERY = 44,
+    OFFSET_GENERATION = 48,
+    OFFSET_SYNCED = 52,
+    OFFSET_SYNCING = 56
 };
 
 enum {
-    HEADER_SIZE = OFFSET_LASTRECOVERY + 4
+    HEADER_SIZE_V2 = OFFSET_LASTRECOVERY + 4,
+    HEADER_SIZE = OFFSET_SYNCING + 4
 };
 
+/* minor version 2 files have no generation; they are upgraded by the
+   next checkpoint */
+#define HAS_GENERATION(db) ((db)->version_minor >= 3)
+#define HEADER_LEN(db) (HAS_GENERATION(db) ? HEADER_SIZE : HEADER_SIZE_V2)
+
 static int mycommit(struct db *db, struct txn *tid);
 static int myabort(struct db *db, struct txn *tid);
 static int mycheckpoint(struct db *db, int locked);
@@ -364,8 +387,8 @@ enum {
        bit32 forward[db->maxlevel];
        bit32 pad = -1;
    } */
-#define DUMMY_OFFSET(db) (HEADER_SIZE)
-#define DUMMY_PTR(db) ((db)->map_base + HEADER_SIZE)
+#define DUMMY_OFFSET(db) (HEADER_LEN(db))
+#define DUMMY_PTR(db) ((db)->map_base + HEADER_LEN(db))
 #define DUMMY_SIZE(db) (4 * (3 + db->maxlevel + 1))
 
 /* bump to the next multiple of 4 bytes */
@@ -452,7 +475,7 @@ static int read_header(struct db *db)
     int r;
     
     assert(db && db->map_len && db->fname && db->map_base);
-    if (db->map_len < HEADER_SIZE) {
+    if (db->map_len < HEADER_SIZE_V2) {
 	syslog(LOG_ERR, 
 	       "skiplist: file not large enough for header: %s", db->fname);
     }
@@ -493,6 +516,10 @@ static int read_header(struct db *db)
     db->logstart = ntohl(*((bit32 *)(db->map_base + OFFSET_LOGSTART)));
     db->last_recovery = 
 	ntohl(*((bit32 *)(db->map_base + OFFSET_LASTRECOVERY)));
+    db->generation = HAS_GENERATION(db) ?
+	ntohl(*((bit32 *)(db->map_base + OFFSET_GENERATION))) : 0;
+    db->synced = HAS_GENERATION(db) ?
+	ntohl(*((bit32 *)(db->map_base + OFFSET_SYNCED))) : 0;
 
     /* verify dummy node */
     dptr = DUMMY_PTR(db);
@@ -537,11 +564,14 @@ static int write_header(struct db *db)
     *((bit32 *)(buf + OFFSET_LISTSIZE)) = htonl(db->listsize);
     *((bit32 *)(buf + OFFSET_LOGSTART)) = htonl(db->logstart);
     *((bit32 *)(buf + OFFSET_LASTRECOVERY)) = htonl(db->last_recovery);
+    *((bit32 *)(buf + OFFSET_GENERATION)) = htonl(db->generation);
+    *((bit32 *)(buf + OFFSET_SYNCED)) = htonl(db->synced);
+    *((bit32 *)(buf + OFFSET_SYNCING)) = htonl(db->synced);
 
     /* write it out */
     lseek(db->fd, 0, SEEK_SET);
-    n = retry_write(db->fd, buf, HEADER_SIZE);
-    if (n != HEADER_SIZE) {
+    n = retry_write(db->fd, buf, HEADER_LEN(db));
+    if (n != HEADER_LEN(db)) {
 	syslog(LOG_ERR, "DBERROR: writing skiplist header for %s: %m",
 	       db->fname);
 	return CYRUSDB_IOERROR;
@@ -550,6 +580,58 @@ static int write_header(struct db *db)
     return 0;
 }
 
+/* given a locked db, set the generation in the header */
+static int write_generation(struct db *db, bit32 generation)
+{
+    bit32 netgen = htonl(generation);
+
+    if (!HAS_GENERATION(db)) return 0;
+
+    lseek(db->fd, OFFSET_GENERATION, SEEK_SET);
+    if (retry_write(db->fd, (char *) &netgen, 4) != 4) {
+	syslog(LOG_ERR, "DBERROR: writing skiplist generation for %s: %m",
+	       db->fname);
+	return CYRUSDB_IOERROR;
+    }
+    db->generation = generation;
+
+    return 0;
+}
+
+/* writers make the generation odd before they change anything in place
+   and even again once the file is consistent */
+static void begin_update(struct db *db)
+{
+    if (!(db->generation & 1)) write_generation(db, db->generation + 1);
+}
+
+static void end_update(struct db *db)
+{
+    if (db->generation & 1) write_generation(db, db->generation + 1);
+}
+
+/* we just (re)mapped the file, possibly a different one than before
+   if 'newfile'; pick up the header fields that other processes change */
+static void refresh_header(struct db *db, int newfile)
+{
+    /* still opening the db; read_header() will do this */
+    if (!db->curlevel || db->map_size < HEADER_SIZE_V2) return;
+
+    if (newfile) {
+	db->version_minor =
+	    ntohl(*((bit32 *)(db->map_base + OFFSET_VERSION_MINOR)));
+	db->logstart = ntohl(*((bit32 *)(db->map_base + OFFSET_LOGSTART)));
+    }
+
+    /* reread curlevel */
+    db->curlevel = ntohl(*((bit32 *)(db->map_base + OFFSET_CURLEVEL)));
+
+    db->generation = HAS_GENERATION(db) ?
+	ntohl(*((bit32 *)(db->map_base + OFFSET_GENERATION))) : 0;
+    db->synced = HAS_GENERATION(db) ?
+	ntohl(*((bit32 *)(db->map_base + OFFSET_SYNCED))) : 0;
+}
+
 static int dispose_db(struct db *db)
 {
     if (!db) return 0;
@@ -584,12 +666,14 @@ static int write_lock(struct db *db, const char *altname)
     struct stat sbuf;
     const char *lockfailaction;
     const char *fname = altname ? altname : db->fname;
+    int newfile;
 
     if (lock_reopen(db->fd, fname, &sbuf, &lockfailaction) < 0) {
 	syslog(LOG_ERR, "IOERROR: %s %s: %m", lockfailaction, fname);
 	return CYRUSDB_IOERROR;
     }
-    if (db->map_ino != sbuf.st_ino) {
+    newfile = (db->map_ino != sbuf.st_ino);
+    if (newfile) {
 	map_free(&db->map_base, &db->map_len);
     }
     db->map_size = sbuf.st_size;
@@ -598,10 +682,7 @@ static int write_lock(struct db *db, const char *altname)
     map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
 		fname, 0);
 
-    if (db->curlevel) {
-	/* reread curlevel */
-	db->curlevel = ntohl(*((bit32 *)(db->map_base + OFFSET_CURLEVEL)));
-    }
+    refresh_header(db, newfile);
     
     /* printf("%d: write lock: %d\n", getpid(), db->map_ino); */
 
@@ -612,6 +693,7 @@ static int read_lock(struct db *db)
 {
     struct stat sbuf, sbuffile;
     int newfd = -1;
+    int newfile;
 
     for (;;) {
 	if (lock_shared(db->fd) < 0) {
@@ -643,7 +725,8 @@ static int read_lock(struct db *db)
 	close(newfd);
     }
 
-    if (db->map_ino != sbuf.st_ino) {
+    newfile = (db->map_ino != sbuf.st_ino);
+    if (newfile) {
 	map_free(&db->map_base, &db->map_len);
     }
     db->map_size = sbuf.st_size;
@@ -654,14 +737,77 @@ static int read_lock(struct db *db)
     map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
 		db->fname, 0);
 
-    if (db->curlevel) {
-	/* reread curlevel */
-	db->curlevel = ntohl(*((bit32 *)(db->map_base + OFFSET_CURLEVEL)));
-    }
+    refresh_header(db, newfile);
     
     return 0;
 }
 
+/* Lock-free readers.
+ *
+ * A reader without a txn doesn't need the shared lock as long as no
+ * writer touches the part of the file it looks at.  Writers only ever
+ * change a file in place between begin_update() and end_update(), so
+ * the generation in the header is odd exactly while the list may be
+ * inconsistent; a checkpoint writes a new file and never modifies the
+ * one it replaces.  So the reader notes an even generation, walks the
+ * list in its own mapping and afterwards checks the generation again.
+ * If it moved, the walk may have seen a half-done update and the
+ * caller retries under read_lock().
+ *
+ * Returns 0 and the generation if the snapshot can be used.
+ */
+static int read_snapshot(struct db *db, bit32 *gen)
+{
+    struct stat sbuf;
+    bit32 netgen;
+    int newfile;
+
+    if (!lockfree_reads) return -1;
+
+    if (stat(db->fname, &sbuf) == -1) return -1;
+    newfile = (db->map_ino != sbuf.st_ino);
+    if (newfile) {
+	/* checkpointed since we last looked; switch to the new file */
+	int newfd = open(db->fname, O_RDWR, 0644);
+
+	if (newfd == -1) return -1;
+	dup2(newfd, db->fd);
+	close(newfd);
+	if (fstat(db->fd, &sbuf) == -1) return -1;
+
+	map_free(&db->map_base, &db->map_len);
+	db->map_ino = sbuf.st_ino;
+    }
+    if (sbuf.st_size < HEADER_SIZE) return -1;
+
+    db->map_size = sbuf.st_size;
+    map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
+		db->fname, 0);
+    if (newfile) refresh_header(db, newfile);
+    if (!HAS_GENERATION(db)) return -1;
+
+    /* read the generation with a syscall, so our loads from the map
+       can't be ordered before it */
+    if (pread(db->fd, &netgen, 4, OFFSET_GENERATION) != 4) return -1;
+    *gen = ntohl(netgen);
+    if (*gen & 1) return -1;
+
+    db->curlevel = ntohl(*((bit32 *)(db->map_base + OFFSET_CURLEVEL)));
+    if (!db->curlevel || db->curlevel > db->maxlevel) return -1;
+
+    return 0;
+}
+
+/* is everything we read since read_snapshot() still valid? */
+static int snapshot_valid(struct db *db, bit32 gen)
+{
+    bit32 netgen;
+
+    if (pread(db->fd, &netgen, 4, OFFSET_GENERATION) != 4) return 0;
+
+    return ntohl(netgen) == gen;
+}
+
 static int unlock(struct db *db)
 {
     if (lock_unlock(db->fd) < 0) {
@@ -846,6 +992,72 @@ static const char *find_node(struct db *db,
     return ptr;
 }
 
+/* without a lock a writer may be changing pointers under us, so make
+   sure the record at 'offset' lies within the map, up to and including
+   skip pointer 'level', before we look at it */
+static int record_ok(struct db *db, bit32 offset, int level)
+{
+    const char *ptr = db->map_base + offset;
+    unsigned long end;
+    bit32 klen, dlen;
+
+    if (offset < (bit32) DUMMY_OFFSET(db) || offset % 4 ||
+	offset + 12 > db->map_size) {
+	return 0;
+    }
+    if (TYPE(ptr) != DUMMY && TYPE(ptr) != INORDER && TYPE(ptr) != ADD) {
+	return 0;
+    }
+
+    klen = KEYLEN(ptr);
+    if (klen > db->map_size) return 0;
+    end = offset + 8 + ROUNDUP(klen) + 4;
+    if (end > db->map_size) return 0;
+
+    dlen = DATALEN(ptr);
+    if (dlen > db->map_size) return 0;
+    end += ROUNDUP(dlen) + 4 * (level + 1);
+
+    return (end <= db->map_size);
+}
+
+/* find_node() for a lock-free snapshot.  returns NULL if we ran into
+   something that doesn't make sense; the caller must then check the
+   generation anyway, and will find it changed. */
+static const char *find_node_nolock(struct db *db, 
+				    const char *key, int keylen)
+{
+    bit32 offset = DUMMY_OFFSET(db);
+    bit32 next = 0;
+    int i;
+
+    for (i = db->curlevel - 1; i >= 0; i--) {
+	if (!record_ok(db, offset, i)) return NULL;
+	while ((next = FORWARD(db->map_base + offset, i))) {
+	    if (!record_ok(db, next, i)) return NULL;
+	    if (db->compar(KEY(db->map_base + next), 
+			   KEYLEN(db->map_base + next), key, keylen) >= 0) {
+		break;
+	    }
+	    /* move forward at level 'i' */
+	    offset = next;
+	}
+    }
+
+    /* don't reread the pointer; it might have changed since we checked */
+    return db->map_base + next;
+}
+
+/* the record after 'ptr' in a lock-free snapshot, or NULL */
+static const char *next_nolock(struct db *db, const char *ptr)
+{
+    bit32 next = FORWARD(ptr, 0);
+
+    if (next && !record_ok(db, next, 0)) return NULL;
+
+    return db->map_base + next;
+}
+
 int myfetch(struct db *db,
 	    const char *key, int keylen,
 	    const char **data, int *datalen,
@@ -853,6 +1065,7 @@ int myfetch(struct db *db,
 {
     const char *ptr;
     struct txn t, *tp;
+    bit32 gen;
     int r = 0;
 
     assert(db != NULL && key != NULL);
@@ -860,6 +1073,25 @@ int myfetch(struct db *db,
     if (data) *data = NULL;
     if (datalen) *datalen = 0;
 
+    if (!mytid && !read_snapshot(db, &gen)) {
+	/* try without the lock first */
+	ptr = find_node_nolock(db, key, keylen);
+	if (ptr && ptr != db->map_base &&
+	    !db->compar(KEY(ptr), KEYLEN(ptr), key, keylen)) {
+	    if (datalen) *datalen = DATALEN(ptr);
+	    if (data) *data = DATA(ptr);
+	} else if (ptr) {
+	    r = CYRUSDB_NOTFOUND;
+	}
+
+	if (ptr && snapshot_valid(db, gen)) return r;
+
+	/* a writer got in our way */
+	if (data) *data = NULL;
+	if (datalen) *datalen = 0;
+	r = 0;
+    }
+
     if (!mytid) {
 	/* grab a r lock */
 	if ((r = read_lock(db)) < 0) {
@@ -926,6 +1158,37 @@ static int fetchlock(struct db *db,
     return myfetch(db, key, keylen, data, datalen, mytid);
 }
 
+/* the file changed under a foreach; find where we left off: the record
+   after 'savebuf', or the first one matching 'prefix' if we haven't made
+   a callback yet */
+static const char *foreach_reseek(struct db *db, int nolock,
+				  const char *prefix, int prefixlen,
+				  const char *savebuf, size_t savebufsize)
+{
+    const char *ptr;
+
+    if (!savebuf) {
+	return nolock ? find_node_nolock(db, prefix, prefixlen) :
+	    find_node(db, prefix, prefixlen, 0);
+    }
+
+    ptr = nolock ? find_node_nolock(db, savebuf, savebufsize) :
+	find_node(db, savebuf, savebufsize, 0);
+
+    /* 'ptr' might not equal 'savebuf'.  if it's different,
+       we want to stay where we are.  if it's the same, we
+       should move on to the next one */
+    if (ptr && ptr != db->map_base &&
+	savebufsize == KEYLEN(ptr) && !memcmp(savebuf, KEY(ptr), savebufsize)) {
+	ptr = nolock ? next_nolock(db, ptr) : db->map_base + FORWARD(ptr, 0);
+    } else {
+	/* 'savebuf' got deleted, so we're now pointing at the
+	   right thing */
+    }
+
+    return ptr;
+}
+
 /* foreach allows for subsidary mailbox operations in 'cb'.
    if there is a txn, 'cb' must make use of it.
 */
@@ -938,16 +1201,20 @@ int myforeach(struct db *db,
     const char *ptr;
     char *savebuf = NULL;
     size_t savebuflen = 0;
-    size_t savebufsize;
+    size_t savebufsize = 0;
     struct txn t, *tp;
+    bit32 gen = 0;
+    int nolock = 0;
     int r = 0, cb_r = 0;
 
     assert(db != NULL);
     assert(prefixlen >= 0);
 
     if (!tid) {
-	/* grab a r lock */
-	if ((r = read_lock(db)) < 0) {
+	/* walk a lock-free snapshot if we can, else grab a r lock */
+	if (!read_snapshot(db, &gen)) {
+	    nolock = 1;
+	} else if ((r = read_lock(db)) < 0) {
 	    return r;
 	}
 
@@ -967,9 +1234,10 @@ int myforeach(struct db *db,
 	update_lock(db, tp);
     }
 
-    ptr = find_node(db, prefix, prefixlen, 0);
+    ptr = foreach_reseek(db, nolock, prefix, prefixlen, NULL, 0);
 
-    while (ptr != db->map_base) {
+ again:
+    while (ptr && ptr != db->map_base) {
 	/* does it match prefix? */
 	if (KEYLEN(ptr) < (bit32) prefixlen) break;
 	if (prefixlen && db->compar(KEY(ptr), prefixlen, prefix, prefixlen)) break;
@@ -978,8 +1246,13 @@ int myforeach(struct db *db,
 	    goodp(rock, KEY(ptr), KEYLEN(ptr), DATA(ptr), DATALEN(ptr))) {
 	    ino_t ino = db->map_ino;
 	    unsigned long sz = db->map_size;
+	    bit32 oldgen = gen;
+	    int oldnolock = nolock;
 
-	    if (!tid) {
+	    if (nolock) {
+		/* don't hand the callback anything a writer touched */
+		if (!snapshot_valid(db, gen)) break;
+	    } else if (!tid) {
 		/* release read lock */
 		if ((r = unlock(db)) < 0) {
 		    return r;
@@ -999,8 +1272,10 @@ int myforeach(struct db *db,
 	    if (cb_r) break;
 
 	    if (!tid) {
+		if (nolock && read_snapshot(db, &gen)) nolock = 0;
+
 		/* grab a r lock */
-		if ((r = read_lock(db)) < 0) {
+		if (!nolock && (r = read_lock(db)) < 0) {
 		    return r;
 		}
 	    } else {
@@ -1009,28 +1284,34 @@ int myforeach(struct db *db,
 	    }
 
 	    /* reposition */
-	    if (!(ino == db->map_ino && sz == db->map_size)) {
+	    if (!(ino == db->map_ino && sz == db->map_size &&
+		  gen == oldgen && nolock == oldnolock)) {
 		/* something changed in the file; reseek */
-		ptr = find_node(db, savebuf, savebufsize, 0);
-
-		/* 'ptr' might not equal 'savebuf'.  if it's different,
-		   we want to stay where we are.  if it's the same, we
-		   should move on to the next one */
-		if (savebufsize == KEYLEN(ptr) &&
-		    !memcmp(savebuf, KEY(ptr), savebufsize)) {
-		    ptr = db->map_base + FORWARD(ptr, 0);
-		} else {
-		    /* 'savebuf' got deleted, so we're now pointing at the
-		       right thing */
-		}
+		ptr = foreach_reseek(db, nolock, prefix, prefixlen,
+				     savebuf, savebufsize);
 	    } else {
 		/* move to the next one */
-		ptr = db->map_base + FORWARD(ptr, 0);
+		ptr = nolock ? next_nolock(db, ptr) : 
+		    db->map_base + FORWARD(ptr, 0);
 	    }
 	} else {
 	    /* we didn't make the callback; keep going */
-	    ptr = db->map_base + FORWARD(ptr, 0);
+	    ptr = nolock ? next_nolock(db, ptr) : 
+		db->map_base + FORWARD(ptr, 0);
+	}
+    }
+
+    if (nolock && !cb_r && (!ptr || !snapshot_valid(db, gen))) {
+	/* a writer got in our way; carry on from where we made the
+	   last callback, under the lock this time */
+	nolock = 0;
+	if ((r = read_lock(db)) < 0) {
+	    if (savebuf) free(savebuf);
+	    return r;
 	}
+	ptr = foreach_reseek(db, nolock, prefix, prefixlen,
+			     savebuf, savebufsize);
+	goto again;
     }
 
     if (tid) {
@@ -1041,7 +1322,7 @@ int myforeach(struct db *db,
 	    memcpy(*tid, tp, sizeof(struct txn));
 	    (*tid)->ismalloc = 1;
 	}
-    } else {
+    } else if (!nolock) {
 	/* release read lock */
 	if ((r = unlock(db)) < 0) {
 	    return r;
@@ -1055,6 +1336,333 @@ int myforeach(struct db *db,
     return r ? r : cb_r;
 }
 
+/* find_node() for a run of keys in ascending order.  'fingers' holds,
+   for every level, a node before the previous key (the dummy node to
+   begin with).  rather than start each search at the top of the list,
+   we climb from the bottom only as long as a higher level lets us skip
+   ahead, and search down from there, so nearby keys cost little more
+   than a step or two.  with 'nolock', returns NULL like
+   find_node_nolock() when the snapshot doesn't make sense. */
+static const char *find_node_finger(struct db *db, int nolock,
+				    const char *key, int keylen,
+				    bit32 *fingers)
+{
+    bit32 offset, next = 0;
+    int i;
+
+    for (i = 0; i < db->curlevel - 1; i++) {
+	offset = fingers[i + 1];
+	if (nolock && !record_ok(db, offset, i + 1)) return NULL;
+	next = FORWARD(db->map_base + offset, i + 1);
+	if (!next) break;
+	if (nolock && !record_ok(db, next, i + 1)) return NULL;
+	if (db->compar(KEY(db->map_base + next), KEYLEN(db->map_base + next),
+		       key, keylen) >= 0) {
+	    break;
+	}
+    }
+
+    offset = fingers[i];
+    for (; i >= 0; i--) {
+	if (nolock && !record_ok(db, offset, i)) return NULL;
+	while ((next = FORWARD(db->map_base + offset, i))) {
+	    if (nolock && !record_ok(db, next, i)) return NULL;
+	    if (db->compar(KEY(db->map_base + next), 
+			   KEYLEN(db->map_base + next), key, keylen) >= 0) {
+		break;
+	    }
+	    /* move forward at level 'i' */
+	    offset = next;
+	}
+	fingers[i] = offset;
+    }
+
+    return db->map_base + next;
+}
+
+/* look up 'keys' in the current map.  returns CYRUSDB_AGAIN if a
+   lock-free walk ran into a writer */
+static int fetchmany_walk(struct db *db, int nolock, int nkeys,
+			  const char * const *keys, const int *keylens,
+			  const char **datas, int *datalens)
+{
+    bit32 fingers[SKIPLIST_MAXLEVEL];
+    const char *ptr;
+    int i, n;
+
+    for (n = 0; n < nkeys; n++) {
+	if (!n || db->compar(keys[n], keylens[n],
+			     keys[n - 1], keylens[n - 1]) < 0) {
+	    /* out of order; start again from the top */
+	    for (i = 0; i < db->maxlevel; i++) {
+		fingers[i] = DUMMY_OFFSET(db);
+	    }
+	}
+
+	ptr = find_node_finger(db, nolock, keys[n], keylens[n], fingers);
+	if (!ptr) return CYRUSDB_AGAIN;
+
+	if (ptr != db->map_base &&
+	    !db->compar(KEY(ptr), KEYLEN(ptr), keys[n], keylens[n])) {
+	    datas[n] = DATA(ptr);
+	    datalens[n] = DATALEN(ptr);
+	} else {
+	    datas[n] = NULL;
+	    datalens[n] = 0;
+	}
+    }
+
+    return 0;
+}
+
+static int myfetchmany(struct db *db, int nkeys,
+		       const char * const *keys, const int *keylens,
+		       const char **datas, int *datalens,
+		       struct txn **mytid)
+{
+    struct txn t, *tp;
+    bit32 gen;
+    int r = 0;
+
+    assert(db != NULL && nkeys >= 0);
+
+    if (!mytid && !read_snapshot(db, &gen)) {
+	/* try without the lock first */
+	if (!fetchmany_walk(db, 1, nkeys, keys, keylens, datas, datalens) &&
+	    snapshot_valid(db, gen)) {
+	    return 0;
+	}
+	/* a writer got in our way */
+    }
+
+    if (!mytid) {
+	/* grab a r lock */
+	if ((r = read_lock(db)) < 0) {
+	    return r;
+	}
+
+	tp = NULL;
+    } else if (!*mytid) {
+	/* grab a r/w lock */
+	if ((r = write_lock(db, NULL)) < 0) {
+	    return r;
+	}
+
+	/* fill in t */
+	newtxn(db, &t);
+
+	tp = &t;
+    } else {
+	tp = *mytid;
+	update_lock(db, tp);
+    }
+
+    r = fetchmany_walk(db, 0, nkeys, keys, keylens, datas, datalens);
+
+    if (mytid) {
+	if (!*mytid) {
+	    /* return the txn structure */
+
+	    *mytid = xmalloc(sizeof(struct txn));
+	    memcpy(*mytid, tp, sizeof(struct txn));
+	    (*mytid)->ismalloc = 1;
+	}
+    } else {
+	/* release read lock */
+	int r1;
+	if ((r1 = unlock(db)) < 0) {
+	    return r1;
+	}
+    }
+
+    return r;
+}
+
+/* a cursor remembers the last key it returned, so that it can find its
+   place again whenever the file changed between calls; while it
+   didn't, it just steps on from the record it returned */
+struct cursor {
+    struct db *db;
+    struct txn *tid;		/* NULL if not txn protected */
+
+    char *start;		/* range, NULL if unbounded */
+    int startlen;
+    char *end;
+    int endlen;
+
+    char *key;			/* last key returned, or where to seek to */
+    int keylen;
+    int keyalloc;
+    int seeking;		/* 'key' hasn't been returned yet */
+
+    bit32 offset;		/* 'key' in the map below, 0 if unknown */
+    ino_t ino;
+    unsigned long size;
+    bit32 gen;
+    int nolock;
+};
+
+static void cursor_savekey(struct cursor *c, const char *key, int keylen)
+{
+    if (keylen + 1 > c->keyalloc) {
+	c->keyalloc = keylen + 1024;
+	c->key = xrealloc(c->key, c->keyalloc);
+    }
+    memcpy(c->key, key, keylen);
+    c->key[keylen] = '\0';
+    c->keylen = keylen;
+}
+
+static int mycursor_seek(struct cursor *c, const char *key, int keylen)
+{
+    assert(c != NULL);
+
+    if (!key || (c->start &&
+		 c->db->compar(key, keylen, c->start, c->startlen) < 0)) {
+	key = c->start ? c->start : "";
+	keylen = c->startlen;
+    }
+    cursor_savekey(c, key, keylen);
+    c->seeking = 1;
+    c->offset = 0;
+
+    return 0;
+}
+
+static int mycursor_open(struct db *db,
+			 const char *start, int startlen,
+			 const char *end, int endlen,
+			 struct cursor **cursor, struct txn **mytid)
+{
+    struct cursor *c;
+    struct txn t;
+    int r;
+
+    assert(db != NULL && cursor != NULL);
+
+    if (mytid && !*mytid) {
+	/* grab a r/w lock */
+	if ((r = write_lock(db, NULL)) < 0) {
+	    return r;
+	}
+
+	/* fill in t, and return it */
+	newtxn(db, &t);
+	*mytid = xmalloc(sizeof(struct txn));
+	memcpy(*mytid, &t, sizeof(struct txn));
+	(*mytid)->ismalloc = 1;
+    }
+
+    c = (struct cursor *) xzmalloc(sizeof(struct cursor));
+    c->db = db;
+    c->tid = mytid ? *mytid : NULL;
+    if (start) {
+	c->start = xmalloc(startlen + 1);
+	memcpy(c->start, start, startlen);
+	c->start[startlen] = '\0';
+	c->startlen = startlen;
+    }
+    if (end) {
+	c->end = xmalloc(endlen + 1);
+	memcpy(c->end, end, endlen);
+	c->end[endlen] = '\0';
+	c->endlen = endlen;
+    }
+    mycursor_seek(c, NULL, 0);
+
+    *cursor = c;
+    return 0;
+}
+
+static int mycursor_next(struct cursor *c,
+			 const char **key, int *keylen,
+			 const char **data, int *datalen)
+{
+    struct db *db;
+    const char *ptr;
+    bit32 gen = 0;
+    int nolock = 0;
+    int r = 0;
+
+    assert(c != NULL);
+    db = c->db;
+
+    if (!c->tid) {
+	/* use a lock-free snapshot if we can, else grab a r lock */
+	if (!read_snapshot(db, &gen)) {
+	    nolock = 1;
+	} else if ((r = read_lock(db)) < 0) {
+	    return r;
+	}
+    } else {
+	update_lock(db, c->tid);
+    }
+
+ again:
+    if (!nolock) gen = db->generation;
+
+    if (c->offset && c->ino == db->map_ino && c->size == db->map_size &&
+	c->gen == gen && c->nolock == nolock) {
+	/* nothing changed; move to the next one */
+	ptr = db->map_base + c->offset;
+	ptr = nolock ? next_nolock(db, ptr) : db->map_base + FORWARD(ptr, 0);
+    } else {
+	/* something changed in the file (or we were told to seek) */
+	ptr = foreach_reseek(db, nolock, c->key, c->keylen,
+			     c->seeking ? NULL : c->key, c->keylen);
+    }
+
+    if (nolock && (!ptr || !snapshot_valid(db, gen))) {
+	/* a writer got in our way; try again under the lock */
+	nolock = 0;
+	if ((r = read_lock(db)) < 0) {
+	    return r;
+	}
+	goto again;
+    }
+
+    if (ptr == db->map_base ||
+	(c->end && db->compar(KEY(ptr), KEYLEN(ptr), c->end, c->endlen) >= 0)) {
+	/* off the end; stay where we are */
+	r = CYRUSDB_DONE;
+    } else {
+	cursor_savekey(c, KEY(ptr), KEYLEN(ptr));
+	c->seeking = 0;
+	c->offset = ptr - db->map_base;
+	c->ino = db->map_ino;
+	c->size = db->map_size;
+	c->gen = gen;
+	c->nolock = nolock;
+
+	if (key) *key = KEY(ptr);
+	if (keylen) *keylen = KEYLEN(ptr);
+	if (data) *data = DATA(ptr);
+	if (datalen) *datalen = DATALEN(ptr);
+    }
+
+    if (!c->tid && !nolock) {
+	/* release read lock */
+	int r1;
+	if ((r1 = unlock(db)) < 0) {
+	    return r1;
+	}
+    }
+
+    return r;
+}
+
+static int mycursor_close(struct cursor *c)
+{
+    assert(c != NULL);
+
+    if (c->start) free(c->start);
+    if (c->end) free(c->end);
+    if (c->key) free(c->key);
+    free(c);
+
+    return 0;
+}
+
 unsigned int randlvl(struct db *db)
 {
     unsigned int lvl = 1;
@@ -1176,6 +1784,9 @@ int mystore(struct db *db,
     
     newoffset = htonl(newoffset);
 
+    /* lock-free readers must not trust what they see from here on */
+    begin_update(db);
+
     /* set pointers appropriately */
     for (i = 0; i < lvl; i++) {
 	/* write pointer updates */
@@ -1290,11 +1901,13 @@ int mydelete(struct db *db,
     }
 
     ptr = find_node(db, key, keylen, updateoffsets);
-    if (ptr == db->map_base ||
+    if (ptr != db->map_base &&
 	!db->compar(KEY(ptr), KEYLEN(ptr), key, keylen)) {
 	/* gotcha */
 	offset = ptr - db->map_base;
 
+	begin_update(db);
+
 	/* update pointers */
 	for (i = 0; i < db->curlevel; i++) {
 	    int newoffset;
@@ -1339,9 +1952,77 @@ int mydelete(struct db *db,
     return 0;
 }
 
+/* compare generations, allowing for wraparound */
+#define GEN_AT_LEAST(a, b) ((int) ((bit32) (a) - (bit32) (b)) >= 0)
+
+/* how often group_sync() looks for another process's fdatasync(), and how
+   long it waits for one that's in progress (microseconds) */
+enum {
+    GROUPCOMMIT_POLL = 1000,
+    GROUPCOMMIT_STALL = 1000000
+};
+
+/* the commit that made the file generation 'gen' has been written but
+   not synced, and the db is no longer locked.  wait for an fdatasync()
+   by another process to cover it, or do one ourselves once the group
+   commit window has passed. */
+static int group_sync(struct db *db, bit32 gen)
+{
+    long window = libcyrus_config_getint(CYRUSOPT_SKIPLIST_GROUPCOMMIT);
+    struct timeval start, now;
+    bit32 buf[2], target;
+    long waited;
+
+    gettimeofday(&start, NULL);
+    for (;;) {
+	if (pread(db->fd, buf, 8, OFFSET_SYNCED) != 8) break;
+	if (GEN_AT_LEAST(ntohl(buf[0]), gen)) {
+	    /* someone else synced us */
+	    return 0;
+	}
+
+	gettimeofday(&now, NULL);
+	waited = (now.tv_sec - start.tv_sec) * 1000000 +
+	    (now.tv_usec - start.tv_usec);
+	if (waited >= window * 1000) {
+	    /* keep waiting for a sync that's already under way, unless
+	       it seems to have gotten stuck */
+	    if (!GEN_AT_LEAST(ntohl(buf[1]), gen) ||
+		waited >= window * 1000 + GROUPCOMMIT_STALL) {
+		break;
+	    }
+	}
+	usleep(GROUPCOMMIT_POLL);
+    }
+
+    /* everything committed so far rides along with us */
+    if (pread(db->fd, buf, 4, OFFSET_GENERATION) != 4) {
+	buf[0] = htonl(gen);
+    }
+    target = ntohl(buf[0]) & ~1;
+    if (!GEN_AT_LEAST(target, gen)) target = gen;
+
+    buf[0] = htonl(target);
+    pwrite(db->fd, buf, 4, OFFSET_SYNCING);
+
+    if (fdatasync(db->fd) < 0) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
+	return CYRUSDB_IOERROR;
+    }
+
+    /* we don't hold the lock, so this can race with another syncer;
+       losing just means someone does an fdatasync() they didn't need */
+    pwrite(db->fd, buf, 4, OFFSET_SYNCED);
+
+    return 0;
+}
+
 int mycommit(struct db *db, struct txn *tid)
 {
     bit32 commitrectype = htonl(COMMIT);
+    int group = DO_FSYNC && !use_osync && HAS_GENERATION(db) &&
+	libcyrus_config_getint(CYRUSOPT_SKIPLIST_GROUPCOMMIT) > 0;
+    int needsync = 0;
     int r = 0;
 
     assert(db && tid);
@@ -1359,8 +2040,10 @@ int mycommit(struct db *db, struct txn *tid)
 	goto done;
     }
 
-    /* fsync if we're not using O_SYNC writes */
-    if (!use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+    /* fsync if we're not using O_SYNC writes.  with group commit we
+       don't: until group_sync() the txn may reach the disk only in
+       part, and recovery throws away a partial txn. */
+    if (!group && !use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
 	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
 	r = CYRUSDB_IOERROR;
         goto done;
@@ -1377,16 +2060,22 @@ int mycommit(struct db *db, struct txn *tid)
     retry_write(tid->syncfd, (char *) &commitrectype, 4);
 
     /* fsync if we're not using O_SYNC writes */
-    if (!use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+    if (!group && !use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
 	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
 	r = CYRUSDB_IOERROR;
         goto done;
     }
 
+    /* the file is consistent again; let lock-free readers back in */
+    end_update(db);
+    needsync = group;
+
  done:
     /* consider checkpointing */
     if (!r && tid->logend > (2 * db->logstart + SKIPLIST_MINREWRITE)) {
+	/* the checkpoint syncs everything we committed */
 	r = mycheckpoint(db, 1);
+	needsync = 0;
     }
     
     if (be_paranoid) {
@@ -1403,10 +2092,16 @@ int mycommit(struct db *db, struct txn *tid)
 		   db->fname);
         }
     } else {
+	bit32 gen = db->generation;
+
         /* release the write lock */
         if ((r = unlock(db)) < 0) {
             return r;
         }
+
+	/* other processes can see our changes, but they aren't on
+	   disk yet */
+	if (needsync) r = group_sync(db, gen);
         
         /* must close this after releasing the lock */
         closesyncfd(db, tid);
@@ -1425,10 +2120,13 @@ int myabort(struct db *db, struct txn *tid)
     const char *ptr;
     int updateoffsets[SKIPLIST_MAXLEVEL];
     bit32 offset;
+    int dirty = (tid->logstart != tid->logend);
     int i;
     int r = 0;
 
     assert(db && tid);
+
+    if (dirty) begin_update(db);
     
     /* look at the log entries we've written, and undo their effects */
     while (tid->logstart != tid->logend) {
@@ -1502,6 +2200,8 @@ int myabort(struct db *db, struct txn *tid)
 
     db->map_size = tid->logstart;
 
+    if (dirty) end_update(db);
+
     /* release the write lock */
     if ((r = unlock(db)) < 0) {
 	return r;
@@ -1532,6 +2232,7 @@ static int mycheckpoint(struct db *db, int locked)
     int r = 0;
     int iorectype = htonl(INORDER);
     int i;
+    int oldminor = db->version_minor;
     time_t start = time(NULL);
 
     /* grab write lock (could be read but this prevents multiple checkpoints
@@ -1562,6 +2263,11 @@ static int mycheckpoint(struct db *db, int locked)
 	return CYRUSDB_IOERROR;
     }
 
+    /* where the old file's list starts; the new file gets the current
+       format, which may put the dummy record somewhere else */
+    offset = FORWARD(DUMMY_PTR(db), 0);
+    db->version_minor = SKIPLIST_VERSION_MINOR;
+
     /* write dummy record */
     if (!r) {
 	int dsize = DUMMY_SIZE(db);
@@ -1589,7 +2295,6 @@ static int mycheckpoint(struct db *db, int locked)
     }
 
     /* write records to new file */
-    offset = FORWARD(db->map_base + DUMMY_OFFSET(db), 0);
     db->listsize = 0;
     while (!r && offset != 0) {
 	unsigned int lvl;
@@ -1659,8 +2364,9 @@ static int mycheckpoint(struct db *db, int locked)
 	}
     }
 
-    /* create the header */
+    /* create the header; the new file is synced before anyone sees it */
     db->logstart = lseek(db->fd, 0, SEEK_END);
+    db->synced = db->generation & ~1;
     r = write_header(db);
 
     /* sync new file */
@@ -1692,6 +2398,7 @@ static int mycheckpoint(struct db *db, int locked)
 	close(db->fd);
 	db->fd = oldfd;
 	unlink(fname);
+	db->version_minor = oldminor;
     }
 
     /* release old write lock */
@@ -1710,6 +2417,7 @@ static int mycheckpoint(struct db *db, int locked)
 	db->map_ino = sbuf.st_ino;
 	map_refresh(db->fd, 0, &db->map_base, &db->map_len, sbuf.st_size,
 		    db->fname, 0);
+	refresh_header(db, 1);
     }
 
     if ((r = myconsistent(db, NULL, 1)) < 0) {
@@ -1882,6 +2590,9 @@ static int recovery(struct db *db, int flags)
 	return 0;
     }
 
+    /* we're about to rewrite every pointer in the file */
+    begin_update(db);
+
     db->listsize = 0;
 
     ptr = DUMMY_PTR(db);
@@ -2021,6 +2732,21 @@ static int recovery(struct db *db, int flags)
 	    continue;
 	}
 
+	/* with group commit, a txn torn by a crash can leave zeroes
+	   where its first record should be; treat it as partial */
+	if (TYPE(ptr) == 0) {
+	    syslog(LOG_NOTICE, 
+		   "skiplist recovery %s: found torn txn at %04X, not replaying",
+		   db->fname, offset);
+	    if (ftruncate(db->fd, offset) < 0) {
+		syslog(LOG_ERR, 
+		       "DBERROR: skiplist recovery %s: ftruncate: %m",
+		       db->fname);
+		r = CYRUSDB_IOERROR;
+	    }
+	    break;
+	}
+
 	/* make sure this is ADD or DELETE */
 	if (TYPE(ptr) != ADD && TYPE(ptr) != DELETE) {
 	    syslog(LOG_ERR, 
@@ -2162,6 +2888,8 @@ static int recovery(struct db *db, int flags)
     /* set the last recovery timestamp */
     if (!r) {
 	db->last_recovery = time(NULL);
+	if (db->generation & 1) db->generation++;
+	db->synced = db->generation;
 	write_header(db);
     }
 
@@ -2211,5 +2939,11 @@ struct cyrusdb_backend cyrusdb_skiplist =
     &myabort,
 
     &dump,
-    &consistent
+    &consistent,
+
+    &myfetchmany,
+    &mycursor_open,
+    &mycursor_seek,
+    &mycursor_next,
+    &mycursor_close
 };
@@ -0,0 +1,122 @@
+/* keysort.c -- array sort on a fixed-width key prefix
+ *
+ * Items are sorted by their 64-bit keys with an LSD radix sort, a
+ * byte at a time (skipping bytes where every key is the same), and
+ * then each run of equal keys is merge sorted with the comparison
+ * function.  When the keys hold enough of what is being compared, the
+ * comparison function is hardly ever called.
+ */
+
+/* $Id$ */
+
+#include <config.h>
+#include <string.h>
+
+#include "keysort.h"
+#include "xmalloc.h"
+
+/* runs this short are insertion sorted */
+#define KEYSORT_SMALL 16
+
+static void keysort_insertion(struct keysort_item *items, unsigned n,
+			      int (*compar)(void *, void *, void *),
+			      void *call_data)
+{
+    struct keysort_item tmp;
+    unsigned i, j;
+
+    for (i = 1; i < n; i++) {
+	tmp = items[i];
+	for (j = i; j > 0; j--) {
+	    if (items[j-1].key < tmp.key) break;
+	    if (items[j-1].key == tmp.key &&
+		compar(items[j-1].data, tmp.data, call_data) <= 0) break;
+	    items[j] = items[j-1];
+	}
+	items[j] = tmp;
+    }
+}
+
+/* merge sort a run of equal keys, using 'tmp' (at least 'n' items) */
+static void keysort_run(struct keysort_item *items, unsigned n,
+			struct keysort_item *tmp,
+			int (*compar)(void *, void *, void *),
+			void *call_data)
+{
+    unsigned half = n / 2, i, j, k;
+
+    if (n <= KEYSORT_SMALL) {
+	keysort_insertion(items, n, compar, call_data);
+	return;
+    }
+
+    keysort_run(items, half, tmp, compar, call_data);
+    keysort_run(items + half, n - half, tmp, compar, call_data);
+
+    /* already in order? */
+    if (compar(items[half-1].data, items[half].data, call_data) <= 0) return;
+
+    memcpy(tmp, items, half * sizeof(struct keysort_item));
+    for (i = 0, j = half, k = 0; i < half && j < n; k++) {
+	if (compar(items[j].data, tmp[i].data, call_data) < 0)
+	    items[k] = items[j++];
+	else
+	    items[k] = tmp[i++];
+    }
+    while (i < half) items[k++] = tmp[i++];
+}
+
+void keysort(struct keysort_item *items, unsigned n,
+	     int (*compar)(void *, void *, void *),
+	     void *call_data)
+{
+    struct keysort_item *tmp, *src, *dst, *swap;
+    unsigned (*count)[256];
+    unsigned i, j, pos, sum;
+    int byte, shift;
+
+    if (n <= KEYSORT_SMALL) {
+	keysort_insertion(items, n, compar, call_data);
+	return;
+    }
+
+    /* count every byte of every key in one pass */
+    count = (unsigned (*)[256]) xzmalloc(8 * sizeof(*count));
+    for (i = 0; i < n; i++) {
+	for (byte = 0; byte < 8; byte++) {
+	    count[byte][(items[i].key >> (8 * byte)) & 0xff]++;
+	}
+    }
+
+    tmp = (struct keysort_item *) xmalloc(n * sizeof(struct keysort_item));
+    src = items;
+    dst = tmp;
+    for (byte = 0; byte < 8; byte++) {
+	shift = 8 * byte;
+
+	/* all the keys have the same byte here; nothing to do */
+	if (count[byte][(src[0].key >> shift) & 0xff] == n) continue;
+
+	for (i = 0, sum = 0; i < 256; i++) {
+	    pos = count[byte][i];
+	    count[byte][i] = sum;
+	    sum += pos;
+	}
+	for (i = 0; i < n; i++) {
+	    dst[count[byte][(src[i].key >> shift) & 0xff]++] = src[i];
+	}
+	swap = src;
+	src = dst;
+	dst = swap;
+    }
+    if (src != items) memcpy(items, src, n * sizeof(struct keysort_item));
+    free(count);
+
+    /* order the runs of equal keys */
+    for (i = 0; i < n; i = j) {
+	for (j = i + 1; j < n && items[j].key == items[i].key; j++);
+	if (j - i > 1) keysort_run(items + i, j - i, tmp, compar, call_data);
+    }
+
+    free(tmp);
+}
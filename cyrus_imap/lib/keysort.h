@@ -0,0 +1,28 @@
+/* keysort.h -- array sort on a fixed-width key prefix
+ */
+
+/* $Id$ */
+
+#ifndef INCLUDED_KEYSORT_H
+#define INCLUDED_KEYSORT_H
+
+/*
+ * An item to be sorted: 'key' must order items the same way compar()
+ * would, as far as it goes (items with different keys are never
+ * compared), and 'data' is what is passed to compar().
+ */
+struct keysort_item {
+    unsigned long long key;
+    void *data;
+};
+
+/*
+ * Sorts the 'n' items in 'items' by key, then by compar() among items
+ * with equal keys.  compar() is passed the two items' data and
+ * 'call_data', as for lsort().
+ */
+extern void keysort(struct keysort_item *items, unsigned n,
+		    int (*compar)(void *, void *, void *),
+		    void *call_data);
+
+#endif /* INCLUDED_KEYSORT_H */
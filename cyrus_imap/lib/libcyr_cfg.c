@@ -75,6 +75,10 @@ struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 0),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_SKIPLIST_GROUPCOMMIT,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
     { CYRUSOPT_TEMP_PATH,
       CFGVAL(const char *, "/tmp"),
       CYRUS_OPT_STRING },
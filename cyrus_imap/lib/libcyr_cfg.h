@@ -75,6 +75,8 @@ enum cyrus_opt {
     CYRUSOPT_USERNAME_TOLOWER,
     /* Don't fsync() the skiplist backend (OFF) */
     CYRUSOPT_SKIPLIST_UNSAFE,
+    /* Skiplist group commit window in milliseconds (0 = off) */
+    CYRUSOPT_SKIPLIST_GROUPCOMMIT,
     /* Temporary Storage Directory ("/tmp") */
     CYRUSOPT_TEMP_PATH,
     /* PTS Cache Timeout */
@@ -64,12 +64,37 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+#define PROT_EPOLL
+#ifndef HAVE___ATTRIBUTE__
+/* struct epoll_event is packed on some architectures; don't let
+ * config.h's stub __attribute__ change its layout */
+#undef __attribute__
+#include <sys/epoll.h>
+#define __attribute__(foo)
+#else
+#include <sys/epoll.h>
+#endif
+#elif defined(HAVE_POLL_H) && defined(HAVE_POLL)
+#define PROT_POLL
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#elif defined(HAVE_SENDFILE) && defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
 #include "map.h"
 #include "nonblock.h"
 #include "prot.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 
@@ -79,8 +104,36 @@ struct protgroup
     size_t nalloced; /* Number of nodes in the group */
     size_t next_element; /* Node number of next group member */
     struct protstream **group;
+
+#ifdef PROT_EPOLL
+    /* Event set for prot_select(), created on first use.  Registrations
+     * persist between calls; prot_select() only adds the streams that
+     * are new to the group, and starts over when any have left it. */
+    int epfd;
+    struct protgroup_reg *byfd; /* indexed by fd */
+    int nbyfd;
+    int *regfds;		/* fds currently registered */
+    int nreg, nregalloced;
+    struct epoll_event *events;
+    int nevents;
+    unsigned gen;		/* prot_select() call count */
+#elif defined(PROT_POLL)
+    struct pollfd *pfds;
+    int npfds;
+#endif
 };
 
+#ifdef PROT_EPOLL
+struct protgroup_reg {
+    struct protstream *s;	/* stream registered for this fd, or NULL */
+    unsigned long serial;	/* its serial number */
+    unsigned gen;		/* last prot_select() that wanted it */
+};
+#endif
+
+/* Source of protstream serial numbers */
+static unsigned long prot_serial = 0;
+
 /*
  * Create a new protection stream for file descriptor 'fd'.  Stream
  * will be used for writing iff 'write' is nonzero.
@@ -101,6 +154,7 @@ int write;
     newstream->write = write;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
+    newstream->serial = ++prot_serial;
     if(write)
 	newstream->cnt = PROT_BUFSIZE;
 
@@ -120,6 +174,15 @@ int prot_free(struct protstream *s)
 	close(s->big_buffer);
     }
 
+#ifdef HAVE_ZLIB
+    if (s->zstrm) {
+	if (s->write) deflateEnd(s->zstrm);
+	else inflateEnd(s->zstrm);
+	free(s->zstrm);
+	free(s->zbuf);
+    }
+#endif /* HAVE_ZLIB */
+
     free((char*)s);
 
     return 0;
@@ -154,6 +217,167 @@ int prot_settls(struct protstream *s, SSL *tlsconn)
 
 #endif /* HAVE_SSL */
 
+#ifdef HAVE_ZLIB
+
+/*
+ * Largest amount of plaintext that still fits in 'max' octets once
+ * deflate()d and sync flushed, so that a SASL layer never sees more
+ * than it allows.
+ */
+static unsigned prot_zmaxplain(struct protstream *s, unsigned max)
+{
+    unsigned over = deflateBound(s->zstrm, max) - max + 6;
+
+    return max > 2 * over ? max - over : max / 2;
+}
+
+/*
+ * Turn on DEFLATE compression for this connection (RFC 4978).  Output
+ * buffered so far goes out uncompressed; input buffered so far is
+ * taken to be compressed.
+ */
+int prot_setcompress(struct protstream *s)
+{
+    z_stream *zstrm;
+    int zr;
+
+    if (s->zstrm) return 0;
+
+    if (s->write && s->ptr != s->buf) {
+	/* flush any pending output */
+	if (prot_flush_internal(s, 1) == EOF) return EOF;
+    }
+
+    zstrm = (z_stream *) xzmalloc(sizeof(z_stream));
+    zstrm->zalloc = Z_NULL;
+    zstrm->zfree = Z_NULL;
+    zstrm->opaque = Z_NULL;
+
+    /* RFC 4978 wants a raw deflate stream: no zlib header or checksum */
+    if (s->write) {
+	zr = deflateInit2(zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			  -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    } else {
+	zr = inflateInit2(zstrm, -MAX_WBITS);
+    }
+    if (zr != Z_OK) {
+	syslog(LOG_ERR, "failed to initialize compression: %s",
+	       zstrm->msg ? zstrm->msg : "unknown error");
+	free(zstrm);
+	return EOF;
+    }
+
+    s->zstrm = zstrm;
+    s->zbuf_size = PROT_BUFSIZE;
+    s->zbuf = (unsigned char *) xmalloc(s->zbuf_size);
+
+    if (s->write) {
+	if (s->saslssf) {
+	    s->maxplain = prot_zmaxplain(s, s->maxplain);
+	    s->cnt = s->maxplain;
+	}
+    }
+    else if (s->cnt > 0) {
+	/* the client has already started sending compressed data */
+	if (s->cnt > s->zbuf_size) {
+	    s->zbuf_size = s->cnt;
+	    s->zbuf = (unsigned char *) xrealloc(s->zbuf, s->zbuf_size);
+	}
+	memcpy(s->zbuf, s->ptr, s->cnt);
+	zstrm->next_in = s->zbuf;
+	zstrm->avail_in = s->cnt;
+	s->zpending = 1;
+	s->cnt = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Inflate the compressed input of 's' into its buffer.  The 'n' octets
+ * at the start of the buffer are new input; if 'n' is 0 we carry on
+ * with what was left over from the last call.
+ */
+static int prot_inflate(struct protstream *s, int n)
+{
+    z_stream *zstrm = s->zstrm;
+    int zr;
+
+    if (n > 0) {
+	if (n > s->zbuf_size) {
+	    s->zbuf_size = n;
+	    s->zbuf = (unsigned char *) xrealloc(s->zbuf, s->zbuf_size);
+	}
+	memcpy(s->zbuf, s->buf, n);
+	zstrm->next_in = s->zbuf;
+	zstrm->avail_in = n;
+    }
+
+    zstrm->next_out = s->buf;
+    zstrm->avail_out = s->buf_size;
+
+    zr = inflate(zstrm, Z_SYNC_FLUSH);
+    if (zr != Z_OK && zr != Z_BUF_ERROR && zr != Z_STREAM_END) {
+	char errbuf[256];
+
+	snprintf(errbuf, sizeof(errbuf), "decompression error: %s",
+		 zstrm->msg ? zstrm->msg : "unknown error");
+	s->error = xstrdup(errbuf);
+	return EOF;
+    }
+
+    /* a full buffer means inflate() may be holding more output */
+    s->zpending = zstrm->avail_in > 0 || zstrm->avail_out == 0;
+    s->ptr = s->buf + 1;
+    s->cnt = s->buf_size - zstrm->avail_out;
+
+    return 0;
+}
+
+/*
+ * Deflate the 'len' octets at '*ptr' into the compression buffer of
+ * 's' and point '*ptr' and '*len' at the result.  Each flush of the
+ * stream is a sync flush, so the other end can decode everything we've
+ * sent so far.
+ */
+static int prot_deflate(struct protstream *s, const unsigned char **ptr,
+			unsigned *len)
+{
+    z_stream *zstrm = s->zstrm;
+    int zr, used;
+
+    zstrm->next_in = (Bytef *) *ptr;
+    zstrm->avail_in = *len;
+    zstrm->next_out = s->zbuf;
+    zstrm->avail_out = s->zbuf_size;
+
+    do {
+	if (!zstrm->avail_out) {
+	    used = s->zbuf_size;
+	    s->zbuf_size += PROT_BUFSIZE;
+	    s->zbuf = (unsigned char *) xrealloc(s->zbuf, s->zbuf_size);
+	    zstrm->next_out = s->zbuf + used;
+	    zstrm->avail_out = s->zbuf_size - used;
+	}
+
+	zr = deflate(zstrm, Z_SYNC_FLUSH);
+	if (zr != Z_OK && zr != Z_BUF_ERROR) {
+	    char errbuf[256];
+
+	    snprintf(errbuf, sizeof(errbuf), "compression error: %s",
+		     zstrm->msg ? zstrm->msg : "unknown error");
+	    s->error = xstrdup(errbuf);
+	    return EOF;
+	}
+    } while (!zstrm->avail_out);
+
+    *ptr = s->zbuf;
+    *len = s->zbuf_size - zstrm->avail_out;
+    return 0;
+}
+
+#endif /* HAVE_ZLIB */
+
 /*
  * Turn on SASL for this connection
  */
@@ -195,6 +419,9 @@ sasl_conn_t *conn;
 	    /* max = 0 means unlimited, and we can't go bigger */
 	    max = PROT_BUFSIZE;
 	}
+#ifdef HAVE_ZLIB
+	if (s->zstrm) max = prot_zmaxplain(s, max);
+#endif
     
 	s->maxplain = max;
 	s->cnt = max;
@@ -372,6 +599,14 @@ int prot_fill(struct protstream *s)
     if (s->eof || s->error) return EOF;
 
     do {
+#ifdef HAVE_ZLIB
+	if (s->zstrm && s->zpending) {
+	    /* finish off the input we already have before reading more */
+	    n = 0;
+	    goto inflate;
+	}
+#endif /* HAVE_ZLIB */
+
 	/* wait until get input */
 	haveinput = 0;
 
@@ -521,6 +756,15 @@ int prot_fill(struct protstream *s)
 	    s->ptr = s->buf+1;
 	    s->cnt = n;
 	}
+
+#ifdef HAVE_ZLIB
+	if (s->zstrm) {
+	    /* what we've got so far is compressed */
+	    n = s->cnt;
+	inflate:
+	    if (prot_inflate(s, n) == EOF) return EOF;
+	}
+#endif /* HAVE_ZLIB */
 	
 	if (s->cnt > 0) {
 	    if (s->logfd != -1) {
@@ -591,8 +835,15 @@ static int prot_flush_encode(struct protstream *s,
 			     const char **output_buf,
 			     unsigned *output_len) 
 {
-    unsigned char *ptr = s->buf;
-    int left = s->ptr - s->buf;
+    const unsigned char *ptr = s->buf;
+    unsigned left = s->ptr - s->buf;
+
+#ifdef HAVE_ZLIB
+    if (s->zstrm) {
+	/* compress the data */
+	if (prot_deflate(s, &ptr, &left) == EOF) return EOF;
+    }
+#endif /* HAVE_ZLIB */
 
     if (s->saslssf != 0) {
 	/* encode the data */
@@ -846,6 +1097,80 @@ int prot_flush_internal(struct protstream *s, int force)
     return 0;
 }
 
+/*
+ * Can data bound for 's' bypass its buffer?  That takes a blocking
+ * stream with no SASL layer to encode for and no telemetry log to feed
+ * (both of which work on the buffer) and no big buffer to drain first.
+ */
+static int prot_canwritethrough(struct protstream *s)
+{
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+    return (!s->dontblock && !s->saslssf && s->logfd == PROT_NO_FD &&
+	    s->big_buffer == PROT_NO_FD);
+}
+
+/*
+ * Write the buffered data of 's' followed by the 'len' bytes at 'buf'
+ * to the descriptor without first copying 'buf' into the buffer.
+ * Plain streams do it as a single writev(); with TLS the buffer is
+ * topped up and written first, and the rest goes to SSL_write() whole
+ * so that it is cut into full-sized records.
+ */
+static int prot_writethrough(struct protstream *s, const char *buf,
+			     unsigned len)
+{
+    struct iovec iov[2];
+    int n;
+
+    if (s->dontblock_isset) {
+	nonblock(s->fd, 0);
+	s->dontblock_isset = 0;
+    }
+
+#ifdef HAVE_SSL
+    if (s->tls_conn != NULL) {
+	n = s->cnt;
+	memcpy(s->ptr, buf, n);
+	s->ptr += n;
+	s->cnt = 0;
+	if (prot_flush_internal(s, 0) == EOF) return EOF;
+
+	buf += n;
+	len -= n;
+	while (len) {
+	    n = prot_flush_writebuffer(s, buf, len);
+	    if (n == -1) {
+		s->error = xstrdup(strerror(errno));
+		return EOF;
+	    }
+	    if (n > 0) {
+		buf += n;
+		len -= n;
+	    }
+	}
+	return 0;
+    }
+#endif /* HAVE_SSL */
+
+    iov[0].iov_base = (char *) s->buf;
+    iov[0].iov_len = s->ptr - s->buf;
+    iov[1].iov_base = (char *) buf;
+    iov[1].iov_len = len;
+
+    n = retry_writev(s->fd, iov, 2);
+
+    s->ptr = s->buf;
+    s->cnt = s->maxplain;
+
+    if (n == -1) {
+	s->error = xstrdup(strerror(errno));
+	return EOF;
+    }
+    return 0;
+}
+
 /*
  * Write to the output stream 's' the 'len' bytes of data at 'buf'
  */
@@ -854,10 +1179,13 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
     assert(s->write);
     if(s->error || s->eof) return EOF;
     if(len == 0) return 0;
+
+    /* Data that won't fit in the buffer goes straight out with it */
+    if (len >= s->cnt && prot_canwritethrough(s)) {
+	return prot_writethrough(s, buf, len);
+    }
     
     while (len >= s->cnt) {
-	/* XXX can we manage to write data from 'buf' without copying it
-	   to s->ptr ? */
 	memcpy(s->ptr, buf, s->cnt);
 	s->ptr += s->cnt;
 	buf += s->cnt;
@@ -874,6 +1202,109 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
     return 0;
 }
 
+/*
+ * Can the output stream 's' be bypassed by prot_sendfile()?  Anything
+ * that has to see the plaintext (a SASL security layer, TLS or the
+ * telemetry log) rules it out.
+ */
+int prot_cansendfile(struct protstream *s)
+{
+    assert(s->write);
+
+#if defined(HAVE_SYS_SENDFILE_H) || (defined(HAVE_SENDFILE) && defined(__APPLE__))
+    if (s->saslssf || s->logfd != PROT_NO_FD) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_SSL
+    if (s->tls_conn != NULL) return 0;
+#endif /* HAVE_SSL */
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Copy 'len' bytes of 'fd' at 'offset' through the buffer of 's'.
+ * Used when the kernel won't do the transfer for us.
+ */
+static int prot_sendfile_copy(struct protstream *s, int fd,
+			      off_t offset, size_t len)
+{
+    int n;
+
+    while (len) {
+	n = pread(fd, s->ptr, len < s->cnt ? len : s->cnt, offset);
+	if (n == -1 && errno == EINTR) continue;
+	if (n <= 0) {
+	    s->error = xstrdup(n ? strerror(errno) : "unexpected end of file");
+	    return EOF;
+	}
+	s->ptr += n;
+	s->cnt -= n;
+	offset += n;
+	len -= n;
+	if (!s->cnt && prot_flush_internal(s, 1) == EOF) return EOF;
+    }
+
+    return prot_flush_internal(s, 1);
+}
+
+/*
+ * Write 'len' bytes of the file 'fd' starting at 'offset' to the
+ * output stream 's', letting the kernel move the data from the page
+ * cache to the socket.  Any buffered output is flushed first.
+ */
+int prot_sendfile(struct protstream *s, int fd, off_t offset, size_t len)
+{
+    int sent_any = 0;
+
+    assert(s->write);
+    assert(prot_cansendfile(s));
+
+    if (s->error || s->eof) return EOF;
+    if (len == 0) return 0;
+
+    /* a forced flush also leaves s->fd in blocking mode */
+    if (prot_flush_internal(s, 1) == EOF) return EOF;
+
+    while (len) {
+#ifdef HAVE_SYS_SENDFILE_H
+	ssize_t n = sendfile(s->fd, fd, &offset, len);
+
+	if (n == -1 && errno == EINTR) continue;
+#elif defined(HAVE_SENDFILE) && defined(__APPLE__)
+	off_t n = len;
+	int r;
+
+	/* on EINTR/EAGAIN 'n' is set to the number of bytes sent */
+	r = sendfile(fd, s->fd, offset, &n, NULL, 0);
+	if (r == -1 && errno != EINTR && errno != EAGAIN) n = -1;
+	else if (r == -1 && n == 0) continue;
+	else offset += n;
+#else
+	int n = -1;
+
+	errno = ENOSYS;
+#endif
+	if (n == -1 && !sent_any &&
+	    (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+	    /* this descriptor pair isn't supported, do it the slow way */
+	    return prot_sendfile_copy(s, fd, offset, len);
+	}
+	if (n <= 0) {
+	    s->error = xstrdup(n ? strerror(errno) : "unexpected end of file");
+	    return EOF;
+	}
+
+	sent_any = 1;
+	len -= n;
+    }
+
+    return 0;
+}
+
 /*
  * Stripped-down version of printf() that works on protection streams
  * Only understands '%lld', '%llu', '%ld', '%lu', '%d', %u', '%s',
@@ -1007,6 +1438,250 @@ int prot_read(struct protstream *s, char *buf, unsigned size)
     return size+1;
 }
 
+/*
+ * Add 's' to the set of ready protstreams '*ready', creating the set
+ * (sized for 'group') if necessary.
+ */
+static void protgroup_ready(struct protgroup **ready, struct protgroup *group,
+			    struct protstream *s)
+{
+    if (!*ready) *ready = protgroup_new(group->next_element + 1);
+
+    protgroup_insert(*ready, s);
+}
+
+#ifdef PROT_EPOLL
+/*
+ * Wait for input on the protstreams of 'group' and 'extra_fd' with epoll.
+ *
+ * Streams stay registered with the group's epoll set from one call to
+ * the next, so a call costs one pass over the group to spot changes and
+ * the kernel only reports the descriptors that are actually ready;
+ * there is no FD_SETSIZE limit.
+ *
+ * Returns the number of ready protstreams (added to '*ready'), or -1.
+ */
+static int protgroup_wait(struct protgroup *group, int extra_fd,
+			  struct timeval *timeout, int *extra_ready,
+			  struct protgroup **ready)
+{
+    struct protstream *s;
+    struct protgroup_reg *reg;
+    struct epoll_event ev;
+    int i, n, fd, found = 0, ms = -1;
+
+    group->gen++;
+
+    /* note which registered streams are still in the group */
+    for (i = 0; i < group->next_element; i++) {
+	s = group->group[i];
+	if (!s) continue;
+	fd = s->fd;
+
+	if (fd >= group->nbyfd) {
+	    n = group->nbyfd;
+	    group->nbyfd = fd + 1 + PROTGROUP_SIZE_DEFAULT;
+	    group->byfd = xrealloc(group->byfd,
+				   group->nbyfd * sizeof(struct protgroup_reg));
+	    memset(group->byfd + n, 0,
+		   (group->nbyfd - n) * sizeof(struct protgroup_reg));
+	}
+	reg = &group->byfd[fd];
+	if (reg->s == s && reg->serial == s->serial) reg->gen = group->gen;
+    }
+
+    /*
+     * If any have left it, start over with a new event set.  We can't
+     * just EPOLL_CTL_DEL them: the kernel keys registrations on the open
+     * file, not the descriptor number, so once a stream's fd has been
+     * closed (while a dup() or a child's copy keeps the socket open) or
+     * reused, a DEL by number misses the old registration or removes
+     * the new one, and the old one goes on reporting its fd as ready.
+     */
+    for (i = 0; i < group->nreg; i++) {
+	if (group->byfd[group->regfds[i]].gen != group->gen) break;
+    }
+    if (i < group->nreg) {
+	for (i = 0; i < group->nreg; i++) {
+	    group->byfd[group->regfds[i]].s = NULL;
+	}
+	group->nreg = 0;
+	close(group->epfd);
+	group->epfd = -1;
+    }
+
+    if (group->epfd == -1) {
+	group->epfd = epoll_create(group->nalloced + 1);
+	if (group->epfd == -1) return -1;
+    }
+
+    /* register the streams new to the group */
+    for (i = 0; i < group->next_element; i++) {
+	s = group->group[i];
+	if (!s) continue;
+	fd = s->fd;
+	reg = &group->byfd[fd];
+
+	if (!reg->s) {
+	    memset(&ev, 0, sizeof(ev));
+	    ev.events = EPOLLIN;
+	    ev.data.fd = fd;
+	    if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		if (errno != EEXIST ||
+		    epoll_ctl(group->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		    return -1;
+		}
+	    }
+
+	    if (group->nreg == group->nregalloced) {
+		group->nregalloced += PROTGROUP_SIZE_DEFAULT;
+		group->regfds = xrealloc(group->regfds,
+					 group->nregalloced * sizeof(int));
+	    }
+	    group->regfds[group->nreg++] = fd;
+	    reg->s = s;
+	    reg->serial = s->serial;
+	    reg->gen = group->gen;
+	}
+	/* else it's registered already, or two streams share one
+	   descriptor and the first one wins */
+    }
+
+    if (extra_fd != PROT_NO_FD) {
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = extra_fd;
+	if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, extra_fd, &ev) == -1 &&
+	    errno != EEXIST) {
+	    return -1;
+	}
+    }
+
+    if (group->nevents < group->nreg + 1) {
+	group->nevents = group->nreg + 1;
+	group->events = xrealloc(group->events,
+				 group->nevents * sizeof(struct epoll_event));
+    }
+
+    if (timeout) {
+	ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    }
+
+    n = epoll_wait(group->epfd, group->events, group->nevents, ms);
+
+    /* the extra fd isn't ours to keep track of */
+    if (extra_fd != PROT_NO_FD) {
+	epoll_ctl(group->epfd, EPOLL_CTL_DEL, extra_fd, &ev);
+    }
+
+    if (n == -1) return -1;
+
+    for (i = 0; i < n; i++) {
+	fd = group->events[i].data.fd;
+
+	if (fd == extra_fd) {
+	    *extra_ready = 1;
+	}
+	else if (fd < group->nbyfd && (s = group->byfd[fd].s)) {
+	    protgroup_ready(ready, group, s);
+	    found++;
+	}
+    }
+
+    return found;
+}
+#elif defined(PROT_POLL)
+/*
+ * Wait for input on the protstreams of 'group' and 'extra_fd' with poll(),
+ * which unlike select() has no FD_SETSIZE limit.
+ *
+ * Returns the number of ready protstreams (added to '*ready'), or -1.
+ */
+static int protgroup_wait(struct protgroup *group, int extra_fd,
+			  struct timeval *timeout, int *extra_ready,
+			  struct protgroup **ready)
+{
+    struct protstream *s;
+    int i, n, npfd = 0, found = 0, ms = -1;
+
+    if (group->npfds < group->next_element + 1) {
+	group->npfds = group->nalloced + 1;
+	group->pfds = xrealloc(group->pfds,
+			       group->npfds * sizeof(struct pollfd));
+    }
+
+    for (i = 0; i < group->next_element; i++) {
+	if (!(s = group->group[i])) continue;
+	group->pfds[npfd].fd = s->fd;
+	group->pfds[npfd].events = POLLIN;
+	group->pfds[npfd].revents = 0;
+	npfd++;
+    }
+    if (extra_fd != PROT_NO_FD) {
+	group->pfds[npfd].fd = extra_fd;
+	group->pfds[npfd].events = POLLIN;
+	group->pfds[npfd].revents = 0;
+	npfd++;
+    }
+
+    if (timeout) {
+	ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    }
+
+    if (poll(group->pfds, npfd, ms) == -1) return -1;
+
+    for (i = n = 0; i < group->next_element; i++) {
+	if (!(s = group->group[i])) continue;
+	if (group->pfds[n++].revents) {
+	    protgroup_ready(ready, group, s);
+	    found++;
+	}
+    }
+    if (extra_fd != PROT_NO_FD && group->pfds[n].revents) {
+	*extra_ready = 1;
+    }
+
+    return found;
+}
+#else
+/*
+ * Wait for input on the protstreams of 'group' and 'extra_fd' with select().
+ *
+ * Returns the number of ready protstreams (added to '*ready'), or -1.
+ */
+static int protgroup_wait(struct protgroup *group, int extra_fd,
+			  struct timeval *timeout, int *extra_ready,
+			  struct protgroup **ready)
+{
+    struct protstream *s;
+    fd_set rfds;
+    int i, max_fd = extra_fd, found = 0;
+
+    FD_ZERO(&rfds);
+    for (i = 0; i < group->next_element; i++) {
+	if (!(s = group->group[i])) continue;
+	FD_SET(s->fd, &rfds);
+	if (s->fd > max_fd) max_fd = s->fd;
+    }
+    if (extra_fd != PROT_NO_FD) FD_SET(extra_fd, &rfds);
+
+    if (select(max_fd + 1, &rfds, NULL, NULL, timeout) == -1) return -1;
+
+    for (i = 0; i < group->next_element; i++) {
+	if (!(s = group->group[i])) continue;
+	if (FD_ISSET(s->fd, &rfds)) {
+	    protgroup_ready(ready, group, s);
+	    found++;
+	}
+    }
+    if (extra_fd != PROT_NO_FD && FD_ISSET(extra_fd, &rfds)) {
+	*extra_ready = 1;
+    }
+
+    return found;
+}
+#endif /* PROT_EPOLL */
+
 /*
  * select() for protection streams, read only
  * Also supports selecting on an extra file descriptor
@@ -1021,9 +1696,8 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
 {
     struct protstream *s, *timeout_prot = NULL;
     struct protgroup *retval = NULL;
-    int max_fd, found_fds = 0;
-    int i;
-    fd_set rfds;
+    int found_fds = 0;
+    int i, n, extra_ready = 0;
     int have_readtimeout = 0;
     struct timeval my_timeout;
     struct prot_waitevent *event;
@@ -1037,11 +1711,6 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
     /* Initialize things we might use */
     errno = 0;
     found_fds = 0;
-    FD_ZERO(&rfds);
-
-    /* If extra_read_fd is PROT_NO_FD, then the first protstream
-     * will override it */
-    max_fd = extra_read_fd;
 
     for(i = 0; i<readstreams->next_element; i++) {
 	int have_thistimeout = 0; /* used to compute the minimal timeout for */
@@ -1075,29 +1744,22 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
 	    if(!timeout || this_timeout <= timeout->tv_sec)
 		timeout_prot = s;
 	}
-	    
-	FD_SET(s->fd, &rfds);
-	if(s->fd > max_fd)
-	    max_fd = s->fd;
 
 	/* Is something currently pending in our protstream's buffer? */
 	if(s->cnt > 0) {
 	    found_fds++;
-
-	    if(!retval)
-		retval = protgroup_new(readstreams->next_element + 1);
-
-	    protgroup_insert(retval, s);
-	    
+	    protgroup_ready(&retval, readstreams, s);
 	}
 #ifdef HAVE_SSL
 	else if(s->tls_conn != NULL && SSL_pending(s->tls_conn)) {
 	    found_fds++;
-
-	    if(!retval)
-		retval = protgroup_new(readstreams->next_element + 1);
-
-	    protgroup_insert(retval, s);
+	    protgroup_ready(&retval, readstreams, s);
+	}
+#endif
+#ifdef HAVE_ZLIB
+	else if(s->zstrm && s->zpending) {
+	    found_fds++;
+	    protgroup_ready(&retval, readstreams, s);
 	}
 #endif
     }
@@ -1107,12 +1769,6 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
     if(!retval) {
 	time_t sleepfor;
 
-	/* do a select */
-	if(extra_read_fd != PROT_NO_FD) {
-	    /* max_fd started with atleast extra_read_fd */
-	    FD_SET(extra_read_fd, &rfds);
-	}
-
 	if(read_timeout < now)
 	    sleepfor = 0;
 	else
@@ -1128,41 +1784,35 @@ int prot_select(struct protgroup *readstreams, int extra_read_fd,
 	    timeout->tv_usec = 0;
 	}
 
-	if(select(max_fd + 1, &rfds, NULL, NULL, timeout) == -1)
+	n = protgroup_wait(readstreams, extra_read_fd, timeout,
+			   &extra_ready, &retval);
+	if (n == -1) {
+	    protgroup_free(retval);
 	    return -1;
+	}
+	found_fds += n;
 
 	/* Reset now */
 	now = time(NULL);
 
-	if(extra_read_fd != PROT_NO_FD && FD_ISSET(extra_read_fd, &rfds)) {
+	if(extra_read_fd != PROT_NO_FD && extra_ready) {
 	    *extra_read_flag = 1;
 	    found_fds++;
 	} else if(extra_read_flag) {
 	    *extra_read_flag = 0;
 	}
-	
-	for(i = 0; i<readstreams->next_element; i++) {
-	    s = readstreams->group[i];
-	    if (!s) continue;
 
-	    if(FD_ISSET(s->fd, &rfds)) {
-		found_fds++;
-
-		if(!retval)
-		    retval = protgroup_new(readstreams->next_element + 1);
-
-		protgroup_insert(retval, s);
-	    } else if(s == timeout_prot && now >= read_timeout) {
-		/* If we timed out, be sure to add the protstream we were
-		 * waiting for, even if it didn't show up */
+	if(timeout_prot && now >= read_timeout) {
+	    /* If we timed out, be sure to add the protstream we were
+	     * waiting for, even if it didn't show up */
+	    for (i = 0; retval && i < retval->next_element; i++) {
+		if (retval->group[i] == timeout_prot) break;
+	    }
+	    if (!retval || i == retval->next_element) {
 		found_fds++;
-
-		if(!retval)
-		    retval = protgroup_new(readstreams->next_element + 1);
-
-		protgroup_insert(retval, s);
+		protgroup_ready(&retval, readstreams, timeout_prot);
 	    }
-	}	
+	}
     }
     
     *out = retval;
@@ -1203,6 +1853,19 @@ struct protgroup *protgroup_new(size_t size)
     ret->nalloced = size;
     ret->next_element = 0;
     ret->group = xzmalloc(size * sizeof(struct protstream *));
+#ifdef PROT_EPOLL
+    ret->epfd = -1;
+    ret->byfd = NULL;
+    ret->nbyfd = 0;
+    ret->regfds = NULL;
+    ret->nreg = ret->nregalloced = 0;
+    ret->events = NULL;
+    ret->nevents = 0;
+    ret->gen = 0;
+#elif defined(PROT_POLL)
+    ret->pfds = NULL;
+    ret->npfds = 0;
+#endif
 
     return ret;
 }
@@ -1233,6 +1896,14 @@ void protgroup_free(struct protgroup *group)
     if(group) {
 	assert(group->group);
 	free(group->group);
+#ifdef PROT_EPOLL
+	if (group->epfd != -1) close(group->epfd);
+	if (group->byfd) free(group->byfd);
+	if (group->regfds) free(group->regfds);
+	if (group->events) free(group->events);
+#elif defined(PROT_POLL)
+	if (group->pfds) free(group->pfds);
+#endif
 	free(group);
     }
 }
@@ -49,6 +49,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #include <sasl/sasl.h>
 
@@ -61,6 +62,9 @@
 
 #define PROT_NO_FD -1
 
+/* Below this many octets prot_sendfile() isn't worth the forced flush */
+#define PROT_SENDFILE_MIN (4 * PROT_BUFSIZE)
+
 struct protstream;
 struct prot_waitevent;
 
@@ -87,6 +91,14 @@ struct protstream {
     SSL *tls_conn;
 #endif /* HAVE_SSL */
 
+#ifdef HAVE_ZLIB
+    /* Compression */
+    struct z_stream_s *zstrm; /* deflate (write) or inflate (read) state */
+    unsigned char *zbuf;      /* compressed data */
+    int zbuf_size;
+    int zpending;             /* read only: inflate() has more for us */
+#endif /* HAVE_ZLIB */
+
     /* Big Buffer Information */
     const char *bigbuf_base;  /* Base Pointer */
     unsigned long bigbuf_siz; /* Overall Size of Buffer */
@@ -106,6 +118,8 @@ struct protstream {
     struct protstream *flushonread;
 
     /* Events */
+    unsigned long serial; /* tells a reused protstream from its predecessor
+			     in a protgroup's event registrations */
     prot_readcallback_t *readcallback_proc;
     void *readcallback_rock;
     struct prot_waitevent *waitevent;
@@ -178,6 +192,12 @@ extern int prot_setsasl(struct protstream *s, sasl_conn_t *conn);
 extern int prot_settls(struct protstream *s, SSL *tlsconn);
 #endif /* HAVE_SSL */
 
+#ifdef HAVE_ZLIB
+/* Start DEFLATE compression (RFC 4978) of the protstream; any output
+ * already buffered is sent uncompressed first */
+extern int prot_setcompress(struct protstream *s);
+#endif /* HAVE_ZLIB */
+
 /* Set a timeout for the connection (in seconds) */
 extern int prot_settimeout(struct protstream *s, int timeout);
 
@@ -210,6 +230,17 @@ extern int prot_flush(struct protstream *s);
 
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
+
+/* Can data be handed from a file straight to the socket of 's'?
+ * (no SASL security layer, no TLS and no telemetry log) */
+extern int prot_cansendfile(struct protstream *s);
+
+/* Flush 's', then write 'len' bytes of file 'fd' starting at 'offset'
+ * directly to the socket without copying them through the buffer.
+ * Behaves like a forced (blocking) flush.  Only valid if
+ * prot_cansendfile() is true for 's'. */
+extern int prot_sendfile(struct protstream *s, int fd,
+			 off_t offset, size_t len);
 extern int prot_printf(struct protstream *, const char *, ...)
 #ifdef __GNUC__
     __attribute__ ((format (printf, 2, 3)));
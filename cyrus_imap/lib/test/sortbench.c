@@ -0,0 +1,192 @@
+/* Compare lsort() with keysort() on synthetic SORT data.
+ *
+ * usage: sortbench [-n messages] [-s seed]
+ *
+ * Builds 'messages' (default 1000000) records that look like what
+ * index_sort() loads -- a date, a base subject, a from local-part and
+ * a sequence number -- and sorts them by REVERSE DATE, by SUBJECT DATE
+ * and by FROM, once as a linked list with lsort() and once as an
+ * array of key-prefixed items with keysort(), checking that both give
+ * the same order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "../lsort.h"
+#include "../keysort.h"
+#include "../xmalloc.h"
+
+struct msg {
+    unsigned msgno;
+    long date;
+    char *subj;
+    char *from;
+    struct msg *next;
+};
+
+enum { REVERSE_DATE, SUBJECT_DATE, FROM };
+static const char *crit_names[] = { "REVERSE DATE", "SUBJECT DATE", "FROM" };
+
+void fatal(const char *s, int code)
+{
+    fprintf(stderr, "sortbench: %s\n", s);
+    exit(code);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int numcmp(long n1, long n2)
+{
+    return ((n1 < n2) ? -1 : (n1 > n2) ? 1 : 0);
+}
+
+/* same shape as index_sort_compare(): criteria, then sequence */
+static int msg_compare(struct msg *m1, struct msg *m2, int *crit)
+{
+    int ret = 0;
+
+    switch (*crit) {
+    case REVERSE_DATE:
+	ret = -numcmp(m1->date, m2->date);
+	break;
+    case SUBJECT_DATE:
+	ret = strcmp(m1->subj, m2->subj);
+	if (!ret) ret = numcmp(m1->date, m2->date);
+	break;
+    case FROM:
+	ret = strcmp(m1->from, m2->from);
+	break;
+    }
+    if (!ret) ret = numcmp(m1->msgno, m2->msgno);
+
+    return ret;
+}
+
+static unsigned long long str_key(const char *s)
+{
+    unsigned long long key = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+	key <<= 8;
+	if (*s) key |= (unsigned char) *s++;
+    }
+    return key;
+}
+
+static unsigned long long msg_key(struct msg *m, int crit)
+{
+    switch (crit) {
+    case REVERSE_DATE:
+	return ~(unsigned long long) m->date;
+    case SUBJECT_DATE:
+	return str_key(m->subj);
+    default:
+	return str_key(m->from);
+    }
+}
+
+static void *msg_getnext(struct msg *m)
+{
+    return m->next;
+}
+
+static void msg_setnext(struct msg *m, struct msg *next)
+{
+    m->next = next;
+}
+
+static const char *words[] = {
+    "meeting", "report", "invoice", "lunch", "release", "build", "review",
+    "patch", "question", "update", "status", "weekly", "draft", "notes"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+int main(int argc, char **argv)
+{
+    struct msg *msgs, *list, *m;
+    struct keysort_item *items;
+    unsigned n = 1000000, i, seed = 1;
+    char buf[100];
+    int opt, crit, bad = 0;
+    double start, lsort_time, keysort_time;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != EOF) {
+	switch (opt) {
+	case 'n':
+	    n = atoi(optarg);
+	    break;
+
+	case 's':
+	    seed = atoi(optarg);
+	    break;
+
+	default:
+	    fprintf(stderr, "usage: sortbench [-n messages] [-s seed]\n");
+	    exit(1);
+	}
+    }
+    if (n < 1) fatal("need at least one message", 1);
+    srand(seed);
+
+    /* dates a few seconds apart with some duplicates, subjects drawn
+       from a small vocabulary so threads share them, and a few
+       thousand senders */
+    msgs = (struct msg *) xmalloc(n * sizeof(struct msg));
+    for (i = 0; i < n; i++) {
+	msgs[i].msgno = i + 1;
+	msgs[i].date = 1170000000L + i * 7 - (rand() % 600);
+	snprintf(buf, sizeof(buf), "%s %s %u",
+		 words[rand() % NWORDS], words[rand() % NWORDS],
+		 rand() % 1000);
+	msgs[i].subj = xstrdup(buf);
+	snprintf(buf, sizeof(buf), "user%u", rand() % 5000);
+	msgs[i].from = xstrdup(buf);
+    }
+    items = (struct keysort_item *) xmalloc(n * sizeof(struct keysort_item));
+
+    printf("%u messages\n", n);
+    for (crit = REVERSE_DATE; crit <= FROM; crit++) {
+	/* lsort() on a linked list, as index_sort() used to */
+	for (i = 0; i < n; i++) msgs[i].next = (i+1 < n) ? &msgs[i+1] : NULL;
+	start = now();
+	list = lsort(msgs,
+		     (void * (*)(void*)) msg_getnext,
+		     (void (*)(void*,void*)) msg_setnext,
+		     (int (*)(void*,void*,void*)) msg_compare,
+		     &crit);
+	lsort_time = now() - start;
+
+	/* keysort() on an array, including building the keys */
+	start = now();
+	for (i = 0; i < n; i++) {
+	    items[i].key = msg_key(&msgs[i], crit);
+	    items[i].data = &msgs[i];
+	}
+	keysort(items, n, (int (*)(void*,void*,void*)) msg_compare, &crit);
+	keysort_time = now() - start;
+
+	for (i = 0, m = list; i < n; i++, m = m->next) {
+	    if (m != items[i].data) {
+		bad++;
+		break;
+	    }
+	}
+
+	printf("%-13s lsort %.3f s, keysort %.3f s (%.1fx)%s\n",
+	       crit_names[crit], lsort_time, keysort_time,
+	       keysort_time > 0 ? lsort_time / keysort_time : 0.0,
+	       i < n ? ", ORDER DIFFERS" : "");
+    }
+
+    return bad ? 1 : 0;
+}
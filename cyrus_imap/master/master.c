@@ -1231,6 +1231,97 @@ void sighandler_setup(void)
     }
 }
 
+/*
+ * Adaptive pool sizing.  A service with a maxprefork above its prefork
+ * keeps between prefork and maxprefork processes ready: the pool grows
+ * when clients have had to queue for a process, and shrinks again when
+ * processes sat unused for a whole ADAPT_INTERVAL.
+ */
+enum {
+    ADAPT_INTERVAL = 60		/* seconds between shrink decisions */
+};
+
+static void adapt_wakeup(struct service *s)
+{
+    struct event *evt = (struct event *) xmalloc(sizeof(struct event));
+
+    memset(evt, 0, sizeof(struct event));
+
+    evt->name = xstrdup("adaptive pool wakeup call");
+    evt->mark = s->last_adapt + ADAPT_INTERVAL;
+    schedule_event(evt);
+}
+
+/* a child took a connection: did the client have to wait for it? */
+static void adapt_connection(struct service *s, struct notify_message *msg)
+{
+    int grow;
+
+    /* if the child found it waiting as soon as it was ready, the client
+     * queued; so did any that are still queued behind it */
+    grow = msg->backlog > 0 ? msg->backlog : 0;
+    if (msg->wait == 0) grow++;
+    if (!grow || !s->exec) return;
+
+    if (s->desired_workers <= s->prefork) {
+	/* start looking for a chance to shrink back */
+	s->last_adapt = time(NULL);
+	s->min_ready = s->ready_workers;
+	s->nqueued = 0;
+	adapt_wakeup(s);
+    }
+    s->nqueued++;
+
+    if (s->desired_workers >= s->maxprefork) return;
+    s->desired_workers += grow;
+    if (s->desired_workers > s->maxprefork)
+	s->desired_workers = s->maxprefork;
+
+    if (verbose)
+	syslog(LOG_DEBUG, "service %s: growing pool to %d ready workers",
+	       SERVICENAME(s->name), s->desired_workers);
+}
+
+/* once an interval, give back processes that were never needed */
+static void adapt_service(const int si, time_t now)
+{
+    struct service * const s = &Services[si];
+    struct centry *c;
+    int spare, j;
+
+    if (!s->maxprefork || s->desired_workers <= s->prefork ||
+	now - s->last_adapt < ADAPT_INTERVAL) return;
+
+    if (!s->nqueued && s->min_ready > 0) {
+	/* min_ready processes stayed idle all along; let half of them go */
+	spare = (s->min_ready + 1) / 2;
+	if (spare > s->desired_workers - s->prefork)
+	    spare = s->desired_workers - s->prefork;
+	s->desired_workers -= spare;
+
+	if (verbose)
+	    syslog(LOG_DEBUG, "service %s: shrinking pool to %d ready workers",
+		   SERVICENAME(s->name), s->desired_workers);
+
+	/* ready processes exit on SIGHUP */
+	spare = s->ready_workers - s->desired_workers;
+	for (j = 0; spare > 0 && j < child_table_size; j++) {
+	    for (c = ctable[j]; spare > 0 && c; c = c->next) {
+		if (c->si == si && c->service_state == SERVICE_STATE_READY &&
+		    c->pid > 0) {
+		    kill(c->pid, SIGHUP);
+		    spare--;
+		}
+	    }
+	}
+    }
+
+    s->last_adapt = now;
+    s->min_ready = s->ready_workers;
+    s->nqueued = 0;
+    if (s->desired_workers > s->prefork) adapt_wakeup(s);
+}
+
 void process_msg(const int si, struct notify_message *msg) 
 {
     struct centry *c;
@@ -1372,6 +1463,7 @@ void process_msg(const int si, struct notify_message *msg)
 	    s->nconnections++;
 	    s->ready_workers--;
 	}
+	if (s->maxprefork) adapt_connection(s, msg);
 	break;
 	
     case MASTER_SERVICE_CONNECTION_MULTI:
@@ -1431,6 +1523,9 @@ void process_msg(const int si, struct notify_message *msg)
 	break;
     }
 
+    if (s->maxprefork && s->ready_workers < s->min_ready)
+	s->min_ready = s->ready_workers;
+
     if (verbose)
 	syslog(LOG_DEBUG, "service %s now has %d ready workers\n", 
 	       SERVICENAME(s->name), s->ready_workers);
@@ -1486,6 +1581,7 @@ void add_service(const char *name, struct entry *e, void *rock)
     int ignore_err = (int) rock;
     char *cmd = xstrdup(masterconf_getstring(e, "cmd", ""));
     int prefork = masterconf_getint(e, "prefork", 0);
+    int maxprefork = masterconf_getint(e, "maxprefork", 0);
     int babysit = masterconf_getswitch(e, "babysit", 0);
     int maxforkrate = masterconf_getint(e, "maxforkrate", 0);
     char *listen = xstrdup(masterconf_getstring(e, "listen", ""));
@@ -1580,6 +1676,8 @@ void add_service(const char *name, struct entry *e, void *rock)
 	!strcmp(Services[i].proto, "tcp4") ||
 	!strcmp(Services[i].proto, "tcp6")) {
 	Services[i].desired_workers = prefork;
+	Services[i].prefork = prefork;
+	Services[i].maxprefork = maxprefork > prefork ? maxprefork : 0;
 	Services[i].babysit = babysit;
 	Services[i].max_workers = atoi(max);
 	if (Services[i].max_workers == -1) {
@@ -1589,6 +1687,8 @@ void add_service(const char *name, struct entry *e, void *rock)
 	/* udp */
 	if (prefork > 1) prefork = 1;
 	Services[i].desired_workers = prefork;
+	Services[i].prefork = prefork;
+	Services[i].maxprefork = 0;
 	Services[i].max_workers = 1;
     }
     free(max);
@@ -1601,6 +1701,8 @@ void add_service(const char *name, struct entry *e, void *rock)
 		Services[j].maxforkrate = Services[i].maxforkrate;
 		Services[j].exec = Services[i].exec;
 		Services[j].desired_workers = Services[i].desired_workers;
+		Services[j].prefork = Services[i].prefork;
+		Services[j].maxprefork = Services[i].maxprefork;
 		Services[j].babysit = Services[i].babysit;
 		Services[j].max_workers = Services[i].max_workers;
 		Services[j].provide_uuid = Services[i].provide_uuid;
@@ -1875,6 +1977,7 @@ void reread_conf(void)
 	    Services[i].listen = NULL;
 	    Services[i].proto = NULL;
 	    Services[i].desired_workers = 0;
+	    Services[i].maxprefork = 0;
 
 	    /* send SIGHUP to all children */
 	    for (j = 0 ; j < child_table_size ; j++ ) {
@@ -2279,6 +2382,8 @@ int main(int argc, char **argv)
 	
 	/* do we have any services undermanned? */
 	for (i = 0; i < nservices; i++) {
+	    adapt_service(i, now);
+
 	    if (Services[i].exec /* enabled */ &&
 		(Services[i].nactive < Services[i].max_workers) &&
 		(Services[i].ready_workers < Services[i].desired_workers)) {
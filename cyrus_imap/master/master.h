@@ -27,6 +27,8 @@ struct service {
 
     /* limits */
     int desired_workers;	/* num child processes to have ready */
+    int prefork;		/* configured (minimum) desired_workers */
+    int maxprefork;		/* adaptive limit on desired_workers, or 0 */
     int max_workers;		/* max num child processes to spawn */
     rlim_t maxfds;		/* max num file descriptors to use */
     unsigned int maxforkrate;	/* max rate to spawn children */
@@ -41,6 +43,11 @@ struct service {
     /* fork rate computation */
     time_t last_interval_start;
     unsigned int interval_forks;
+
+    /* adaptive pool sizing */
+    time_t last_adapt;		/* start of the current sizing interval */
+    int min_ready;		/* fewest ready workers this interval */
+    int nqueued;		/* connections that queued this interval */
 };
 
 #ifdef APPLE_OS_X_SERVER
@@ -82,6 +82,8 @@ void notify_master(int fd, int msg)
     if (verbose) syslog(LOG_DEBUG, "telling master %x", msg);
     notifymsg.message = msg;
     notifymsg.service_pid = getpid();
+    notifymsg.backlog = -1;
+    notifymsg.wait = 0;
     if (write(fd, &notifymsg, sizeof(notifymsg)) != sizeof(notifymsg)) {
 	syslog(LOG_ERR, "unable to tell master %x: %m", msg);
     }
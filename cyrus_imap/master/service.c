@@ -61,11 +61,23 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <sysexits.h>
 #include <string.h>
 #include <limits.h>
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+#ifndef HAVE___ATTRIBUTE__
+/* struct epoll_event is packed on some architectures; don't let
+ * config.h's stub __attribute__ change its layout */
+#undef __attribute__
+#include <sys/epoll.h>
+#define __attribute__(foo)
+#else
+#include <sys/epoll.h>
+#endif
+#endif
 
 #include "service.h"
 #include "libconfig.h"
@@ -81,19 +93,27 @@ extern char *optarg;
 static int use_count = 0;
 static int verbose = 0;
 static int lockfd = -1;
+static int acceptfd = -1;
 static int newfile = 0;
 
-void notify_master(int fd, int msg)
+static void tell_master(int fd, int msg, int backlog, unsigned int wait)
 {
     struct notify_message notifymsg;
     if (verbose) syslog(LOG_DEBUG, "telling master %x", msg);
     notifymsg.message = msg;
     notifymsg.service_pid = getpid();
+    notifymsg.backlog = backlog;
+    notifymsg.wait = wait;
     if (write(fd, &notifymsg, sizeof(notifymsg)) != sizeof(notifymsg)) {
 	syslog(LOG_ERR, "unable to tell master %x: %m", msg);
     }
 }
 
+void notify_master(int fd, int msg)
+{
+    tell_master(fd, msg, -1, 0);
+}
+
 #ifdef HAVE_LIBWRAP
 #include <tcpd.h>
 
@@ -173,6 +193,83 @@ static int getlockfd(char *service, int id)
     return 0;
 }
 
+#ifdef EPOLLEXCLUSIVE
+/*
+ * Wait for connections on LISTEN_FD without the accept lock: every idle
+ * process sits in epoll_wait() on the socket with EPOLLEXCLUSIVE, and
+ * the kernel wakes one of them (rather than all of them) per connection.
+ * Returns -1 if the kernel can't do this.
+ */
+static int getacceptfd(void)
+{
+    struct epoll_event ev;
+    int fd;
+
+    fd = epoll_create(1);
+    if (fd == -1) return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if (epoll_ctl(fd, EPOLL_CTL_ADD, LISTEN_FD, &ev) == -1 ||
+	fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+	close(fd);
+	return -1;
+    }
+
+    acceptfd = fd;
+    return 0;
+}
+
+/*
+ * Block until a connection might be waiting on LISTEN_FD.  Returns -1
+ * if interrupted, in which case the caller checks for signals.  Another
+ * process may still beat us to the connection, in which case we wait in
+ * accept() for the next one; that wait is exclusive too.
+ */
+static int waitaccept(void)
+{
+    struct epoll_event ev;
+
+    if (epoll_wait(acceptfd, &ev, 1, -1) == -1 && errno == EINTR) return -1;
+
+    return 0;
+}
+#else
+static int getacceptfd(void)
+{
+    return -1;
+}
+
+static int waitaccept(void)
+{
+    return 0;
+}
+#endif /* EPOLLEXCLUSIVE */
+
+/*
+ * signals_add_handlers() sets SA_RESTART on SIGHUP, so a process blocked
+ * in fcntl(F_SETLKW) or accept() would sleep right through the SIGHUP
+ * master sends to shrink the pool.  Clear it while we wait for a
+ * connection so the wait returns EINTR and the loop sees the signal;
+ * set it again before handing the connection to service_main().
+ */
+static void sighup_interrupts(int on)
+{
+#ifdef SA_RESTART
+    struct sigaction action;
+
+    if (sigaction(SIGHUP, NULL, &action) < 0) return;
+    if (action.sa_handler == SIG_DFL || action.sa_handler == SIG_IGN) return;
+
+    if (on) action.sa_flags &= ~SA_RESTART;
+    else action.sa_flags |= SA_RESTART;
+
+    if (sigaction(SIGHUP, &action, NULL) < 0) {
+	syslog(LOG_ERR, "unable to change SIGHUP handler flags: %m");
+    }
+#endif
+}
+
 static int lockaccept(void)
 {
     struct flock alockinfo;
@@ -238,6 +335,26 @@ static int unlockaccept(void)
     return 0;
 }
 
+/*
+ * How many connections are still queued on LISTEN_FD, for master's
+ * adaptive pool sizing, or -1 if we can't tell.  Linux reports the
+ * accept queue length of a listening TCP socket in tcpi_unacked.
+ */
+static int getbacklog(void)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(LISTEN_FD, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+	info.tcpi_state == TCP_LISTEN) {
+	return info.tcpi_unacked;
+    }
+#endif
+
+    return -1;
+}
+
 #define ARGV_GROW 10
 
 int main(int argc, char **argv, char **envp)
@@ -261,6 +378,8 @@ int main(int argc, char **argv, char **envp)
     ino_t start_ino;
     off_t start_size;
     time_t start_mtime;
+    struct timeval readymark, now;
+    long waited;
     
     opterr = 0; /* disable error reporting,
 		   since we don't know about service-specific options */
@@ -405,18 +524,25 @@ int main(int argc, char **argv, char **envp)
     start_size = sbuf.st_size;
     start_mtime = sbuf.st_mtime;
 
-    getlockfd(service, id);
+    if (soctype != SOCK_STREAM ||
+	config_getenum(IMAPOPT_ACCEPT_MODE) != IMAP_ENUM_ACCEPT_MODE_EXCLUSIVE ||
+	getacceptfd() == -1) {
+	getlockfd(service, id);
+    }
     for (;;) {
 	/* ok, listen to this socket until someone talks to us */
 
 	/* (re)set signal handlers, including SIGALRM */
 	signals_add_handlers(SIGALRM);
+	sighup_interrupts(1);
 
 	if (use_count > 0) {
 	    /* we want to time out after 60 seconds, set an alarm */
 	    alarm(reuse_timeout);
 	}
 
+	gettimeofday(&readymark, NULL);
+
 	/* lock */
 	lockaccept();
 
@@ -432,6 +558,8 @@ int main(int argc, char **argv, char **envp)
 	    }
 
 	    if (soctype == SOCK_STREAM) {
+		if (acceptfd != -1 && waitaccept() == -1) continue;
+
 		fd = accept(LISTEN_FD, NULL, NULL);
 		if (fd < 0) {
 		    switch (errno) {
@@ -472,6 +600,7 @@ int main(int argc, char **argv, char **envp)
 		r = recvfrom(LISTEN_FD, (void *) &ch, 1, MSG_PEEK,
 			     (struct sockaddr *) &from, &fromlen);
 		if (r == -1) {
+		    if (errno == EINTR) continue;
 		    syslog(LOG_ERR, "recvfrom failed: %m");
 		    if (MESSAGE_MASTER_ON_EXIT) 
 			notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
@@ -500,6 +629,7 @@ int main(int argc, char **argv, char **envp)
 
 	/* cancel the alarm */
 	alarm(0);
+	sighup_interrupts(0);
 
 	/* tcp only */
 	if(soctype == SOCK_STREAM) {
@@ -534,7 +664,14 @@ int main(int argc, char **argv, char **envp)
 	    if (fd > 2) close(fd);
 	}
 	
-	notify_master(STATUS_FD, MASTER_SERVICE_CONNECTION);
+	/* tell master how long we waited for this connection and how
+	   many are waiting behind it, so it can size the pool */
+	gettimeofday(&now, NULL);
+	waited = (now.tv_sec - readymark.tv_sec) * 1000 +
+	    (now.tv_usec - readymark.tv_usec) / 1000;
+	tell_master(STATUS_FD, MASTER_SERVICE_CONNECTION,
+		    soctype == SOCK_STREAM ? getbacklog() : -1,
+		    waited > 0 ? waited : 0);
 	use_count++;
 	service_main(newargc, newargv, envp);
 	/* if we returned, we can service another client with this process */
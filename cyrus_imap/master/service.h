@@ -74,6 +74,10 @@ enum {
 struct notify_message {
     int message;
     pid_t service_pid;
+    int backlog;		/* CONNECTION: connections still waiting to be
+				   accepted after this one, -1 if unknown */
+    unsigned int wait;		/* CONNECTION: msecs the service process was
+				   ready before it got this one */
 #ifdef APPLE_OS_X_SERVER
 	time_t	s_start_time;
 	char s_user_buf[64+1];